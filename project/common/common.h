@@ -78,4 +78,8 @@
 
 #define STR( QSTR ) QSTR.toStdString().c_str()
 
+// Particle and node counts and flat indices. Large scenes go past 2^31 of
+// either, so these are 64-bit; offsets within a block or stencil stay int.
+typedef long long index_t;
+
 #endif // COMMON_H
@@ -0,0 +1,385 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   communicator.cpp
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#include "common/communicator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/common.h"
+
+// Per direction between two ranks. Halo bands stream through in pieces.
+#define CHANNEL_BYTES (4 << 20)
+#define CONNECT_ATTEMPTS 300
+#define CONNECT_RETRY_US 100000
+
+void
+Communicator::exchange( int peer, const void *sendData, size_t sendBytes, void *receiveData, size_t receiveBytes )
+{
+    if ( m_rank < peer ) {
+        send( peer, sendData, sendBytes );
+        receive( peer, receiveData, receiveBytes );
+    } else {
+        receive( peer, receiveData, receiveBytes );
+        send( peer, sendData, sendBytes );
+    }
+}
+
+void
+Communicator::allReduceSum( double *values, int count )
+{
+    if ( m_size == 1 ) return;
+    if ( m_rank == 0 ) {
+        std::vector<double> partial( count );
+        for ( int peer = 1; peer < m_size; ++peer ) {
+            receive( peer, partial.data(), count*sizeof(double) );
+            for ( int i = 0; i < count; ++i ) values[i] += partial[i];
+        }
+        for ( int peer = 1; peer < m_size; ++peer ) {
+            send( peer, values, count*sizeof(double) );
+        }
+    } else {
+        send( 0, values, count*sizeof(double) );
+        receive( 0, values, count*sizeof(double) );
+    }
+}
+
+void
+Communicator::barrier()
+{
+    double token = 0.0;
+    allReduceSum( &token, 1 );
+}
+
+namespace
+{
+
+/**
+ * One ring buffer per ordered pair of ranks in a shared segment. The writer
+ * only moves written and the reader only moves read, so a channel needs no
+ * lock; a side that has to wait yields.
+ */
+struct SharedChannel
+{
+    std::atomic<unsigned long long> written;
+    std::atomic<unsigned long long> read;
+    char data[CHANNEL_BYTES];
+};
+
+struct SharedHeader
+{
+    std::atomic<int> ready; // set by rank 0 once the channels are initialized
+    int size;
+};
+
+class SharedMemoryCommunicator : public Communicator
+{
+
+public:
+
+    SharedMemoryCommunicator( int rank, int size ) : Communicator(rank, size), m_segment(NULL), m_bytes(0) {}
+
+    virtual ~SharedMemoryCommunicator()
+    {
+        if ( m_segment ) munmap( m_segment, m_bytes );
+    }
+
+    bool connect( const std::string &address )
+    {
+        std::string name = "/" + address;
+        m_bytes = sizeof(SharedHeader) + (size_t)m_size*m_size*sizeof(SharedChannel);
+        int fd = -1;
+        if ( m_rank == 0 ) {
+            shm_unlink( name.c_str() );
+            fd = shm_open( name.c_str(), O_CREAT|O_EXCL|O_RDWR, 0600 );
+            if ( fd < 0 || ftruncate(fd, m_bytes) != 0 ) {
+                LOG( "Couldn't create shared memory segment %s.", name.c_str() );
+                if ( fd >= 0 ) close( fd );
+                return false;
+            }
+        } else {
+            // Wait for rank 0 to create and size it
+            struct stat status;
+            for ( int attempt = 0; attempt < CONNECT_ATTEMPTS; ++attempt ) {
+                fd = shm_open( name.c_str(), O_RDWR, 0600 );
+                if ( fd >= 0 && fstat(fd, &status) == 0 && (size_t)status.st_size == m_bytes ) break;
+                if ( fd >= 0 ) close( fd );
+                fd = -1;
+                usleep( CONNECT_RETRY_US );
+            }
+            if ( fd < 0 ) {
+                LOG( "Couldn't open shared memory segment %s.", name.c_str() );
+                return false;
+            }
+        }
+
+        void *segment = mmap( NULL, m_bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+        close( fd );
+        if ( segment == MAP_FAILED ) {
+            LOG( "Couldn't map shared memory segment %s.", name.c_str() );
+            return false;
+        }
+        m_segment = (char*)segment;
+
+        // A new segment is zero filled, which is a valid state for the atomics
+        SharedHeader *header = (SharedHeader*)m_segment;
+        if ( m_rank == 0 ) {
+            header->size = m_size;
+            header->ready.store( 1, std::memory_order_release );
+        } else {
+            while ( !header->ready.load(std::memory_order_acquire) ) sched_yield();
+        }
+
+        // Everyone is mapped, so the name can go; the memory stays until the last unmap
+        barrier();
+        if ( m_rank == 0 ) shm_unlink( name.c_str() );
+        return true;
+    }
+
+    virtual void send( int peer, const void *data, size_t bytes )
+    {
+        SharedChannel *channel = this->channel( m_rank, peer );
+        const char *source = (const char*)data;
+        unsigned long long written = channel->written.load( std::memory_order_relaxed );
+        while ( bytes > 0 ) {
+            size_t space = CHANNEL_BYTES - (size_t)( written - channel->read.load(std::memory_order_acquire) );
+            if ( space == 0 ) {
+                sched_yield();
+                continue;
+            }
+            size_t offset = written % CHANNEL_BYTES;
+            size_t chunk = std::min( std::min(space, bytes), (size_t)CHANNEL_BYTES - offset );
+            memcpy( channel->data + offset, source, chunk );
+            written += chunk;
+            channel->written.store( written, std::memory_order_release );
+            source += chunk;
+            bytes -= chunk;
+        }
+    }
+
+    virtual void receive( int peer, void *data, size_t bytes )
+    {
+        SharedChannel *channel = this->channel( peer, m_rank );
+        char *target = (char*)data;
+        unsigned long long read = channel->read.load( std::memory_order_relaxed );
+        while ( bytes > 0 ) {
+            size_t available = (size_t)( channel->written.load(std::memory_order_acquire) - read );
+            if ( available == 0 ) {
+                sched_yield();
+                continue;
+            }
+            size_t offset = read % CHANNEL_BYTES;
+            size_t chunk = std::min( std::min(available, bytes), (size_t)CHANNEL_BYTES - offset );
+            memcpy( target, channel->data + offset, chunk );
+            read += chunk;
+            channel->read.store( read, std::memory_order_release );
+            target += chunk;
+            bytes -= chunk;
+        }
+    }
+
+private:
+
+    char *m_segment;
+    size_t m_bytes;
+
+    SharedChannel* channel( int from, int to )
+    {
+        return (SharedChannel*)( m_segment + sizeof(SharedHeader) ) + ( (size_t)from*m_size + to );
+    }
+
+};
+
+/**
+ * A socket to every other rank. Rank i listens on port+i, connects to the
+ * ranks below it and accepts the ones above, which introduce themselves with
+ * their rank.
+ */
+class TcpCommunicator : public Communicator
+{
+
+public:
+
+    TcpCommunicator( int rank, int size ) : Communicator(rank, size), m_sockets(size, -1) {}
+
+    virtual ~TcpCommunicator()
+    {
+        for ( int i = 0; i < m_size; ++i ) {
+            if ( m_sockets[i] >= 0 ) close( m_sockets[i] );
+        }
+    }
+
+    bool connect( const std::string &address )
+    {
+        size_t colon = address.rfind( ':' );
+        if ( colon == std::string::npos ) {
+            LOG( "TCP address %s has no port.", address.c_str() );
+            return false;
+        }
+        int port = atoi( address.c_str() + colon + 1 );
+        std::vector<std::string> hosts;
+        for ( size_t begin = 0; begin <= colon; ) {
+            size_t end = address.find( ',', begin );
+            if ( end == std::string::npos || end > colon ) end = colon;
+            hosts.push_back( address.substr(begin, end-begin) );
+            begin = end + 1;
+        }
+        if ( hosts.size() != 1 && (int)hosts.size() != m_size ) {
+            LOG( "TCP address %s names %d hosts for %d ranks.", address.c_str(), (int)hosts.size(), m_size );
+            return false;
+        }
+
+        int listener = -1;
+        if ( m_rank+1 < m_size ) {
+            listener = socket( AF_INET, SOCK_STREAM, 0 );
+            int on = 1;
+            setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+            sockaddr_in local;
+            memset( &local, 0, sizeof(local) );
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl( INADDR_ANY );
+            local.sin_port = htons( port + m_rank );
+            if ( bind(listener, (sockaddr*)&local, sizeof(local)) != 0 || listen(listener, m_size) != 0 ) {
+                LOG( "Couldn't listen on port %d.", port + m_rank );
+                close( listener );
+                return false;
+            }
+        }
+
+        bool connected = true;
+        for ( int peer = 0; peer < m_rank && connected; ++peer ) {
+            const std::string &host = hosts[hosts.size() == 1 ? 0 : peer];
+            connected = connectTo( peer, host, port + peer );
+            LOGIF( !connected, "Couldn't connect to rank %d at %s:%d.", peer, host.c_str(), port + peer );
+        }
+        for ( int i = m_rank+1; i < m_size && connected; ++i ) {
+            int socket = accept( listener, NULL, NULL );
+            int peer = -1;
+            connected = ( socket >= 0 && readAll(socket, &peer, sizeof(peer)) && peer > m_rank && peer < m_size && m_sockets[peer] < 0 );
+            if ( !connected ) {
+                LOG( "Bad connection on port %d.", port + m_rank );
+                if ( socket >= 0 ) close( socket );
+                break;
+            }
+            setNoDelay( socket );
+            m_sockets[peer] = socket;
+        }
+        if ( listener >= 0 ) close( listener );
+        return connected;
+    }
+
+    virtual void send( int peer, const void *data, size_t bytes )
+    {
+        const char *source = (const char*)data;
+        while ( bytes > 0 ) {
+            ssize_t sent = ::send( m_sockets[peer], source, bytes, MSG_NOSIGNAL );
+            if ( sent <= 0 ) fail( peer );
+            source += sent;
+            bytes -= sent;
+        }
+    }
+
+    virtual void receive( int peer, void *data, size_t bytes )
+    {
+        if ( !readAll(m_sockets[peer], data, bytes) ) fail( peer );
+    }
+
+private:
+
+    std::vector<int> m_sockets;
+
+    // The peer may not be listening yet, so keep trying for a while
+    bool connectTo( int peer, const std::string &host, int port )
+    {
+        addrinfo hints, *addresses;
+        memset( &hints, 0, sizeof(hints) );
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        char service[16];
+        snprintf( service, sizeof(service), "%d", port );
+        if ( getaddrinfo(host.c_str(), service, &hints, &addresses) != 0 ) return false;
+        int socket = -1;
+        for ( int attempt = 0; attempt < CONNECT_ATTEMPTS && socket < 0; ++attempt ) {
+            socket = ::socket( AF_INET, SOCK_STREAM, 0 );
+            if ( ::connect(socket, addresses->ai_addr, addresses->ai_addrlen) != 0 ) {
+                close( socket );
+                socket = -1;
+                usleep( CONNECT_RETRY_US );
+            }
+        }
+        freeaddrinfo( addresses );
+        if ( socket < 0 ) return false;
+        setNoDelay( socket );
+        m_sockets[peer] = socket;
+        send( peer, &m_rank, sizeof(m_rank) );
+        return true;
+    }
+
+    static bool readAll( int socket, void *data, size_t bytes )
+    {
+        char *target = (char*)data;
+        while ( bytes > 0 ) {
+            ssize_t received = recv( socket, target, bytes, 0 );
+            if ( received <= 0 ) return false;
+            target += received;
+            bytes -= received;
+        }
+        return true;
+    }
+
+    // Halo and reduction messages are small and waited on right away
+    static void setNoDelay( int socket )
+    {
+        int on = 1;
+        setsockopt( socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+    }
+
+    // The ranks step in lockstep, so there is no going on without a peer
+    void fail( int peer )
+    {
+        LOG( "Lost the connection to rank %d.", peer );
+        abort();
+    }
+
+};
+
+}
+
+Communicator*
+Communicator::create( Transport transport, int rank, int size, const std::string &address )
+{
+    if ( rank < 0 || rank >= size ) {
+        LOG( "Rank %d is not in [0, %d).", rank, size );
+        return NULL;
+    }
+    if ( transport == SHARED_MEMORY ) {
+        SharedMemoryCommunicator *communicator = new SharedMemoryCommunicator( rank, size );
+        if ( communicator->connect(address) ) return communicator;
+        delete communicator;
+    } else {
+        TcpCommunicator *communicator = new TcpCommunicator( rank, size );
+        if ( communicator->connect(address) ) return communicator;
+        delete communicator;
+    }
+    return NULL;
+}
@@ -0,0 +1,67 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   communicator.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef COMMUNICATOR_H
+#define COMMUNICATOR_H
+
+/*
+ * Message passing between the processes of a distributed run, each of which
+ * has a rank in [0, size). A transport only has to move bytes from one rank
+ * to another, in order; exchanges and reductions are built on top of that.
+ * Shared memory connects processes on one machine, TCP connects them across
+ * machines (or over loopback, to test). Included by nvcc, so no C++11 here.
+ */
+
+#include <stddef.h>
+#include <string>
+
+class Communicator
+{
+
+public:
+
+    enum Transport { SHARED_MEMORY, TCP };
+
+    /**
+     * Connects this process to the other ranks and returns NULL if it can't.
+     * For shared memory the address names the segment, and has to be unique
+     * to the run. For TCP it is host:port, or host0,host1,...:port with the
+     * host of each rank; rank i listens on port+i. Blocks until every rank
+     * has connected.
+     */
+    static Communicator* create( Transport transport, int rank, int size, const std::string &address );
+
+    virtual ~Communicator() {}
+
+    int rank() const { return m_rank; }
+    int size() const { return m_size; }
+
+    // Blocking. Messages to a peer arrive in the order they were sent.
+    virtual void send( int peer, const void *data, size_t bytes ) = 0;
+    virtual void receive( int peer, void *data, size_t bytes ) = 0;
+
+    // Sends to peer and receives from it. The lower rank sends first, so two
+    // ranks exchanging with each other never both wait on a full channel.
+    void exchange( int peer, const void *sendData, size_t sendBytes, void *receiveData, size_t receiveBytes );
+
+    // Sums over all ranks, in rank order, so every rank gets the same bits
+    void allReduceSum( double *values, int count );
+
+    void barrier();
+
+protected:
+
+    Communicator( int rank, int size ) : m_rank(rank), m_size(size) {}
+
+    int m_rank;
+    int m_size;
+
+};
+
+#endif // COMMUNICATOR_H
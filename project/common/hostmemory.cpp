@@ -0,0 +1,110 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   hostmemory.cpp
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#include "common/hostmemory.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common/common.h"
+#include "common/threadpool.h"
+
+// Below this, huge pages would mostly be padding
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// Large arrays are mapped in whole huge pages, whatever the mode, so that
+// freeHostArray can work the length out again
+static size_t mappedSize( size_t bytes )
+{
+    if ( bytes < HUGE_PAGE_SIZE ) return bytes;
+    return ( bytes + HUGE_PAGE_SIZE - 1 ) & ~(size_t)( HUGE_PAGE_SIZE - 1 );
+}
+
+void*
+allocateHostArray( size_t bytes, HugePages hugePages )
+{
+    if ( bytes == 0 ) return NULL;
+    size_t size = mappedSize( bytes );
+    // mmap leaves pages untouched until first use, unlike new[] of a type with a constructor
+    if ( hugePages == NO_HUGE_PAGES || bytes < HUGE_PAGE_SIZE ) {
+        void *array = mmap( NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+        return ( array == MAP_FAILED ) ? NULL : array;
+    }
+#ifdef MAP_HUGETLB
+    if ( hugePages == EXPLICIT_HUGE_PAGES ) {
+        void *array = mmap( NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0 );
+        if ( array != MAP_FAILED ) return array;
+        LOG( "No reserved huge pages for %.2f MB; using transparent huge pages.", size / 1e6 );
+    }
+#endif
+    void *array = mmap( NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+    if ( array == MAP_FAILED ) return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise( array, size, MADV_HUGEPAGE );
+#endif
+    return array;
+}
+
+void
+freeHostArray( void *array, size_t bytes )
+{
+    if ( array ) munmap( array, mappedSize(bytes) );
+}
+
+void
+firstTouchHostArray( void *array, size_t count, size_t elementSize )
+{
+    char *bytes = (char*)array;
+    ThreadPool::instance().parallelForStatic( 0, count, [&]( index_t begin, index_t end ) {
+        memset( bytes + begin*elementSize, 0, (end-begin)*elementSize );
+    });
+}
+
+void*
+mapHostFile( const char *path, size_t bytes )
+{
+    if ( bytes == 0 ) return NULL;
+    int fd = open( path, O_RDWR|O_CREAT, 0644 );
+    if ( fd < 0 ) {
+        LOG( "Unable to open %s.", path );
+        return NULL;
+    }
+    if ( ftruncate(fd, bytes) != 0 ) {
+        LOG( "Unable to make %s %.2f MB.", path, bytes / 1e6 );
+        close( fd );
+        return NULL;
+    }
+    void *array = mmap( NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+    // The mapping keeps the file open
+    close( fd );
+    if ( array == MAP_FAILED ) {
+        LOG( "Unable to map %s.", path );
+        return NULL;
+    }
+    // Streamed front to back, so read ahead aggressively
+    madvise( array, bytes, MADV_SEQUENTIAL );
+    return array;
+}
+
+void
+unmapHostFile( void *array, size_t bytes )
+{
+    if ( array ) munmap( array, bytes );
+}
+
+void
+prefetchHostFile( void *array, size_t offset, size_t bytes )
+{
+    // madvise wants a page-aligned start
+    size_t page = sysconf( _SC_PAGESIZE );
+    size_t begin = offset & ~( page - 1 );
+    madvise( (char*)array + begin, bytes + ( offset - begin ), MADV_WILLNEED );
+}
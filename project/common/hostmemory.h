@@ -0,0 +1,46 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   hostmemory.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef HOSTMEMORY_H
+#define HOSTMEMORY_H
+
+/*
+ * Large host arrays for NUMA machines. Pages are placed on the socket of the
+ * thread that first writes them, so an array filled by one thread ends up
+ * entirely on that thread's socket. firstTouchHostArray instead zeroes each
+ * worker's static share of the array from that worker (see
+ * ThreadPool::parallelForStatic); loops that later use the same split then
+ * only read local memory.
+ */
+
+#include <cstddef>
+
+enum HugePages
+{
+    NO_HUGE_PAGES,
+    TRANSPARENT_HUGE_PAGES, // madvise, the kernel backs the array when it can
+    EXPLICIT_HUGE_PAGES // MAP_HUGETLB from the reserved pool, else transparent
+};
+
+void* allocateHostArray( size_t bytes, HugePages hugePages );
+void freeHostArray( void *array, size_t bytes );
+
+// Zeroes the array, each worker its own static share of elementSize elements
+void firstTouchHostArray( void *array, size_t count, size_t elementSize );
+
+// Maps a file, created or resized to bytes, so that writes to the array reach
+// the file. Pages come and go as the kernel sees fit, so the file may be much
+// larger than RAM. Returns NULL on failure.
+void* mapHostFile( const char *path, size_t bytes );
+void unmapHostFile( void *array, size_t bytes );
+
+// Asks the kernel to start reading [offset, offset+bytes) of a mapped file in
+void prefetchHostFile( void *array, size_t offset, size_t bytes );
+
+#endif // HOSTMEMORY_H
@@ -0,0 +1,351 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   threadpool.cpp
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#include "common/threadpool.h"
+
+#include <QMutexLocker>
+#include <QThread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define SCRATCH_BLOCK_SIZE (1 << 20)
+#define SCRATCH_ALIGNMENT 16
+
+// Pool and worker index of the calling thread, if it is a worker
+static thread_local ThreadPool *t_pool = NULL;
+static thread_local int t_worker = -1;
+
+ScratchArena::ScratchArena()
+    : m_block(0), m_offset(0)
+{
+}
+
+ScratchArena::~ScratchArena()
+{
+    for ( int i = 0; i < m_blocks.size(); ++i ) {
+        delete [] m_blocks[i];
+    }
+}
+
+void*
+ScratchArena::allocate( size_t bytes )
+{
+    bytes = ( bytes + SCRATCH_ALIGNMENT - 1 ) & ~(size_t)( SCRATCH_ALIGNMENT - 1 );
+    // Move on to the first kept block that fits, or add one
+    while ( m_block < m_blocks.size() && m_offset + bytes > m_sizes[m_block] ) {
+        ++m_block;
+        m_offset = 0;
+    }
+    if ( m_block == m_blocks.size() ) {
+        size_t size = qMax( bytes, (size_t)SCRATCH_BLOCK_SIZE );
+        // new[] only guarantees alignment for fundamental types
+        m_blocks += new char[size + SCRATCH_ALIGNMENT];
+        m_sizes += size;
+    }
+    char *block = m_blocks[m_block];
+    char *aligned = (char*)( ( (size_t)block + SCRATCH_ALIGNMENT - 1 ) & ~(size_t)( SCRATCH_ALIGNMENT - 1 ) );
+    void *result = aligned + m_offset;
+    m_offset += bytes;
+    return result;
+}
+
+ScratchArena::Mark
+ScratchArena::mark() const
+{
+    Mark mark;
+    mark.block = m_block;
+    mark.offset = m_offset;
+    return mark;
+}
+
+void
+ScratchArena::release( const Mark &mark )
+{
+    m_block = mark.block;
+    m_offset = mark.offset;
+}
+
+class ThreadPool::Worker : public QThread
+{
+public:
+
+    Worker( ThreadPool *pool, int index ) : QThread(), m_pool(pool), m_index(index) {}
+
+protected:
+
+    virtual void run()
+    {
+        t_pool = m_pool;
+        t_worker = m_index;
+        m_pool->workerLoop();
+    }
+
+private:
+
+    ThreadPool *m_pool;
+    int m_index;
+};
+
+ThreadPool&
+ThreadPool::instance()
+{
+    static ThreadPool pool( qMax(QThread::idealThreadCount()-1, 0) );
+    return pool;
+}
+
+ThreadPool::ThreadPool( int workerCount )
+    : m_queued(0), m_stopping(false), m_pinned(0), m_affinityGeneration(0)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    if ( sched_getaffinity(0, sizeof(set), &set) == 0 ) {
+        for ( int cpu = 0; cpu < CPU_SETSIZE; ++cpu ) {
+            if ( CPU_ISSET(cpu, &set) ) m_cpus += cpu;
+        }
+    }
+#endif
+    for ( int i = 0; i <= workerCount; ++i ) {
+        m_queues += new Queue;
+    }
+    for ( int i = 0; i < workerCount; ++i ) {
+        m_workers += new Worker( this, i );
+        m_workers[i]->start();
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        QMutexLocker lock( &m_sleepMutex );
+        m_stopping = true;
+        m_wake.wakeAll();
+    }
+    for ( int i = 0; i < m_workers.size(); ++i ) {
+        m_workers[i]->wait();
+        delete m_workers[i];
+    }
+    for ( int i = 0; i < m_queues.size(); ++i ) {
+        delete m_queues[i];
+    }
+}
+
+ScratchArena&
+ThreadPool::scratch()
+{
+    static thread_local ScratchArena arena;
+    return arena;
+}
+
+int
+ThreadPool::ownQueue() const
+{
+    return ( t_pool == this ) ? t_worker : m_queues.size()-1;
+}
+
+void
+ThreadPool::push( const Task &task )
+{
+    Queue *queue = m_queues[ownQueue()];
+    {
+        QMutexLocker lock( &queue->mutex );
+        queue->tasks.push_back( task );
+    }
+    m_queued.ref();
+    wake( false );
+}
+
+void
+ThreadPool::pushOwned( int worker, const Task &task )
+{
+    Queue *queue = m_queues[worker];
+    {
+        QMutexLocker lock( &queue->mutex );
+        queue->owned.push_back( task );
+    }
+    m_queued.ref();
+    // Only that worker can take it
+    wake( true );
+}
+
+void
+ThreadPool::wake( bool all )
+{
+    // Taking the lock orders this against a worker deciding to sleep
+    QMutexLocker lock( &m_sleepMutex );
+    if ( all ) m_wake.wakeAll();
+    else m_wake.wakeOne();
+}
+
+bool
+ThreadPool::pop( Task &task )
+{
+    int own = ownQueue();
+    int count = m_queues.size();
+    for ( int i = 0; i < count; ++i ) {
+        Queue *queue = m_queues[(own+i)%count];
+        QMutexLocker lock( &queue->mutex );
+        if ( i == 0 && !queue->owned.empty() ) {
+            task = queue->owned.front();
+            queue->owned.pop_front();
+            m_queued.deref();
+            return true;
+        }
+        if ( queue->tasks.empty() ) continue;
+        // Own work newest first, while it is still in cache; steal the oldest,
+        // which is the biggest range left
+        if ( i == 0 ) {
+            task = queue->tasks.back();
+            queue->tasks.pop_back();
+        } else {
+            task = queue->tasks.front();
+            queue->tasks.pop_front();
+        }
+        m_queued.deref();
+        return true;
+    }
+    return false;
+}
+
+void
+ThreadPool::execute( Task &task )
+{
+    task.run();
+    task.pending->deref();
+}
+
+void
+ThreadPool::waitFor( QAtomicInt &pending )
+{
+    while ( pending.load() > 0 ) {
+        Task task;
+        if ( pop(task) ) {
+            execute( task );
+        } else {
+            // The rest is running on other threads
+            QThread::yieldCurrentThread();
+        }
+    }
+}
+
+void
+ThreadPool::workerLoop()
+{
+    int generation = 0;
+    forever {
+        if ( m_affinityGeneration.load() != generation ) {
+            generation = m_affinityGeneration.load();
+            applyAffinity();
+        }
+        Task task;
+        if ( pop(task) ) {
+            execute( task );
+            continue;
+        }
+        QMutexLocker lock( &m_sleepMutex );
+        if ( m_stopping ) return;
+        if ( m_queued.load() == 0 && m_affinityGeneration.load() == generation ) m_wake.wait( &m_sleepMutex );
+    }
+}
+
+void
+ThreadPool::splitRange( index_t begin, index_t end, index_t grain, const RangeBody &body, QAtomicInt *pending )
+{
+    while ( end - begin > grain ) {
+        index_t mid = begin + ( end - begin ) / 2;
+        Task task;
+        task.run = [this, mid, end, grain, &body, pending]() { splitRange( mid, end, grain, body, pending ); };
+        task.pending = pending;
+        pending->ref();
+        push( task );
+        end = mid;
+    }
+    body( begin, end );
+}
+
+void
+ThreadPool::parallelFor( index_t begin, index_t end, index_t grain, const RangeBody &body )
+{
+    if ( begin >= end ) return;
+    QAtomicInt pending( 1 );
+    splitRange( begin, end, qMax(grain, (index_t)1), body, &pending );
+    pending.deref();
+    waitFor( pending );
+}
+
+void
+ThreadPool::parallelForChunks( index_t count, index_t chunkSize, const ChunkBody &body )
+{
+    parallelFor( 0, chunkCount(count, chunkSize), 1, [&]( index_t first, index_t last ) {
+        for ( index_t chunk = first; chunk < last; ++chunk ) {
+            body( chunk, chunk*chunkSize, qMin(count, (chunk+1)*chunkSize) );
+        }
+    });
+}
+
+void
+ThreadPool::parallelInvoke( const std::function<void()> &a, const std::function<void()> &b )
+{
+    QAtomicInt pending( 2 );
+    Task task;
+    task.run = b;
+    task.pending = &pending;
+    push( task );
+    a();
+    pending.deref();
+    waitFor( pending );
+}
+
+void
+ThreadPool::parallelForStatic( index_t begin, index_t end, const RangeBody &body )
+{
+    if ( begin >= end ) return;
+    int parts = m_workers.size();
+    if ( parts == 0 ) {
+        body( begin, end );
+        return;
+    }
+    QAtomicInt pending( parts );
+    index_t count = end - begin;
+    for ( int i = 0; i < parts; ++i ) {
+        index_t partBegin = begin + count*i/parts, partEnd = begin + count*(i+1)/parts;
+        Task task;
+        task.run = [&body, partBegin, partEnd]() { if ( partBegin < partEnd ) body( partBegin, partEnd ); };
+        task.pending = &pending;
+        pushOwned( i, task );
+    }
+    waitFor( pending );
+}
+
+void
+ThreadPool::setPinned( bool pinned )
+{
+    if ( (m_pinned.load() != 0) == pinned ) return;
+    m_pinned.store( pinned ? 1 : 0 );
+    m_affinityGeneration.ref();
+    wake( true );
+}
+
+void
+ThreadPool::applyAffinity()
+{
+#ifdef __linux__
+    if ( m_cpus.size() < 2 ) return;
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    if ( m_pinned.load() ) {
+        CPU_SET( m_cpus[(t_worker+1) % m_cpus.size()], &set );
+    } else {
+        for ( int i = 0; i < m_cpus.size(); ++i ) CPU_SET( m_cpus[i], &set );
+    }
+    pthread_setaffinity_np( pthread_self(), sizeof(set), &set );
+#endif
+}
@@ -0,0 +1,178 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   threadpool.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/*
+ * Work-stealing task runtime for the host side (the solver itself runs on the
+ * device). Each worker owns a deque of tasks: it pushes and pops at the back,
+ * and idle workers steal from the front of the others. parallelFor splits its
+ * range lazily: a task keeps halving its range, leaving the right half for
+ * thieves, until it is no longer than the grain. Dense and sparse parts of a
+ * loop then even out across workers without any static partitioning.
+ *
+ * Any thread can call into the pool, including from inside a task. A waiting
+ * thread runs queued tasks until its own work is done, so nested loops never
+ * block a worker.
+ *
+ * For NUMA machines, workers can be pinned to cores, and parallelForStatic
+ * gives each worker a fixed share of a range that nobody steals, so memory
+ * first touched through it stays local to the worker that later uses it.
+ */
+
+#include <deque>
+#include <functional>
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "common/common.h"
+
+/**
+ * Grow-only bump allocator for temporaries. Blocks are kept when released, so
+ * after the first few calls allocation is free. Not thread safe: use the one
+ * of the calling thread (see ThreadPool::scratch).
+ */
+class ScratchArena
+{
+
+public:
+
+    struct Mark
+    {
+        int block;
+        size_t offset;
+    };
+
+    ScratchArena();
+    ~ScratchArena();
+
+    // 16 byte aligned, valid until the arena is released past this point
+    void* allocate( size_t bytes );
+
+    template<typename T>
+    T* allocate( index_t count ) { return (T*)allocate( count*sizeof(T) ); }
+
+    Mark mark() const;
+    void release( const Mark &mark );
+
+private:
+
+    QVector<char*> m_blocks;
+    QVector<size_t> m_sizes;
+    int m_block;
+    size_t m_offset;
+
+};
+
+// Releases everything allocated from the arena during its lifetime
+class ScratchScope
+{
+
+public:
+
+    ScratchScope( ScratchArena &arena ) : m_arena(arena), m_mark(arena.mark()) {}
+    ~ScratchScope() { m_arena.release( m_mark ); }
+
+private:
+
+    ScratchArena &m_arena;
+    ScratchArena::Mark m_mark;
+
+};
+
+class ThreadPool
+{
+
+public:
+
+    typedef std::function<void( index_t, index_t )> RangeBody;
+    typedef std::function<void( index_t, index_t, index_t )> ChunkBody;
+
+    // Shared pool, with a worker for every core besides the calling thread
+    static ThreadPool& instance();
+
+    explicit ThreadPool( int workerCount );
+    ~ThreadPool();
+
+    int workerCount() const { return m_workers.size(); }
+
+    // Calls body(begin, end) on disjoint ranges covering [begin, end), none
+    // longer than grain. Returns once all of them have run.
+    void parallelFor( index_t begin, index_t end, index_t grain, const RangeBody &body );
+
+    // Calls body(chunk, begin, end) on the fixed chunks of [0, count). Chunk
+    // boundaries don't depend on scheduling, so per-chunk partials combine to
+    // the same result on every run.
+    void parallelForChunks( index_t count, index_t chunkSize, const ChunkBody &body );
+
+    static index_t chunkCount( index_t count, index_t chunkSize ) { return ( count + chunkSize - 1 ) / chunkSize; }
+
+    // Runs a and b, possibly at the same time
+    void parallelInvoke( const std::function<void()> &a, const std::function<void()> &b );
+
+    // Splits [begin, end) into one contiguous share per worker, in worker
+    // order, and runs each share on its worker. The split only depends on the
+    // range and the worker count. Call from outside the pool.
+    void parallelForStatic( index_t begin, index_t end, const RangeBody &body );
+
+    // Pins worker i to the (i+1)th core the process may run on, leaving the
+    // first to the calling thread, or lets them all float again
+    void setPinned( bool pinned );
+
+    // Arena of the calling thread, for temporaries of the current task
+    static ScratchArena& scratch();
+
+private:
+
+    class Worker;
+
+    struct Task
+    {
+        std::function<void()> run;
+        QAtomicInt *pending; // decremented once run returns
+    };
+
+    struct Queue
+    {
+        QMutex mutex;
+        std::deque<Task> tasks;
+        std::deque<Task> owned; // parallelForStatic shares, never stolen
+    };
+
+    // One queue per worker, plus a last one shared by outside threads
+    QVector<Queue*> m_queues;
+    QVector<Worker*> m_workers;
+
+    QMutex m_sleepMutex;
+    QWaitCondition m_wake;
+    QAtomicInt m_queued; // tasks in all queues
+    bool m_stopping; // guarded by m_sleepMutex
+
+    QVector<int> m_cpus; // cores the process may run on
+    QAtomicInt m_pinned;
+    QAtomicInt m_affinityGeneration; // bumped by setPinned, workers catch up
+
+    int ownQueue() const;
+    void push( const Task &task );
+    void pushOwned( int worker, const Task &task );
+    void wake( bool all );
+    void applyAffinity();
+    bool pop( Task &task );
+    void execute( Task &task );
+    void waitFor( QAtomicInt &pending );
+    void splitRange( index_t begin, index_t end, index_t grain, const RangeBody &body, QAtomicInt *pending );
+    void workerLoop();
+
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,178 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   benchmarks.cu
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#define CUDA_INCLUDE
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <helper_functions.h>
+#include <helper_cuda.h>
+#include <stdlib.h>
+
+#include "common/common.h"
+#include "common/math.h"
+
+#include "cuda/helpers.h"
+#include "cuda/decomposition.h"
+#include "cuda/weighting.h"
+
+/*
+ * Microbenchmarks for the device functions that are too small to time inside
+ * a simulation step. Each entry point runs its kernel 'iterations' times over
+ * 'count' synthetic inputs and returns the elapsed milliseconds. The larger
+ * stages (P2G, G2P, ...) are timed through the profiler in tests/benchmarks.cpp.
+ */
+
+extern "C"
+{
+    float benchmarkSVD( int count, int iterations );
+    float benchmarkPD( int count, int iterations );
+    float benchmarkWeights( int count, int iterations, bool separable );
+}
+
+__global__ void svdBenchmarkKernel( const mat3 *F, mat3 *result, int count )
+{
+    int tid = blockIdx.x*blockDim.x + threadIdx.x;
+    if ( tid >= count ) return;
+    mat3 W, S, V;
+    computeSVD( F[tid], W, S, V );
+    result[tid] = S;
+}
+
+__global__ void pdBenchmarkKernel( const mat3 *F, mat3 *result, int count )
+{
+    int tid = blockIdx.x*blockDim.x + threadIdx.x;
+    if ( tid >= count ) return;
+    mat3 R;
+    computePD( F[tid], R );
+    result[tid] = R;
+}
+
+// Same 4x4x4 stencil walk as processGridVelocities, without the node reads
+__global__ void weightBenchmarkKernel( const vec3 *positions, vec3 *result, int count )
+{
+    int tid = blockIdx.x*blockDim.x + threadIdx.x;
+    if ( tid >= count ) return;
+    const vec3 &pos = positions[tid];
+    vec3 min = vec3::ceil( pos - vec3(2,2,2) );
+    vec3 sum( 0, 0, 0 );
+    for ( int i = 0; i < 4; ++i ) {
+        for ( int j = 0; j < 4; ++j ) {
+            for ( int k = 0; k < 4; ++k ) {
+                vec3 d = pos - ( min + vec3(i,j,k) ), s;
+                d.x *= ( s.x = ( d.x < 0 ) ? -1.f : 1.f );
+                d.y *= ( s.y = ( d.y < 0 ) ? -1.f : 1.f );
+                d.z *= ( s.z = ( d.z < 0 ) ? -1.f : 1.f );
+                float w;
+                vec3 wg;
+                weightAndGradient( s, d, w, wg );
+                sum += wg + vec3( w, w, w );
+            }
+        }
+    }
+    result[tid] = sum;
+}
+
+// Same walk with the per-axis weights from StencilWeights
+__global__ void stencilWeightBenchmarkKernel( const vec3 *positions, vec3 *result, int count )
+{
+    int tid = blockIdx.x*blockDim.x + threadIdx.x;
+    if ( tid >= count ) return;
+    const vec3 &pos = positions[tid];
+    StencilWeights weights( pos, glm::ivec3(pos-1) );
+    vec3 sum( 0, 0, 0 );
+    for ( int i = 0; i < 4; ++i ) {
+        for ( int j = 0; j < 4; ++j ) {
+            for ( int k = 0; k < 4; ++k ) {
+                float w = weights.weight( i, j, k );
+                sum += weights.gradient( i, j, k ) + vec3( w, w, w );
+            }
+        }
+    }
+    result[tid] = sum;
+}
+
+// Random deformation gradients within the default critical strains of identity
+__host__ mat3* createDeformationGradients( int count )
+{
+    mat3 *F = new mat3[count];
+    for ( int i = 0; i < count; ++i ) {
+        for ( int j = 0; j < 9; ++j ) {
+            F[i][j] = ( j%4 == 0 ? 1.f : 0.f ) + 0.01f*( 2.f*rand()/RAND_MAX - 1.f );
+        }
+    }
+    mat3 *devF;
+    checkCudaErrors( cudaMalloc((void**)&devF, count*sizeof(mat3)) );
+    checkCudaErrors( cudaMemcpy(devF, F, count*sizeof(mat3), cudaMemcpyHostToDevice) );
+    delete [] F;
+    return devF;
+}
+
+template<typename Kernel, typename In, typename Out>
+__host__ float timeKernel( Kernel kernel, const In *input, Out *output, int count, int iterations )
+{
+    const int blocks = ( count+THREAD_COUNT-1 )/THREAD_COUNT;
+
+    // Warm up
+    LAUNCH( kernel<<< blocks, THREAD_COUNT >>>(input, output, count) );
+
+    cudaEvent_t start, stop;
+    checkCudaErrors( cudaEventCreate(&start) );
+    checkCudaErrors( cudaEventCreate(&stop) );
+    checkCudaErrors( cudaEventRecord(start) );
+    for ( int i = 0; i < iterations; ++i ) {
+        kernel<<< blocks, THREAD_COUNT >>>( input, output, count );
+    }
+    checkCudaErrors( cudaEventRecord(stop) );
+    checkCudaErrors( cudaEventSynchronize(stop) );
+    float ms;
+    checkCudaErrors( cudaEventElapsedTime(&ms, start, stop) );
+    checkCudaErrors( cudaEventDestroy(start) );
+    checkCudaErrors( cudaEventDestroy(stop) );
+    return ms;
+}
+
+float benchmarkSVD( int count, int iterations )
+{
+    mat3 *devF = createDeformationGradients( count ), *devResult;
+    checkCudaErrors( cudaMalloc((void**)&devResult, count*sizeof(mat3)) );
+    float ms = timeKernel( svdBenchmarkKernel, devF, devResult, count, iterations );
+    checkCudaErrors( cudaFree(devF) );
+    checkCudaErrors( cudaFree(devResult) );
+    return ms;
+}
+
+float benchmarkPD( int count, int iterations )
+{
+    mat3 *devF = createDeformationGradients( count ), *devResult;
+    checkCudaErrors( cudaMalloc((void**)&devResult, count*sizeof(mat3)) );
+    float ms = timeKernel( pdBenchmarkKernel, devF, devResult, count, iterations );
+    checkCudaErrors( cudaFree(devF) );
+    checkCudaErrors( cudaFree(devResult) );
+    return ms;
+}
+
+float benchmarkWeights( int count, int iterations, bool separable )
+{
+    // Positions in grid space, anywhere inside a 64^3 grid
+    vec3 *positions = new vec3[count];
+    for ( int i = 0; i < count; ++i ) {
+        positions[i] = 64.f * vec3( float(rand())/RAND_MAX, float(rand())/RAND_MAX, float(rand())/RAND_MAX );
+    }
+    vec3 *devPositions, *devResult;
+    checkCudaErrors( cudaMalloc((void**)&devPositions, count*sizeof(vec3)) );
+    checkCudaErrors( cudaMemcpy(devPositions, positions, count*sizeof(vec3), cudaMemcpyHostToDevice) );
+    checkCudaErrors( cudaMalloc((void**)&devResult, count*sizeof(vec3)) );
+    delete [] positions;
+    float ms = separable ? timeKernel( stencilWeightBenchmarkKernel, devPositions, devResult, count, iterations )
+                         : timeKernel( weightBenchmarkKernel, devPositions, devResult, count, iterations );
+    checkCudaErrors( cudaFree(devPositions) );
+    checkCudaErrors( cudaFree(devResult) );
+    return ms;
+}
@@ -21,8 +21,9 @@
 #include "cuda/vector.h"
 #include "cuda/matrix.h"
 #include "sim/caches.h"
+#include "cuda/functions.h"
 
-extern "C" { void testConjugateResidual(); }
+extern "C" { bool testConjugateResidual(); }
 
 static const vec3 b[4] = {
 vec3( 0.9429602449, 0.2418600860, 0.9989322688 ),
@@ -57,106 +58,107 @@ mat3( 2.8728408272, 2.5538966178, 2.2751206154, 2.5114012072, 2.0373771307, 2.84
 mat3( 4.0168094858, 2.2950560759, 3.6252732452, 2.2950560759, 2.2574134685, 2.4274841604, 3.6252732452, 2.4274841604, 5.0234253381 )
 };
 
-__global__ void printKernel( NodeCache *caches, int numNodes, NodeCache::Offset offset )
+template<NodeCache::Offset O>
+__global__ void printKernel( NodeCache caches, int numNodes )
 {
     for ( int i = 0; i < numNodes; ++i ) {
-        const NodeCache &cache = caches[i];
-        const vec3 &v = cache[offset];
+        const vec3 &v = caches.get<O>()[i];
         printf( "        %.10f %.10f %.10f\n", v.x, v.y, v.z );
     }
 }
 
-__global__ void _initializeVKernel( NodeCache *caches )
+__global__ void _initializeVKernel( NodeCache caches )
 {
     int tid = blockDim.x*blockIdx.x + threadIdx.x;
-    caches[tid].v = vec3( 0, 0, 0 );
+    caches.get<NodeCache::V>()[tid] = vec3( 0, 0, 0 );
 }
 
-__global__ void _initializeRPKernel( NodeCache *caches, vec3 *devB )
+__global__ void _initializeRPKernel( NodeCache caches, vec3 *devB )
 {
     int tid = blockDim.x*blockIdx.x + threadIdx.x;
-    caches[tid].r = devB[tid] - caches[tid].r;
-    caches[tid].p = caches[tid].r;
+    vec3 &r = caches.get<NodeCache::R>()[tid];
+    r = devB[tid] - r;
+    caches.get<NodeCache::P>()[tid] = r;
 }
 
-__global__ void _initializeApKernel( NodeCache *caches )
+__global__ void _initializeApKernel( NodeCache caches )
 {
     int tid = blockDim.x*blockIdx.x + threadIdx.x;
-    caches[tid].Ap = caches[tid].Ar;
+    caches.get<NodeCache::AP>()[tid] = caches.get<NodeCache::AR>()[tid];
 }
 
-__global__ void _updateVRKernel( NodeCache *caches, float alpha )
+__global__ void _updateVRKernel( NodeCache caches, float alpha )
 {
     int tid = blockDim.x*blockIdx.x + threadIdx.x;
-    caches[tid].v += alpha * caches[tid].p;
-    caches[tid].r -= alpha * caches[tid].Ap;
+    caches.get<NodeCache::V>()[tid] += alpha * caches.get<NodeCache::P>()[tid];
+    caches.get<NodeCache::R>()[tid] -= alpha * caches.get<NodeCache::AP>()[tid];
 }
 
-__global__ void _updatePApResidualKernel( NodeCache *caches, float beta )
+__global__ void _updatePApResidualKernel( NodeCache caches, float beta )
 {
     int tid = blockDim.x*blockIdx.x + threadIdx.x;
-    caches[tid].p = caches[tid].r + beta * caches[tid].p;
-    caches[tid].Ap = caches[tid].Ar + beta * caches[tid].Ap;
-    caches[tid].scratch = vec3::dot( caches[tid].r, caches[tid].r );
+    const vec3 &r = caches.get<NodeCache::R>()[tid];
+    caches.get<NodeCache::P>()[tid] = r + beta * caches.get<NodeCache::P>()[tid];
+    caches.get<NodeCache::AP>()[tid] = caches.get<NodeCache::AR>()[tid] + beta * caches.get<NodeCache::AP>()[tid];
+    caches.scratch[tid] = vec3::dot( r, r );
 }
 
-__global__ void _innerProductKernel( NodeCache *caches, int numNodes, NodeCache::Offset uOffset, NodeCache::Offset vOffset )
+template<NodeCache::Offset U, NodeCache::Offset V>
+__global__ void _innerProductKernel( NodeCache caches, int numNodes )
 {
-    float sum = 0.f;
+    double sum = 0.0;
     for ( int i = 0; i < numNodes; ++i ) {
-        const NodeCache &cache = caches[i];
-        sum += vec3::dot( cache[uOffset], cache[vOffset] );
+        sum += vec3::dot( caches.get<U>()[i], caches.get<V>()[i] );
     }
-    caches[0].scratch = sum;
+    caches.scratch[0] = sum;
 }
 
-__host__ float _innerProduct( NodeCache *caches, int numNodes, NodeCache::Offset uOffset, NodeCache::Offset vOffset )
+template<NodeCache::Offset U, NodeCache::Offset V>
+__host__ float _innerProduct( const NodeCache &caches, int numNodes )
 {
-    _innerProductKernel<<<1,1>>>( caches, numNodes, uOffset, vOffset ); cudaDeviceSynchronize();
-    float result;
-    cudaMemcpy( &result, &(caches[0].scratch), sizeof(float), cudaMemcpyDeviceToHost );
-    return result;
+    _innerProductKernel<U,V><<<1,1>>>( caches, numNodes ); cudaDeviceSynchronize();
+    double result;
+    cudaMemcpy( &result, caches.scratch, sizeof(double), cudaMemcpyDeviceToHost );
+    return (float)result;
 }
 
-__global__ void _scratchSumKernel( NodeCache *caches, int numNodes )
+__global__ void _scratchSumKernel( NodeCache caches, int numNodes )
 {
-    float sum = 0.f;
+    double sum = 0.0;
     for ( int i = 0; i < numNodes; ++i ) {
-        sum += caches[i].scratch;
+        sum += caches.scratch[i];
     }
-    caches[0].scratch = sum;
+    caches.scratch[0] = sum;
 }
 
-__host__ float _scratchSum( NodeCache *caches, int numNodes )
+__host__ float _scratchSum( const NodeCache &caches, int numNodes )
 {
     LAUNCH( _scratchSumKernel<<<1,1>>>(caches,numNodes) );
-    float result;
-    cudaMemcpy( &result, &(caches[0].scratch), sizeof(float), cudaMemcpyDeviceToHost );
-    return result;
+    double result;
+    cudaMemcpy( &result, caches.scratch, sizeof(double), cudaMemcpyDeviceToHost );
+    return (float)result;
 }
 
-__global__ void computeEuKernel( NodeCache *caches, int numNodes, const mat3 *devE, NodeCache::Offset uOffset, NodeCache::Offset resultOffset )
+template<NodeCache::Offset U, NodeCache::Offset RESULT>
+__global__ void computeEuKernel( NodeCache caches, int numNodes, const mat3 *devE )
 {
     for ( int i = 0; i < numNodes; ++i ) {
-        NodeCache &resultCache = caches[i];
-        vec3 &result = resultCache[resultOffset];
+        vec3 &result = caches.get<RESULT>()[i];
         result = vec3( 0, 0, 0 );
         for ( int j = 0; j < numNodes; ++j ) {
-            NodeCache &uCache = caches[j];
-            vec3 &u = uCache[uOffset];
+            const vec3 &u = caches.get<U>()[j];
             const mat3 &m = devE[4*i+j];
             result += m * u;
         }
     }
 }
 
-void testConjugateResidual()
+bool testConjugateResidual()
 {
     int numNodes = 4;
 
-    NodeCache *devCaches;
-    checkCudaErrors( cudaMalloc((void**)&devCaches, numNodes*sizeof(NodeCache)) );
-    checkCudaErrors( cudaMemset(devCaches, 0, numNodes*sizeof(NodeCache)) );
+    NodeCache caches;
+    createNodeCaches( &caches, numNodes, NodeCache::ALL_CHANNELS );
 
     vec3 *devB;
     checkCudaErrors( cudaMalloc((void**)&devB, numNodes*sizeof(vec3)) );
@@ -166,36 +168,33 @@ void testConjugateResidual()
     checkCudaErrors( cudaMalloc((void**)&devE, numNodes*numNodes*sizeof(mat3)) );
     checkCudaErrors( cudaMemcpy(devE, (mat3*)(E), numNodes*numNodes*sizeof(mat3), cudaMemcpyHostToDevice) );
 
-    _initializeVKernel<<<numNodes,1>>>( devCaches ); cudaDeviceSynchronize();
-    computeEuKernel<<<1,1>>>( devCaches, numNodes, devE, NodeCache::V, NodeCache::R ); cudaDeviceSynchronize();
-    _initializeRPKernel<<<numNodes,1>>>( devCaches, devB ); cudaDeviceSynchronize();
-    computeEuKernel<<<1,1>>>( devCaches, numNodes, devE, NodeCache::R, NodeCache::AR ); cudaDeviceSynchronize();
-    _initializeApKernel<<<numNodes,1>>>( devCaches ); cudaDeviceSynchronize();
+    _initializeVKernel<<<numNodes,1>>>( caches ); cudaDeviceSynchronize();
+    computeEuKernel<NodeCache::V, NodeCache::R><<<1,1>>>( caches, numNodes, devE ); cudaDeviceSynchronize();
+    _initializeRPKernel<<<numNodes,1>>>( caches, devB ); cudaDeviceSynchronize();
+    computeEuKernel<NodeCache::R, NodeCache::AR><<<1,1>>>( caches, numNodes, devE ); cudaDeviceSynchronize();
+    _initializeApKernel<<<numNodes,1>>>( caches ); cudaDeviceSynchronize();
 
     int k = 0;
     float residual;
     do {
 
-        float alphaNum = _innerProduct( devCaches, numNodes, NodeCache::R, NodeCache::AR );
-        float alphaDen = _innerProduct( devCaches, numNodes, NodeCache::AP, NodeCache::AP );
+        float alphaNum = _innerProduct<NodeCache::R, NodeCache::AR>( caches, numNodes );
+        float alphaDen = _innerProduct<NodeCache::AP, NodeCache::AP>( caches, numNodes );
         float alpha = ( fabsf(alphaDen) > 0.f ) ? alphaNum / alphaDen : 0.f;
 
         float betaDen = alphaNum;
-        _updateVRKernel<<<numNodes,1>>>( devCaches, alpha ); cudaDeviceSynchronize();
-        computeEuKernel<<<1,1>>>( devCaches, numNodes, devE, NodeCache::R, NodeCache::AR ); cudaDeviceSynchronize();
-        float betaNum = _innerProduct( devCaches, numNodes, NodeCache::R, NodeCache::AR );
+        _updateVRKernel<<<numNodes,1>>>( caches, alpha ); cudaDeviceSynchronize();
+        computeEuKernel<NodeCache::R, NodeCache::AR><<<1,1>>>( caches, numNodes, devE ); cudaDeviceSynchronize();
+        float betaNum = _innerProduct<NodeCache::R, NodeCache::AR>( caches, numNodes );
         float beta = ( fabsf(betaDen) > 0.f ) ? betaNum / betaDen : 0.f;
 
-        _updatePApResidualKernel<<<numNodes,1>>>( devCaches, beta ); cudaDeviceSynchronize();
-        residual = _scratchSum( devCaches, numNodes );
+        _updatePApResidualKernel<<<numNodes,1>>>( caches, beta ); cudaDeviceSynchronize();
+        residual = _scratchSum( caches, numNodes );
 
         LOG( "k = %3d, alpha = %10.7f, beta = %10.7f, residual = %g", k, alpha, beta, residual );
 
     } while ( k++ < 100 && residual > 1e-12 );
 
-    NodeCache *caches = new NodeCache[numNodes];
-    checkCudaErrors( cudaMemcpy(caches, devCaches, numNodes*sizeof(NodeCache), cudaMemcpyDeviceToHost) );
-
     bool passed = residual < 1e-8;
 
     printf( "\nExpected:\n" );
@@ -204,7 +203,7 @@ void testConjugateResidual()
         printf( "        %.10f %.10f %.10f\n", v.x, v.y, v.z );
     }
     printf( "\nGot:\n" );
-    LAUNCH( printKernel<<<1,1>>>(devCaches, numNodes, NodeCache::V) );
+    LAUNCH( printKernel<NodeCache::V><<<1,1>>>(caches, numNodes) );
     printf( "\n" );
 
     if ( passed ) {
@@ -213,7 +212,8 @@ void testConjugateResidual()
         LOG( "CONJUGATE RESIDUAL: FAILED" );
     }
 
-    cudaFree( devCaches );
+    destroyNodeCaches( &caches );
     cudaFree( devB );
     cudaFree( devE );
+    return passed;
 }
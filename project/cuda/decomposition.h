@@ -22,7 +22,7 @@
 #define CSTAR 0.923879532 // cos(pi/8)
 #define SSTAR 0.3826834323 // sin(p/8)
 
-__host__ __device__ void jacobiConjugation( int x, int y, int z, mat3 &S, quat &qV )
+__host__ __device__ __forceinline__ void jacobiConjugation( int x, int y, int z, mat3 &S, quat &qV )
 {
     // eliminate off-diagonal entries Spq, Sqp
     float ch = 2.f * (S[0]-S[4]), ch2 = ch*ch;
@@ -148,7 +148,7 @@ __host__ __device__ __forceinline__ void QRGivensQuaternion( float a1, float a2,
     sh *= w;
 }
 
-__host__ __device__ void QRDecomposition( const mat3 &B, mat3 &Q, mat3 &R )
+__host__ __device__ __forceinline__ void QRDecomposition( const mat3 &B, mat3 &Q, mat3 &R )
 {
     R = B;
 
@@ -234,7 +234,7 @@ __host__ __device__ __forceinline__ void computeSVD( const mat3 &A, mat3 &W, mat
  * S is symmetric positive semidefinite
  * Can get Polar Decomposition from SVD, see first section of http://en.wikipedia.org/wiki/Polar_decomposition
  */
-__host__ __device__ void computePD( const mat3 &A, mat3 &R )
+__host__ __device__ __forceinline__ void computePD( const mat3 &A, mat3 &R )
 {
     // U is unitary matrix (i.e. orthogonal/orthonormal)
     // P is positive semidefinite Hermitian matrix
@@ -250,7 +250,7 @@ __host__ __device__ void computePD( const mat3 &A, mat3 &R )
  * S is symmetric positive semidefinite
  * Can get Polar Decomposition from SVD, see first section of http://en.wikipedia.org/wiki/Polar_decomposition
  */
-__host__ __device__ void computePD( const mat3 &A, mat3 &R, mat3 &P )
+__host__ __device__ __forceinline__ void computePD( const mat3 &A, mat3 &R, mat3 &P )
 {
     // U is unitary matrix (i.e. orthogonal/orthonormal)
     // P is positive semidefinite Hermitian matrix
@@ -268,7 +268,7 @@ __host__ __device__ void computePD( const mat3 &A, mat3 &R, mat3 &P )
  * SVD : A = W * S * V'
  * PD : A = R * E
  */
-__host__ __device__ void computeSVDandPD( const mat3 &A, mat3 &W, mat3 &S, mat3 &V, mat3 &R )
+__host__ __device__ __forceinline__ void computeSVDandPD( const mat3 &A, mat3 &W, mat3 &S, mat3 &V, mat3 &R )
 {
     computeSVD( A, W, S, V );
     R = mat3::multiplyABt( W, V );
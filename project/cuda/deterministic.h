@@ -0,0 +1,235 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   deterministic.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef DETERMINISTIC_H
+#define DETERMINISTIC_H
+
+/*
+ * Gather versions of the particle-to-grid transfers. The scatter kernels add
+ * into nodes with float atomics, so the summation order (and the last bits of
+ * the result) changes from run to run. Here particles are first sorted into
+ * ParticleBins, then each node sums the particles of its 64 neighboring bins
+ * in bin order, and each bin in particle index order. The sort is stable, so
+ * the same input always produces the same bytes.
+ */
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <helper_functions.h>
+#include <helper_cuda.h>
+
+#include <thrust/device_ptr.h>
+#include <thrust/sort.h>
+
+#define CUDA_INCLUDE
+#include "geometry/grid.h"
+#include "sim/caches.h"
+#include "sim/particle.h"
+#include "sim/particlegridnode.h"
+#include "cuda/vector.h"
+
+#include "cuda/helpers.h"
+#include "cuda/weighting.h"
+
+/**
+ * Bin of the particles whose stencil starts at node ijk. Stencils that can
+ * reach a node start in [-3, dim]; everything else goes in the last bin, which
+ * is never gathered.
+ */
+__host__ __device__ __forceinline__ index_t binIndex( const glm::ivec3 &ijk, const glm::ivec3 &dim )
+{
+    glm::ivec3 binDim = dim + glm::ivec3( 4, 4, 4 );
+    glm::ivec3 bin = ijk + glm::ivec3( 3, 3, 3 );
+    if ( !Grid::withinBoundsInclusive(bin, glm::ivec3(0,0,0), binDim-1) ) return (index_t)binDim.x*binDim.y*binDim.z;
+    return Grid::getGridIndex( bin, binDim );
+}
+
+__host__ __device__ __forceinline__ index_t binCount( const glm::ivec3 &dim )
+{
+    return (index_t)(dim.x+4)*(dim.y+4)*(dim.z+4) + 1;
+}
+
+__global__ void computeBinKeys( const Particle *particles, index_t numParticles, const Grid *grid, index_t *keys, index_t *indices )
+{
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( particleIdx >= numParticles ) return;
+    vec3 particleGridPos = ( particles[particleIdx].position - grid->pos ) / grid->h;
+    keys[particleIdx] = binIndex( glm::ivec3(particleGridPos-1), grid->dim );
+    indices[particleIdx] = particleIdx;
+}
+
+__global__ void findBinRanges( const index_t *keys, index_t numParticles, index_t *starts, index_t *ends )
+{
+    index_t idx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( idx >= numParticles ) return;
+    index_t key = keys[idx];
+    if ( idx == 0 || keys[idx-1] != key ) starts[key] = idx;
+    if ( idx == numParticles-1 || keys[idx+1] != key ) ends[key] = idx+1;
+}
+
+/**
+ * Sorts the particles into bins on the given stream. The CUDA 5 Thrust has no
+ * stream policies, so the sort itself runs on the default stream, between
+ * synchronizing the given stream and the default one; the rest stays on the
+ * given stream. Has to run again whenever particles move.
+ */
+__host__ void binParticles( const Particle *particles, index_t numParticles, const Grid *grid, const ParticleBins *bins,
+                            cudaStream_t stream )
+{
+    const dim3 blocks( (numParticles+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+
+    LAUNCH_ASYNC( computeBinKeys<<<blocks,threads,0,stream>>>(particles,numParticles,grid,bins->keys,bins->indices) );
+    checkCudaErrors( cudaStreamSynchronize(stream) );
+    thrust::stable_sort_by_key( thrust::device_ptr<index_t>(bins->keys), thrust::device_ptr<index_t>(bins->keys+numParticles),
+                                thrust::device_ptr<index_t>(bins->indices) );
+    checkCudaErrors( cudaStreamSynchronize(0) );
+    checkCudaErrors( cudaMemsetAsync(bins->starts, 0, bins->count*sizeof(index_t), stream) );
+    checkCudaErrors( cudaMemsetAsync(bins->ends, 0, bins->count*sizeof(index_t), stream) );
+    LAUNCH_ASYNC( findBinRanges<<<blocks,threads,0,stream>>>(bins->keys,numParticles,bins->starts,bins->ends) );
+}
+
+/*
+ * Visits the particles that reach the node at ijk, always in the same order.
+ * Declares 'particleIdx' for the body.
+ */
+#define FOR_EACH_BINNED_PARTICLE( BINS, GRID, IJK, ... )                                        \
+{                                                                                               \
+    for ( int _i = 3; _i >= 0; --_i ) {                                                         \
+        for ( int _j = 3; _j >= 0; --_j ) {                                                     \
+            for ( int _k = 3; _k >= 0; --_k ) {                                                 \
+                index_t _bin = binIndex( IJK - glm::ivec3(_i,_j,_k), (GRID)->dim );             \
+                for ( index_t _n = (BINS).starts[_bin]; _n < (BINS).ends[_bin]; ++_n ) {        \
+                    index_t particleIdx = (BINS).indices[_n];                                   \
+                    __VA_ARGS__                                                                 \
+                }                                                                               \
+            }                                                                                   \
+        }                                                                                       \
+    }                                                                                           \
+}
+
+/**
+ * Deterministic computeNodeMasses. Called over nodes.
+ */
+__global__ void gatherNodeMasses( const Particle *particles, const ParticleBins bins, const Grid *grid, float *nodeMasses, index_t numNodes )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+
+    glm::ivec3 ijk = grid->nodeIJK( nodeIdx );
+    vec3 nodePosition( ijk );
+
+    // Tile padding
+    if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) {
+        nodeMasses[nodeIdx] = 0.f;
+        return;
+    }
+
+    float mass = 0.f;
+    FOR_EACH_BINNED_PARTICLE( bins, grid, ijk,
+        const Particle &particle = particles[particleIdx];
+        vec3 particleGridPos = ( particle.position - grid->pos ) / grid->h;
+        vec3 dx = vec3::abs( particleGridPos - nodePosition );
+        mass += particle.mass*weight( dx );
+    )
+    nodeMasses[nodeIdx] = mass;
+}
+
+/**
+ * Deterministic computeParticleDensity: each particle sums its own stencil.
+ * Called over particles.
+ */
+__global__ void gatherParticleDensity( Particle *particles, index_t numParticles, const Grid *grid, const float *nodeMasses )
+{
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( particleIdx >= numParticles ) return;
+
+    Particle &particle = particles[particleIdx];
+    vec3 particleGridPos = ( particle.position - grid->pos ) / grid->h;
+    glm::ivec3 origin( particleGridPos-1 );
+    float gridVolume = grid->h * grid->h * grid->h;
+
+    float density = 0.f;
+    for ( int s = 0; s < 64; ++s ) {
+        glm::ivec3 currIJK;
+        Grid::gridIndexToIJK( s, glm::ivec3(4,4,4), currIJK );
+        currIJK += origin;
+        if ( Grid::withinBoundsInclusive(currIJK, glm::ivec3(0,0,0), grid->dim) ) {
+            vec3 dx = vec3::abs( particleGridPos - vec3(currIJK) );
+            density += nodeMasses[grid->nodeIndex(currIJK)] * weight( dx ) / gridVolume;
+        }
+    }
+    particle.volume += density;
+}
+
+/**
+ * Deterministic computeCellMassVelocityAndForceFast. Called over nodes, which
+ * must be cleared beforehand.
+ */
+__global__ void gatherCellMassVelocityAndForce( const Particle *particles, const ParticleCache *particleCache, const ParticleBins bins,
+                                                const Grid *grid, Node *nodes, index_t numNodes )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+
+    glm::ivec3 ijk = grid->nodeIJK( nodeIdx );
+    vec3 nodePosition( ijk );
+
+    // Tile padding, left cleared
+    if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) return;
+
+    float mass = 0.f;
+    vec3 momentum( 0.f, 0.f, 0.f ), force( 0.f, 0.f, 0.f );
+    FOR_EACH_BINNED_PARTICLE( bins, grid, ijk,
+        const Particle &particle = particles[particleIdx];
+        vec3 particleGridPos = ( particle.position - grid->pos ) / grid->h;
+        float w;
+        vec3 wg;
+        weightAndGradient( particleGridPos - nodePosition, w, wg );
+        mass += particle.mass*w;
+        momentum += particle.velocity*particle.mass*w;
+        force += particleCache->sigmas[particleIdx]*wg;
+    )
+
+    Node &node = nodes[nodeIdx];
+    node.mass = mass;
+    node.velocity = momentum;
+    node.force = force;
+}
+
+/**
+ * Deterministic computedf. Called over nodes.
+ */
+__global__ void gatherdf( const Particle *particles, const ParticleCache *particleCache, const ParticleBins bins,
+                          const Grid *grid, NodeCache nodeCaches, index_t numNodes )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+
+    glm::ivec3 ijk = grid->nodeIJK( nodeIdx );
+    vec3 nodePos( ijk );
+
+    // Tile padding
+    if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) {
+        nodeCaches.get<NodeCache::DF>()[nodeIdx] = vec3( 0.f, 0.f, 0.f );
+        return;
+    }
+
+    vec3 df( 0.f, 0.f, 0.f );
+    FOR_EACH_BINNED_PARTICLE( bins, grid, ijk,
+        const Particle &particle = particles[particleIdx];
+        vec3 gridPos = ( particle.position - grid->pos ) / grid->h;
+        vec3 wg;
+        weightGradient( gridPos-nodePos, wg );
+        df += -particle.volume * mat3::multiplyABt( particleCache->Aps[particleIdx], particle.elasticF ) * wg;
+    )
+    nodeCaches.get<NodeCache::DF>()[nodeIdx] = df;
+}
+
+#endif // DETERMINISTIC_H
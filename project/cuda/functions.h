@@ -11,6 +11,8 @@
 #ifndef FUNCTIONS_H
 #define FUNCTIONS_H
 
+#include "common/common.h"
+#include "sim/caches.h"
 #include "sim/particlegridnode.h"
 
 typedef unsigned int GLuint;
@@ -18,11 +20,13 @@ struct cudaGraphicsResource;
 struct Grid;
 struct Particle;
 struct ParticleCache;
+struct ParticleBins;
 struct Node;
 struct NodeCache;
 struct ImplicitCollider;
 struct SimulationParameters;
 struct Material;
+class StepGraph;
 
 extern "C"
 {
@@ -31,21 +35,178 @@ extern "C"
 void registerVBO( cudaGraphicsResource **resource, GLuint vbo );
 void unregisterVBO( cudaGraphicsResource *resource );
 
-// Particle simulation
-void updateParticles( Particle *particles, ParticleCache *devParticleCache, ParticleCache *hostParticleCache, int numParticles,
-                      Grid *grid, Node *nodes, NodeCache *nodeCache, int numNodes,
-                      ImplicitCollider *colliders, int numColliders,
-                      float timeStep, bool implicitUpdate );
+// Particle simulation. Pass bins (see createParticleBins) to run the
+// grid-to-particle transfer tile by tile, or NULL; with deterministic set they
+// also replace the atomic particle-to-grid scatters with gathers. The multigrid
+// preconditioner needs coarse levels (see createMultigrid) and isn't
+// deterministic; without them it falls back to Jacobi. The implicit solve stops
+// at the given residual relative to the explicit velocities. Pass a stiffness
+// matrix (see createStiffnessMatrix) to let it assemble the force Jacobian
+// instead of recomputing it from particles, or NULL. Colliders are moved by the
+// step unless moveColliders is false, as for every domain but the first of a
+// step. Pass a halo (see createHalo) when the grid is split across processes,
+// or NULL; multigrid is ignored then. Pass a sleep state (see createSleepState)
+// to let resting snow sleep, or NULL; it reorders the particles, so not with a
+// halo. The stages run on graph (see createStepGraph). Returns the number of
+// solver iterations (0 for explicit updates).
+int updateParticles( Particle *particles, ParticleCache *devParticleCache, ParticleCache *hostParticleCache, index_t numParticles,
+                     Grid *grid, Node *nodes, const NodeCache &nodeCaches, index_t numNodes,
+                     ImplicitCollider *colliders, int numColliders, bool moveColliders,
+                     float timeStep, bool implicitUpdate, float tolerance, Preconditioner preconditioner, const Multigrid *multigrid,
+                     StiffnessMatrix *stiffness, const ParticleBins *bins, bool deterministic, const Halo *halo,
+                     SleepState *sleep, StepGraph *graph );
+
+// updateParticles in two halves, to step several domains at once.
+// beginParticleUpdate only enqueues the stages up to the implicit solve on
+// graph (see createStepGraph) and returns the number of awake particles.
+// finishParticleUpdate, given that count and the same arguments, waits for the
+// graph and does the rest. Domains with graphs of their own overlap on the
+// device between the two calls; colliders shared by them should be moved
+// beforehand (see moveColliders) rather than by the step.
+index_t beginParticleUpdate( Particle *particles, ParticleCache *devParticleCache, ParticleCache *hostParticleCache, index_t numParticles,
+                             Grid *grid, Node *nodes, const NodeCache &nodeCaches, index_t numNodes,
+                             ImplicitCollider *colliders, int numColliders, bool moveColliders,
+                             float timeStep, bool implicitUpdate, float tolerance, Preconditioner preconditioner, const Multigrid *multigrid,
+                             StiffnessMatrix *stiffness, const ParticleBins *bins, bool deterministic, const Halo *halo,
+                             SleepState *sleep, StepGraph *graph );
+int finishParticleUpdate( Particle *particles, ParticleCache *devParticleCache, ParticleCache *hostParticleCache, index_t numParticles,
+                          Grid *grid, Node *nodes, const NodeCache &nodeCaches, index_t numNodes,
+                          ImplicitCollider *colliders, int numColliders, bool moveColliders,
+                          float timeStep, bool implicitUpdate, float tolerance, Preconditioner preconditioner, const Multigrid *multigrid,
+                          StiffnessMatrix *stiffness, const ParticleBins *bins, bool deterministic, const Halo *halo,
+                          SleepState *sleep, StepGraph *graph );
+
+// Streams and events for the stages of one domain's step
+StepGraph* createStepGraph();
+void destroyStepGraph( StepGraph *graph );
+
+void moveColliders( ImplicitCollider *colliders, int numColliders, float timeStep );
+
+// Sizes the caches and arena of a run from its mode. Pass multigrid if the
+// coarse levels exist.
+void planMemory( MemoryPlan *plan, index_t numNodes, bool implicitUpdate, Preconditioner preconditioner,
+                 bool multigrid, bool deterministic );
+
+// Allocates the channels in the mask (see NodeCache::Mask), zeroed. Pass more
+// nodes than the grid has to leave room for larger grids later.
+void createNodeCaches( NodeCache *caches, index_t numNodes, unsigned int channels );
+void destroyNodeCaches( NodeCache *caches );
+
+void createParticleCache( ParticleCache *cache, index_t numParticles, const MemoryPlan &plan );
+void destroyParticleCache( ParticleCache *cache );
+
+// Grows the arena to at least capacity bytes. Only while nothing is allocated.
+void reserveDeviceArena( DeviceArena *arena, size_t capacity );
+void* deviceArenaAllocate( DeviceArena *arena, size_t bytes );
+void clearDeviceArena( DeviceArena *arena );
+void destroyDeviceArena( DeviceArena *arena );
+
+// Matrix storage grows on demand, up to half the free device memory
+void createStiffnessMatrix( StiffnessMatrix *stiffness, index_t numNodes, ImplicitOperator mode );
+void destroyStiffnessMatrix( StiffnessMatrix *stiffness );
+
+void createMultigrid( Multigrid *multigrid, const Grid &grid );
+void destroyMultigrid( Multigrid *multigrid );
+// Refits the levels to another grid, reallocating only those that don't fit
+void resizeMultigrid( Multigrid *multigrid, const Grid &grid );
+
+void createParticleBins( ParticleBins *bins, index_t numParticles, const Grid &grid );
+void destroyParticleBins( ParticleBins *bins );
+// Refits the bins to another grid and particle count, growing what doesn't fit
+void resizeParticleBins( ParticleBins *bins, index_t numParticles, const Grid &grid );
+
+// Bounds of the particle positions, by a parallel reduction
+void computeParticleBounds( const Particle *particles, index_t numParticles, vec3 &min, vec3 &max );
+
+// Copies the nodes of a domain (a grid on the same lattice, inside grid) into
+// the layout of the whole grid. Nodes outside it are left alone.
+void expandDomainNodes( const Node *domainNodes, const Grid &domain, Node *gridNodes, const Grid &grid );
+
+// Copies the per-node values of one grid into another on the same lattice,
+// where the two overlap. Nodes of to outside from are left alone.
+void remapNodeValues( const vec3 *from, const Grid &fromGrid, vec3 *to, const Grid &toGrid );
+
+// Flags the blocks of blockSize^3 grid cells that the particles come within
+// margin cells of. devFlags holds one bool per block, indexed by
+// Grid::getGridIndex over the block dimensions. Particles outside the grid
+// count in the block nearest to them.
+void markOccupiedBlocks( const Particle *particles, index_t numParticles, const Grid &grid, int blockSize, int margin, bool *devFlags );
+
+// Sets *devEscaped if any of the particles comes within margin cells of the
+// edge of domain, other than where it meets the edge of grid. Doesn't clear
+// it, or synchronize.
+void flagEscapedParticles( const Particle *particles, index_t numParticles, const Grid &grid, const Grid &domain, int margin, int *devEscaped );
+
+// Stably sorts the particles by the domain of their block, from devBlockDomains
+// (one int per block, laid out as for markOccupiedBlocks), and returns how many
+// each of the domainCount domains got. Every particle's block must be in one.
+// The keys and counts come out of arena, which must hold domainSortBytes.
+void sortParticlesByDomain( Particle *particles, index_t numParticles, const Grid &grid, int blockSize,
+                            const int *devBlockDomains, int domainCount, index_t *counts, DeviceArena *arena );
+size_t domainSortBytes( index_t numParticles, int domainCount );
+
+// Blocks of grid fall asleep after steps steps below speed (m/s) and strain
+// rate (1/s). Start one per grid, and reset it for the new grid whenever the
+// particles are reordered from outside.
+void createSleepState( SleepState *sleep, const Grid &grid, int steps, float speed, float strainRate );
+void resetSleepState( SleepState *sleep, const Grid &grid );
+void destroySleepState( SleepState *sleep );
+
+// Splits grid across the ranks of the communicator into slabs along x, and
+// returns this rank's slab with its ghost cells as localGrid. Fails if a slab
+// would be too narrow.
+bool createHalo( Halo *halo, Communicator *communicator, const Grid &grid, Grid *localGrid );
+void destroyHalo( Halo *halo );
+
+// Copies the particles of this rank's slab of grid, in order, to slabParticles
+// and returns how many there are; with slabParticles NULL, only counts them.
+// To split a particle set that every rank holds all of.
+index_t copySlabParticles( const Particle *particles, index_t numParticles, const Grid &grid, const Halo &halo,
+                           Particle *slabParticles );
+
+// Sends the particles that left this rank's slab of grid to the neighbors, and
+// appends the ones that entered it. Particles move less than a cell per step,
+// so only neighbors are involved. Only the leaving particles are moved out,
+// through the arena, and the last particles staying fill the gaps they leave.
+// If the arrivals don't fit in capacity, particles is reallocated, with a
+// quarter to spare, and capacity updated. Returns the new count.
+index_t migrateParticles( Particle **particles, index_t numParticles, index_t *capacity, const Grid &grid, Halo *halo,
+                          DeviceArena *arena );
+
+// Chunks of chunkSize particles for the streamed passes below
+void createParticleStream( ParticleStream *stream, index_t chunkSize );
+void destroyParticleStream( ParticleStream *stream );
+
+// Versions of initializeParticleVolumes and an explicit updateParticles for
+// particles in host memory, typically a ParticleFile. They are streamed
+// through the device chunk by chunk, twice per call, while the grid stays on
+// the device. The arena must hold MemoryPlan::arenaBytes.
+void initializeStreamedParticleVolumes( Particle *particles, index_t numParticles, const Grid *grid, index_t numNodes,
+                                        ParticleStream *stream, DeviceArena *arena );
+void updateStreamedParticles( Particle *particles, index_t numParticles, ParticleStream *stream,
+                              Grid *grid, Node *nodes, index_t numNodes,
+                              ImplicitCollider *colliders, int numColliders, float timeStep );
+
+// Packs the channels the volume exporter writes into half precision
+void packExportNodes( const Node *nodes, index_t numNodes, float cellVolume, ExportNode *exportNodes );
 
 // Mesh filling
-void fillMesh( cudaGraphicsResource **resource, int triCount, const Grid &grid, Particle *particles, int particleCount, float targetDensity, int materialPreset);
+void fillMesh( cudaGraphicsResource **resource, int triCount, const Grid &grid, Particle *particles, index_t particleCount, float targetDensity, int materialPreset, unsigned int seed );
+
+// Flags the grid cells inside a mesh (interleaved position/normal triangles, as in the
+// mesh VBO) and returns how many there are. devFlags holds one bool per grid cell.
+index_t voxelizeMesh( void *tris, int triCount, const Grid &grid, bool *devFlags );
 
 #if 0
-void fillMesh2( cudaGraphicsResource **resource, int triCount, const Grid &grid, Particle *particles, int particleCount, float targetDensity);
+void fillMesh2( cudaGraphicsResource **resource, int triCount, const Grid &grid, Particle *particles, index_t particleCount, float targetDensity);
 #endif
 
-// One time computation to get particle volumes
-void initializeParticleVolumes( Particle *particles, int numParticles, const Grid *grid, int numNodes );
+// One time computation to get particle volumes. Node masses are staged in the
+// arena, which must hold MemoryPlan::arenaBytes. Pass a halo when the grid is
+// split across processes, or NULL; the node masses are then summed with the
+// neighbors', so each rank only needs the particles of its slab.
+void initializeParticleVolumes( Particle *particles, index_t numParticles, const Grid *grid, index_t numNodes,
+                                const ParticleBins *bins, const Halo *halo, DeviceArena *arena );
 
 }
 
@@ -0,0 +1,90 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   half.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef HALF_H
+#define HALF_H
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include "cuda/vector.h"
+
+/*
+ * IEEE 754 half precision storage. All arithmetic is still done in float;
+ * these types only make memory-bound arrays smaller. The conversions are
+ * written out in software (round to nearest even) so the host and the device
+ * produce the same bits, which deterministic mode relies on.
+ */
+
+typedef unsigned short half_t;
+
+__host__ __device__ __forceinline__ half_t floatToHalf( float f )
+{
+    union { float f; unsigned int u; } v;
+    v.f = f;
+    unsigned int sign = ( v.u >> 16 ) & 0x8000;
+    unsigned int fexp = ( v.u >> 23 ) & 0xff;
+    unsigned int mant = v.u & 0x7fffff;
+    if ( fexp == 0xff ) return sign | 0x7c00 | ( mant ? 0x200 : 0 ); // inf, nan
+    int exp = (int)fexp - 127 + 15;
+    if ( exp >= 31 ) return sign | 0x7c00; // overflow
+    if ( exp <= 0 ) {
+        if ( exp < -10 ) return sign; // underflow
+        // Subnormal
+        mant |= 0x800000;
+        unsigned int shift = 14 - exp;
+        unsigned int h = mant >> shift, rem = mant & ( (1u<<shift)-1 ), halfway = 1u << (shift-1);
+        if ( rem > halfway || (rem == halfway && (h & 1)) ) ++h;
+        return sign | h;
+    }
+    // A carry out of the mantissa correctly bumps the exponent
+    unsigned int h = ( exp << 10 ) | ( mant >> 13 ), rem = mant & 0x1fff;
+    if ( rem > 0x1000 || (rem == 0x1000 && (h & 1)) ) ++h;
+    return sign | h;
+}
+
+__host__ __device__ __forceinline__ float halfToFloat( half_t h )
+{
+    unsigned int sign = ( h & 0x8000 ) << 16;
+    unsigned int exp = ( h >> 10 ) & 0x1f;
+    unsigned int mant = h & 0x3ff;
+    union { float f; unsigned int u; } v;
+    if ( exp == 0x1f ) {
+        v.u = sign | 0x7f800000 | ( mant << 13 );
+    } else if ( exp != 0 ) {
+        v.u = sign | ( (exp + 112) << 23 ) | ( mant << 13 );
+    } else if ( mant == 0 ) {
+        v.u = sign;
+    } else {
+        // Subnormal, renormalize
+        exp = 113;
+        while ( !(mant & 0x400) ) { mant <<= 1; --exp; }
+        v.u = sign | ( exp << 23 ) | ( (mant & 0x3ff) << 13 );
+    }
+    return v.f;
+}
+
+struct hvec3
+{
+    half_t x, y, z;
+
+    __host__ __device__ __forceinline__
+    hvec3() { x = 0; y = 0; z = 0; }
+
+    __host__ __device__ __forceinline__
+    hvec3( const vec3 &v ) { x = floatToHalf(v.x); y = floatToHalf(v.y); z = floatToHalf(v.z); }
+
+    __host__ __device__ __forceinline__
+    hvec3& operator = ( const vec3 &rhs ) { x = floatToHalf(rhs.x); y = floatToHalf(rhs.y); z = floatToHalf(rhs.z); return *this; }
+
+    __host__ __device__ __forceinline__
+    operator vec3() const { return vec3( halfToFloat(x), halfToFloat(y), halfToFloat(z) ); }
+};
+
+#endif // HALF_H
@@ -0,0 +1,133 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   halo.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef HALO_H
+#define HALO_H
+
+/*
+ * Summing the scattered node values of a grid split across processes (see
+ * Halo). Each band is gathered on the device, copied to the host, swapped with
+ * the neighbor and added back on the device. Both neighbors add the same two bands, so the band ends
+ * up with the same values on either side.
+ */
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <helper_functions.h>
+#include <helper_cuda.h>
+
+#define CUDA_INCLUDE
+#include "geometry/grid.h"
+#include "sim/caches.h"
+#include "sim/particlegridnode.h"
+#include "sim/profiler.h"
+#include "cuda/vector.h"
+
+#include "cuda/helpers.h"
+
+#include "common/common.h"
+#include "common/communicator.h"
+
+// Only the channels P2G scatters into. The rest are derived per node later.
+__device__ __forceinline__ void addHaloValue( Node &node, const Node &other )
+{
+    node.mass += other.mass;
+    node.velocity += other.velocity;
+    node.force += other.force;
+}
+
+__device__ __forceinline__ void addHaloValue( vec3 &value, const vec3 &other )
+{
+    value += other;
+}
+
+__device__ __forceinline__ void addHaloValue( float &value, const float &other )
+{
+    value += other;
+}
+
+// Storage index of the nodeIdx-th node of the band of node planes starting at
+// firstPlane, taking the planes in order and each plane j-major
+__device__ __forceinline__ index_t bandNodeIndex( const Grid &grid, int firstPlane, index_t nodeIdx )
+{
+    const glm::ivec3 nodeDim = grid.nodeDim();
+    const index_t planeNodes = (index_t)nodeDim.y*nodeDim.z;
+    const index_t inPlane = nodeIdx % planeNodes;
+    return grid.nodeIndex( firstPlane + (int)(nodeIdx/planeNodes), (int)(inPlane/nodeDim.z), (int)(inPlane%nodeDim.z) );
+}
+
+template<typename T>
+__global__ void packHaloBand( const T *values, const Grid grid, int firstPlane, T *band, index_t bandNodes )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= bandNodes ) return;
+    band[nodeIdx] = values[bandNodeIndex(grid, firstPlane, nodeIdx)];
+}
+
+template<typename T>
+__global__ void addHaloBand( T *values, const Grid grid, int firstPlane, const T *other, index_t bandNodes )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= bandNodes ) return;
+    addHaloValue( values[bandNodeIndex(grid, firstPlane, nodeIdx)], other[nodeIdx] );
+}
+
+// The lower ghosts are the first node planes, and the upper ones the last
+__global__ void clearHaloGhostsKernel( double *values, const Grid grid, index_t lowerGhosts, index_t upperGhosts )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= lowerGhosts+upperGhosts ) return;
+    int firstPlane = 0;
+    if ( nodeIdx >= lowerGhosts ) {
+        const index_t planeNodes = (index_t)grid.nodeDim().y*grid.nodeDim().z;
+        nodeIdx -= lowerGhosts;
+        firstPlane = grid.nodeDim().x - (int)( upperGhosts/planeNodes );
+    }
+    values[bandNodeIndex(grid, firstPlane, nodeIdx)] = 0.0;
+}
+
+// Zeroes the values of the nodes the neighbors own
+__host__ void clearHaloGhosts( const Halo &halo, double *values )
+{
+    const index_t ghosts = halo.lowerGhosts + halo.upperGhosts;
+    if ( ghosts == 0 ) return;
+    const dim3 blocks( (ghosts+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+    LAUNCH( clearHaloGhostsKernel<<<blocks,threads>>>(values, halo.grid, halo.lowerGhosts, halo.upperGhosts) );
+}
+
+/**
+ * Adds the neighbors' bands to the local ones. Runs on the default stream and
+ * blocks until the neighbors have sent theirs.
+ */
+template<typename T>
+__host__ void sumHaloBands( const Halo &halo, T *values )
+{
+    PROFILE_SCOPE( "haloExchange" );
+
+    const size_t bytes = halo.bandNodes*sizeof(T);
+    const dim3 blocks( (halo.bandNodes+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+    const int bandPlanes = 2*HALO_CELLS+1;
+
+    // Upper neighbor first on every rank, so rank r's first exchange pairs
+    // with rank r+1's second
+    const int peers[2] = { halo.upperRank, halo.lowerRank };
+    for ( int side = 0; side < 2; ++side ) {
+        if ( peers[side] < 0 ) continue;
+        int firstPlane = ( side == 0 ) ? halo.grid.nodeDim().x - bandPlanes : 0;
+        LAUNCH( packHaloBand<T><<<blocks,threads>>>(values, halo.grid, firstPlane, (T*)halo.devBand, halo.bandNodes) );
+        checkCudaErrors( cudaMemcpy(halo.sendBuffer, halo.devBand, bytes, cudaMemcpyDeviceToHost) );
+        halo.communicator->exchange( peers[side], halo.sendBuffer, bytes, halo.receiveBuffer, bytes );
+        checkCudaErrors( cudaMemcpy(halo.devBand, halo.receiveBuffer, bytes, cudaMemcpyHostToDevice) );
+        LAUNCH( addHaloBand<T><<<blocks,threads>>>(values, halo.grid, firstPlane, (const T*)halo.devBand, halo.bandNodes) );
+    }
+}
+
+#endif // HALO_H
@@ -18,6 +18,9 @@
 
 #define LAUNCH( ... ) { __VA_ARGS__; checkCudaErrors( cudaDeviceSynchronize() ); }
 
+// Kernel launch on a stream: checks the launch without synchronizing
+#define LAUNCH_ASYNC( ... ) { __VA_ARGS__; checkCudaErrors( cudaGetLastError() ); }
+
 #define cudaMallocAndCopy( dst, src, size )                    \
 ({                                                             \
     cudaMalloc((void**) &dst, size);                           \
@@ -17,102 +17,75 @@
 #include <helper_cuda.h>
 #include "math.h"
 
+#include <thrust/device_ptr.h>
+#include <thrust/reduce.h>
+#include <thrust/scan.h>
+
 #define CUDA_INCLUDE
 #include "geometry/grid.h"
 #include "sim/caches.h"
 #include "sim/material.h"
 #include "sim/particle.h"
 #include "sim/particlegridnode.h"
+#include "sim/profiler.h"
 #include "cuda/vector.h"
 
 #include "cuda/helpers.h"
 #include "cuda/atomic.h"
 #include "cuda/decomposition.h"
+#include "cuda/deterministic.h"
+#include "cuda/halo.h"
+#include "cuda/preconditioner.h"
 #include "cuda/weighting.h"
 
 #include "common/common.h"
 
 #define BETA 0.5f
-#define MAX_ITERATIONS 15
-#define RESIDUAL_THRESHOLD 1e-20
 
 /**
- * Called over particles
- **/
-__global__ void computedF( const Particle *particles, ParticleCache *particleCache, int numParticles,
-                           const Grid *grid, const NodeCache *nodeCaches,
-                           NodeCache::Offset uOffset, float dt )
+ * dF = dt * sum_i u_i (wg_ip)^T Fe over the particle's 4x4x4 stencil
+ */
+template<NodeCache::Offset U>
+__device__ mat3 gatherdF( const Particle &particle, const Grid *grid, const NodeCache &nodeCaches, float dt )
 {
-    int particleIdx = blockIdx.x*blockDim.x + threadIdx.x;
-    if ( particleIdx >= numParticles ) return;
-
-    const Particle &particle = particles[particleIdx];
-
-    const glm::ivec3 &dim = grid->dim;
-
-    // Compute neighborhood of particle in grid
-    vec3 gridIndex = (particle.position - grid->pos) / grid->h,
-         gridMax = vec3::floor( gridIndex + vec3(2,2,2) ),
-         gridMin = vec3::ceil( gridIndex - vec3(2,2,2) );
-    glm::ivec3 maxIndex = glm::clamp( glm::ivec3(gridMax), glm::ivec3(0,0,0), dim ),
-               minIndex = glm::clamp( glm::ivec3(gridMin), glm::ivec3(0,0,0), dim );
-
-    // Fill dF
-    mat3 dF(0.0f);
-    int rowSize = dim.z+1;
-    int pageSize = (dim.y+1)*rowSize;
-    for ( int i = minIndex.x; i <= maxIndex.x; ++i ) {
-        vec3 d, s;
-        d.x = gridIndex.x - i;
-        d.x *= ( s.x = ( d.x < 0 ) ? -1.f : 1.f );
-        int pageOffset = i*pageSize;
-        for ( int j = minIndex.y; j <= maxIndex.y; ++j ) {
-            d.y = gridIndex.y - j;
-            d.y *= ( s.y = ( d.y < 0 ) ? -1.f : 1.f );
-            int rowOffset = pageOffset + j*rowSize;
-            for ( int k = minIndex.z; k <= maxIndex.z; ++k ) {
-                d.z = gridIndex.z - k;
-                d.z *= ( s.z = ( d.z < 0 ) ? -1.f : 1.f );
-                vec3 wg;
-                weightGradient( s, d, wg );
-
-                const NodeCache &nodeCache = nodeCaches[rowOffset+k];
-                vec3 du_j = dt * nodeCache[uOffset];
-
-                dF += mat3::outerProduct( du_j, wg );
+    vec3 gridPos = (particle.position - grid->pos) / grid->h;
+    glm::ivec3 origin( gridPos-1 );
+    StencilWeights weights( gridPos, origin );
+
+    const vec3 *u = nodeCaches.get<U>();
+    mat3 dF( 0.f );
+    for ( int i = 0; i < 4; ++i ) {
+        for ( int j = 0; j < 4; ++j ) {
+            for ( int k = 0; k < 4; ++k ) {
+                glm::ivec3 ijk = origin + glm::ivec3( i, j, k );
+                if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) continue;
+                dF += mat3::outerProduct( dt*u[grid->nodeIndex(ijk)], weights.gradient(i, j, k) );
             }
         }
     }
-
-    particleCache->dFs[particleIdx] = dF * particle.elasticF;
+    return dF * particle.elasticF;
 }
 
-/** Currently computed in computedF, we could parallelize this and computedF but not sure what the time benefit would be*/
-__global__ void computeFeHat( Particle *particles, ParticleCache *particleCache, int numParticles, Grid *grid, float dt, Node *nodes )
+__global__ void computeFeHat( Particle *particles, ParticleCache *particleCache, index_t numParticles, Grid *grid, float dt, Node *nodes )
 {
-    int particleIdx = blockIdx.x*blockDim.x + threadIdx.x;
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( particleIdx >= numParticles ) return;
 
     Particle &particle = particles[particleIdx];
 
     vec3 particleGridPos = (particle.position - grid->pos) / grid->h;
-    glm::ivec3 min = glm::ivec3(std::ceil(particleGridPos.x - 2), std::ceil(particleGridPos.y - 2), std::ceil(particleGridPos.z - 2));
-    glm::ivec3 max = glm::ivec3(std::floor(particleGridPos.x + 2), std::floor(particleGridPos.y + 2), std::floor(particleGridPos.z + 2));
+    glm::ivec3 origin( particleGridPos-1 );
+    StencilWeights weights( particleGridPos, origin );
 
     mat3 vGradient(0.0f);
 
-    min = glm::max(glm::ivec3(0.0f), min);
-    max = glm::min(grid->dim, max);
-    for (int i = min.x; i <= max.x; i++){
-        for (int j = min.y; j <= max.y; j++){
-            for (int k = min.z; k <= max.z; k++){
-                int currIdx = grid->getGridIndex(i, j, k, grid->dim+1);
-                Node &node = nodes[currIdx];
-
-                vec3 wg;
-                weightGradient(particleGridPos - vec3(i, j, k), wg);
-
-                vGradient += mat3::outerProduct(dt*node.velocity, wg);
+    for (int i = 0; i < 4; i++){
+        for (int j = 0; j < 4; j++){
+            for (int k = 0; k < 4; k++){
+                glm::ivec3 ijk = origin + glm::ivec3(i, j, k);
+                if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) continue;
+                const Node &node = nodes[grid->nodeIndex(ijk)];
+                vGradient += mat3::outerProduct(dt*node.velocity, weights.gradient(i, j, k));
             }
         }
     }
@@ -192,24 +165,18 @@ __device__ void compute_dJF_invTrans( const mat3 &F, const mat3 &dF, mat3 &dJF_i
 }
 
 /**
- * Called over particles
- **/
-__global__ void computeAp( const Particle *particles, ParticleCache *particleCache, int numParticles )
+ * Ap = d/dF (dPsi/dFe) : dF, the change in stress for a change dF of the
+ * elastic deformation gradient, linearized at FeHat.
+ */
+__device__ mat3 computeAp( const Particle &particle, const ParticleCache *particleCache, index_t particleIdx, const mat3 &dF )
 {
-    int particleIdx =  blockIdx.x*blockDim.x + threadIdx.x;
-    if ( particleIdx >= numParticles ) return;
-
-    const Particle &particle = particles[particleIdx];
     const Material &material = particle.material;
 
-    const mat3 &dF = particleCache->dFs[particleIdx];
-
-    const mat3 &Fp = particle.plasticF; //for the sake of making the code look like the math
-    const mat3 &Fe = particleCache->FeHats[particleIdx];
+    const mat3 &Fe = particleCache->FeHats[particleIdx]; //for the sake of making the code look like the math
     const mat3 &Re = particleCache->ReHats[particleIdx];
     const mat3 &Se = particleCache->SeHats[particleIdx];
 
-    float Jpp = mat3::determinant(Fp);
+    float Jpp = particle.plasticJ;
     float Jep = mat3::determinant(Fe);
 
     float muFp = material.mu*__expf(material.xi*(1-Jpp));
@@ -223,205 +190,644 @@ __global__ void computeAp( const Particle *particles, ParticleCache *particleCac
 
     mat3 JFe_invTrans = mat3::cofactor( Fe );
 
-    particleCache->Aps[particleIdx] = (2*muFp*(dF - dR) + lambdaFp*JFe_invTrans*mat3::innerProduct(JFe_invTrans, dF) + lambdaFp*(Jep - 1)*dJFe_invTrans);
+    return (2*muFp*(dF - dR) + lambdaFp*JFe_invTrans*mat3::innerProduct(JFe_invTrans, dF) + lambdaFp*(Jep - 1)*dJFe_invTrans);
+}
+
+/**
+ * Stores Ap for gatherdf. Called over particles.
+ */
+template<NodeCache::Offset U>
+__global__ void computeAps( const Particle *particles, ParticleCache *particleCache, index_t numParticles,
+                            const Grid *grid, const NodeCache nodeCaches, float dt )
+{
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( particleIdx >= numParticles ) return;
+    const Particle &particle = particles[particleIdx];
+    particleCache->Aps[particleIdx] = computeAp( particle, particleCache, particleIdx, gatherdF<U>(particle, grid, nodeCaches, dt) );
 }
 
-__global__ void computedf( const Particle *particles, const ParticleCache *particleCache, int numParticles, const Grid *grid, NodeCache *nodeCaches )
+/**
+ * The whole particle side of Eu in one pass: gathers dF, builds Ap and
+ * scatters df, all in registers. Called over particles.
+ */
+template<NodeCache::Offset U>
+__global__ void computedf( const Particle *particles, const ParticleCache *particleCache, index_t numParticles,
+                           const Grid *grid, NodeCache nodeCaches, float dt )
 {
-    int particleIdx = blockIdx.y*gridDim.x*blockDim.x + blockIdx.x*blockDim.x + threadIdx.x;
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( particleIdx >= numParticles ) return;
 
     const Particle &particle = particles[particleIdx];
-    vec3 gridPos = (particle.position-grid->pos)/grid->h;
+    mat3 Ap = computeAp( particle, particleCache, particleIdx, gatherdF<U>(particle, grid, nodeCaches, dt) );
+    mat3 stress = -particle.volume * mat3::multiplyABt( Ap, particle.elasticF );
+
+    vec3 gridPos = (particle.position - grid->pos) / grid->h;
+    glm::ivec3 origin( gridPos-1 );
+    StencilWeights weights( gridPos, origin );
+
+    vec3 *df = nodeCaches.get<NodeCache::DF>();
+    for ( int i = 0; i < 4; ++i ) {
+        for ( int j = 0; j < 4; ++j ) {
+            for ( int k = 0; k < 4; ++k ) {
+                glm::ivec3 ijk = origin + glm::ivec3( i, j, k );
+                if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) continue;
+                atomicAdd( df+grid->nodeIndex(ijk), stress*weights.gradient(i, j, k) );
+            }
+        }
+    }
+}
+
+__host__ __device__ __forceinline__ int stiffnessSlot( const glm::ivec3 &offset )
+{
+    return ( (offset.x+STIFFNESS_RADIUS)*(2*STIFFNESS_RADIUS+1) + (offset.y+STIFFNESS_RADIUS) )*(2*STIFFNESS_RADIUS+1) + (offset.z+STIFFNESS_RADIUS);
+}
+
+/**
+ * Numbers the active nodes. Called over nodes, after nodeRows has been set to
+ * 1 for active nodes and exclusive-scanned.
+ */
+__global__ void compactStiffnessRows( const Node *nodes, index_t numNodes, StiffnessMatrix stiffness )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+    if ( nodes[nodeIdx].mass > 0.f ) {
+        stiffness.rowNodes[stiffness.nodeRows[nodeIdx]] = nodeIdx;
+    } else {
+        stiffness.nodeRows[nodeIdx] = -1;
+    }
+}
 
-    glm::ivec3 ijk;
-    Grid::gridIndexToIJK( threadIdx.y, glm::ivec3(4,4,4), ijk );
-    ijk += glm::ivec3( gridPos-1 );
+__global__ void flagActiveNodes( const Node *nodes, index_t numNodes, index_t *flags )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+    flags[nodeIdx] = ( nodes[nodeIdx].mass > 0.f ) ? 1 : 0;
+}
+
+/**
+ * Adds each particle's blocks K_ij = -V*dt * Ap(e_b (Fe^T wg_j)^T) * Fe^T wg_i
+ * (column b) to the stiffness matrix. Ap is linear in dF, so it is evaluated
+ * once per particle on the nine unit matrices. Called over particles, 64
+ * threads per particle (one per row node i), like computeDiagonal.
+ */
+__global__ void assembleStiffnessKernel( const Particle *particles, const ParticleCache *particleCache, index_t numParticles,
+                                         const Grid *grid, StiffnessMatrix stiffness, float dt )
+{
+    __shared__ float tangents[THREAD_COUNT/64][9][9];
 
-    if ( Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) {
+    index_t particleIdx = ((index_t)blockIdx.y*gridDim.x + blockIdx.x)*blockDim.x + threadIdx.x;
+    bool valid = ( particleIdx < numParticles );
 
-        vec3 wg;
-        vec3 nodePos(ijk);
-        weightGradient( gridPos-nodePos, wg );
-        vec3 df_j = -particle.volume * mat3::multiplyABt( particleCache->Aps[particleIdx], particle.elasticF ) * wg;
+    if ( valid && threadIdx.y < 9 ) {
+        mat3 unit( 0.f );
+        unit[threadIdx.y] = 1.f;
+        mat3 Ap = computeAp( particles[particleIdx], particleCache, particleIdx, unit );
+        for ( int e = 0; e < 9; ++e ) tangents[threadIdx.x][threadIdx.y][e] = Ap[e];
+    }
+    __syncthreads();
+    if ( !valid ) return;
 
-        int gridIndex = Grid::getGridIndex( ijk, grid->nodeDim() );
-        atomicAdd( &(nodeCaches[gridIndex].df), df_j );
+    const Particle &particle = particles[particleIdx];
+    vec3 gridPos = (particle.position-grid->pos)/grid->h;
+    glm::ivec3 origin( gridPos-1 );
+
+    glm::ivec3 offset;
+    Grid::gridIndexToIJK( threadIdx.y, glm::ivec3(4,4,4), offset );
+    glm::ivec3 ijk = origin + offset;
+    if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) return;
+    index_t row = stiffness.nodeRows[grid->nodeIndex(ijk)];
+    if ( row < 0 ) return;
+
+    StencilWeights weights( gridPos, origin );
+    mat3 FeT = mat3::transpose( particle.elasticF );
+    vec3 gi = -particle.volume * dt * ( FeT * weights.gradient(offset.x, offset.y, offset.z) );
+
+    // Ap(E_m) * gi for the unit matrix E_m, m = 3*d + b
+    vec3 T[9];
+    for ( int m = 0; m < 9; ++m ) {
+        const float *A = tangents[threadIdx.x][m];
+        T[m] = vec3( A[0]*gi.x + A[3]*gi.y + A[6]*gi.z,
+                     A[1]*gi.x + A[4]*gi.y + A[7]*gi.z,
+                     A[2]*gi.x + A[5]*gi.y + A[8]*gi.z );
+    }
+
+    for ( int i = 0; i < 4; ++i ) {
+        for ( int j = 0; j < 4; ++j ) {
+            for ( int k = 0; k < 4; ++k ) {
+                glm::ivec3 jk = origin + glm::ivec3( i, j, k );
+                if ( !Grid::withinBoundsInclusive(jk, glm::ivec3(0,0,0), grid->dim) ) continue;
+                vec3 gj = FeT * weights.gradient( i, j, k );
+                mat3 K( T[0]*gj.x + T[3]*gj.y + T[6]*gj.z,
+                        T[1]*gj.x + T[4]*gj.y + T[7]*gj.z,
+                        T[2]*gj.x + T[5]*gj.y + T[8]*gj.z );
+                atomicAdd( stiffness.blocks + (index_t)stiffnessSlot(jk-ijk)*stiffness.capacity + row, K );
+            }
+        }
+    }
+}
+
+/**
+ * df = K*u over the active rows. Inactive nodes keep df = 0.
+ */
+template<NodeCache::Offset U>
+__global__ void stiffnessProduct( const Grid *grid, const StiffnessMatrix stiffness, index_t rowCount, NodeCache nodeCaches )
+{
+    index_t row = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( row >= rowCount ) return;
+
+    index_t nodeIdx = stiffness.rowNodes[row];
+    glm::ivec3 ijk = grid->nodeIJK( nodeIdx );
+
+    const vec3 *u = nodeCaches.get<U>();
+    vec3 df( 0.f, 0.f, 0.f );
+    int slot = 0;
+    for ( int i = -STIFFNESS_RADIUS; i <= STIFFNESS_RADIUS; ++i ) {
+        for ( int j = -STIFFNESS_RADIUS; j <= STIFFNESS_RADIUS; ++j ) {
+            for ( int k = -STIFFNESS_RADIUS; k <= STIFFNESS_RADIUS; ++k, ++slot ) {
+                glm::ivec3 neighbor = ijk + glm::ivec3( i, j, k );
+                if ( !Grid::withinBoundsInclusive(neighbor, glm::ivec3(0,0,0), grid->dim) ) continue;
+                df += stiffness.blocks[(index_t)slot*stiffness.capacity + row] * u[grid->nodeIndex(neighbor)];
+            }
+        }
     }
+    nodeCaches.get<NodeCache::DF>()[nodeIdx] = df;
 }
 
-__global__ void computeEuResult( const Node *nodes, NodeCache *nodeCaches, int numNodes, float dt, NodeCache::Offset uOffset, NodeCache::Offset resultOffset )
+template<NodeCache::Offset U, NodeCache::Offset RESULT>
+__global__ void computeEuResult( const Node *nodes, NodeCache nodeCaches, index_t numNodes, float dt )
 {
-    int nodeIdx = blockDim.x*blockIdx.x + threadIdx.x;
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( nodeIdx >= numNodes ) return;
-    NodeCache &nodeCache = nodeCaches[nodeIdx];
     float mass = nodes[nodeIdx].mass;
     float scale = ( mass > 0.f ) ? 1.f/mass : 0.f;
-    nodeCache[resultOffset] = nodeCache[uOffset] - BETA*dt*scale*nodeCache.df;
+    nodeCaches.get<RESULT>()[nodeIdx] = nodeCaches.get<U>()[nodeIdx] - BETA*dt*scale*nodeCaches.get<NodeCache::DF>()[nodeIdx];
 }
 
-__global__ void zero_df( NodeCache *nodeCaches, int numNodes )
+/**
+ * Computes the matrix-vector product Eu. With bins, df is gathered deterministically.
+ * With an assembled stiffness matrix, df is a sparse product instead of a
+ * particle pass. With a halo, df is summed with the neighbors' before use.
+ */
+template<NodeCache::Offset U, NodeCache::Offset RESULT>
+__host__ void computeEu( const Particle *particles, ParticleCache *particleCache, index_t numParticles,
+                         const Grid *grid, const Node *nodes, const NodeCache &nodeCaches, index_t numNodes,
+                         float dt, const ParticleBins *bins, const StiffnessMatrix *stiffness = NULL,
+                         const Halo *halo = NULL )
 {
-    int tid = blockDim.x*blockIdx.x + threadIdx.x;
-    if ( tid >= numNodes ) return;
-    nodeCaches[tid].df = vec3(0.0f);
+
+    const dim3 pBlocks1D( (numParticles+THREAD_COUNT-1)/THREAD_COUNT );
+    const dim3 nBlocks1D( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads1D( THREAD_COUNT );
+
+    PROFILE_SCOPE( "computeEu" );
+
+    {
+        PROFILE_SCOPE( "computedf" );
+        if ( stiffness ) {
+            const dim3 rBlocks1D( (stiffness->rowCount+THREAD_COUNT-1)/THREAD_COUNT );
+            checkCudaErrors( cudaMemset(nodeCaches.get<NodeCache::DF>(), 0, numNodes*sizeof(vec3)) );
+            LAUNCH( stiffnessProduct<U><<<rBlocks1D,threads1D>>>(grid,*stiffness,stiffness->rowCount,nodeCaches) );
+        } else if ( bins ) {
+            LAUNCH( computeAps<U><<<pBlocks1D,threads1D>>>(particles,particleCache,numParticles,grid,nodeCaches,dt) );
+            LAUNCH( gatherdf<<<nBlocks1D,threads1D>>>(particles,particleCache,*bins,grid,nodeCaches,numNodes) );
+        } else {
+            checkCudaErrors( cudaMemset(nodeCaches.get<NodeCache::DF>(), 0, numNodes*sizeof(vec3)) );
+            LAUNCH( computedf<U><<<pBlocks1D,threads1D>>>(particles,particleCache,numParticles,grid,nodeCaches,dt) );
+        }
+        if ( halo ) sumHaloBands( *halo, nodeCaches.get<NodeCache::DF>() );
+    }
+
+    {
+        PROFILE_SCOPE( "computeEuResult" );
+        LAUNCH( computeEuResult<U,RESULT><<<nBlocks1D,threads1D>>>(nodes,nodeCaches,numNodes,dt) );
+    }
+}
+
+// Milliseconds between the stiffness matrix's timing events
+__host__ float elapsedTiming( const StiffnessMatrix *stiffness )
+{
+    float ms;
+    checkCudaErrors( cudaEventRecord(stiffness->timing[1]) );
+    checkCudaErrors( cudaEventSynchronize(stiffness->timing[1]) );
+    checkCudaErrors( cudaEventElapsedTime(&ms, stiffness->timing[0], stiffness->timing[1]) );
+    return ms;
 }
 
 /**
- * Computes the matrix-vector product Eu.
+ * Assembles the stiffness matrix for this step if its mode asks for it, or,
+ * in AUTO_OPERATOR mode, if assembling once and running sparse products beats
+ * a particle pass per operator application. The costs are measured: the
+ * first steps run one of each path, and every step refreshes the cost of the
+ * path it ran. The estimate assumes the solve takes as many sweeps, and the
+ * matrix as many rows, as the last time. Needs FeHat, ReHat and SeHat. Returns whether the matrix is ready
+ * to use.
  */
-__host__ void computeEu( const Particle *particles, ParticleCache *particleCache, int numParticles,
-                         const Grid *grid, const Node *nodes, NodeCache *nodeCaches, int numNodes,
-                         NodeCache::Offset uOffset, NodeCache::Offset resultOffset, float dt )
+__host__ bool assembleStiffness( const Particle *particles, const ParticleCache *particleCache, index_t numParticles,
+                                 const Grid *grid, const Node *nodes, index_t numNodes, float dt, StiffnessMatrix *stiffness )
 {
+    if ( stiffness->mode == MATRIX_FREE_OPERATOR || numParticles == 0 ) return false;
+
+    float sweeps = stiffness->lastSweeps;
+    bool automatic = ( stiffness->mode == AUTO_OPERATOR );
+    bool measured = ( stiffness->matrixFreeCost > 0.f && stiffness->assemblyCost > 0.f );
+    if ( automatic && stiffness->matrixFreeCost == 0.f ) return false;
+    if ( automatic && measured && sweeps*stiffness->matrixFreeCost <= stiffness->assemblyCost ) return false;
+    // The active nodes change little between steps, so the last row count
+    // stands in for this step's before paying for the compaction
+    if ( automatic && measured && stiffness->assemblyCost*numParticles + sweeps*stiffness->productCost*stiffness->rowCount >=
+                                  sweeps*stiffness->matrixFreeCost*numParticles ) return false;
+
+    PROFILE_SCOPE( "assembleStiffness" );
 
-    const dim3 pBlocks1D( (numParticles+THREAD_COUNT-1)/THREAD_COUNT );
     const dim3 nBlocks1D( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
     static const dim3 threads1D( THREAD_COUNT );
-    const dim3 pBlocks2D( (numParticles+THREAD_COUNT-1)/THREAD_COUNT, 64 );
-    static const dim3 threads2D( THREAD_COUNT / 64, 64 );
 
-    LAUNCH( computedF<<<pBlocks1D,threads1D>>>(particles,particleCache,numParticles,grid,nodeCaches,uOffset,dt) );
-
-    LAUNCH( computeAp<<<pBlocks1D,threads1D>>>(particles,particleCache,numParticles) );
+    checkCudaErrors( cudaEventRecord(stiffness->timing[0]) );
+    thrust::device_ptr<index_t> nodeRows( stiffness->nodeRows );
+    LAUNCH( flagActiveNodes<<<nBlocks1D,threads1D>>>(nodes,numNodes,stiffness->nodeRows) );
+    stiffness->rowCount = thrust::reduce( nodeRows, nodeRows+numNodes );
+    thrust::exclusive_scan( nodeRows, nodeRows+numNodes, nodeRows );
+    LAUNCH( compactStiffnessRows<<<nBlocks1D,threads1D>>>(nodes,numNodes,*stiffness) );
+
+    if ( stiffness->rowCount > stiffness->capacity ) {
+        // Leave room to grow, but never take more than half the free memory
+        index_t capacity = stiffness->rowCount + stiffness->rowCount/4;
+        size_t freeBytes, totalBytes;
+        checkCudaErrors( cudaMemGetInfo(&freeBytes, &totalBytes) );
+        freeBytes += stiffness->capacity*STIFFNESS_SLOTS*sizeof(mat3);
+        if ( capacity*STIFFNESS_SLOTS*sizeof(mat3) > freeBytes/2 ) {
+            LOG( "Not enough memory to assemble the stiffness matrix for %lld nodes.", stiffness->rowCount );
+            return false;
+        }
+        checkCudaErrors( cudaFree(stiffness->blocks) );
+        checkCudaErrors( cudaMalloc((void**)&stiffness->blocks, capacity*STIFFNESS_SLOTS*sizeof(mat3)) );
+        stiffness->capacity = capacity;
+    }
+    checkCudaErrors( cudaMemset(stiffness->blocks, 0, stiffness->capacity*STIFFNESS_SLOTS*sizeof(mat3)) );
 
-    LAUNCH( zero_df<<<nBlocks1D,threads1D>>>(nodeCaches,numNodes) );
+    const dim3 pBlocks2D( (numParticles+THREAD_COUNT-1)/THREAD_COUNT, 64 );
+    static const dim3 threads2D( THREAD_COUNT/64, 64 );
+    LAUNCH( assembleStiffnessKernel<<<pBlocks2D,threads2D>>>(particles,particleCache,numParticles,grid,*stiffness,dt) );
+    stiffness->assemblyCost = elapsedTiming( stiffness ) / numParticles;
+    return true;
+}
 
-    LAUNCH( computedf<<<pBlocks2D,threads2D>>>(particles,particleCache,numParticles,grid,nodeCaches) );
+/**
+ * Warm start: v = v* plus the last step's correction, advected semi-Lagrangian
+ * style along v* and interpolated trilinearly. Empty nodes start at v*.
+ */
+__global__ void initializeVKernel( const Grid *grid, const Node *nodes, NodeCache nodeCaches, index_t numNodes, float dt )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
 
-    LAUNCH( computeEuResult<<<nBlocks1D,threads1D>>>(nodes,nodeCaches,numNodes,dt,uOffset,resultOffset) );
+    const Node &node = nodes[nodeIdx];
+    vec3 &v = nodeCaches.get<NodeCache::V>()[nodeIdx];
+    v = node.velocity;
+    if ( node.mass <= 0.f ) return;
+
+    glm::ivec3 ijk = grid->nodeIJK( nodeIdx );
+    vec3 source = vec3::min( vec3::max(vec3(ijk) - (dt/grid->h)*node.velocity, vec3(0.f)), vec3(grid->dim) );
+    glm::ivec3 lo = glm::min( glm::ivec3(source), grid->dim-1 );
+    vec3 t = source - vec3(lo);
+
+    const vec3 *warm = nodeCaches.get<NodeCache::WARM>();
+    for ( int i = 0; i < 2; ++i ) {
+        for ( int j = 0; j < 2; ++j ) {
+            for ( int k = 0; k < 2; ++k ) {
+                float w = ( i ? t.x : 1.f-t.x ) * ( j ? t.y : 1.f-t.y ) * ( k ? t.z : 1.f-t.z );
+                v += w * warm[grid->nodeIndex(lo.x+i, lo.y+j, lo.z+k)];
+            }
+        }
+    }
 }
 
-__global__ void initializeVKernel( const Node *nodes, NodeCache *nodeCaches, int numNodes )
+/**
+ * r = v* - E*v, with E*v already in R. Puts |v*|^2 in scratch for the
+ * relative convergence test.
+ */
+__global__ void initializeRKernel( const Node *nodes, NodeCache nodeCaches, index_t numNodes )
 {
-    int nodeIdx = blockDim.x*blockIdx.x + threadIdx.x;
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( nodeIdx >= numNodes ) return;
-    nodeCaches[nodeIdx].v = nodes[nodeIdx].velocity;
+    const vec3 &b = nodes[nodeIdx].velocity;
+    vec3 &r = nodeCaches.get<NodeCache::R>()[nodeIdx];
+    r = b - r;
+    nodeCaches.scratch[nodeIdx] = (double)vec3::dot( b, b );
 }
 
-__global__ void initializeRPKernel( NodeCache *nodeCaches, int numNodes )
+__global__ void initializePKernel( NodeCache nodeCaches, index_t numNodes )
 {
-    int nodeIdx = blockDim.x*blockIdx.x + threadIdx.x;
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( nodeIdx >= numNodes ) return;
-    NodeCache &nodeCache = nodeCaches[nodeIdx];
-    nodeCache.r = nodeCache.v - nodeCache.r;
-    nodeCache.p = nodeCache.r;
+    nodeCaches.get<NodeCache::P>()[nodeIdx] = nodeCaches.get<NodeCache::Z>()[nodeIdx];
 }
 
-__global__ void initializeApKernel( NodeCache *nodeCaches, int numNodes )
+__global__ void initializeApKernel( NodeCache nodeCaches, index_t numNodes )
 {
-    int nodeIdx = blockDim.x*blockIdx.x + threadIdx.x;
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( nodeIdx >= numNodes ) return;
-    NodeCache &nodeCache = nodeCaches[nodeIdx];
-    nodeCache.Ap = nodeCache.Ar;
+    nodeCaches.get<NodeCache::AP>()[nodeIdx] = nodeCaches.get<NodeCache::AR>()[nodeIdx];
 }
 
-__global__ void updateVRKernel( NodeCache *nodeCaches, int numNodes, double alpha )
+__global__ void updateVRKernel( NodeCache nodeCaches, index_t numNodes, double alpha, bool preconditioned )
 {
-    int nodeIdx = blockDim.x*blockIdx.x + threadIdx.x;
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( nodeIdx >= numNodes ) return;
-    NodeCache &nodeCache = nodeCaches[nodeIdx];
-    nodeCache.v += alpha*nodeCache.p;
-    nodeCache.r -= alpha*nodeCache.Ap;
+    nodeCaches.get<NodeCache::V>()[nodeIdx] += alpha*nodeCaches.get<NodeCache::P>()[nodeIdx];
+    nodeCaches.get<NodeCache::R>()[nodeIdx] -= alpha*nodeCaches.get<NodeCache::AP>()[nodeIdx];
+    if ( preconditioned ) nodeCaches.get<NodeCache::Z>()[nodeIdx] -= alpha*nodeCaches.get<NodeCache::Q>()[nodeIdx];
 }
 
-__global__ void updatePApResidualKernel( NodeCache *nodeCaches, int numNodes, double beta )
+__global__ void updatePApResidualKernel( NodeCache nodeCaches, index_t numNodes, double beta )
 {
-    int nodeIdx = blockDim.x*blockIdx.x + threadIdx.x;
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( nodeIdx >= numNodes ) return;
-    NodeCache &nodeCache = nodeCaches[nodeIdx];
-    nodeCache.p = nodeCache.r + beta * nodeCache.p;
-    nodeCache.Ap = nodeCache.Ar + beta * nodeCache.Ap;
-    nodeCache.scratch = (double)vec3::dot( nodeCache.r, nodeCache.r );
+    const vec3 &r = nodeCaches.get<NodeCache::R>()[nodeIdx];
+    vec3 &p = nodeCaches.get<NodeCache::P>()[nodeIdx];
+    vec3 &Ap = nodeCaches.get<NodeCache::AP>()[nodeIdx];
+    p = nodeCaches.get<NodeCache::Z>()[nodeIdx] + beta * p;
+    Ap = nodeCaches.get<NodeCache::AR>()[nodeIdx] + beta * Ap;
+    nodeCaches.scratch[nodeIdx] = (double)vec3::dot( r, r );
 }
 
-__global__ void finishConjugateResidualKernel( Node *nodes, const NodeCache *nodeCaches, int numNodes )
+__global__ void finishConjugateResidualKernel( Node *nodes, const NodeCache nodeCaches, index_t numNodes )
 {
-    int nodeIdx = blockDim.x*blockIdx.x + threadIdx.x;
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( nodeIdx >= numNodes ) return;
-    nodes[nodeIdx].velocity = nodeCaches[nodeIdx].v;
+    // Keep the correction to warm start the next solve
+    nodeCaches.get<NodeCache::WARM>()[nodeIdx] = nodeCaches.get<NodeCache::V>()[nodeIdx] - nodes[nodeIdx].velocity;
+    nodes[nodeIdx].velocity = nodeCaches.get<NodeCache::V>()[nodeIdx];
     // Update the velocity change. It is assumed to be set as the pre-update velocity
     nodes[nodeIdx].velocityChange = nodes[nodeIdx].velocity - nodes[nodeIdx].velocityChange;
 }
 
-__global__ void scratchReduceKernel( NodeCache *nodeCaches, int numNodes, int reductionSize )
+__global__ void scratchReduceKernel( double *scratch, index_t numNodes, index_t reductionSize )
 {
-    int nodeIdx = blockDim.x*blockIdx.x + threadIdx.x;
-    if ( nodeIdx >= numNodes || nodeIdx+reductionSize >= numNodes ) return;
-    nodeCaches[nodeIdx].scratch += nodeCaches[nodeIdx+reductionSize].scratch;
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= reductionSize || nodeIdx+reductionSize >= numNodes ) return;
+    scratch[nodeIdx] += scratch[nodeIdx+reductionSize];
 }
 
-__host__ double scratchSum( NodeCache *nodeCaches, int numNodes )
+/**
+ * Sums the scratch values of all nodes. With a halo, the sum is over the whole
+ * distributed grid: ghost nodes are left out, so each node counts once, on the
+ * rank that owns it.
+ */
+__host__ double scratchSum( double *scratch, index_t numNodes, const Halo *halo )
 {
-    static const dim3 blocks( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
+    if ( halo ) clearHaloGhosts( *halo, scratch );
+    const dim3 blocks( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
     static const dim3 threads( THREAD_COUNT );
-    int steps = (int)(ceilf(log2f(numNodes)));
-    int reductionSize = 1 << (steps-1);
-    for ( int i = 0; i < steps; i++ ) {
-        scratchReduceKernel<<< blocks, threads >>>( nodeCaches, numNodes, reductionSize );
-        reductionSize /= 2;
-        cudaDeviceSynchronize();
+    // A single node is already summed, and the reduction needs at least one step
+    if ( numNodes > 1 ) {
+        int steps = (int)(ceil(log2((double)numNodes)));
+        index_t reductionSize = (index_t)1 << (steps-1);
+        for ( int i = 0; i < steps; i++ ) {
+            scratchReduceKernel<<< blocks, threads >>>( scratch, numNodes, reductionSize );
+            reductionSize /= 2;
+            cudaDeviceSynchronize();
+        }
     }
-    double result;
-    cudaMemcpy( &result, &(nodeCaches[0].scratch), sizeof(double), cudaMemcpyDeviceToHost );
+    double result = 0.0;
+    if ( numNodes > 0 ) cudaMemcpy( &result, scratch, sizeof(double), cudaMemcpyDeviceToHost );
+    if ( halo ) halo->communicator->allReduceSum( &result, 1 );
     return result;
 }
 
-__global__ void innerProductKernel( NodeCache *nodeCaches, int numNodes, NodeCache::Offset uOffset, NodeCache::Offset vOffset )
+template<NodeCache::Offset U, NodeCache::Offset V>
+__global__ void innerProductKernel( NodeCache nodeCaches, index_t numNodes )
 {
-    int nodeIdx = blockDim.x*blockIdx.x + threadIdx.x;
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( nodeIdx >= numNodes ) return;
-    NodeCache &nodeCache = nodeCaches[nodeIdx];
-    nodeCache.scratch = (double)vec3::dot( nodeCache[uOffset], nodeCache[vOffset] );
+    nodeCaches.scratch[nodeIdx] = (double)vec3::dot( nodeCaches.get<U>()[nodeIdx], nodeCaches.get<V>()[nodeIdx] );
+}
+
+template<NodeCache::Offset U, NodeCache::Offset V>
+__host__ double innerProduct( const NodeCache &nodeCaches, index_t numNodes, const Halo *halo )
+{
+    const dim3 blocks( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+    LAUNCH( innerProductKernel<U,V><<< blocks, threads >>>(nodeCaches, numNodes) );
+    return scratchSum( nodeCaches.scratch, numNodes, halo );
+}
+
+/**
+ * Fills the inverse diagonals the preconditioner needs and, for multigrid, the
+ * coarse node masses. levels[l] is 2^(l+1) times coarser than the simulation
+ * grid and applies the fine operator with weight gradients in its own grid
+ * units, which are 2^(l+1) times those of the simulation grid. computeEu is
+ * quadratic in dt*wg, so levels[l] runs it with dt/2^(l+1).
+ * With a halo, the diagonal is summed with the neighbors' before inverting.
+ */
+__host__ void computePreconditioner( Preconditioner preconditioner, const Multigrid *multigrid,
+                                     const Particle *particles, index_t numParticles,
+                                     const Grid *grid, const Node *nodes, const NodeCache &nodeCaches, index_t numNodes,
+                                     float dt, const ParticleBins *bins, const Halo *halo )
+{
+    if ( preconditioner == NO_PRECONDITIONER ) return;
+
+    PROFILE_SCOPE( "computePreconditioner" );
+
+    const dim3 nBlocks1D( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads1D( THREAD_COUNT );
+    const dim3 pBlocks2D( (numParticles+THREAD_COUNT-1)/THREAD_COUNT, 64 );
+    static const dim3 threads2D( THREAD_COUNT / 64, 64 );
+
+    if ( bins ) {
+        LAUNCH( gatherDiagonal<<<nBlocks1D,threads1D>>>(particles,*bins,grid,nodeCaches,numNodes) );
+    } else {
+        checkCudaErrors( cudaMemset(nodeCaches.get<NodeCache::DINV>(), 0, numNodes*sizeof(vec3)) );
+        LAUNCH( computeDiagonal<<<pBlocks2D,threads2D>>>(particles,numParticles,grid,nodeCaches) );
+    }
+    if ( halo ) sumHaloBands( *halo, nodeCaches.get<NodeCache::DINV>() );
+    LAUNCH( invertDiagonal<<<nBlocks1D,threads1D>>>(nodes,nodeCaches,numNodes,BETA*dt*dt) );
+
+    if ( preconditioner != MULTIGRID_PRECONDITIONER || !multigrid ) return;
+
+    const Grid *fineGrid = grid;
+    const Node *fineNodes = nodes;
+    for ( int l = 0; l < multigrid->levelCount; ++l ) {
+        const MultigridLevel &level = multigrid->levels[l];
+        index_t levelNodes = level.grid.nodeCount();
+        float levelDt = dt / ( 1 << (l+1) );
+        const dim3 lBlocks1D( (levelNodes+THREAD_COUNT-1)/THREAD_COUNT );
+        LAUNCH( restrictMasses<<<lBlocks1D,threads1D>>>(fineGrid,fineNodes,level.devGrid,level.nodes,levelNodes) );
+        checkCudaErrors( cudaMemset(level.caches.get<NodeCache::DINV>(), 0, levelNodes*sizeof(vec3)) );
+        LAUNCH( computeDiagonal<<<pBlocks2D,threads2D>>>(particles,numParticles,level.devGrid,level.caches) );
+        LAUNCH( invertDiagonal<<<lBlocks1D,threads1D>>>(level.nodes,level.caches,levelNodes,BETA*levelDt*levelDt) );
+        fineGrid = level.devGrid;
+        fineNodes = level.nodes;
+    }
 }
 
-__host__ double innerProduct( NodeCache *nodeCaches, int numNodes, NodeCache::Offset uOffset, NodeCache::Offset vOffset )
+/**
+ * Approximately solves E*V = R on coarse level l, starting from zero: damped
+ * Jacobi, coarse grid correction, damped Jacobi.
+ */
+__host__ void coarseVCycle( const Particle *particles, ParticleCache *particleCache, index_t numParticles,
+                            const Multigrid &multigrid, int l, float dt )
+{
+    const MultigridLevel &level = multigrid.levels[l];
+    index_t numNodes = level.grid.nodeCount();
+    float levelDt = dt / ( 1 << (l+1) );
+
+    const dim3 blocks( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+
+    LAUNCH( jacobiKernel<NodeCache::R, NodeCache::V><<<blocks,threads>>>(level.caches,numNodes,JACOBI_OMEGA) );
+
+    if ( l+1 < multigrid.levelCount ) {
+        const MultigridLevel &coarse = multigrid.levels[l+1];
+        index_t coarseNodes = coarse.grid.nodeCount();
+        const dim3 cBlocks( (coarseNodes+THREAD_COUNT-1)/THREAD_COUNT );
+        computeEu<NodeCache::V, NodeCache::AR>( particles, particleCache, numParticles, level.devGrid, level.nodes, level.caches, numNodes, levelDt, NULL );
+        LAUNCH( restrictResidual<NodeCache::R, NodeCache::AR><<<cBlocks,threads>>>(level.devGrid,level.nodes,level.caches,coarse.devGrid,coarse.nodes,coarse.caches,coarseNodes) );
+        coarseVCycle( particles, particleCache, numParticles, multigrid, l+1, dt );
+        LAUNCH( prolongCorrection<NodeCache::V><<<blocks,threads>>>(level.devGrid,level.caches,numNodes,coarse.devGrid,coarse.caches) );
+    }
+
+    computeEu<NodeCache::V, NodeCache::AR>( particles, particleCache, numParticles, level.devGrid, level.nodes, level.caches, numNodes, levelDt, NULL );
+    LAUNCH( smoothKernel<NodeCache::R, NodeCache::V, NodeCache::AR><<<blocks,threads>>>(level.caches,numNodes,JACOBI_OMEGA) );
+}
+
+// Whether applyPreconditioner applies E on the grid itself
+__host__ bool preconditionerSweeps( Preconditioner preconditioner, const Multigrid *multigrid )
+{
+    return preconditioner == MULTIGRID_PRECONDITIONER && multigrid && multigrid->levelCount > 0;
+}
+
+/**
+ * X = M^-1 * B. Multigrid falls back to Jacobi if there are no coarse levels,
+ * and otherwise applies E twice on the grid, with the stiffness matrix if
+ * given.
+ */
+template<NodeCache::Offset B, NodeCache::Offset X>
+__host__ void applyPreconditioner( Preconditioner preconditioner, const Multigrid *multigrid,
+                                   const Particle *particles, ParticleCache *particleCache, index_t numParticles,
+                                   const Grid *grid, const Node *nodes, const NodeCache &nodeCaches, index_t numNodes,
+                                   float dt, const ParticleBins *bins, const StiffnessMatrix *stiffness )
 {
     const dim3 blocks( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
     static const dim3 threads( THREAD_COUNT );
-    LAUNCH( innerProductKernel<<< blocks, threads >>>(nodeCaches, numNodes, uOffset, vOffset) );
-    return scratchSum( nodeCaches, numNodes );
+
+    PROFILE_SCOPE( "applyPreconditioner" );
+
+    if ( !preconditionerSweeps(preconditioner, multigrid) ) {
+        LAUNCH( jacobiKernel<B, X><<<blocks,threads>>>(nodeCaches,numNodes,1.f) );
+        return;
+    }
+
+    const MultigridLevel &coarse = multigrid->levels[0];
+    index_t coarseNodes = coarse.grid.nodeCount();
+    const dim3 cBlocks( (coarseNodes+THREAD_COUNT-1)/THREAD_COUNT );
+
+    LAUNCH( jacobiKernel<B, X><<<blocks,threads>>>(nodeCaches,numNodes,JACOBI_OMEGA) );
+    computeEu<X, NodeCache::TMP>( particles, particleCache, numParticles, grid, nodes, nodeCaches, numNodes, dt, bins, stiffness );
+    LAUNCH( restrictResidual<B, NodeCache::TMP><<<cBlocks,threads>>>(grid,nodes,nodeCaches,coarse.devGrid,coarse.nodes,coarse.caches,coarseNodes) );
+    coarseVCycle( particles, particleCache, numParticles, *multigrid, 0, dt );
+    LAUNCH( prolongCorrection<X><<<blocks,threads>>>(grid,nodeCaches,numNodes,coarse.devGrid,coarse.caches) );
+    computeEu<X, NodeCache::TMP>( particles, particleCache, numParticles, grid, nodes, nodeCaches, numNodes, dt, bins, stiffness );
+    LAUNCH( smoothKernel<B, X, NodeCache::TMP><<<blocks,threads>>>(nodeCaches,numNodes,JACOBI_OMEGA) );
 }
 
-__host__ void integrateNodeForces( Particle *particles, ParticleCache *particleCache, int numParticles,
-                                   Grid *grid, Node *nodes, NodeCache *nodeCaches, int numNodes,
-                                   float dt )
+/**
+ * Solves E*v = v* with the (preconditioned) conjugate residual method, warm
+ * started from the last solve. Stops once |r| <= tolerance*|v*|, or after
+ * MAX_ITERATIONS. Given a stiffness matrix, E may be applied as a sparse
+ * product instead (see assembleStiffness). With a halo, the solve runs over
+ * the whole distributed grid; multigrid isn't supported there. Returns the
+ * number of iterations.
+ */
+__host__ int integrateNodeForces( Particle *particles, ParticleCache *particleCache, index_t numParticles,
+                                  Grid *grid, Node *nodes, const NodeCache &nodeCaches, index_t numNodes,
+                                  float dt, float tolerance, Preconditioner preconditioner, const Multigrid *multigrid,
+                                  StiffnessMatrix *stiffness, const ParticleBins *bins, const Halo *halo )
 {
     const dim3 blocks( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
     static const dim3 threads( THREAD_COUNT );
 
-    // No need to sync because it can run in parallel with other kernels
-    computeFeHat<<< (numParticles+THREAD_COUNT-1)/THREAD_COUNT, THREAD_COUNT >>>(particles,particleCache,numParticles,grid,dt,nodes);
+    // Without a preconditioner z = r and q = Ap, so Z and Q alias R and AP
+    const bool preconditioned = ( preconditioner != NO_PRECONDITIONER );
+    NodeCache caches = nodeCaches;
+    if ( !preconditioned ) {
+        caches.channels[NodeCache::Z] = caches.channels[NodeCache::R];
+        caches.channels[NodeCache::Q] = caches.channels[NodeCache::AP];
+    }
+
+    {
+        PROFILE_SCOPE( "computeFeHat" );
+        // No need to sync because it can run in parallel with other kernels
+        computeFeHat<<< (numParticles+THREAD_COUNT-1)/THREAD_COUNT, THREAD_COUNT >>>(particles,particleCache,numParticles,grid,dt,nodes);
+    }
+
+    // The stiffness matrix is assembled with atomics, so never in deterministic mode
+    const StiffnessMatrix *assembled = NULL;
+    if ( stiffness && !bins && assembleStiffness(particles, particleCache, numParticles, grid, nodes, numNodes, dt, stiffness) ) {
+        assembled = stiffness;
+    }
+
+    computePreconditioner( preconditioner, multigrid, particles, numParticles, grid, nodes, caches, numNodes, dt, bins, halo );
 
     // Initialize conjugate residual method
-    LAUNCH( initializeVKernel<<<blocks,threads>>>(nodes, nodeCaches, numNodes) );
-    computeEu( particles, particleCache, numParticles, grid, nodes, nodeCaches, numNodes, NodeCache::V, NodeCache::R, dt );
-    LAUNCH( initializeRPKernel<<<blocks,threads>>>(nodeCaches, numNodes) );
-    computeEu( particles, particleCache, numParticles, grid, nodes, nodeCaches, numNodes, NodeCache::R, NodeCache::AR, dt );
-    LAUNCH( initializeApKernel<<<blocks,threads>>>(nodeCaches, numNodes) );
+    double threshold;
+    {
+        PROFILE_SCOPE( "crInitialize" );
+        LAUNCH( initializeVKernel<<<blocks,threads>>>(grid, nodes, caches, numNodes, dt) );
+        // The first sweep times the path this step took
+        if ( stiffness ) checkCudaErrors( cudaEventRecord(stiffness->timing[0]) );
+        computeEu<NodeCache::V, NodeCache::R>( particles, particleCache, numParticles, grid, nodes, caches, numNodes, dt, bins, assembled, halo );
+        if ( assembled ) {
+            if ( stiffness->rowCount > 0 ) stiffness->productCost = elapsedTiming( stiffness ) / stiffness->rowCount;
+        } else if ( stiffness && numParticles > 0 ) {
+            stiffness->matrixFreeCost = elapsedTiming( stiffness ) / numParticles;
+        }
+        LAUNCH( initializeRKernel<<<blocks,threads>>>(nodes, caches, numNodes) );
+        threshold = (double)tolerance * tolerance * scratchSum( caches.scratch, numNodes, halo );
+        if ( preconditioned ) {
+            applyPreconditioner<NodeCache::R, NodeCache::Z>( preconditioner, multigrid, particles, particleCache, numParticles, grid, nodes, caches, numNodes, dt, bins, assembled );
+        }
+        LAUNCH( initializePKernel<<<blocks,threads>>>(caches, numNodes) );
+        computeEu<NodeCache::Z, NodeCache::AR>( particles, particleCache, numParticles, grid, nodes, caches, numNodes, dt, bins, assembled, halo );
+        LAUNCH( initializeApKernel<<<blocks,threads>>>(caches, numNodes) );
+    }
 
     int k = 0;
-    float residual;
+    double residual;
     do {
 
-        double alphaNum = innerProduct( nodeCaches, numNodes, NodeCache::R, NodeCache::AR );
-        double alphaDen = innerProduct( nodeCaches, numNodes, NodeCache::AP, NodeCache::AP );
-        double alpha = ( fabsf(alphaDen) > 0.f ) ? alphaNum/alphaDen : 0.f;
+        PROFILE_SCOPE( "crIteration" );
+
+        if ( preconditioned ) {
+            applyPreconditioner<NodeCache::AP, NodeCache::Q>( preconditioner, multigrid, particles, particleCache, numParticles, grid, nodes, caches, numNodes, dt, bins, assembled );
+        }
+
+        double alphaNum = innerProduct<NodeCache::Z, NodeCache::AR>( caches, numNodes, halo );
+        double alphaDen = innerProduct<NodeCache::AP, NodeCache::Q>( caches, numNodes, halo );
+        double alpha = ( fabs(alphaDen) > 0.0 ) ? alphaNum/alphaDen : 0.0;
 
         double betaDen = alphaNum;
-        LAUNCH( updateVRKernel<<<blocks,threads>>>( nodeCaches, numNodes, alpha ) );
-        computeEu( particles, particleCache, numParticles, grid, nodes, nodeCaches, numNodes, NodeCache::R, NodeCache::AR, dt );
-        double betaNum = innerProduct( nodeCaches, numNodes, NodeCache::R, NodeCache::AR );
-        double beta = ( fabsf(betaDen) > 0.f ) ? betaNum/betaDen : 0.f;
+        LAUNCH( updateVRKernel<<<blocks,threads>>>( caches, numNodes, alpha, preconditioned ) );
+        computeEu<NodeCache::Z, NodeCache::AR>( particles, particleCache, numParticles, grid, nodes, caches, numNodes, dt, bins, assembled, halo );
+        double betaNum = innerProduct<NodeCache::Z, NodeCache::AR>( caches, numNodes, halo );
+        double beta = ( fabs(betaDen) > 0.0 ) ? betaNum/betaDen : 0.0;
+
+        LAUNCH( updatePApResidualKernel<<<blocks,threads>>>(caches,numNodes,beta) );
+        residual = scratchSum( caches.scratch, numNodes, halo );
 
-        LAUNCH( updatePApResidualKernel<<<blocks,threads>>>(nodeCaches,numNodes,beta) );
-        residual = scratchSum( nodeCaches, numNodes );
+        LOG( "k = %3d, zAz = %10g, alpha = %10g, beta = %10g, r = %g", k, alphaNum, alpha, beta, residual );
+        Profiler::counter( "crResidual", residual );
 
-        LOG( "k = %3d, rAr = %10g, alpha = %10g, beta = %10g, r = %g", k, alphaNum, alpha, beta, residual );
+    } while ( ++k < MAX_ITERATIONS && residual > threshold );
 
-    } while ( ++k < MAX_ITERATIONS && residual > RESIDUAL_THRESHOLD );
+    Profiler::counter( "crIterations", k );
+    // Every iteration applies E once and initialization twice, plus the
+    // preconditioner's own sweeps
+    if ( stiffness ) stiffness->lastSweeps = k + 2 + ( preconditionerSweeps(preconditioner, multigrid) ? 2*(k+1) : 0 );
 
-    LAUNCH( finishConjugateResidualKernel<<<blocks,threads>>>(nodes, nodeCaches, numNodes) );
+    PROFILE_SCOPE( "crFinish" );
+    LAUNCH( finishConjugateResidualKernel<<<blocks,threads>>>(nodes, caches, numNodes) );
+    return k;
 }
 
 #endif // IMPLICIT_H
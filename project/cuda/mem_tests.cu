@@ -20,7 +20,7 @@
 #include "cuda/vector.h"
 #include "cuda/matrix.h"
 
-extern "C" { void testMemoryStuff(); }
+extern "C" { bool testMemoryStuff(); }
 
 
 
@@ -87,12 +87,12 @@ __global__ void processThingList( ThingList *thingList, int numThings )
     for ( int i = -10; i <= 10; ++i ) {
         int index = tid+i;
         if ( index >= 0 && index < numThings ) {
-            thingList->positions[tid] += mat3::inverse(thingList->Fs[tid]) * thingList->velocities[tid];
+            thingList->positions[tid] += mat3::inverse(thingList->Fs[tid]) * thingList->velocities[index];
         }
     }
 }
 
-void testMemoryStuff()
+bool testMemoryStuff()
 {
     LOG( "TESTING MEMORY STUFF" );
 
@@ -129,6 +129,20 @@ void testMemoryStuff()
         LAUNCH( processThingList<<<blocks,threads>>>(devThingList,N) );
     );
 
+    // Both layouts have to compute the same positions
+    Thing *things = new Thing[N];
+    vec3 *positions = new vec3[N];
+    checkCudaErrors( cudaMemcpy(things, devThings, N*sizeof(Thing), cudaMemcpyDeviceToHost) );
+    checkCudaErrors( cudaMemcpy(positions, hostThingList->positions, N*sizeof(vec3), cudaMemcpyDeviceToHost) );
+    int mismatches = 0;
+    for ( int i = 0; i < N; ++i ) {
+        mismatches += ( vec3::length(things[i].position - positions[i]) > 1e-4f );
+    }
+    delete [] things;
+    delete [] positions;
+    bool passed = ( mismatches == 0 );
+    printf( "MEMORY: %s (%d of %d positions differ between layouts)\n", passed ? "PASSED" : "FAILED", mismatches, N );
+
     cudaFree( hostThingList->positions );
     cudaFree( hostThingList->velocities );
     cudaFree( hostThingList->forces );
@@ -139,4 +153,5 @@ void testMemoryStuff()
     cudaFree( devThings );
 
     LOG( "DONE" );
+    return passed;
 }
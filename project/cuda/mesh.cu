@@ -19,6 +19,9 @@
 #include <helper_cuda.h>
 #include <helper_cuda_gl.h>
 
+#include <thrust/count.h>
+#include <thrust/device_ptr.h>
+
 #include "cuda/helpers.h"
 #include "cuda/vector.h"
 
@@ -86,7 +89,8 @@ __global__ void voxelizeMeshKernel( Tri *tris, int triCount, Grid grid, bool *fl
 
     // Flag surface-intersecting voxels
     float t;
-    int xyOffset = x*dim.y*dim.z + y*dim.z, z;
+    index_t xyOffset = ((index_t)x*dim.y + y)*dim.z;
+    int z;
     for ( int i = 0; i < triCount; ++i ) {
         const Tri &tri = tris[i];
         if ( intersectTri(tri.v0, tri.v1, tri.v2, origin, direction, t) ) {
@@ -96,14 +100,14 @@ __global__ void voxelizeMeshKernel( Tri *tris, int triCount, Grid grid, bool *fl
     }
 
     // Scanline to fill inner voxels
-    int end = xyOffset + dim.z, zz;
-    for ( int z = xyOffset; z < end; ++z ) {
+    index_t end = xyOffset + dim.z, zz;
+    for ( index_t z = xyOffset; z < end; ++z ) {
         if ( flags[z] ) {
             do { z++; } while ( flags[z] && z < end );
             zz = z;
             do { zz++; } while ( !flags[zz] && zz < end );
             if ( zz < end - 1 ) {
-                for ( int i = z; i < zz; ++i ) flags[i] = true;
+                for ( index_t i = z; i < zz; ++i ) flags[i] = true;
                 z = zz;
             } else break;
         }
@@ -111,39 +115,28 @@ __global__ void voxelizeMeshKernel( Tri *tris, int triCount, Grid grid, bool *fl
 
 }
 
-__global__ void initReduction( bool *flags, int voxelCount, int *reduction, int reductionSize )
-{
-    int tid = threadIdx.x + blockIdx.x * blockDim.x;
-    if ( tid >= reductionSize ) return;
-    reduction[tid] = ( tid < voxelCount ) ? flags[tid] : 0;
-}
-
-__global__ void reduce( int *reduction, int size )
-{
-    int tid = threadIdx.x + blockIdx.x * blockDim.x;
-    if ( tid >= size ) return;
-    reduction[tid] += reduction[tid+size];
-}
-
-__global__ void fillMeshVoxelsKernel( curandState *states, unsigned int seed, Grid grid, bool *flags, Particle *particles, float particleMass, int particleCount )
+__global__ void fillMeshVoxelsKernel( unsigned int seed, Grid grid, bool *flags, Particle *particles, float particleMass, index_t particleCount )
 {
-    int tid = threadIdx.x + blockIdx.x * blockDim.x;
+    index_t tid = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( tid >= particleCount ) return;
 
-    curandState &localState = states[tid];
+    // Each thread draws from its own subsequence, so the state never leaves registers
+    curandState localState;
     curand_init( seed, tid, 0, &localState );
 
     const glm::ivec3 &dim = grid.dim;
 
-    // Rejection sample
-    unsigned int i;
-    unsigned int voxelCount = dim.x * dim.y * dim.z;
-    do { i = curand(&localState) % voxelCount; } while ( !flags[i] );
+    // Rejection sample, with 64 random bits so every voxel of a large grid is reachable
+    index_t i;
+    index_t voxelCount = grid.cellCount();
+    do {
+        unsigned long long r = ( (unsigned long long)curand(&localState) << 32 ) | curand(&localState);
+        i = (index_t)( r % voxelCount );
+    } while ( !flags[i] );
 
     // Get 3D voxel index
-    unsigned int x = i / (dim.y*dim.z);
-    unsigned int y = (i - x*dim.y*dim.z) / dim.z;
-    unsigned int z = i - y*dim.z - x*dim.y*dim.z;
+    int x, y, z;
+    Grid::gridIndexToIJK( i, x, y, z, dim );
 
     // Generate random point in voxel cube
     vec3 r = vec3( curand_uniform(&localState), curand_uniform(&localState), curand_uniform(&localState) );
@@ -158,39 +151,36 @@ __global__ void fillMeshVoxelsKernel( curandState *states, unsigned int seed, Gr
     particles[tid] = particle;
 }
 
-void fillMesh( cudaGraphicsResource **resource, int triCount, const Grid &grid, Particle *particles, int particleCount, float targetDensity, int materialPreset)
+index_t voxelizeMesh( void *tris, int triCount, const Grid &grid, bool *devFlags )
 {
-    // Get mesh data
-    cudaGraphicsMapResources( 1, resource, 0 );
-    Tri *devTris;
-    size_t size;
-    checkCudaErrors( cudaGraphicsResourceGetMappedPointer((void**)&devTris, &size, *resource) );
+    Tri *devTris = (Tri*)tris;
 
     // Voxelize mesh
     int x = grid.dim.x > 16 ? MAX( 1, MIN(16, grid.dim.x/8)) : 1;
     int y = grid.dim.y > 16 ? MAX( 1, MIN(16, grid.dim.y/8)) : 1;
     dim3 blocks( (grid.dim.x+x-1)/x, (grid.dim.y+y-1)/y ), threads( x, y );
-    int voxelCount = grid.dim.x * grid.dim.y * grid.dim.z;
-    bool *devFlags;
-    checkCudaErrors( cudaMalloc((void**)&devFlags, voxelCount*sizeof(bool)) );
+    index_t voxelCount = grid.cellCount();
     checkCudaErrors( cudaMemset((void*)devFlags, 0, voxelCount*sizeof(bool)) );
     voxelizeMeshKernel<<< blocks, threads >>>( devTris, triCount, grid, devFlags );
     checkCudaErrors( cudaDeviceSynchronize() );
 
-    int powerOfTwo = (int)(log2f(voxelCount)+1);
-    int reductionSize = 1 << powerOfTwo;
-    int *devReduction;
-    checkCudaErrors( cudaMalloc((void**)&devReduction, reductionSize*sizeof(int)) );
-    initReduction<<< (reductionSize+511)/512, 512 >>>( devFlags, voxelCount, devReduction, reductionSize );
-    checkCudaErrors( cudaDeviceSynchronize() );
-    for ( int i = 0; i < powerOfTwo-1; ++i ) {
-        int size = 1 << (powerOfTwo-i-1);
-        reduce<<< (size+511)/512, 512 >>>( devReduction, size );
-        checkCudaErrors( cudaDeviceSynchronize() );
-    }
-    int count;
-    checkCudaErrors( cudaMemcpy(&count, devReduction, sizeof(int), cudaMemcpyDeviceToHost) );
-    checkCudaErrors( cudaFree(devReduction) );
+    // Count the flagged voxels
+    return thrust::count( thrust::device_ptr<bool>(devFlags), thrust::device_ptr<bool>(devFlags+voxelCount), true );
+}
+
+void fillMesh( cudaGraphicsResource **resource, int triCount, const Grid &grid, Particle *particles, index_t particleCount, float targetDensity, int materialPreset, unsigned int seed )
+{
+    // Get mesh data
+    cudaGraphicsMapResources( 1, resource, 0 );
+    Tri *devTris;
+    size_t size;
+    checkCudaErrors( cudaGraphicsResourceGetMappedPointer((void**)&devTris, &size, *resource) );
+
+    // Voxel flags and the particle staging copy share one allocation for the fill
+    DeviceArena arena = { NULL, 0, 0 };
+    reserveDeviceArena( &arena, grid.cellCount()*sizeof(bool) + particleCount*sizeof(Particle) + 2*DEVICE_ARENA_ALIGNMENT );
+    bool *devFlags = (bool*)deviceArenaAllocate( &arena, grid.cellCount()*sizeof(bool) );
+    index_t count = voxelizeMesh( devTris, triCount, grid, devFlags );
     float volume = count*grid.h*grid.h*grid.h;
     float particleMass = targetDensity * volume / particleCount;
     LOG( "Average %.2f particles per grid cell.", float(particleCount)/count );
@@ -198,11 +188,8 @@ void fillMesh( cudaGraphicsResource **resource, int triCount, const Grid &grid,
 
 
     // Randomly fill mesh voxels and copy back resulting particles
-    curandState *devStates;
-    checkCudaErrors( cudaMalloc(&devStates, particleCount*sizeof(curandState)) );
-    Particle *devParticles;
-    checkCudaErrors( cudaMalloc((void**)&devParticles, particleCount*sizeof(Particle)) );
-    fillMeshVoxelsKernel<<< (particleCount+511)/512, 512 >>>( devStates, time(NULL), grid, devFlags, devParticles, particleMass, particleCount );
+    Particle *devParticles = (Particle*)deviceArenaAllocate( &arena, particleCount*sizeof(Particle) );
+    fillMeshVoxelsKernel<<< (particleCount+511)/512, 512 >>>( seed, grid, devFlags, devParticles, particleMass, particleCount );
     checkCudaErrors( cudaDeviceSynchronize() );
 
     switch (materialPreset)
@@ -219,8 +206,7 @@ void fillMesh( cudaGraphicsResource **resource, int triCount, const Grid &grid,
 
     checkCudaErrors( cudaMemcpy(particles, devParticles, particleCount*sizeof(Particle), cudaMemcpyDeviceToHost) );
 
-    checkCudaErrors( cudaFree(devFlags) );
-    checkCudaErrors( cudaFree(devStates) );
+    destroyDeviceArena( &arena );
     checkCudaErrors( cudaGraphicsUnmapResources(1, resource, 0) );
 }
 
@@ -251,12 +237,12 @@ __device__ bool isInMesh(vec3 pos, int seed, Tri *tris, int triCount)
 
 
 
-__global__ void fillMeshKernel2( Tri *tris, int triCount, vec3 bbox_min, vec3 bbox_size, Particle *particles, float particleMass, int particleCount)
+__global__ void fillMeshKernel2( Tri *tris, int triCount, vec3 bbox_min, vec3 bbox_size, Particle *particles, float particleMass, index_t particleCount)
 {
     // naive mesh filling algorithm
     // this approach results in less successes than scanline projection from Z plane and sorting the intersections,
     // but implementation is much simpler and all particles should be filled within a couple iterations.
-    int tid = threadIdx.x + blockIdx.x * blockDim.x;
+    index_t tid = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( tid >= particleCount ) return;
 
     vec3 pos;
@@ -282,7 +268,7 @@ __global__ void fillMeshKernel2( Tri *tris, int triCount, vec3 bbox_min, vec3 bb
  * works really well if mesh occupies majority of bounding box but really slow otherwise.
  * CUDA ends up timing out
  */
-void fillMesh2( cudaGraphicsResource **resource, int triCount, const Grid &grid, Particle *particles, int particleCount, float targetDensity)
+void fillMesh2( cudaGraphicsResource **resource, int triCount, const Grid &grid, Particle *particles, index_t particleCount, float targetDensity)
 {
     // Get mesh data    
     cudaGraphicsMapResources( 1, resource, 0 );
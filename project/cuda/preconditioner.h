@@ -0,0 +1,228 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   preconditioner.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef PRECONDITIONER_H
+#define PRECONDITIONER_H
+
+/*
+ * Kernels for the preconditioners of the implicit velocity solve (the host
+ * side is in implicit.h).
+ *
+ * Jacobi scales by the inverse diagonal of E = I + BETA*dt^2*M^-1*K. The
+ * diagonal blocks of K come from the small strain limit of computeAp: with
+ * g = Fe^T*wg, each particle adds V*(mu*|g|^2 + (mu+lambda)*g_a^2) to axis a
+ * of each node in its stencil.
+ *
+ * Multigrid runs a V-cycle over coarser copies of the grid. Coarse node masses
+ * and residuals are restricted with full weighting (residuals weighted by mass,
+ * since E is scaled by M^-1), corrections are prolonged trilinearly, and each
+ * level is smoothed with damped Jacobi using computeEu on the coarse grid.
+ */
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <helper_functions.h>
+#include <helper_cuda.h>
+
+#define CUDA_INCLUDE
+#include "geometry/grid.h"
+#include "sim/caches.h"
+#include "sim/particle.h"
+#include "sim/particlegridnode.h"
+#include "cuda/vector.h"
+
+#include "cuda/atomic.h"
+#include "cuda/deterministic.h"
+#include "cuda/helpers.h"
+#include "cuda/weighting.h"
+
+#define JACOBI_OMEGA 0.6667f
+
+__device__ __forceinline__ vec3 diagonalContribution( const Particle &particle, const vec3 &wg )
+{
+    const Material &material = particle.material;
+    float hardening = __expf( material.xi*(1-particle.plasticJ) );
+    float mu = material.mu*hardening, lambda = material.lambda*hardening;
+    vec3 g = mat3::transpose( particle.elasticF ) * wg;
+    return particle.volume * ( vec3(mu*vec3::dot(g, g)) + (mu+lambda)*(g*g) );
+}
+
+/**
+ * Called over particles, 64 threads per particle (one per stencil node), like computedf.
+ */
+__global__ void computeDiagonal( const Particle *particles, index_t numParticles, const Grid *grid, NodeCache nodeCaches )
+{
+    index_t particleIdx = ((index_t)blockIdx.y*gridDim.x + blockIdx.x)*blockDim.x + threadIdx.x;
+    if ( particleIdx >= numParticles ) return;
+
+    const Particle &particle = particles[particleIdx];
+    vec3 gridPos = (particle.position-grid->pos)/grid->h;
+
+    glm::ivec3 ijk;
+    Grid::gridIndexToIJK( threadIdx.y, glm::ivec3(4,4,4), ijk );
+    ijk += glm::ivec3( gridPos-1 );
+
+    if ( Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) {
+        vec3 wg;
+        weightGradient( gridPos-vec3(ijk), wg );
+        atomicAdd( nodeCaches.get<NodeCache::DINV>()+grid->nodeIndex(ijk), diagonalContribution(particle, wg) );
+    }
+}
+
+/**
+ * Deterministic computeDiagonal. Called over nodes.
+ */
+__global__ void gatherDiagonal( const Particle *particles, const ParticleBins bins, const Grid *grid, NodeCache nodeCaches, index_t numNodes )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+
+    glm::ivec3 ijk = grid->nodeIJK( nodeIdx );
+    vec3 nodePos( ijk );
+
+    vec3 diagonal( 0.f, 0.f, 0.f );
+    if ( Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) {
+        FOR_EACH_BINNED_PARTICLE( bins, grid, ijk,
+            const Particle &particle = particles[particleIdx];
+            vec3 wg;
+            weightGradient( (particle.position-grid->pos)/grid->h - nodePos, wg );
+            diagonal += diagonalContribution( particle, wg );
+        )
+    }
+    nodeCaches.get<NodeCache::DINV>()[nodeIdx] = diagonal;
+}
+
+/**
+ * Turns the summed stiffness diagonal in DINV into the inverse diagonal of E,
+ * given scale = BETA*dt^2. Empty nodes have E = I.
+ */
+__global__ void invertDiagonal( const Node *nodes, NodeCache nodeCaches, index_t numNodes, float scale )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+    float mass = nodes[nodeIdx].mass;
+    vec3 &dinv = nodeCaches.get<NodeCache::DINV>()[nodeIdx];
+    if ( mass > 0.f ) {
+        vec3 diagonal = vec3(1.f) + (scale/mass)*dinv;
+        dinv = vec3(1.f) / diagonal;
+    } else {
+        dinv = vec3( 1.f );
+    }
+}
+
+/**
+ * X = omega * D^-1 * B
+ */
+template<NodeCache::Offset B, NodeCache::Offset X>
+__global__ void jacobiKernel( NodeCache nodeCaches, index_t numNodes, float omega )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+    nodeCaches.get<X>()[nodeIdx] = omega * nodeCaches.get<NodeCache::DINV>()[nodeIdx] * nodeCaches.get<B>()[nodeIdx];
+}
+
+/**
+ * X += omega * D^-1 * (B - EX)
+ */
+template<NodeCache::Offset B, NodeCache::Offset X, NodeCache::Offset EX>
+__global__ void smoothKernel( NodeCache nodeCaches, index_t numNodes, float omega )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+    vec3 residual = nodeCaches.get<B>()[nodeIdx] - nodeCaches.get<EX>()[nodeIdx];
+    nodeCaches.get<X>()[nodeIdx] += omega * nodeCaches.get<NodeCache::DINV>()[nodeIdx] * residual;
+}
+
+// Full weighting: fine node 2*I+o contributes to coarse node I with weight prod(1-|o|/2)
+#define FOR_EACH_FINE_NODE( FINE, COARSE_IJK, ... )                                             \
+{                                                                                               \
+    for ( int _i = -1; _i <= 1; ++_i ) {                                                        \
+        for ( int _j = -1; _j <= 1; ++_j ) {                                                    \
+            for ( int _k = -1; _k <= 1; ++_k ) {                                                \
+                glm::ivec3 fineIJK = 2*(COARSE_IJK) + glm::ivec3( _i, _j, _k );                 \
+                if ( !Grid::withinBoundsInclusive(fineIJK, glm::ivec3(0,0,0), (FINE)->dim) ) continue; \
+                float w = ( _i ? 0.5f : 1.f ) * ( _j ? 0.5f : 1.f ) * ( _k ? 0.5f : 1.f );     \
+                index_t fineIdx = (FINE)->nodeIndex( fineIJK );                                 \
+                __VA_ARGS__                                                                     \
+            }                                                                                   \
+        }                                                                                       \
+    }                                                                                           \
+}
+
+/**
+ * Coarse node masses. Called over coarse nodes.
+ */
+__global__ void restrictMasses( const Grid *fineGrid, const Node *fineNodes, const Grid *coarseGrid, Node *coarseNodes, index_t numCoarseNodes )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numCoarseNodes ) return;
+
+    glm::ivec3 ijk = coarseGrid->nodeIJK( nodeIdx );
+    float mass = 0.f;
+    if ( Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), coarseGrid->dim) ) {
+        FOR_EACH_FINE_NODE( fineGrid, ijk,
+            mass += w * fineNodes[fineIdx].mass;
+        )
+    }
+    coarseNodes[nodeIdx].mass = mass;
+}
+
+/**
+ * Restricts the fine residual B - EX into the coarse R channel, weighted by
+ * mass. Called over coarse nodes.
+ */
+template<NodeCache::Offset B, NodeCache::Offset EX>
+__global__ void restrictResidual( const Grid *fineGrid, const Node *fineNodes, NodeCache fineCaches,
+                                  const Grid *coarseGrid, const Node *coarseNodes, NodeCache coarseCaches, index_t numCoarseNodes )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numCoarseNodes ) return;
+
+    glm::ivec3 ijk = coarseGrid->nodeIJK( nodeIdx );
+    float mass = coarseNodes[nodeIdx].mass;
+    vec3 momentum( 0.f, 0.f, 0.f );
+    if ( mass > 0.f ) {
+        FOR_EACH_FINE_NODE( fineGrid, ijk,
+            vec3 residual = fineCaches.get<B>()[fineIdx] - fineCaches.get<EX>()[fineIdx];
+            momentum += ( w * fineNodes[fineIdx].mass ) * residual;
+        )
+        momentum /= mass;
+    }
+    coarseCaches.get<NodeCache::R>()[nodeIdx] = momentum;
+}
+
+/**
+ * Adds the trilinear interpolation of the coarse V channel to X. Called over
+ * fine nodes.
+ */
+template<NodeCache::Offset X>
+__global__ void prolongCorrection( const Grid *fineGrid, NodeCache fineCaches, index_t numFineNodes,
+                                   const Grid *coarseGrid, NodeCache coarseCaches )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numFineNodes ) return;
+
+    glm::ivec3 ijk = fineGrid->nodeIJK( nodeIdx );
+    if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), fineGrid->dim) ) return;
+
+    // Even coordinates sit on a coarse node, odd ones halfway between two
+    glm::ivec3 lo = ijk / 2, hi = ( ijk + glm::ivec3(1,1,1) ) / 2;
+    vec3 correction( 0.f, 0.f, 0.f );
+    for ( int i = lo.x; i <= hi.x; ++i ) {
+        for ( int j = lo.y; j <= hi.y; ++j ) {
+            for ( int k = lo.z; k <= hi.z; ++k ) {
+                float w = ( lo.x == hi.x ? 1.f : 0.5f ) * ( lo.y == hi.y ? 1.f : 0.5f ) * ( lo.z == hi.z ? 1.f : 0.5f );
+                correction += w * coarseCaches.get<NodeCache::V>()[coarseGrid->nodeIndex(i, j, k)];
+            }
+        }
+    }
+    fineCaches.get<X>()[nodeIdx] += correction;
+}
+
+#endif // PRECONDITIONER_H
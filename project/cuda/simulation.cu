@@ -14,20 +14,35 @@
 #include <helper_functions.h>
 #include <helper_cuda.h>
 #include "math.h"
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <thrust/copy.h>
+#include <thrust/count.h>
+#include <thrust/device_ptr.h>
+#include <thrust/sort.h>
+#include <thrust/transform_reduce.h>
 
 #include "sim/caches.h"
 #include "sim/implicitcollider.h"
 #include "sim/material.h"
 #include "sim/particle.h"
 #include "sim/particlegridnode.h"
+#include "sim/profiler.h"
 
+#include "common/hostmemory.h"
 #include "common/math.h"
 
 #include "cuda/helpers.h"
 #include "cuda/atomic.h"
 #include "cuda/collider.h"
 #include "cuda/decomposition.h"
+#include "cuda/deterministic.h"
 #include "cuda/implicit.h"
+#include "cuda/sleep.h"
+#include "cuda/stepgraph.h"
 #include "cuda/weighting.h"
 
 #include "cuda/functions.h"
@@ -42,9 +57,9 @@
  *
  * Operation done over Particles over grid node particle affects
  */
-__global__ void computeNodeMasses( const Particle *particles, int numParticles, const Grid *grid, float *nodeMasses )
+__global__ void computeNodeMasses( const Particle *particles, index_t numParticles, const Grid *grid, float *nodeMasses )
 {
-    int particleIdx = blockIdx.y*gridDim.x*blockDim.x + blockIdx.x*blockDim.x + threadIdx.x;
+    index_t particleIdx = ((index_t)blockIdx.y*gridDim.x + blockIdx.x)*blockDim.x + threadIdx.x;
     if ( particleIdx >= numParticles ) return;
 
     const Particle &particle = particles[particleIdx];
@@ -58,7 +73,7 @@ __global__ void computeNodeMasses( const Particle *particles, int numParticles,
         vec3 nodePosition(currIJK);
         vec3 dx = vec3::abs( particleGridPos - nodePosition );
         float w = weight( dx );
-        atomicAdd( &nodeMasses[Grid::getGridIndex(currIJK, grid->dim+1)], particle.mass*w );
+        atomicAdd( &nodeMasses[grid->nodeIndex(currIJK)], particle.mass*w );
      }
 }
 
@@ -68,9 +83,9 @@ __global__ void computeNodeMasses( const Particle *particles, int numParticles,
  *
  * Operation done over Particles over grid node particle affects
  */
-__global__ void computeParticleDensity( Particle *particles, int numParticles, const Grid *grid, const float *cellMasses )
+__global__ void computeParticleDensity( Particle *particles, index_t numParticles, const Grid *grid, const float *cellMasses )
 {
-    int particleIdx = blockIdx.y*gridDim.x*blockDim.x + blockIdx.x*blockDim.x + threadIdx.x;
+    index_t particleIdx = ((index_t)blockIdx.y*gridDim.x + blockIdx.x)*blockDim.x + threadIdx.x;
     if ( particleIdx >= numParticles ) return;
 
     Particle &particle = particles[particleIdx];
@@ -85,7 +100,7 @@ __global__ void computeParticleDensity( Particle *particles, int numParticles, c
         vec3 dx = vec3::abs( particleGridPos - nodePosition );
         float w = weight( dx );
         float gridVolume = grid->h * grid->h * grid->h;
-        atomicAdd( &particle.volume, cellMasses[Grid::getGridIndex(currIJK, grid->dim+1)] * w / gridVolume ); //fill volume with particle density. Then in final step, compute volume
+        atomicAdd( &particle.volume, cellMasses[grid->nodeIndex(currIJK)] * w / gridVolume ); //fill volume with particle density. Then in final step, compute volume
      }
 }
 
@@ -95,43 +110,49 @@ __global__ void computeParticleDensity( Particle *particles, int numParticles, c
  *
  * Operation done over particles
  */
-__global__ void computeParticleVolume( Particle *particleData, int numParticles )
+__global__ void computeParticleVolume( Particle *particleData, index_t numParticles )
 {
-    int particleIdx = blockIdx.x * blockDim.x + threadIdx.x;
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( particleIdx >= numParticles ) return;
     Particle &particle = particleData[particleIdx];
     particle.volume = particle.mass / particle.volume; // Note: particle.volume is assumed to be the (particle's density ) before we compute it correctly
 }
 
-__host__ void initializeParticleVolumes( Particle *particles, int numParticles, const Grid *grid, int numNodes )
+__host__ void initializeParticleVolumes( Particle *particles, index_t numParticles, const Grid *grid, index_t numNodes,
+                                         const ParticleBins *bins, const Halo *halo, DeviceArena *arena )
 {
-    float *devNodeMasses;
-    checkCudaErrors( cudaMalloc( (void**)&devNodeMasses, numNodes*sizeof(float) ) );
-    cudaMemset( devNodeMasses, 0, numNodes*sizeof(float) );
+    float *devNodeMasses = (float*)deviceArenaAllocate( arena, numNodes*sizeof(float) );
+    checkCudaErrors( cudaMemset(devNodeMasses, 0, numNodes*sizeof(float)) );
 
     const dim3 blocks( (numParticles+THREAD_COUNT-1)/THREAD_COUNT, 64 );
     static const dim3 threads( THREAD_COUNT / 64, 64 );
 
-    LAUNCH( computeNodeMasses<<<blocks,threads>>>(particles,numParticles,grid,devNodeMasses) );
-
-    LAUNCH( computeParticleDensity<<<blocks,threads>>>(particles,numParticles,grid,devNodeMasses) );
+    if ( bins ) {
+        binParticles( particles, numParticles, grid, bins, 0 );
+        LAUNCH( gatherNodeMasses<<<(numNodes+THREAD_COUNT-1)/THREAD_COUNT,THREAD_COUNT>>>(particles,*bins,grid,devNodeMasses,numNodes) );
+        if ( halo ) sumHaloBands( *halo, devNodeMasses );
+        LAUNCH( gatherParticleDensity<<<(numParticles+THREAD_COUNT-1)/THREAD_COUNT,THREAD_COUNT>>>(particles,numParticles,grid,devNodeMasses) );
+    } else {
+        LAUNCH( computeNodeMasses<<<blocks,threads>>>(particles,numParticles,grid,devNodeMasses) );
+        if ( halo ) sumHaloBands( *halo, devNodeMasses );
+        LAUNCH( computeParticleDensity<<<blocks,threads>>>(particles,numParticles,grid,devNodeMasses) );
+    }
 
     LAUNCH( computeParticleVolume<<<(numParticles+THREAD_COUNT-1)/THREAD_COUNT,THREAD_COUNT>>>(particles,numParticles) );
 
-    checkCudaErrors( cudaFree(devNodeMasses) );
+    clearDeviceArena( arena );
 }
 
-__global__ void computeSigma( const Particle *particles, ParticleCache *particleCache, int numParticles, const Grid *grid )
+__global__ void computeSigma( const Particle *particles, ParticleCache *particleCache, index_t numParticles, const Grid *grid )
 {
-    int particleIdx = blockIdx.x*blockDim.x + threadIdx.x;
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( particleIdx >= numParticles ) return;
 
     const Particle &particle = particles[particleIdx];
 
-    const mat3 &Fp = particle.plasticF; //for the sake of making the code look like the math
-    const mat3 &Fe = particle.elasticF;
+    const mat3 &Fe = particle.elasticF; //for the sake of making the code look like the math
 
-    float Jpp = mat3::determinant(Fp);
+    float Jpp = particle.plasticJ;
     float Jep = mat3::determinant(Fe);
 
     mat3 Re;
@@ -159,9 +180,9 @@ __global__ void computeSigma( const Particle *particles, ParticleCache *particle
  * nodes -- list of every node in grid ((dim.x+1)*(dim.y+1)*(dim.z+1))
  *
  */
-__global__ void computeCellMassVelocityAndForceFast( const Particle *particleData, const ParticleCache *particleCache, int numParticles, const Grid *grid, Node *nodes )
+__global__ void computeCellMassVelocityAndForceFast( const Particle *particleData, const ParticleCache *particleCache, index_t numParticles, const Grid *grid, Node *nodes )
 {
-    int particleIdx = blockIdx.y*gridDim.x*blockDim.x + blockIdx.x*blockDim.x + threadIdx.x;
+    index_t particleIdx = ((index_t)blockIdx.y*gridDim.x + blockIdx.x)*blockDim.x + threadIdx.x;
     if ( particleIdx >= numParticles ) return;
 
     const Particle &particle = particleData[particleIdx];
@@ -172,7 +193,7 @@ __global__ void computeCellMassVelocityAndForceFast( const Particle *particleDat
     currIJK += glm::ivec3( particleGridPos-1 );
 
     if ( Grid::withinBoundsInclusive(currIJK, glm::ivec3(0,0,0), grid->dim) ) {
-        Node &node = nodes[Grid::getGridIndex(currIJK, grid->dim+1)];
+        Node &node = nodes[grid->nodeIndex(currIJK)];
 
         float w;
         vec3 wg;
@@ -202,9 +223,9 @@ __global__ void computeCellMassVelocityAndForceFast( const Particle *particleDat
  * nodes -- updated velocity and velocityChange
  *
  */
-__global__ void updateNodeVelocities( Node *nodes, int numNodes, float dt, const ImplicitCollider* colliders, int numColliders, const Grid *grid, bool updateVelocityChange )
+__global__ void updateNodeVelocities( Node *nodes, index_t numNodes, float dt, const ImplicitCollider* colliders, int numColliders, const Grid *grid, bool updateVelocityChange )
 {
-    int nodeIdx = blockIdx.x*blockDim.x + threadIdx.x;
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( nodeIdx >= numNodes ) return;
 
     Node &node = nodes[nodeIdx];
@@ -225,9 +246,7 @@ __global__ void updateNodeVelocities( Node *nodes, int numNodes, float dt, const
         node.velocity += dt * scale * node.force;
 
         // Handle collisions
-        int gridI, gridJ, gridK;
-        Grid::gridIndexToIJK( nodeIdx, gridI, gridJ, gridK, grid->dim+1 );
-        vec3 nodePosition = vec3(gridI, gridJ, gridK)*grid->h + grid->pos;
+        vec3 nodePosition = vec3( grid->nodeIJK(nodeIdx) )*grid->h + grid->pos;
         checkForAndHandleCollisions( colliders, numColliders, nodePosition, node.velocity );
 
         if ( updateVelocityChange ) node.velocityChange = node.velocity - node.velocityChange;
@@ -235,19 +254,50 @@ __global__ void updateNodeVelocities( Node *nodes, int numNodes, float dt, const
     }
 }
 
-// Use weighting functions to compute particle velocity gradient and update particle velocity
-__device__ void processGridVelocities( Particle &particle, const Grid *grid, const Node *nodes, mat3 &velocityGradient )
+// Node values for G2P, read straight from the grid
+struct GlobalNodes
 {
-    const vec3 &pos = particle.position;
-    const glm::ivec3 &dim = grid->dim;
-    const float h = grid->h;
+    const Grid *grid;
+    const Node *nodes;
+
+    // False if ijk is outside the grid
+    __device__ __forceinline__ bool get( const glm::ivec3 &ijk, vec3 &velocity, vec3 &velocityChange ) const
+    {
+        if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) return false;
+        const Node &node = nodes[grid->nodeIndex(ijk)];
+        velocity = node.velocity;
+        velocityChange = vec3( node.velocityChange );
+        return true;
+    }
+};
 
-    // Compute neighborhood of particle in grid
-    vec3 particleGridPos = (pos - grid->pos) / h,
-         gridMax = vec3::floor( particleGridPos + vec3(2,2,2) ),
-         gridMin = vec3::ceil( particleGridPos - vec3(2,2,2) );
-    glm::ivec3 maxIndex = glm::clamp( glm::ivec3(gridMax), glm::ivec3(0,0,0), dim ),
-               minIndex = glm::clamp( glm::ivec3(gridMin), glm::ivec3(0,0,0), dim );
+// Node values for G2P, read from a tile staged in shared memory (see
+// updateParticlesFromGridTiled). Nodes outside the grid are staged as zero.
+struct TileNodes
+{
+    const float *velocities;
+    const float *velocityChanges;
+    glm::ivec3 origin; // grid node of tile node (0,0,0)
+
+    __device__ __forceinline__ bool get( const glm::ivec3 &ijk, vec3 &velocity, vec3 &velocityChange ) const
+    {
+        glm::ivec3 local = ijk - origin;
+        if ( !Grid::withinBoundsInclusive(local, glm::ivec3(0,0,0), glm::ivec3(G2P_HALO-1)) ) return false;
+        int idx = 3 * Grid::getGridIndex( local, glm::ivec3(G2P_HALO) );
+        velocity = vec3( velocities[idx], velocities[idx+1], velocities[idx+2] );
+        velocityChange = vec3( velocityChanges[idx], velocityChanges[idx+1], velocityChanges[idx+2] );
+        return true;
+    }
+};
+
+// Use weighting functions to compute particle velocity gradient and update particle velocity
+template<class NodeSource>
+__device__ void processGridVelocities( Particle &particle, const Grid *grid, const NodeSource &source, mat3 &velocityGradient )
+{
+    // Stencil of the particle in the grid, starting at the same node as its bin
+    vec3 particleGridPos = (particle.position - grid->pos) / grid->h;
+    glm::ivec3 origin = glm::ivec3( particleGridPos-1 );
+    StencilWeights weights( particleGridPos, origin );
 
     // For computing particle velocity gradient:
     //      grad(v_p) = sum( v_i * transpose(grad(w_ip)) ) = [3x3 matrix]
@@ -256,28 +306,18 @@ __device__ void processGridVelocities( Particle &particle, const Grid *grid, con
     //      v_FLIP = v_p + sum( dv_i * w_ip )
     //      v = (1-alpha)*v_PIC _ alpha*v_FLIP
     vec3 v_PIC(0,0,0), dv_FLIP(0,0,0);
-    int rowSize = dim.z+1;
-    int pageSize = (dim.y+1)*rowSize;
-    for ( int i = minIndex.x; i <= maxIndex.x; ++i ) {
-        vec3 d, s;
-        d.x = particleGridPos.x - i;
-        d.x *= ( s.x = ( d.x < 0 ) ? -1.f : 1.f );
-        int pageOffset = i*pageSize;
-        for ( int j = minIndex.y; j <= maxIndex.y; ++j ) {
-            d.y = particleGridPos.y - j;
-            d.y *= ( s.y = ( d.y < 0 ) ? -1.f : 1.f );
-            int rowOffset = pageOffset + j*rowSize;
-            for ( int k = minIndex.z; k <= maxIndex.z; ++k ) {
-                d.z = particleGridPos.z - k;
-                d.z *= ( s.z = ( d.z < 0 ) ? -1.f : 1.f );
-                const Node &node = nodes[rowOffset+k];
-                float w;
-                vec3 wg;
-                weightAndGradient( s, d, w, wg );
-                velocityGradient += mat3::outerProduct( node.velocity, wg );
+    for ( int i = 0; i < 4; ++i ) {
+        for ( int j = 0; j < 4; ++j ) {
+            for ( int k = 0; k < 4; ++k ) {
+                glm::ivec3 ijk = origin + glm::ivec3( i, j, k );
+                vec3 velocity, velocityChange;
+                if ( !source.get(ijk, velocity, velocityChange) ) continue;
+                float w = weights.weight( i, j, k );
+                vec3 wg = weights.gradient( i, j, k );
+                velocityGradient += mat3::outerProduct( velocity, wg );
                 // Particle velocities
-                v_PIC += node.velocity * w;
-                dv_FLIP += node.velocityChange * w;
+                v_PIC += velocity * w;
+                dv_FLIP += velocityChange * w;
             }
         }
     }
@@ -290,17 +330,26 @@ __device__ void updateParticleDeformationGradients( Particle &particle, const ma
     particle.elasticF = mat3::addIdentity( timeStep*velocityGradient ) * particle.elasticF;
     const Material &material = particle.material;
     // Clamp the singular values
-    mat3 W, S, Sinv, V;
+    mat3 W, S, V;
+#ifdef FULL_PLASTIC_F
+    mat3 Sinv;
+#endif
     computeSVD( particle.elasticF, W, S, V );
+    float Je = S[0]*S[4]*S[8];
 
     // FAST COMPUTATION:
     S = mat3( CLAMP( S[0], material.criticalCompressionRatio, material.criticalStretchRatio ), 0.f, 0.f,
               0.f, CLAMP( S[4], material.criticalCompressionRatio, material.criticalStretchRatio ), 0.f,
               0.f, 0.f, CLAMP( S[8], material.criticalCompressionRatio, material.criticalStretchRatio ) );
+    // Whatever the clamp removed from det(Fe) moves into det(Fp). W and V are
+    // rotations, so det(Fe) is the product of the unclamped singular values.
+    particle.plasticJ *= Je / ( S[0]*S[4]*S[8] );
+#ifdef FULL_PLASTIC_F
     Sinv = mat3( 1.f/S[0], 0.f, 0.f,
                  0.f, 1.f/S[4], 0.f,
                  0.f, 0.f, 1.f/S[8] );
     particle.plasticF = mat3::multiplyADBt( V, Sinv, W ) * particle.elasticF * particle.plasticF;
+#endif
     particle.elasticF = mat3::multiplyADBt( W, S, V );
 
 //     // MORE ACCURATE COMPUTATION:
@@ -312,16 +361,12 @@ __device__ void updateParticleDeformationGradients( Particle &particle, const ma
 
 }
 
-__global__ void updateParticlesFromGrid( Particle *particles, int numParticles, const Grid *grid, const Node *nodes, float timeStep, const ImplicitCollider *colliders, int numColliders )
+template<class NodeSource>
+__device__ void updateParticleFromGrid( Particle &particle, const Grid *grid, const NodeSource &source, float timeStep, const ImplicitCollider *colliders, int numColliders )
 {
-    int particleIdx = threadIdx.x + blockIdx.x * blockDim.x;
-    if ( particleIdx >= numParticles ) return;
-
-    Particle &particle = particles[particleIdx];
-
     // Update particle velocities and fill in velocity gradient for deformation gradient computation
     mat3 velocityGradient = mat3( 0.f );
-    processGridVelocities( particle, grid, nodes, velocityGradient );
+    processGridVelocities( particle, grid, source, velocityGradient );
 
     updateParticleDeformationGradients( particle, velocityGradient, timeStep );
 
@@ -330,30 +375,182 @@ __global__ void updateParticlesFromGrid( Particle *particles, int numParticles,
     particle.position += timeStep * ( particle.velocity );
 }
 
+__global__ void updateParticlesFromGrid( Particle *particles, index_t numParticles, const Grid *grid, const Node *nodes, float timeStep, const ImplicitCollider *colliders, int numColliders )
+{
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( particleIdx >= numParticles ) return;
+
+    GlobalNodes source = { grid, nodes };
+    updateParticleFromGrid( particles[particleIdx], grid, source, timeStep, colliders, numColliders );
+}
+
+/**
+ * Tiled G2P over binned particles. Each block takes a tile of G2P_TILE^3 bins,
+ * stages the G2P_HALO^3 nodes their stencils reach in shared memory, then
+ * updates the tile's particles from there. One block per tile plus one for
+ * the particles outside the grid, which read nodes from global memory.
+ */
+__global__ void updateParticlesFromGridTiled( Particle *particles, const ParticleBins bins, const Grid *grid, const Node *nodes, float timeStep, const ImplicitCollider *colliders, int numColliders )
+{
+    __shared__ float velocities[3*G2P_HALO_NODES];
+    __shared__ float velocityChanges[3*G2P_HALO_NODES];
+    __shared__ index_t binStarts[G2P_TILE_BINS];
+    __shared__ int binOffsets[G2P_TILE_BINS+1];
+
+    const glm::ivec3 binDim = grid->dim + glm::ivec3( 4, 4, 4 );
+    const glm::ivec3 tileDim = ( binDim + glm::ivec3(G2P_TILE-1) ) / G2P_TILE;
+
+    if ( blockIdx.x == bins.tileCount ) {
+        GlobalNodes source = { grid, nodes };
+        for ( index_t n = bins.starts[bins.count-1] + threadIdx.x; n < bins.ends[bins.count-1]; n += blockDim.x ) {
+            updateParticleFromGrid( particles[bins.indices[n]], grid, source, timeStep, colliders, numColliders );
+        }
+        return;
+    }
+
+    glm::ivec3 firstBin;
+    Grid::gridIndexToIJK( blockIdx.x, tileDim, firstBin );
+    firstBin *= G2P_TILE;
+
+    // Bin b holds the stencils starting at node b-3
+    TileNodes source;
+    source.velocities = velocities;
+    source.velocityChanges = velocityChanges;
+    source.origin = firstBin - glm::ivec3( 3, 3, 3 );
+
+    for ( int s = threadIdx.x; s < G2P_HALO_NODES; s += blockDim.x ) {
+        glm::ivec3 ijk;
+        Grid::gridIndexToIJK( s, glm::ivec3(G2P_HALO), ijk );
+        ijk += source.origin;
+        vec3 velocity( 0.f ), velocityChange( 0.f );
+        if ( Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), grid->dim) ) {
+            const Node &node = nodes[grid->nodeIndex(ijk)];
+            velocity = node.velocity;
+            velocityChange = vec3( node.velocityChange );
+        }
+        velocities[3*s] = velocity.x; velocities[3*s+1] = velocity.y; velocities[3*s+2] = velocity.z;
+        velocityChanges[3*s] = velocityChange.x; velocityChanges[3*s+1] = velocityChange.y; velocityChanges[3*s+2] = velocityChange.z;
+    }
+
+    // Bin ranges of the tile, so its particles can be spread over all threads
+    // instead of one bin at a time
+    if ( threadIdx.x < G2P_TILE_BINS ) {
+        glm::ivec3 bin;
+        Grid::gridIndexToIJK( threadIdx.x, glm::ivec3(G2P_TILE), bin );
+        bin += firstBin;
+        int count = 0;
+        if ( Grid::withinBoundsInclusive(bin, glm::ivec3(0,0,0), binDim-1) ) {
+            index_t binIdx = Grid::getGridIndex( bin, binDim );
+            binStarts[threadIdx.x] = bins.starts[binIdx];
+            count = (int)( bins.ends[binIdx] - bins.starts[binIdx] );
+        }
+        binOffsets[threadIdx.x+1] = count;
+    }
+    __syncthreads();
+    if ( threadIdx.x == 0 ) {
+        binOffsets[0] = 0;
+        for ( int b = 0; b < G2P_TILE_BINS; ++b ) binOffsets[b+1] += binOffsets[b];
+    }
+    __syncthreads();
+
+    for ( int n = threadIdx.x; n < binOffsets[G2P_TILE_BINS]; n += blockDim.x ) {
+        // Last bin starting at or before n
+        int lo = 0, hi = G2P_TILE_BINS-1;
+        while ( lo < hi ) {
+            int mid = ( lo + hi + 1 ) / 2;
+            if ( binOffsets[mid] <= n ) lo = mid;
+            else hi = mid - 1;
+        }
+        index_t particleIdx = bins.indices[binStarts[lo] + n - binOffsets[lo]];
+        updateParticleFromGrid( particles[particleIdx], grid, source, timeStep, colliders, numColliders );
+    }
+}
+
 __global__ void updateColliderPositions(ImplicitCollider *colliders, int numColliders,float timestep)
 {
     int colliderIdx = blockDim.x*blockIdx.x + threadIdx.x;
     colliders[colliderIdx].center += colliders[colliderIdx].velocity*timestep;
 }
 
-__host__ void updateParticles( Particle *particles, ParticleCache *devParticleCache, ParticleCache *hostParticleCache, int numParticles,
-                               Grid *grid, Node *nodes, NodeCache *nodeCaches, int numNodes,
-                               ImplicitCollider *colliders, int numColliders,
-                               float timeStep, bool implicitUpdate )
+// Stages of a step up to the implicit solve
+enum StepStage
+{
+    CLEAR_NODES,
+    CLEAR_NODE_CACHES,
+    MOVE_COLLIDERS,
+    COMPUTE_SIGMA,
+    BIN_PARTICLES,
+    P2G,
+    GRID_UPDATE,
+    STEP_STAGE_COUNT
+};
+
+// Streams: 0 is the node chain, 1 the particle side, 2 everything that only
+// has to be done before the implicit solve
+static const StepGraph::Stage STEP_STAGES[STEP_STAGE_COUNT] =
+{
+    { "clear",          0, { -1 } },
+    { "clearCaches",    2, { -1 } },
+    { "colliders",      2, { -1 } },
+    { "computeSigma",   1, { -1 } },
+    { "binParticles",   0, { -1 } },
+    { "P2G",            0, { CLEAR_NODES, COMPUTE_SIGMA, BIN_PARTICLES, -1 } },
+    { "gridUpdate",     0, { P2G, MOVE_COLLIDERS, -1 } }
+};
+
+__host__ StepGraph* createStepGraph()
+{
+    return new StepGraph( STEP_STAGES, STEP_STAGE_COUNT );
+}
+
+__host__ void destroyStepGraph( StepGraph *graph )
+{
+    delete graph;
+}
+
+__host__ int updateParticles( Particle *particles, ParticleCache *devParticleCache, ParticleCache *hostParticleCache, index_t numParticles,
+                              Grid *grid, Node *nodes, const NodeCache &nodeCaches, index_t numNodes,
+                              ImplicitCollider *colliders, int numColliders, bool moveColliders,
+                              float timeStep, bool implicitUpdate, float tolerance, Preconditioner preconditioner, const Multigrid *multigrid,
+                              StiffnessMatrix *stiffness, const ParticleBins *bins, bool deterministic, const Halo *halo,
+                              SleepState *sleep, StepGraph *graph )
+{
+    numParticles = beginParticleUpdate( particles, devParticleCache, hostParticleCache, numParticles, grid, nodes, nodeCaches, numNodes,
+                                        colliders, numColliders, moveColliders, timeStep, implicitUpdate, tolerance, preconditioner,
+                                        multigrid, stiffness, bins, deterministic, halo, sleep, graph );
+    return finishParticleUpdate( particles, devParticleCache, hostParticleCache, numParticles, grid, nodes, nodeCaches, numNodes,
+                                 colliders, numColliders, moveColliders, timeStep, implicitUpdate, tolerance, preconditioner,
+                                 multigrid, stiffness, bins, deterministic, halo, sleep, graph );
+}
+
+__host__ index_t beginParticleUpdate( Particle *particles, ParticleCache *devParticleCache, ParticleCache *hostParticleCache, index_t numParticles,
+                                      Grid *grid, Node *nodes, const NodeCache &nodeCaches, index_t numNodes,
+                                      ImplicitCollider *colliders, int numColliders, bool moveColliders,
+                                      float timeStep, bool implicitUpdate, float tolerance, Preconditioner preconditioner, const Multigrid *multigrid,
+                                      StiffnessMatrix *stiffness, const ParticleBins *bins, bool deterministic, const Halo *halo,
+                                      SleepState *sleep, StepGraph *graph )
 {
     cudaDeviceSetCacheConfig( cudaFuncCachePreferL1 );
 
-    // Clear data before update
-    checkCudaErrors( cudaMemset(nodes, 0, numNodes*sizeof(Node)) );
-    checkCudaErrors( cudaMemset(nodeCaches, 0, numNodes*sizeof(NodeCache)) );
+    // Bins always drive the tiled G2P, but only replace the scatters when deterministic
+    const ParticleBins *gatherBins = deterministic ? bins : NULL;
 
-    // All dat ParticleCache data
-    cudaMemset( hostParticleCache->sigmas, 0, numParticles*sizeof(mat3) );
-    cudaMemset( hostParticleCache->Aps, 0, numParticles*sizeof(mat3) );
-    cudaMemset( hostParticleCache->FeHats, 0, numParticles*sizeof(mat3) );
-    cudaMemset( hostParticleCache->ReHats, 0, numParticles*sizeof(mat3) );
-    cudaMemset( hostParticleCache->SeHats, 0, numParticles*sizeof(mat3) );
-    cudaMemset( hostParticleCache->dFs, 0, numParticles*sizeof(mat3) );
+    // Coarse levels would need halos of their own
+    if ( halo ) multigrid = NULL;
+
+    // Dormant particles wait behind the awake ones and sit the step out
+    if ( sleep ) {
+        numParticles = awakeParticles( particles, numParticles, sleep );
+        if ( numParticles == 0 ) {
+            // Only a moving collider can wake anything now
+            checkCudaErrors( cudaMemset(nodes, 0, numNodes*sizeof(Node)) );
+            if ( moveColliders && numColliders > 0 ) {
+                LAUNCH( updateColliderPositions<<<numColliders,1>>>(colliders,numColliders,timeStep) );
+            }
+            updateSleepingBlocks( nodes, numNodes, grid, colliders, numColliders, sleep );
+            return 0;
+        }
+    }
 
     const dim3 pBlocks1D( (numParticles+THREAD_COUNT-1)/THREAD_COUNT );
     const dim3 nBlocks1D( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
@@ -361,15 +558,985 @@ __host__ void updateParticles( Particle *particles, ParticleCache *devParticleCa
     const dim3 pBlocks2D( (numParticles+THREAD_COUNT-1)/THREAD_COUNT, 64 );
     const dim3 threads2D( THREAD_COUNT/64, 64 );
 
-    LAUNCH( updateColliderPositions<<<numColliders,1>>>(colliders,numColliders,timeStep) );
+    // The particle caches need no clearing: every entry is written before it is read
+    cudaStream_t stream = graph->begin( CLEAR_NODES );
+    checkCudaErrors( cudaMemsetAsync(nodes, 0, numNodes*sizeof(Node), stream) );
+    graph->end( CLEAR_NODES );
+
+    stream = graph->begin( CLEAR_NODE_CACHES );
+    if ( implicitUpdate ) {
+        for ( int i = 0; i < NodeCache::CHANNEL_COUNT; ++i ) {
+            if ( i == NodeCache::WARM || !nodeCaches.channels[i] ) continue;
+            checkCudaErrors( cudaMemsetAsync(nodeCaches.channels[i], 0, numNodes*sizeof(vec3), stream) );
+        }
+        checkCudaErrors( cudaMemsetAsync(nodeCaches.scratch, 0, numNodes*sizeof(double), stream) );
+    }
+    graph->end( CLEAR_NODE_CACHES );
+
+    stream = graph->begin( MOVE_COLLIDERS );
+    if ( moveColliders && numColliders > 0 ) {
+        LAUNCH_ASYNC( updateColliderPositions<<<numColliders,1,0,stream>>>(colliders,numColliders,timeStep) );
+    }
+    graph->end( MOVE_COLLIDERS );
+
+    stream = graph->begin( COMPUTE_SIGMA );
+    LAUNCH_ASYNC( computeSigma<<<pBlocks1D,threads1D,0,stream>>>(particles,devParticleCache,numParticles,grid) );
+    graph->end( COMPUTE_SIGMA );
+
+    stream = graph->begin( BIN_PARTICLES );
+    if ( bins ) binParticles( particles, numParticles, grid, bins, stream );
+    graph->end( BIN_PARTICLES );
+
+    stream = graph->begin( P2G );
+    if ( gatherBins ) {
+        LAUNCH_ASYNC( gatherCellMassVelocityAndForce<<<nBlocks1D,threads1D,0,stream>>>(particles,devParticleCache,*bins,grid,nodes,numNodes) );
+    } else {
+        LAUNCH_ASYNC( computeCellMassVelocityAndForceFast<<<pBlocks2D,threads2D,0,stream>>>(particles,devParticleCache,numParticles,grid,nodes) );
+    }
+    graph->end( P2G );
+
+    // Both neighbors' scatters have to be in before the grid update
+    if ( halo ) {
+        graph->synchronize();
+        sumHaloBands( *halo, nodes );
+    }
+
+    stream = graph->begin( GRID_UPDATE );
+    LAUNCH_ASYNC( updateNodeVelocities<<<nBlocks1D,threads1D,0,stream>>>(nodes,numNodes,timeStep,colliders,numColliders,grid,!implicitUpdate) );
+    graph->end( GRID_UPDATE );
+
+    return numParticles;
+}
+
+__host__ int finishParticleUpdate( Particle *particles, ParticleCache *devParticleCache, ParticleCache *hostParticleCache, index_t numParticles,
+                                   Grid *grid, Node *nodes, const NodeCache &nodeCaches, index_t numNodes,
+                                   ImplicitCollider *colliders, int numColliders, bool moveColliders,
+                                   float timeStep, bool implicitUpdate, float tolerance, Preconditioner preconditioner, const Multigrid *multigrid,
+                                   StiffnessMatrix *stiffness, const ParticleBins *bins, bool deterministic, const Halo *halo,
+                                   SleepState *sleep, StepGraph *graph )
+{
+    // Everything slept, and beginParticleUpdate has already done the step
+    if ( numParticles == 0 ) return 0;
+
+    const ParticleBins *gatherBins = deterministic ? bins : NULL;
+    if ( halo ) multigrid = NULL;
+
+    const dim3 pBlocks1D( (numParticles+THREAD_COUNT-1)/THREAD_COUNT );
+    const dim3 threads1D( THREAD_COUNT );
+
+    // The rest runs on the default stream
+    graph->synchronize();
+
+    int iterations = 0;
+    if ( implicitUpdate ) {
+        PROFILE_SCOPE( "implicitSolve" );
+        iterations = integrateNodeForces( particles, devParticleCache, numParticles, grid, nodes, nodeCaches, numNodes,
+                                          timeStep, tolerance, preconditioner, multigrid, stiffness, gatherBins, halo );
+    }
+
+    if ( sleep ) updateSleepingBlocks( nodes, numNodes, grid, colliders, numColliders, sleep );
+
+    {
+        PROFILE_SCOPE( "G2P" );
+        if ( bins ) {
+            const dim3 tileBlocks( bins->tileCount+1 );
+            LAUNCH( updateParticlesFromGridTiled<<<tileBlocks,threads1D>>>(particles,*bins,grid,nodes,timeStep,colliders,numColliders) );
+        } else {
+            LAUNCH( updateParticlesFromGrid<<<pBlocks1D,threads1D>>>(particles,numParticles,grid,nodes,timeStep,colliders,numColliders) );
+        }
+    }
+
+    return iterations;
+}
+
+__host__ void moveColliders( ImplicitCollider *colliders, int numColliders, float timeStep )
+{
+    if ( numColliders > 0 ) LAUNCH( updateColliderPositions<<<numColliders,1>>>(colliders,numColliders,timeStep) );
+}
+
+__host__ void planMemory( MemoryPlan *plan, index_t numNodes, bool implicitUpdate, Preconditioner preconditioner,
+                          bool multigrid, bool deterministic )
+{
+    plan->nodeChannels = 0;
+    if ( implicitUpdate ) {
+        plan->nodeChannels = NodeCache::SCRATCH;
+        const NodeCache::Offset solver[] = { NodeCache::R, NodeCache::AR, NodeCache::P, NodeCache::AP,
+                                             NodeCache::V, NodeCache::DF, NodeCache::WARM };
+        for ( int i = 0; i < 7; ++i ) plan->nodeChannels |= NodeCache::bit( solver[i] );
+        // Without a preconditioner, Z and Q alias R and AP
+        if ( preconditioner != NO_PRECONDITIONER ) {
+            plan->nodeChannels |= NodeCache::bit(NodeCache::Z) | NodeCache::bit(NodeCache::Q) | NodeCache::bit(NodeCache::DINV);
+        }
+        if ( multigrid ) plan->nodeChannels |= NodeCache::bit( NodeCache::TMP );
+    }
+    plan->implicitCaches = implicitUpdate;
+    plan->aps = implicitUpdate && deterministic;
+    // initializeParticleVolumes stages one mass per node
+    plan->arenaBytes = numNodes*sizeof(float) + DEVICE_ARENA_ALIGNMENT;
+}
+
+// The channels of the mask share one allocation, starting at the first of them
+__host__ void createNodeCaches( NodeCache *caches, index_t numNodes, unsigned int channels )
+{
+    size_t bytes = numNodes*NodeCache::bytesPerNode( channels );
+    char *data = NULL;
+    if ( bytes > 0 ) {
+        checkCudaErrors( cudaMalloc((void**)&data, bytes) );
+        checkCudaErrors( cudaMemset(data, 0, bytes) );
+    }
+    vec3 *next = (vec3*)data;
+    for ( int i = 0; i < NodeCache::CHANNEL_COUNT; ++i ) {
+        caches->channels[i] = ( channels & (1u << i) ) ? next : NULL;
+        if ( caches->channels[i] ) next += numNodes;
+    }
+    caches->scratch = ( channels & NodeCache::SCRATCH ) ? (double*)next : NULL;
+}
+
+__host__ void destroyNodeCaches( NodeCache *caches )
+{
+    void *data = caches->scratch;
+    for ( int i = NodeCache::CHANNEL_COUNT-1; i >= 0; --i ) {
+        if ( caches->channels[i] ) data = caches->channels[i];
+        caches->channels[i] = NULL;
+    }
+    checkCudaErrors( cudaFree(data) );
+    caches->scratch = NULL;
+}
+
+__host__ void createParticleCache( ParticleCache *cache, index_t numParticles, const MemoryPlan &plan )
+{
+    mat3 **arrays[4] = { &cache->FeHats, &cache->ReHats, &cache->SeHats, &cache->Aps };
+    bool needed[4] = { plan.implicitCaches, plan.implicitCaches, plan.implicitCaches, plan.aps };
+    for ( int i = 0; i < 4; ++i ) {
+        *arrays[i] = NULL;
+        if ( needed[i] ) checkCudaErrors( cudaMalloc((void**)arrays[i], numParticles*sizeof(mat3)) );
+    }
+    // sigmas is only live from computeSigma to P2G, FeHats only during the implicit solve
+    if ( cache->FeHats ) {
+        cache->sigmas = cache->FeHats;
+    } else {
+        checkCudaErrors( cudaMalloc((void**)&cache->sigmas, numParticles*sizeof(mat3)) );
+    }
+}
+
+__host__ void destroyParticleCache( ParticleCache *cache )
+{
+    if ( cache->sigmas != cache->FeHats ) checkCudaErrors( cudaFree(cache->sigmas) );
+    checkCudaErrors( cudaFree(cache->FeHats) );
+    checkCudaErrors( cudaFree(cache->ReHats) );
+    checkCudaErrors( cudaFree(cache->SeHats) );
+    checkCudaErrors( cudaFree(cache->Aps) );
+    cache->sigmas = cache->FeHats = cache->ReHats = cache->SeHats = cache->Aps = NULL;
+}
+
+__host__ void reserveDeviceArena( DeviceArena *arena, size_t capacity )
+{
+    if ( capacity <= arena->capacity ) return;
+    assert( arena->offset == 0 );
+    checkCudaErrors( cudaFree(arena->data) );
+    checkCudaErrors( cudaMalloc((void**)&arena->data, capacity) );
+    arena->capacity = capacity;
+}
+
+__host__ void* deviceArenaAllocate( DeviceArena *arena, size_t bytes )
+{
+    bytes = ( bytes + DEVICE_ARENA_ALIGNMENT - 1 ) & ~(size_t)( DEVICE_ARENA_ALIGNMENT - 1 );
+    assert( arena->offset + bytes <= arena->capacity );
+    void *result = arena->data + arena->offset;
+    arena->offset += bytes;
+    return result;
+}
+
+__host__ void clearDeviceArena( DeviceArena *arena )
+{
+    arena->offset = 0;
+}
+
+__host__ void destroyDeviceArena( DeviceArena *arena )
+{
+    checkCudaErrors( cudaFree(arena->data) );
+    arena->data = NULL;
+    arena->capacity = arena->offset = 0;
+}
+
+__host__ void createStiffnessMatrix( StiffnessMatrix *stiffness, index_t numNodes, ImplicitOperator mode )
+{
+    stiffness->mode = mode;
+    checkCudaErrors( cudaMalloc((void**)&stiffness->nodeRows, numNodes*sizeof(index_t)) );
+    checkCudaErrors( cudaMalloc((void**)&stiffness->rowNodes, numNodes*sizeof(index_t)) );
+    // Blocks are allocated on first assembly, once the active node count is known
+    stiffness->blocks = NULL;
+    stiffness->rowCount = 0;
+    stiffness->capacity = 0;
+    stiffness->lastSweeps = MAX_ITERATIONS + 2;
+    stiffness->matrixFreeCost = stiffness->assemblyCost = stiffness->productCost = 0.f;
+    checkCudaErrors( cudaEventCreate(&stiffness->timing[0]) );
+    checkCudaErrors( cudaEventCreate(&stiffness->timing[1]) );
+}
+
+__host__ void destroyStiffnessMatrix( StiffnessMatrix *stiffness )
+{
+    checkCudaErrors( cudaFree(stiffness->nodeRows) );
+    checkCudaErrors( cudaFree(stiffness->rowNodes) );
+    checkCudaErrors( cudaFree(stiffness->blocks) );
+    checkCudaErrors( cudaEventDestroy(stiffness->timing[0]) );
+    checkCudaErrors( cudaEventDestroy(stiffness->timing[1]) );
+    stiffness->nodeRows = stiffness->rowNodes = NULL;
+    stiffness->blocks = NULL;
+    stiffness->capacity = 0;
+}
+
+// Grids of the coarse levels below grid, and how many there are
+__host__ int multigridLevels( const Grid &grid, Grid levels[MULTIGRID_MAX_LEVELS] )
+{
+    int levelCount = 0;
+    Grid coarse = grid;
+    while ( levelCount < MULTIGRID_MAX_LEVELS ) {
+        coarse.dim = ( coarse.dim + glm::ivec3(1,1,1) ) / 2;
+        coarse.h *= 2.f;
+        if ( MIN(coarse.dim.x, MIN(coarse.dim.y, coarse.dim.z)) < MULTIGRID_MIN_DIM ) break;
+        levels[levelCount++] = coarse;
+    }
+    return levelCount;
+}
+
+__host__ void createMultigrid( Multigrid *multigrid, const Grid &grid )
+{
+    Grid levels[MULTIGRID_MAX_LEVELS];
+    multigrid->levelCount = multigridLevels( grid, levels );
+    for ( int i = 0; i < multigrid->levelCount; ++i ) {
+        MultigridLevel &level = multigrid->levels[i];
+        level.grid = levels[i];
+        level.nodeCapacity = levels[i].nodeCount();
+        checkCudaErrors( cudaMalloc((void**)&level.devGrid, sizeof(Grid)) );
+        checkCudaErrors( cudaMemcpy(level.devGrid, &level.grid, sizeof(Grid), cudaMemcpyHostToDevice) );
+        checkCudaErrors( cudaMalloc((void**)&level.nodes, level.nodeCapacity*sizeof(Node)) );
+        checkCudaErrors( cudaMemset(level.nodes, 0, level.nodeCapacity*sizeof(Node)) );
+        createNodeCaches( &level.caches, level.nodeCapacity, MULTIGRID_CHANNELS );
+    }
+}
+
+// Levels hold no state between steps, so only their grids change
+__host__ void resizeMultigrid( Multigrid *multigrid, const Grid &grid )
+{
+    Grid levels[MULTIGRID_MAX_LEVELS];
+    int levelCount = multigridLevels( grid, levels );
+    bool fits = ( levelCount == multigrid->levelCount );
+    for ( int i = 0; i < levelCount && fits; ++i ) {
+        fits = levels[i].nodeCount() <= multigrid->levels[i].nodeCapacity;
+    }
+    if ( !fits ) {
+        destroyMultigrid( multigrid );
+        createMultigrid( multigrid, grid );
+        return;
+    }
+    for ( int i = 0; i < levelCount; ++i ) {
+        MultigridLevel &level = multigrid->levels[i];
+        level.grid = levels[i];
+        checkCudaErrors( cudaMemcpy(level.devGrid, &level.grid, sizeof(Grid), cudaMemcpyHostToDevice) );
+    }
+}
+
+__host__ void destroyMultigrid( Multigrid *multigrid )
+{
+    for ( int i = 0; i < multigrid->levelCount; ++i ) {
+        MultigridLevel &level = multigrid->levels[i];
+        checkCudaErrors( cudaFree(level.devGrid) );
+        checkCudaErrors( cudaFree(level.nodes) );
+        destroyNodeCaches( &level.caches );
+        level.devGrid = NULL;
+        level.nodes = NULL;
+    }
+    multigrid->levelCount = 0;
+}
+
+__host__ void createParticleBins( ParticleBins *bins, index_t numParticles, const Grid &grid )
+{
+    bins->keys = bins->indices = bins->starts = bins->ends = NULL;
+    bins->particleCapacity = bins->binCapacity = 0;
+    resizeParticleBins( bins, numParticles, grid );
+}
+
+// Buffers that have to grow get a quarter more than asked, for the next time
+__host__ void resizeParticleBins( ParticleBins *bins, index_t numParticles, const Grid &grid )
+{
+    bins->count = binCount( grid.dim );
+    glm::ivec3 tileDim = ( grid.dim + glm::ivec3(4+G2P_TILE-1) ) / G2P_TILE;
+    bins->tileCount = (index_t)tileDim.x*tileDim.y*tileDim.z;
+    if ( numParticles > bins->particleCapacity ) {
+        index_t capacity = bins->particleCapacity ? numParticles + numParticles/4 : numParticles;
+        checkCudaErrors( cudaFree(bins->keys) );
+        checkCudaErrors( cudaFree(bins->indices) );
+        checkCudaErrors( cudaMalloc((void**)&bins->keys, capacity*sizeof(index_t)) );
+        checkCudaErrors( cudaMalloc((void**)&bins->indices, capacity*sizeof(index_t)) );
+        bins->particleCapacity = capacity;
+    }
+    if ( bins->count > bins->binCapacity ) {
+        index_t capacity = bins->binCapacity ? bins->count + bins->count/4 : bins->count;
+        checkCudaErrors( cudaFree(bins->starts) );
+        checkCudaErrors( cudaFree(bins->ends) );
+        checkCudaErrors( cudaMalloc((void**)&bins->starts, capacity*sizeof(index_t)) );
+        checkCudaErrors( cudaMalloc((void**)&bins->ends, capacity*sizeof(index_t)) );
+        bins->binCapacity = capacity;
+    }
+}
+
+__host__ void destroyParticleBins( ParticleBins *bins )
+{
+    checkCudaErrors( cudaFree(bins->keys) );
+    checkCudaErrors( cudaFree(bins->indices) );
+    checkCudaErrors( cudaFree(bins->starts) );
+    checkCudaErrors( cudaFree(bins->ends) );
+    bins->keys = bins->indices = bins->starts = bins->ends = NULL;
+    bins->count = bins->tileCount = 0;
+    bins->particleCapacity = bins->binCapacity = 0;
+}
+
+__global__ void packExportNodesKernel( const Node *nodes, index_t numNodes, float cellVolume, ExportNode *exportNodes )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+    const Node &node = nodes[nodeIdx];
+    ExportNode exportNode;
+    exportNode.density = floatToHalf( node.mass / cellVolume );
+    exportNode.velocity = node.velocity;
+    exportNodes[nodeIdx] = exportNode;
+}
+
+__host__ void packExportNodes( const Node *nodes, index_t numNodes, float cellVolume, ExportNode *exportNodes )
+{
+    const dim3 blocks( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+    LAUNCH( packExportNodesKernel<<<blocks,threads>>>(nodes,numNodes,cellVolume,exportNodes) );
+}
+
+struct ParticleBounds
+{
+    vec3 min, max;
+};
+
+struct ParticleBoundsOf
+{
+    __host__ __device__ ParticleBounds operator()( const Particle &particle ) const
+    {
+        ParticleBounds bounds;
+        bounds.min = bounds.max = particle.position;
+        return bounds;
+    }
+};
+
+struct ParticleBoundsUnion
+{
+    __host__ __device__ ParticleBounds operator()( const ParticleBounds &a, const ParticleBounds &b ) const
+    {
+        ParticleBounds bounds;
+        bounds.min = vec3::min( a.min, b.min );
+        bounds.max = vec3::max( a.max, b.max );
+        return bounds;
+    }
+};
+
+__host__ void computeParticleBounds( const Particle *particles, index_t numParticles, vec3 &min, vec3 &max )
+{
+    ParticleBounds init;
+    init.min = vec3( HUGE_VALF, HUGE_VALF, HUGE_VALF );
+    init.max = -init.min;
+    thrust::device_ptr<const Particle> begin( particles );
+    ParticleBounds bounds = thrust::transform_reduce( begin, begin+numParticles, ParticleBoundsOf(), init, ParticleBoundsUnion() );
+    min = bounds.min;
+    max = bounds.max;
+}
+
+// Both grids share a lattice, and the domain starts offset nodes into the grid
+__global__ void expandDomainNodesKernel( const Node *domainNodes, Grid domain, index_t numDomainNodes, glm::ivec3 offset, Node *gridNodes, Grid grid )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numDomainNodes ) return;
+    glm::ivec3 ijk = domain.nodeIJK( nodeIdx );
+    if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), domain.dim) ) return;
+    gridNodes[grid.nodeIndex(ijk+offset)] = domainNodes[nodeIdx];
+}
+
+__host__ void expandDomainNodes( const Node *domainNodes, const Grid &domain, Node *gridNodes, const Grid &grid )
+{
+    index_t numDomainNodes = domain.nodeCount();
+    glm::ivec3 offset = glm::ivec3( vec3::round((domain.pos - grid.pos) / grid.h) );
+    const dim3 blocks( (numDomainNodes+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+    LAUNCH( expandDomainNodesKernel<<<blocks,threads>>>(domainNodes,domain,numDomainNodes,offset,gridNodes,grid) );
+}
+
+__global__ void remapNodeValuesKernel( const vec3 *from, Grid fromGrid, glm::ivec3 offset, vec3 *to, Grid toGrid, index_t toNodes )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= toNodes ) return;
+    glm::ivec3 ijk = toGrid.nodeIJK( nodeIdx );
+    if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), toGrid.dim) ) return;
+    glm::ivec3 source = ijk + offset;
+    if ( !Grid::withinBoundsInclusive(source, glm::ivec3(0,0,0), fromGrid.dim) ) return;
+    to[nodeIdx] = from[fromGrid.nodeIndex(source)];
+}
+
+__host__ void remapNodeValues( const vec3 *from, const Grid &fromGrid, vec3 *to, const Grid &toGrid )
+{
+    index_t toNodes = toGrid.nodeCount();
+    glm::ivec3 offset = glm::ivec3( vec3::round((toGrid.pos - fromGrid.pos) / toGrid.h) );
+    const dim3 blocks( (toNodes+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+    LAUNCH( remapNodeValuesKernel<<<blocks,threads>>>(from,fromGrid,offset,to,toGrid,toNodes) );
+}
+
+// Block of the cell, clamped into the grid
+__device__ glm::ivec3 blockOf( const glm::ivec3 &cell, const glm::ivec3 &dim, int blockSize )
+{
+    return glm::clamp( cell, glm::ivec3(0,0,0), dim-1 ) / blockSize;
+}
+
+__global__ void markOccupiedBlocksKernel( const Particle *particles, index_t numParticles, Grid grid, int blockSize, int margin, glm::ivec3 blocks, bool *flags )
+{
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( particleIdx >= numParticles ) return;
+    vec3 particleGridPos = ( particles[particleIdx].position - grid.pos ) / grid.h;
+    glm::ivec3 cell( floorf(particleGridPos.x), floorf(particleGridPos.y), floorf(particleGridPos.z) );
+    glm::ivec3 lo = blockOf( cell-margin, grid.dim, blockSize );
+    glm::ivec3 hi = blockOf( cell+margin, grid.dim, blockSize );
+    // The margin is less than a block, so this is at most 2x2x2 blocks
+    for ( int k = lo.z; k <= hi.z; ++k )
+        for ( int j = lo.y; j <= hi.y; ++j )
+            for ( int i = lo.x; i <= hi.x; ++i )
+                flags[Grid::getGridIndex(i, j, k, blocks)] = true;
+}
+
+__host__ void markOccupiedBlocks( const Particle *particles, index_t numParticles, const Grid &grid, int blockSize, int margin, bool *devFlags )
+{
+    glm::ivec3 blocks = ( grid.dim + blockSize-1 ) / blockSize;
+    checkCudaErrors( cudaMemset(devFlags, 0, (size_t)blocks.x*blocks.y*blocks.z*sizeof(bool)) );
+    const dim3 launchBlocks( (numParticles+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+    LAUNCH( markOccupiedBlocksKernel<<<launchBlocks,threads>>>(particles,numParticles,grid,blockSize,margin,blocks,devFlags) );
+}
+
+__global__ void flagEscapedParticlesKernel( const Particle *particles, index_t numParticles, Grid grid, glm::ivec3 lo, glm::ivec3 hi, int margin, int *escaped )
+{
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( particleIdx >= numParticles ) return;
+    vec3 particleGridPos = ( particles[particleIdx].position - grid.pos ) / grid.h;
+    glm::ivec3 cell( floorf(particleGridPos.x), floorf(particleGridPos.y), floorf(particleGridPos.z) );
+    // Particles outside the grid count in the cell nearest to them
+    cell = glm::clamp( cell, glm::ivec3(0), grid.dim-1 );
+    glm::ivec3 needLo = glm::max( cell-margin, glm::ivec3(0) );
+    glm::ivec3 needHi = glm::min( cell+margin+1, grid.dim );
+    if ( glm::any(glm::lessThan(needLo, lo)) || glm::any(glm::greaterThan(needHi, hi)) ) *escaped = 1;
+}
+
+__host__ void flagEscapedParticles( const Particle *particles, index_t numParticles, const Grid &grid, const Grid &domain, int margin, int *devEscaped )
+{
+    if ( numParticles == 0 ) return;
+    glm::ivec3 lo = glm::ivec3( vec3::round((domain.pos - grid.pos) / grid.h) );
+    const dim3 launchBlocks( (numParticles+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+    LAUNCH_ASYNC( flagEscapedParticlesKernel<<<launchBlocks,threads>>>(particles,numParticles,grid,lo,lo+domain.dim,margin,devEscaped) );
+}
+
+__global__ void computeDomainKeys( const Particle *particles, index_t numParticles, Grid grid, int blockSize, glm::ivec3 blocks,
+                                   const int *blockDomains, int *keys, unsigned long long *counts )
+{
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( particleIdx >= numParticles ) return;
+    vec3 particleGridPos = ( particles[particleIdx].position - grid.pos ) / grid.h;
+    glm::ivec3 block = blockOf( glm::ivec3(floorf(particleGridPos.x), floorf(particleGridPos.y), floorf(particleGridPos.z)), grid.dim, blockSize );
+    int domain = blockDomains[Grid::getGridIndex(block, blocks)];
+    keys[particleIdx] = domain;
+    atomicAdd( &counts[domain], 1ull );
+}
+
+__host__ size_t domainSortBytes( index_t numParticles, int domainCount )
+{
+    return numParticles*sizeof(int) + domainCount*sizeof(unsigned long long) + 2*DEVICE_ARENA_ALIGNMENT;
+}
+
+__host__ void sortParticlesByDomain( Particle *particles, index_t numParticles, const Grid &grid, int blockSize,
+                                     const int *devBlockDomains, int domainCount, index_t *counts, DeviceArena *arena )
+{
+    glm::ivec3 blocks = ( grid.dim + blockSize-1 ) / blockSize;
+    int *devKeys = (int*)deviceArenaAllocate( arena, numParticles*sizeof(int) );
+    unsigned long long *devCounts = (unsigned long long*)deviceArenaAllocate( arena, domainCount*sizeof(unsigned long long) );
+    checkCudaErrors( cudaMemset(devCounts, 0, domainCount*sizeof(unsigned long long)) );
+
+    const dim3 launchBlocks( (numParticles+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+    LAUNCH( computeDomainKeys<<<launchBlocks,threads>>>(particles,numParticles,grid,blockSize,blocks,devBlockDomains,devKeys,devCounts) );
+    // Stable, so particles keep their relative order and a deterministic run stays deterministic
+    thrust::stable_sort_by_key( thrust::device_ptr<int>(devKeys), thrust::device_ptr<int>(devKeys+numParticles),
+                                thrust::device_ptr<Particle>(particles) );
+
+    // index_t is as wide as the counts, so they land in place
+    assert( sizeof(index_t) == sizeof(unsigned long long) );
+    checkCudaErrors( cudaMemcpy(counts, devCounts, domainCount*sizeof(unsigned long long), cudaMemcpyDeviceToHost) );
+
+    clearDeviceArena( arena );
+}
+
+__host__ void createSleepState( SleepState *sleep, const Grid &grid, int steps, float speed, float strainRate )
+{
+    sleep->steps = steps;
+    sleep->speed = speed;
+    sleep->strainRate = strainRate;
+
+    sleep->disturbed = sleep->calmSteps = NULL;
+    sleep->asleep = sleep->dormant = NULL;
+    sleep->blockCapacity = 0;
+    checkCudaErrors( cudaMalloc((void**)&sleep->changed, sizeof(int)) );
+    checkCudaErrors( cudaMallocHost((void**)&sleep->hostChanged, sizeof(int)) );
+    checkCudaErrors( cudaEventCreateWithFlags(&sleep->changedCopied, cudaEventDisableTiming) );
+    checkCudaErrors( cudaEventRecord(sleep->changedCopied) );
+
+    resetSleepState( sleep, grid );
+}
+
+__host__ void resetSleepState( SleepState *sleep, const Grid &grid )
+{
+    sleep->grid = grid;
+    sleep->blocks = ( grid.dim + SLEEP_BLOCK-1 ) / SLEEP_BLOCK;
+
+    index_t blockCount = (index_t)sleep->blocks.x*sleep->blocks.y*sleep->blocks.z;
+    if ( blockCount > sleep->blockCapacity ) {
+        checkCudaErrors( cudaFree(sleep->disturbed) );
+        checkCudaErrors( cudaFree(sleep->calmSteps) );
+        checkCudaErrors( cudaFree(sleep->asleep) );
+        checkCudaErrors( cudaFree(sleep->dormant) );
+        checkCudaErrors( cudaMalloc((void**)&sleep->disturbed, blockCount*sizeof(int)) );
+        checkCudaErrors( cudaMalloc((void**)&sleep->calmSteps, blockCount*sizeof(int)) );
+        checkCudaErrors( cudaMalloc((void**)&sleep->asleep, blockCount*sizeof(bool)) );
+        checkCudaErrors( cudaMalloc((void**)&sleep->dormant, blockCount*sizeof(bool)) );
+        sleep->blockCapacity = blockCount;
+    }
+    checkCudaErrors( cudaMemset(sleep->calmSteps, 0, blockCount*sizeof(int)) );
+    checkCudaErrors( cudaMemset(sleep->asleep, 0, blockCount*sizeof(bool)) );
+    checkCudaErrors( cudaMemset(sleep->dormant, 0, blockCount*sizeof(bool)) );
+
+    // Everything starts awake, in whatever order the particles are in
+    checkCudaErrors( cudaEventSynchronize(sleep->changedCopied) );
+    *sleep->hostChanged = 0;
+    sleep->awakeParticles = -1;
+}
+
+__host__ void destroySleepState( SleepState *sleep )
+{
+    checkCudaErrors( cudaFree(sleep->disturbed) );
+    checkCudaErrors( cudaFree(sleep->calmSteps) );
+    checkCudaErrors( cudaFree(sleep->asleep) );
+    checkCudaErrors( cudaFree(sleep->dormant) );
+    checkCudaErrors( cudaFree(sleep->changed) );
+    checkCudaErrors( cudaFreeHost(sleep->hostChanged) );
+    checkCudaErrors( cudaEventDestroy(sleep->changedCopied) );
+    sleep->hostChanged = NULL;
+    sleep->disturbed = sleep->calmSteps = sleep->changed = NULL;
+    sleep->asleep = sleep->dormant = NULL;
+    sleep->blockCapacity = 0;
+}
+
+__host__ bool createHalo( Halo *halo, Communicator *communicator, const Grid &grid, Grid *localGrid )
+{
+    const int rank = communicator->rank(), size = communicator->size();
+    // Particles only ever cross into a neighbor's slab if the bands around a
+    // slab's two boundaries don't overlap
+    if ( grid.dim.x / size < 2*HALO_CELLS+1 ) {
+        LOG( "A grid %d cells wide is too narrow to split across %d processes.", grid.dim.x, size );
+        return false;
+    }
+
+    halo->communicator = communicator;
+    halo->lowerRank = ( rank > 0 ) ? rank-1 : -1;
+    halo->upperRank = ( rank+1 < size ) ? rank+1 : -1;
+    halo->ownedBegin = (int)( (index_t)grid.dim.x*rank/size );
+    halo->ownedEnd = (int)( (index_t)grid.dim.x*(rank+1)/size );
+
+    int begin = MAX( halo->ownedBegin-HALO_CELLS, 0 );
+    int end = MIN( halo->ownedEnd+HALO_CELLS, grid.dim.x );
+    *localGrid = grid;
+    localGrid->dim.x = end - begin;
+    localGrid->pos.x = grid.pos.x + begin*grid.h;
+    halo->grid = *localGrid;
+
+    // Node planes [begin, ownedBegin) belong to the lower neighbor, and
+    // [ownedEnd, end] to the upper one
+    index_t planeNodes = (index_t)( grid.dim.y+1 ) * ( grid.dim.z+1 );
+    halo->bandNodes = ( 2*HALO_CELLS+1 ) * planeNodes;
+    halo->lowerGhosts = ( halo->lowerRank >= 0 ) ? HALO_CELLS*planeNodes : 0;
+    halo->upperGhosts = ( halo->upperRank >= 0 ) ? ( HALO_CELLS+1 )*planeNodes : 0;
+
+    // Bands are exchanged as whole nodes, or as one vec3 per node
+    size_t bytes = halo->bandNodes * MAX( sizeof(Node), sizeof(vec3) );
+    checkCudaErrors( cudaMallocHost((void**)&halo->sendBuffer, bytes) );
+    checkCudaErrors( cudaMallocHost((void**)&halo->receiveBuffer, bytes) );
+    checkCudaErrors( cudaMalloc((void**)&halo->devBand, bytes) );
+
+    halo->outgoing[0] = halo->outgoing[1] = halo->incoming = NULL;
+    halo->migrationCapacity = 0;
+    return true;
+}
+
+__host__ void destroyHalo( Halo *halo )
+{
+    checkCudaErrors( cudaFreeHost(halo->sendBuffer) );
+    checkCudaErrors( cudaFreeHost(halo->receiveBuffer) );
+    checkCudaErrors( cudaFree(halo->devBand) );
+    halo->sendBuffer = halo->receiveBuffer = halo->devBand = NULL;
+    checkCudaErrors( cudaFreeHost(halo->outgoing[0]) );
+    checkCudaErrors( cudaFreeHost(halo->outgoing[1]) );
+    checkCudaErrors( cudaFreeHost(halo->incoming) );
+    halo->outgoing[0] = halo->outgoing[1] = halo->incoming = NULL;
+    halo->migrationCapacity = 0;
+}
+
+// Grows the pinned migration buffers to hold count particles each, with a
+// quarter to spare
+__host__ void reserveMigrationBuffers( Halo *halo, index_t count )
+{
+    if ( count <= halo->migrationCapacity ) return;
+    count += count/4;
+    Particle **buffers[] = { &halo->outgoing[0], &halo->outgoing[1], &halo->incoming };
+    for ( int i = 0; i < 3; ++i ) {
+        checkCudaErrors( cudaFreeHost(*buffers[i]) );
+        checkCudaErrors( cudaMallocHost((void**)buffers[i], count*sizeof(Particle)) );
+    }
+    halo->migrationCapacity = count;
+}
+
+// 0 for particles in the slab, 1 for those below it and 2 for those above.
+// The end slabs own everything past the ends of the grid.
+struct SlabKey
+{
+    Grid grid;
+    int ownedBegin, ownedEnd;
+    bool hasLower, hasUpper;
+
+    SlabKey( const Grid &grid, const Halo &halo )
+        : grid(grid), ownedBegin(halo.ownedBegin), ownedEnd(halo.ownedEnd),
+          hasLower(halo.lowerRank >= 0), hasUpper(halo.upperRank >= 0)
+    {
+    }
+
+    __host__ __device__ int operator()( const Particle &particle ) const
+    {
+        int cell = (int)floorf( (particle.position.x - grid.pos.x) / grid.h );
+        if ( hasLower && cell < ownedBegin ) return 1;
+        if ( hasUpper && cell >= ownedEnd ) return 2;
+        return 0;
+    }
+};
+
+struct InSlab
+{
+    SlabKey key;
+
+    __host__ __device__ bool operator()( const Particle &particle ) const
+    {
+        return key( particle ) == 0;
+    }
+};
+
+__host__ index_t copySlabParticles( const Particle *particles, index_t numParticles, const Grid &grid, const Halo &halo,
+                                    Particle *slabParticles )
+{
+    InSlab inSlab = { SlabKey(grid, halo) };
+    thrust::device_ptr<const Particle> begin( particles );
+    if ( !slabParticles ) return thrust::count_if( begin, begin+numParticles, inSlab );
+    thrust::device_ptr<Particle> first( slabParticles );
+    return thrust::copy_if( begin, begin+numParticles, first, inSlab ) - first;
+}
+
+// Counts the particles leaving for the lower and the upper neighbor
+__global__ void countLeavingParticles( const Particle *particles, index_t numParticles, SlabKey slabKey, unsigned long long *counts )
+{
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( particleIdx >= numParticles ) return;
+    int key = slabKey( particles[particleIdx] );
+    if ( key ) atomicAdd( &counts[key-1], 1ull );
+}
+
+// Lists the leaving particles as key*numParticles+index, in no particular order
+__global__ void listLeavingParticles( const Particle *particles, index_t numParticles, SlabKey slabKey,
+                                      unsigned long long *count, index_t *leaving )
+{
+    index_t particleIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( particleIdx >= numParticles ) return;
+    int key = slabKey( particles[particleIdx] );
+    if ( key ) leaving[atomicAdd(count, 1ull)] = key*numParticles + particleIdx;
+}
+
+__global__ void gatherParticles( const Particle *particles, const index_t *indices, index_t count, Particle *gathered )
+{
+    index_t i = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( i >= count ) return;
+    gathered[i] = particles[indices[i]];
+}
+
+// Every from is past every to, so the moves don't overlap
+__global__ void moveParticles( Particle *particles, const index_t *from, const index_t *to, index_t count )
+{
+    index_t i = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( i >= count ) return;
+    particles[to[i]] = particles[from[i]];
+}
+
+// The leaving particles listed, the indices to gather them and to move the
+// staying ones, and the leaving particles themselves
+__host__ size_t migrationBytes( index_t leaving )
+{
+    return sizeof(unsigned long long) + leaving*( 3*sizeof(index_t) + sizeof(Particle) ) + 4*DEVICE_ARENA_ALIGNMENT;
+}
+
+// Moves the k leaving particles into staging, lower neighbor's first, each
+// side in the order they had. The staying particles past the first
+// numParticles-k fill the gaps, so the staying ones end up in front.
+__host__ void partitionLeavingParticles( Particle *particles, index_t numParticles, const SlabKey &slabKey, index_t k,
+                                         Particle **staging, DeviceArena *arena )
+{
+    reserveDeviceArena( arena, migrationBytes(k) );
+    unsigned long long *devCount = (unsigned long long*)deviceArenaAllocate( arena, sizeof(unsigned long long) );
+    index_t *devIndices = (index_t*)deviceArenaAllocate( arena, 3*k*sizeof(index_t) );
+    *staging = (Particle*)deviceArenaAllocate( arena, k*sizeof(Particle) );
+    checkCudaErrors( cudaMemset(devCount, 0, sizeof(unsigned long long)) );
+    const dim3 blocks( (numParticles+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads( THREAD_COUNT );
+    LAUNCH( listLeavingParticles<<<blocks,threads>>>(particles,numParticles,slabKey,devCount,devIndices) );
+
+    // Few particles leave per step, so their order is settled on the host
+    std::vector<index_t> indices( k );
+    checkCudaErrors( cudaMemcpy(&indices[0], devIndices, k*sizeof(index_t), cudaMemcpyDeviceToHost) );
+    std::sort( indices.begin(), indices.end() );
+
+    // The gather indices, then the moves: from the staying particles past
+    // staying, to the gaps before it
+    const index_t staying = numParticles - k;
+    std::vector<bool> leavingTail( k, false );
+    index_t gaps = 0;
+    for ( index_t i = 0; i < k; ++i ) {
+        indices[i] %= numParticles;
+        if ( indices[i] >= staying ) leavingTail[indices[i]-staying] = true;
+        else ++gaps;
+    }
+    std::vector<index_t> moves( 2*gaps );
+    index_t from = 0, to = gaps;
+    for ( index_t i = 0; i < k; ++i ) {
+        if ( !leavingTail[i] ) moves[from++] = staying + i;
+        if ( indices[i] < staying ) moves[to++] = indices[i];
+    }
+    indices.insert( indices.end(), moves.begin(), moves.end() );
+
+    checkCudaErrors( cudaMemcpy(devIndices, &indices[0], indices.size()*sizeof(index_t), cudaMemcpyHostToDevice) );
+    LAUNCH( gatherParticles<<<(k+THREAD_COUNT-1)/THREAD_COUNT,THREAD_COUNT>>>(particles,devIndices,k,*staging) );
+    if ( gaps > 0 ) {
+        LAUNCH( moveParticles<<<(gaps+THREAD_COUNT-1)/THREAD_COUNT,THREAD_COUNT>>>(particles,devIndices+k,devIndices+k+gaps,gaps) );
+    }
+}
+
+__host__ index_t migrateParticles( Particle **particles, index_t numParticles, index_t *capacity, const Grid &grid, Halo *halo,
+                                   DeviceArena *arena )
+{
+    PROFILE_SCOPE( "migrateParticles" );
+
+    // Leaving for the lower and the upper neighbor
+    const SlabKey slabKey( grid, *halo );
+    unsigned long long leaving[2] = { 0, 0 };
+    if ( numParticles > 0 ) {
+        reserveDeviceArena( arena, 2*sizeof(unsigned long long) + DEVICE_ARENA_ALIGNMENT );
+        unsigned long long *devCounts = (unsigned long long*)deviceArenaAllocate( arena, 2*sizeof(unsigned long long) );
+        checkCudaErrors( cudaMemset(devCounts, 0, 2*sizeof(unsigned long long)) );
+        const dim3 blocks( (numParticles+THREAD_COUNT-1)/THREAD_COUNT );
+        static const dim3 threads( THREAD_COUNT );
+        LAUNCH( countLeavingParticles<<<blocks,threads>>>(*particles,numParticles,slabKey,devCounts) );
+        checkCudaErrors( cudaMemcpy(leaving, devCounts, 2*sizeof(unsigned long long), cudaMemcpyDeviceToHost) );
+        clearDeviceArena( arena );
+    }
+    const index_t staying = numParticles - (index_t)( leaving[0] + leaving[1] );
+
+    // Counts go both ways first, so the buffers can be sized for all of it.
+    // Upper neighbor first on every rank, as for the node bands.
+    const int peers[2] = { halo->upperRank, halo->lowerRank };
+    const index_t outgoingFirst[2] = { (index_t)leaving[0], 0 };
+    const index_t outgoingCount[2] = { (index_t)leaving[1], (index_t)leaving[0] };
+    index_t incomingCount[2] = { 0, 0 };
+    for ( int side = 0; side < 2; ++side ) {
+        if ( peers[side] < 0 ) continue;
+        halo->communicator->exchange( peers[side], &outgoingCount[side], sizeof(index_t), &incomingCount[side], sizeof(index_t) );
+    }
+    reserveMigrationBuffers( halo, MAX(MAX(outgoingCount[0], outgoingCount[1]), MAX(incomingCount[0], incomingCount[1])) );
+
+    // Everything leaving is copied out first, since arrivals overwrite it
+    if ( staying < numParticles ) {
+        Particle *staging;
+        partitionLeavingParticles( *particles, numParticles, slabKey, numParticles-staying, &staging, arena );
+        for ( int side = 0; side < 2; ++side ) {
+            checkCudaErrors( cudaMemcpy(halo->outgoing[side], staging+outgoingFirst[side], outgoingCount[side]*sizeof(Particle),
+                                        cudaMemcpyDeviceToHost) );
+        }
+        clearDeviceArena( arena );
+    }
+
+    const index_t total = staying + incomingCount[0] + incomingCount[1];
+    if ( total > *capacity ) {
+        index_t grown = total + total/4;
+        Particle *devParticles;
+        checkCudaErrors( cudaMalloc((void**)&devParticles, grown*sizeof(Particle)) );
+        checkCudaErrors( cudaMemcpy(devParticles, *particles, staying*sizeof(Particle), cudaMemcpyDeviceToDevice) );
+        checkCudaErrors( cudaFree(*particles) );
+        *particles = devParticles;
+        *capacity = grown;
+    }
+
+    index_t next = staying;
+    for ( int side = 0; side < 2; ++side ) {
+        if ( peers[side] < 0 ) continue;
+        halo->communicator->exchange( peers[side], halo->outgoing[side], outgoingCount[side]*sizeof(Particle),
+                                      halo->incoming, incomingCount[side]*sizeof(Particle) );
+        checkCudaErrors( cudaMemcpy(*particles+next, halo->incoming, incomingCount[side]*sizeof(Particle), cudaMemcpyHostToDevice) );
+        next += incomingCount[side];
+    }
+    return total;
+}
+
+__host__ void createParticleStream( ParticleStream *stream, index_t chunkSize )
+{
+    // Streamed steps are explicit, so each chunk only needs its sigmas
+    MemoryPlan plan;
+    plan.nodeChannels = 0;
+    plan.implicitCaches = false;
+    plan.aps = false;
+    plan.arenaBytes = 0;
+
+    stream->chunkSize = chunkSize;
+    for ( int b = 0; b < PARTICLE_STREAM_BUFFERS; ++b ) {
+        checkCudaErrors( cudaStreamCreate(&stream->streams[b]) );
+        checkCudaErrors( cudaMallocHost((void**)&stream->staging[b], chunkSize*sizeof(Particle)) );
+        checkCudaErrors( cudaMalloc((void**)&stream->chunks[b], chunkSize*sizeof(Particle)) );
+        createParticleCache( &stream->caches[b], chunkSize, plan );
+        checkCudaErrors( cudaMalloc((void**)&stream->devCaches[b], sizeof(ParticleCache)) );
+        checkCudaErrors( cudaMemcpy(stream->devCaches[b], &stream->caches[b], sizeof(ParticleCache), cudaMemcpyHostToDevice) );
+    }
+}
+
+__host__ void destroyParticleStream( ParticleStream *stream )
+{
+    for ( int b = 0; b < PARTICLE_STREAM_BUFFERS; ++b ) {
+        checkCudaErrors( cudaFree(stream->devCaches[b]) );
+        destroyParticleCache( &stream->caches[b] );
+        checkCudaErrors( cudaFree(stream->chunks[b]) );
+        checkCudaErrors( cudaFreeHost(stream->staging[b]) );
+        checkCudaErrors( cudaStreamDestroy(stream->streams[b]) );
+        stream->chunks[b] = stream->staging[b] = NULL;
+        stream->devCaches[b] = NULL;
+    }
+}
 
-    LAUNCH( computeSigma<<<pBlocks1D,threads1D>>>(particles,devParticleCache,numParticles,grid) );
+enum StreamPass
+{
+    STREAM_NODE_MASSES,
+    STREAM_VOLUMES,
+    STREAM_P2G,
+    STREAM_G2P
+};
 
-    LAUNCH( computeCellMassVelocityAndForceFast<<<pBlocks2D,threads2D>>>(particles,devParticleCache,numParticles,grid,nodes) );
+/**
+ * One pass over host particles, chunk by chunk. Chunk c goes through buffer
+ * c%PARTICLE_STREAM_BUFFERS: once that buffer's stream is done with chunk
+ * c-PARTICLE_STREAM_BUFFERS (and has copied it back, for passes that change
+ * particles), the host fills its staging memory, and the upload, kernels and
+ * download are queued on its stream. The host copy of one chunk thus overlaps
+ * the device work of the other.
+ */
+__host__ void streamParticles( StreamPass pass, Particle *particles, index_t numParticles, ParticleStream *stream,
+                               const Grid *grid, Node *nodes, float *nodeMasses,
+                               const ImplicitCollider *colliders, int numColliders, float timeStep )
+{
+    const bool writeBack = ( pass == STREAM_VOLUMES || pass == STREAM_G2P );
+    const index_t chunkSize = stream->chunkSize;
+    const index_t chunkCount = ( numParticles+chunkSize-1 ) / chunkSize;
+    static const dim3 threads1D( THREAD_COUNT );
+    static const dim3 threads2D( THREAD_COUNT/64, 64 );
 
-    LAUNCH( updateNodeVelocities<<<nBlocks1D,threads1D>>>(nodes,numNodes,timeStep,colliders,numColliders,grid,!implicitUpdate) );
+    for ( index_t c = 0; c < chunkCount+PARTICLE_STREAM_BUFFERS; ++c ) {
 
-    if ( implicitUpdate ) integrateNodeForces( particles, devParticleCache, numParticles, grid, nodes, nodeCaches, numNodes, timeStep );
+        const int b = c % PARTICLE_STREAM_BUFFERS;
+        checkCudaErrors( cudaStreamSynchronize(stream->streams[b]) );
 
-    LAUNCH( updateParticlesFromGrid<<<pBlocks1D,threads1D>>>(particles,numParticles,grid,nodes,timeStep,colliders,numColliders) );
+        index_t retired = c - PARTICLE_STREAM_BUFFERS;
+        if ( writeBack && retired >= 0 ) {
+            index_t first = retired*chunkSize, count = MIN( chunkSize, numParticles-first );
+            memcpy( particles+first, stream->staging[b], count*sizeof(Particle) );
+        }
+        if ( c >= chunkCount ) continue;
+
+        index_t first = c*chunkSize, count = MIN( chunkSize, numParticles-first );
+        if ( c+1 < chunkCount ) {
+            index_t next = first+chunkSize;
+            prefetchHostFile( particles, next*sizeof(Particle), MIN(chunkSize, numParticles-next)*sizeof(Particle) );
+        }
+        memcpy( stream->staging[b], particles+first, count*sizeof(Particle) );
+
+        cudaStream_t s = stream->streams[b];
+        Particle *chunk = stream->chunks[b];
+        const dim3 blocks1D( (count+THREAD_COUNT-1)/THREAD_COUNT );
+        const dim3 blocks2D( (count+THREAD_COUNT-1)/THREAD_COUNT, 64 );
+        checkCudaErrors( cudaMemcpyAsync(chunk, stream->staging[b], count*sizeof(Particle), cudaMemcpyHostToDevice, s) );
+        switch ( pass ) {
+        case STREAM_NODE_MASSES:
+            LAUNCH_ASYNC( computeNodeMasses<<<blocks2D,threads2D,0,s>>>(chunk,count,grid,nodeMasses) );
+            break;
+        case STREAM_VOLUMES:
+            LAUNCH_ASYNC( computeParticleDensity<<<blocks2D,threads2D,0,s>>>(chunk,count,grid,nodeMasses) );
+            LAUNCH_ASYNC( computeParticleVolume<<<blocks1D,threads1D,0,s>>>(chunk,count) );
+            break;
+        case STREAM_P2G:
+            LAUNCH_ASYNC( computeSigma<<<blocks1D,threads1D,0,s>>>(chunk,stream->devCaches[b],count,grid) );
+            LAUNCH_ASYNC( computeCellMassVelocityAndForceFast<<<blocks2D,threads2D,0,s>>>(chunk,stream->devCaches[b],count,grid,nodes) );
+            break;
+        case STREAM_G2P:
+            LAUNCH_ASYNC( updateParticlesFromGrid<<<blocks1D,threads1D,0,s>>>(chunk,count,grid,nodes,timeStep,colliders,numColliders) );
+            break;
+        }
+        if ( writeBack ) {
+            checkCudaErrors( cudaMemcpyAsync(stream->staging[b], chunk, count*sizeof(Particle), cudaMemcpyDeviceToHost, s) );
+        }
+    }
+}
+
+__host__ void initializeStreamedParticleVolumes( Particle *particles, index_t numParticles, const Grid *grid, index_t numNodes,
+                                                 ParticleStream *stream, DeviceArena *arena )
+{
+    float *devNodeMasses = (float*)deviceArenaAllocate( arena, numNodes*sizeof(float) );
+    checkCudaErrors( cudaMemset(devNodeMasses, 0, numNodes*sizeof(float)) );
+    // Every chunk's masses have to be in before any density is read
+    streamParticles( STREAM_NODE_MASSES, particles, numParticles, stream, grid, NULL, devNodeMasses, NULL, 0, 0.f );
+    streamParticles( STREAM_VOLUMES, particles, numParticles, stream, grid, NULL, devNodeMasses, NULL, 0, 0.f );
+    clearDeviceArena( arena );
+}
+
+__host__ void updateStreamedParticles( Particle *particles, index_t numParticles, ParticleStream *stream,
+                                       Grid *grid, Node *nodes, index_t numNodes,
+                                       ImplicitCollider *colliders, int numColliders, float timeStep )
+{
+    checkCudaErrors( cudaMemset(nodes, 0, numNodes*sizeof(Node)) );
+    if ( numColliders > 0 ) {
+        LAUNCH( updateColliderPositions<<<numColliders,1>>>(colliders,numColliders,timeStep) );
+    }
+
+    {
+        PROFILE_SCOPE( "P2G" );
+        streamParticles( STREAM_P2G, particles, numParticles, stream, grid, nodes, NULL, colliders, numColliders, timeStep );
+    }
+
+    {
+        PROFILE_SCOPE( "gridUpdate" );
+        const dim3 nBlocks1D( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
+        static const dim3 threads1D( THREAD_COUNT );
+        LAUNCH( updateNodeVelocities<<<nBlocks1D,threads1D>>>(nodes,numNodes,timeStep,colliders,numColliders,grid,true) );
+    }
+
+    {
+        PROFILE_SCOPE( "G2P" );
+        streamParticles( STREAM_G2P, particles, numParticles, stream, grid, nodes, NULL, colliders, numColliders, timeStep );
+    }
 }
@@ -0,0 +1,199 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   sleep.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef SLEEP_H
+#define SLEEP_H
+
+/*
+ * Putting resting snow to sleep (see SleepState). Blocks are judged by their
+ * nodes after the grid update: a node with mass is disturbed if it moves
+ * faster than the speed threshold, or if its velocity differs from the next
+ * node's along any axis by more than the strain rate over a cell, and any node
+ * inside a moving collider is disturbed. A disturbed block keeps itself and
+ * its neighbors awake, so motion wakes a sleeping region one block per step.
+ */
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <helper_functions.h>
+#include <helper_cuda.h>
+
+#include <thrust/device_ptr.h>
+#include <thrust/partition.h>
+
+#define CUDA_INCLUDE
+#include "geometry/grid.h"
+#include "sim/caches.h"
+#include "sim/implicitcollider.h"
+#include "sim/particle.h"
+#include "sim/particlegridnode.h"
+#include "sim/profiler.h"
+#include "cuda/vector.h"
+
+#include "cuda/helpers.h"
+#include "cuda/collider.h"
+
+// Block of the cell, clamped into the grid
+__host__ __device__ __forceinline__ glm::ivec3 sleepBlock( const glm::ivec3 &cell, const glm::ivec3 &dim )
+{
+    return glm::clamp( cell, glm::ivec3(0,0,0), dim-1 ) / SLEEP_BLOCK;
+}
+
+__global__ void markDisturbedBlocks( const Node *nodes, index_t numNodes, const Grid *grid,
+                                     const ImplicitCollider *colliders, int numColliders, SleepState sleep )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+
+    glm::ivec3 ijk = grid->nodeIJK( nodeIdx );
+    const Node &node = nodes[nodeIdx];
+    bool disturbed = false;
+    if ( node.mass > 0.f ) {
+        disturbed = vec3::length2( node.velocity ) > sleep.speed*sleep.speed;
+        const glm::ivec3 axes[3] = { glm::ivec3(1,0,0), glm::ivec3(0,1,0), glm::ivec3(0,0,1) };
+        const float maxDifference = sleep.strainRate * grid->h;
+        for ( int a = 0; a < 3 && !disturbed; ++a ) {
+            glm::ivec3 next = ijk + axes[a];
+            if ( !Grid::withinBoundsInclusive(next, glm::ivec3(0,0,0), grid->dim) ) continue;
+            const Node &neighbor = nodes[grid->nodeIndex(next)];
+            disturbed = neighbor.mass > 0.f && vec3::length2( neighbor.velocity-node.velocity ) > maxDifference*maxDifference;
+        }
+    }
+    // Static colliders (like the ground) don't wake anything
+    vec3 position = vec3( ijk )*grid->h + grid->pos;
+    for ( int i = 0; i < numColliders && !disturbed; ++i ) {
+        disturbed = vec3::length2( colliders[i].velocity ) > 0.f && isColliding( colliders[i], position );
+    }
+
+    if ( disturbed ) sleep.disturbed[Grid::getGridIndex(sleepBlock(ijk, grid->dim), sleep.blocks)] = 1;
+}
+
+__global__ void updateSleepingBlocksKernel( SleepState sleep, index_t blockCount )
+{
+    index_t blockIndex = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( blockIndex >= blockCount ) return;
+
+    glm::ivec3 block;
+    Grid::gridIndexToIJK( blockIndex, sleep.blocks, block );
+    bool disturbed = false;
+    for ( int k = -1; k <= 1; ++k )
+        for ( int j = -1; j <= 1; ++j )
+            for ( int i = -1; i <= 1; ++i ) {
+                glm::ivec3 neighbor = block + glm::ivec3( i, j, k );
+                if ( !Grid::withinBoundsInclusive(neighbor, glm::ivec3(0,0,0), sleep.blocks-1) ) continue;
+                disturbed = disturbed || sleep.disturbed[Grid::getGridIndex(neighbor, sleep.blocks)];
+            }
+
+    int calm = disturbed ? 0 : sleep.calmSteps[blockIndex]+1;
+    if ( calm > sleep.steps ) calm = sleep.steps;
+    sleep.calmSteps[blockIndex] = calm;
+    sleep.asleep[blockIndex] = ( calm >= sleep.steps );
+}
+
+__global__ void markDormantBlocks( SleepState sleep, index_t blockCount )
+{
+    index_t blockIndex = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( blockIndex >= blockCount ) return;
+
+    glm::ivec3 block;
+    Grid::gridIndexToIJK( blockIndex, sleep.blocks, block );
+    bool dormant = true;
+    for ( int k = -1; k <= 1; ++k )
+        for ( int j = -1; j <= 1; ++j )
+            for ( int i = -1; i <= 1; ++i ) {
+                glm::ivec3 neighbor = block + glm::ivec3( i, j, k );
+                if ( !Grid::withinBoundsInclusive(neighbor, glm::ivec3(0,0,0), sleep.blocks-1) ) continue;
+                dormant = dormant && sleep.asleep[Grid::getGridIndex(neighbor, sleep.blocks)];
+            }
+
+    if ( dormant != sleep.dormant[blockIndex] ) {
+        sleep.dormant[blockIndex] = dormant;
+        *sleep.changed = 1;
+    }
+}
+
+// Sleeping nodes end the step at rest. The velocity change keeps FLIP
+// consistent with that: v_new - v_old, with v_new = 0.
+__global__ void freezeSleepingNodes( Node *nodes, index_t numNodes, const Grid *grid, SleepState sleep )
+{
+    index_t nodeIdx = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if ( nodeIdx >= numNodes ) return;
+
+    glm::ivec3 ijk = grid->nodeIJK( nodeIdx );
+    if ( !sleep.asleep[Grid::getGridIndex(sleepBlock(ijk, grid->dim), sleep.blocks)] ) return;
+    Node &node = nodes[nodeIdx];
+    node.velocityChange = vec3( node.velocityChange ) - node.velocity;
+    node.velocity = vec3( 0.f, 0.f, 0.f );
+}
+
+/**
+ * Judges every block from the updated nodes, then holds the sleeping ones
+ * still. Call between the grid update (or implicit solve) and G2P. Only
+ * enqueues work on the default stream; whether any block changed is copied
+ * back for the next step's awakeParticles.
+ */
+__host__ void updateSleepingBlocks( Node *nodes, index_t numNodes, const Grid *grid,
+                                    const ImplicitCollider *colliders, int numColliders, SleepState *sleep )
+{
+    PROFILE_SCOPE( "updateSleep" );
+
+    const index_t blockCount = (index_t)sleep->blocks.x*sleep->blocks.y*sleep->blocks.z;
+    const dim3 nBlocks1D( (numNodes+THREAD_COUNT-1)/THREAD_COUNT );
+    const dim3 bBlocks1D( (blockCount+THREAD_COUNT-1)/THREAD_COUNT );
+    static const dim3 threads1D( THREAD_COUNT );
+
+    checkCudaErrors( cudaMemsetAsync(sleep->disturbed, 0, blockCount*sizeof(int)) );
+    checkCudaErrors( cudaMemsetAsync(sleep->changed, 0, sizeof(int)) );
+    LAUNCH_ASYNC( markDisturbedBlocks<<<nBlocks1D,threads1D>>>(nodes,numNodes,grid,colliders,numColliders,*sleep) );
+    LAUNCH_ASYNC( updateSleepingBlocksKernel<<<bBlocks1D,threads1D>>>(*sleep,blockCount) );
+    LAUNCH_ASYNC( markDormantBlocks<<<bBlocks1D,threads1D>>>(*sleep,blockCount) );
+    LAUNCH_ASYNC( freezeSleepingNodes<<<nBlocks1D,threads1D>>>(nodes,numNodes,grid,*sleep) );
+
+    checkCudaErrors( cudaMemcpyAsync(sleep->hostChanged, sleep->changed, sizeof(int), cudaMemcpyDeviceToHost) );
+    checkCudaErrors( cudaEventRecord(sleep->changedCopied) );
+}
+
+struct ParticleAwake
+{
+    Grid grid;
+    glm::ivec3 blocks;
+    const bool *dormant;
+
+    __host__ __device__ bool operator()( const Particle &particle ) const
+    {
+        vec3 particleGridPos = ( particle.position - grid.pos ) / grid.h;
+        glm::ivec3 cell( floorf(particleGridPos.x), floorf(particleGridPos.y), floorf(particleGridPos.z) );
+        return !dormant[Grid::getGridIndex(sleepBlock(cell, grid.dim), blocks)];
+    }
+};
+
+/**
+ * Returns how many of the particles are awake, moving them in front of the
+ * dormant ones first if any block changed in the last step. Stable, so
+ * deterministic runs stay deterministic.
+ */
+__host__ index_t awakeParticles( Particle *particles, index_t numParticles, SleepState *sleep )
+{
+    // Long done by now, since the last step's G2P came after the copy
+    checkCudaErrors( cudaEventSynchronize(sleep->changedCopied) );
+    if ( *sleep->hostChanged ) {
+        PROFILE_SCOPE( "partitionAwake" );
+        ParticleAwake awake;
+        awake.grid = sleep->grid;
+        awake.blocks = sleep->blocks;
+        awake.dormant = sleep->dormant;
+        thrust::device_ptr<Particle> first( particles );
+        sleep->awakeParticles = thrust::stable_partition( first, first+numParticles, awake ) - first;
+        *sleep->hostChanged = 0;
+    }
+    if ( sleep->awakeParticles < 0 || sleep->awakeParticles > numParticles ) return numParticles;
+    return sleep->awakeParticles;
+}
+
+#endif // SLEEP_H
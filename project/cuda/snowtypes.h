@@ -33,10 +33,10 @@
  *
  */
 
-__global__ void applyChunky(Particle *particles, int particleCount)
+__global__ void applyChunky(Particle *particles, index_t particleCount)
 {
     // spatially varying constitutive parameters
-    int tid = threadIdx.x + blockIdx.x * blockDim.x;
+    index_t tid = (index_t)blockIdx.x*blockDim.x + threadIdx.x;
     if ( tid >= particleCount ) return;
     Particle &particle = particles[tid];
     vec3 pos = particle.position;
@@ -0,0 +1,107 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   stepgraph.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef STEPGRAPH_H
+#define STEPGRAPH_H
+
+/*
+ * Part of a simulation step as a small DAG of stages. Each stage is declared
+ * once, with the stream it runs on and the stages it depends on, in an order
+ * that respects the dependencies. begin() makes the stage's stream wait on the
+ * events recorded at the end of its dependencies and returns the stream; end()
+ * records the stage's event. Stages on different streams with no path between
+ * them then overlap on the device, while the host just enqueues work.
+ *
+ * The streams don't block the legacy default stream, so work launched outside
+ * the graph must come after synchronize(). Each stage is a profiler scope,
+ * which only synchronizes the device (and so serializes the graph) while the
+ * profiler is enabled.
+ */
+
+#include <assert.h>
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <helper_functions.h>
+#include <helper_cuda.h>
+
+#include "sim/profiler.h"
+
+class StepGraph
+{
+
+public:
+
+    enum { MAX_STAGES = 16, MAX_DEPENDENCIES = 4, STREAM_COUNT = 3 };
+
+    struct Stage
+    {
+        const char *name; // profiler scope, must be a literal
+        int stream;
+        int dependencies[MAX_DEPENDENCIES]; // terminated by -1 if fewer
+    };
+
+    StepGraph( const Stage *stages, int stageCount )
+        : m_stages(stages), m_stageCount(stageCount)
+    {
+        assert( stageCount <= MAX_STAGES );
+        for ( int i = 0; i < m_stageCount; ++i ) {
+            assert( m_stages[i].stream >= 0 && m_stages[i].stream < STREAM_COUNT );
+            for ( int d = 0; d < MAX_DEPENDENCIES && m_stages[i].dependencies[d] >= 0; ++d ) {
+                assert( m_stages[i].dependencies[d] < i );
+            }
+            checkCudaErrors( cudaEventCreateWithFlags(&m_events[i], cudaEventDisableTiming) );
+        }
+        for ( int i = 0; i < STREAM_COUNT; ++i ) {
+            checkCudaErrors( cudaStreamCreateWithFlags(&m_streams[i], cudaStreamNonBlocking) );
+        }
+    }
+
+    ~StepGraph()
+    {
+        for ( int i = 0; i < m_stageCount; ++i ) checkCudaErrors( cudaEventDestroy(m_events[i]) );
+        for ( int i = 0; i < STREAM_COUNT; ++i ) checkCudaErrors( cudaStreamDestroy(m_streams[i]) );
+    }
+
+    cudaStream_t begin( int stage )
+    {
+        const Stage &s = m_stages[stage];
+        Profiler::begin( s.name );
+        cudaStream_t stream = m_streams[s.stream];
+        for ( int d = 0; d < MAX_DEPENDENCIES && s.dependencies[d] >= 0; ++d ) {
+            // Same stream dependencies are already ordered
+            if ( m_stages[s.dependencies[d]].stream != s.stream ) {
+                checkCudaErrors( cudaStreamWaitEvent(stream, m_events[s.dependencies[d]], 0) );
+            }
+        }
+        return stream;
+    }
+
+    void end( int stage )
+    {
+        checkCudaErrors( cudaEventRecord(m_events[stage], m_streams[m_stages[stage].stream]) );
+        Profiler::end();
+    }
+
+    // Waits for every stage
+    void synchronize()
+    {
+        for ( int i = 0; i < STREAM_COUNT; ++i ) checkCudaErrors( cudaStreamSynchronize(m_streams[i]) );
+    }
+
+private:
+
+    const Stage *m_stages;
+    int m_stageCount;
+    cudaStream_t m_streams[STREAM_COUNT];
+    cudaEvent_t m_events[MAX_STAGES];
+
+};
+
+#endif // STEPGRAPH_H
@@ -138,4 +138,54 @@ __host__ __device__ __forceinline__ void weightAndGradient( const vec3 &dx, floa
     wg.z = N.x  * N.y * Nx.z;
 }
 
+/*
+ * Weights and gradients of a particle's whole 4x4x4 stencil. The kernel is
+ * separable, so each axis only needs the four 1D weights of its nodes, which
+ * are the four pieces of the cubic B-spline evaluated at the fractional
+ * position f; all three axes are done at once as vec3 ops. Each of the 64
+ * node weights is then a product of three of them.
+ *
+ * origin is the first stencil node, glm::ivec3(gridPos-1) like everywhere
+ * else. That truncates toward zero, so left of the grid the stencil starts
+ * one node past floor(gridPos)-1 and the pieces shift down by one.
+ */
+struct StencilWeights
+{
+    vec3 w[4]; // w[i].x = N along x for node origin.x+i, same for y and z
+    vec3 wd[4]; // derivatives of w with respect to gridPos
+
+    __host__ __device__ __forceinline__
+    StencilWeights( const vec3 &gridPos, const glm::ivec3 &origin )
+    {
+        vec3 fl = vec3::floor( gridPos );
+        vec3 f = gridPos - fl, g = vec3(1.f) - f;
+        vec3 f2 = f*f, g2 = g*g;
+        vec3 shift = vec3( origin ) - ( fl - vec3(1.f) );
+
+        // Distances 1+f, f, 1-f and 2-f from nodes floor(gridPos)-1 .. floor(gridPos)+2
+        vec3 c[5], cd[5];
+        c[0] = (1.f/6.f)*g2*g;                  cd[0] = -0.5f*g2;
+        c[1] = 0.5f*f2*f - f2 + vec3(2.f/3.f);  cd[1] = 1.5f*f2 - 2.f*f;
+        c[2] = 0.5f*g2*g - g2 + vec3(2.f/3.f);  cd[2] = 2.f*g - 1.5f*g2;
+        c[3] = (1.f/6.f)*f2*f;                  cd[3] = 0.5f*f2;
+        c[4] = vec3( 0.f );                     cd[4] = vec3( 0.f );
+
+        for ( int i = 0; i < 4; ++i ) {
+            w[i] = vec3::mix( c[i], c[i+1], shift );
+            wd[i] = vec3::mix( cd[i], cd[i+1], shift );
+        }
+    }
+
+    __host__ __device__ __forceinline__
+    float weight( int i, int j, int k ) const { return w[i].x * w[j].y * w[k].z; }
+
+    __host__ __device__ __forceinline__
+    vec3 gradient( int i, int j, int k ) const
+    {
+        return vec3( wd[i].x * w[j].y * w[k].z,
+                     w[i].x * wd[j].y * w[k].z,
+                     w[i].x * w[j].y * wd[k].z );
+    }
+};
+
 #endif // WEIGHTING_H
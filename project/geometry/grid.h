@@ -24,8 +24,21 @@
     #endif
 #endif
 
+#include "common/common.h"
 #include "cuda/vector.h"
 
+// Node storage order. By default nodes are stored row-major, k fastest. With
+// BLOCKED_NODES they are grouped into 4x4x4 tiles: the tiles are stored
+// row-major and the nodes inside a tile in Z-order, so a particle's 4x4x4
+// stencil touches at most 8 contiguous tiles instead of 16 rows on 4 pages.
+// Storage is then padded to whole tiles, and nodeIJK() of a padding slot lies
+// outside the grid. Always go through nodeIndex()/nodeIJK() to address nodes.
+// BLOCKED_NODES is defined by building with CONFIG+=blocked_nodes (see
+// snow.pro), for the host and device code alike.
+
+#define NODE_TILE_BITS 2
+#define NODE_TILE_SIZE (1 << NODE_TILE_BITS)
+
 struct Grid
 {
     glm::ivec3 dim;
@@ -35,41 +48,127 @@ struct Grid
     FUNC Grid() : dim(0,0,0), pos(0,0,0), h(0.f) {}
     FUNC Grid( const Grid &grid ) : dim(grid.dim), pos(grid.pos), h(grid.h) {}
 
-    FUNC int cellCount() const { return dim.x * dim.y * dim.z; }
-    FUNC bool empty() const { return dim.x*dim.y*dim.z == 0; }
+    FUNC index_t cellCount() const { return (index_t)dim.x * dim.y * dim.z; }
+    FUNC bool empty() const { return dim.x == 0 || dim.y == 0 || dim.z == 0; }
     FUNC glm::ivec3 nodeDim() const { return dim + glm::ivec3(1,1,1); }
 
-    FUNC int nodeCount() const { return (dim.x+1)*(dim.y+1)*(dim.z+1); }
-    FUNC int index( int i, int j, int k ) const { return (i*(dim.y*dim.z) + j*(dim.z) + k); }
+    FUNC glm::ivec3 tileDim() const { return ( nodeDim() + glm::ivec3(NODE_TILE_SIZE-1) ) / NODE_TILE_SIZE; }
+
+    // Number of node slots to allocate, including any tile padding
+    FUNC index_t nodeCount() const
+    {
+#ifdef BLOCKED_NODES
+        glm::ivec3 tiles = tileDim();
+        return ( (index_t)tiles.x*tiles.y*tiles.z ) << ( 3*NODE_TILE_BITS );
+#else
+        return (index_t)(dim.x+1)*(dim.y+1)*(dim.z+1);
+#endif
+    }
+
+    FUNC static bool blockedNodes()
+    {
+#ifdef BLOCKED_NODES
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    FUNC index_t index( int i, int j, int k ) const { return ((index_t)i*dim.y + j)*dim.z + k; }
+
+    // Storage index of node ijk
+    FUNC index_t nodeIndex( int i, int j, int k ) const
+    {
+#ifdef BLOCKED_NODES
+        const int mask = NODE_TILE_SIZE-1;
+        glm::ivec3 tiles = tileDim();
+        index_t tile = ( (index_t)(i >> NODE_TILE_BITS)*tiles.y + (j >> NODE_TILE_BITS) )*tiles.z + (k >> NODE_TILE_BITS);
+        return ( tile << (3*NODE_TILE_BITS) ) | mortonEncode( i&mask, j&mask, k&mask );
+#else
+        return getGridIndex( i, j, k, nodeDim() );
+#endif
+    }
+
+    FUNC index_t nodeIndex( const glm::ivec3 &ijk ) const { return nodeIndex( ijk.x, ijk.y, ijk.z ); }
+
+    // Inverse of nodeIndex
+    FUNC glm::ivec3 nodeIJK( index_t index ) const
+    {
+        glm::ivec3 ijk;
+#ifdef BLOCKED_NODES
+        glm::ivec3 local;
+        gridIndexToIJK( index >> (3*NODE_TILE_BITS), tileDim(), ijk );
+        mortonDecode( (int)( index & ((1 << 3*NODE_TILE_BITS)-1) ), local.x, local.y, local.z );
+        ijk = ijk*NODE_TILE_SIZE + local;
+#else
+        gridIndexToIJK( index, nodeDim(), ijk );
+#endif
+        return ijk;
+    }
+
+    // Moves the low 10 bits of x to every third bit
+    FUNC static unsigned int spreadBits( unsigned int x )
+    {
+        x &= 0x000003ff;
+        x = ( x | (x << 16) ) & 0xff0000ff;
+        x = ( x | (x << 8) ) & 0x0300f00f;
+        x = ( x | (x << 4) ) & 0x030c30c3;
+        x = ( x | (x << 2) ) & 0x09249249;
+        return x;
+    }
+
+    // Inverse of spreadBits
+    FUNC static unsigned int compactBits( unsigned int x )
+    {
+        x &= 0x09249249;
+        x = ( x | (x >> 2) ) & 0x030c30c3;
+        x = ( x | (x >> 4) ) & 0x0300f00f;
+        x = ( x | (x >> 8) ) & 0xff0000ff;
+        x = ( x | (x >> 16) ) & 0x000003ff;
+        return x;
+    }
+
+    // Z-order code of ijk, k in the lowest bit. Components must be under 1024.
+    FUNC static int mortonEncode( int i, int j, int k )
+    {
+        return (int)( (spreadBits(i) << 2) | (spreadBits(j) << 1) | spreadBits(k) );
+    }
+
+    FUNC static void mortonDecode( int code, int &i, int &j, int &k )
+    {
+        i = (int)compactBits( code >> 2 );
+        j = (int)compactBits( code >> 1 );
+        k = (int)compactBits( code );
+    }
 
 #define INDEX2IJK( I, J, K, INDEX, NI, NJ, NK )     \
 {                                                   \
-    I = INDEX / (NJ*NK);                            \
-    INDEX = INDEX % (NJ*NK);                        \
+    I = INDEX / ((index_t)NJ*NK);                   \
+    INDEX = INDEX % ((index_t)NJ*NK);               \
     J = INDEX / NK;                                 \
     K = INDEX % NK;                                 \
 }
 
-    FUNC static void gridIndexToIJK( int idx, int &i, int &j, int &k, const glm::ivec3 &nodeDim )
+    FUNC static void gridIndexToIJK( index_t idx, int &i, int &j, int &k, const glm::ivec3 &nodeDim )
     {
         INDEX2IJK( i, j, k, idx, nodeDim.x, nodeDim.y, nodeDim.z );
     }
 
-    FUNC static void gridIndexToIJK( int idx, const glm::ivec3 &nodeDim, glm::ivec3 &ijk )
+    FUNC static void gridIndexToIJK( index_t idx, const glm::ivec3 &nodeDim, glm::ivec3 &ijk )
     {
         INDEX2IJK( ijk.x, ijk.y, ijk.z, idx, nodeDim.x, nodeDim.y, nodeDim.z );
     }
 
 #undef INDEX2IJK
 
-    FUNC static int getGridIndex( int i, int j, int k, const glm::ivec3 &nodeDim )
+    FUNC static index_t getGridIndex( int i, int j, int k, const glm::ivec3 &nodeDim )
     {
-        return (i*(nodeDim.y*nodeDim.z)+j*(nodeDim.z)+k);
+        return ((index_t)i*nodeDim.y + j)*nodeDim.z + k;
     }
 
-    FUNC static int getGridIndex( const glm::ivec3 &ijk, const glm::ivec3 &nodeDim )
+    FUNC static index_t getGridIndex( const glm::ivec3 &ijk, const glm::ivec3 &nodeDim )
     {
-        return (ijk.x*(nodeDim.y*nodeDim.z)+ijk.y*(nodeDim.z)+ijk.z);
+        return ((index_t)ijk.x*nodeDim.y + ijk.y)*nodeDim.z + ijk.z;
     }
 
     FUNC static bool withinBoundsInclusive( const float &v, const float &min, const float &max )
@@ -21,10 +21,17 @@
 #include "glm/gtx/rotate_vector.hpp"
 #include <glm/gtx/string_cast.hpp>
 
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
 #include <QElapsedTimer>
 #include <QLocale>
 
 #include "common/common.h"
+#include "common/threadpool.h"
 #include "cuda/functions.h"
 #include "geometry/bbox.h"
 #include "geometry/grid.h"
@@ -32,6 +39,9 @@
 #include "ui/uisettings.h"
 #include "ui/tools/tool.h"
 
+// Vertices or triangles per pool task
+#define MESH_GRAIN 4096
+
 Mesh::Mesh()
     : m_glVBO(0),
       m_color(0.4f, 0.4f, 0.4f, 1.f)
@@ -83,41 +93,70 @@ Mesh::~Mesh()
 void
 Mesh::computeNormals()
 {
-    Normal *triNormals = new Normal[getNumTris()];
-    float *triAreas = new float[getNumTris()];
-    QVector<int> *vertexMembership = new QVector<int>[getNumVertices()];
-    for ( int i = 0; i < getNumTris(); ++i ) {
-        // Compute triangle normal and area
-        const Tri &tri = m_tris[i];
-        const Vertex &v0 = m_vertices[tri[0]];
-        const Vertex &v1 = m_vertices[tri[1]];
-        const Vertex &v2 = m_vertices[tri[2]];
-        Normal n = vec3::cross(v1-v0, v2-v0);
-        triAreas[i] = vec3::length(n)/2.f;
-        triNormals[i] = 2.f*n/triAreas[i];
-        // Record triangle membership for each vertex
-        vertexMembership[tri[0]] += i;
-        vertexMembership[tri[1]] += i;
-        vertexMembership[tri[2]] += i;
+    ThreadPool &pool = ThreadPool::instance();
+    ScratchArena &scratch = ThreadPool::scratch();
+    ScratchScope scope( scratch );
+
+    Normal *triNormals = scratch.allocate<Normal>( getNumTris() );
+    float *triAreas = scratch.allocate<float>( getNumTris() );
+    const Tri *tris = m_tris.constData();
+    const Vertex *vertices = m_vertices.constData();
+    pool.parallelFor( 0, getNumTris(), MESH_GRAIN, [&]( index_t begin, index_t end ) {
+        for ( index_t i = begin; i < end; ++i ) {
+            // Compute triangle normal and area
+            const Tri &tri = tris[i];
+            const Vertex &v0 = vertices[tri[0]];
+            const Vertex &v1 = vertices[tri[1]];
+            const Vertex &v2 = vertices[tri[2]];
+            Normal n = vec3::cross(v1-v0, v2-v0);
+            triAreas[i] = vec3::length(n)/2.f;
+            triNormals[i] = 2.f*n/triAreas[i];
+        }
+    });
+
+    // Record triangle membership for each vertex, the lists of all vertices
+    // packed one after another: count, scan, then fill through the cursors
+    const int numVertices = getNumVertices();
+    std::atomic<index_t> *cursors = scratch.allocate<std::atomic<index_t> >( numVertices );
+    index_t *firsts = scratch.allocate<index_t>( numVertices+1 );
+    int *members = scratch.allocate<int>( 3*(index_t)getNumTris() );
+    pool.parallelFor( 0, numVertices, MESH_GRAIN, [&]( index_t begin, index_t end ) {
+        for ( index_t i = begin; i < end; ++i ) new ( &cursors[i] ) std::atomic<index_t>( 0 );
+    });
+    pool.parallelFor( 0, getNumTris(), MESH_GRAIN, [&]( index_t begin, index_t end ) {
+        for ( index_t i = begin; i < end; ++i ) {
+            for ( int c = 0; c < 3; ++c ) cursors[tris[i][c]].fetch_add( 1, std::memory_order_relaxed );
+        }
+    });
+    firsts[0] = 0;
+    for ( int i = 0; i < numVertices; ++i ) {
+        firsts[i+1] = firsts[i] + cursors[i].load( std::memory_order_relaxed );
+        cursors[i].store( firsts[i], std::memory_order_relaxed );
     }
+    pool.parallelFor( 0, getNumTris(), MESH_GRAIN, [&]( index_t begin, index_t end ) {
+        for ( index_t i = begin; i < end; ++i ) {
+            for ( int c = 0; c < 3; ++c ) members[cursors[tris[i][c]].fetch_add( 1, std::memory_order_relaxed )] = (int)i;
+        }
+    });
 
     m_normals.clear();
     m_normals.resize( getNumVertices() );
-    for ( int i = 0; i < getNumVertices(); ++i ) {
-        Normal normal = Normal( 0.f, 0.f, 0.f );
-        float sum = 0.f;
-        for ( int j = 0; j < vertexMembership[i].size(); ++j ) {
-            int index = vertexMembership[i][j];
-            normal += triAreas[index]*triNormals[index];
-            sum += triAreas[index];
+    Normal *normals = m_normals.data();
+    pool.parallelFor( 0, getNumVertices(), MESH_GRAIN, [&]( index_t begin, index_t end ) {
+        for ( index_t i = begin; i < end; ++i ) {
+            // Workers fill the lists in any order; sum in triangle order
+            std::sort( members + firsts[i], members + firsts[i+1] );
+            Normal normal = Normal( 0.f, 0.f, 0.f );
+            float sum = 0.f;
+            for ( index_t j = firsts[i]; j < firsts[i+1]; ++j ) {
+                int index = members[j];
+                normal += triAreas[index]*triNormals[index];
+                sum += triAreas[index];
+            }
+            normal /= sum;
+            normals[i] = normal;
         }
-        normal /= sum;
-        m_normals[i] = normal;
-    }
-
-    delete [] triNormals;
-    delete [] triAreas;
-    delete [] vertexMembership;
+    });
 }
 
 void
@@ -520,8 +559,11 @@ Mesh::fill( ParticleSystem &particles, int particleCount, float h, float targetD
 
     LOG( "Filling mesh in %d x %d x %d grid (%s voxels)...", grid.dim.x, grid.dim.y, grid.dim.z, STR(QLocale().toString(grid.dim.x*grid.dim.y*grid.dim.z)) );
 
+    // Deterministic mode fills from the scene's seed, so every run starts from the same particles
+    unsigned int seed = UiSettings::deterministic() ? UiSettings::seed() : time( NULL );
+
     particles.resize( particleCount );
-    fillMesh( &m_cudaVBO, getNumTris(), grid, particles.data(), particleCount, targetDensity,  materialPreset );
+    fillMesh( &m_cudaVBO, getNumTris(), grid, particles.data(), particleCount, targetDensity,  materialPreset, seed );
 
 #if 0
     fillMesh2(&m_cudaVBO, getNumTris(), grid, particles.data(), particleCount, targetDensity);
@@ -539,11 +581,19 @@ Mesh::fill( ParticleSystem &particles, int particleCount, float h, float targetD
 BBox
 Mesh::getBBox( const glm::mat4 &ctm )
 {
+    const Vertex *vertices = m_vertices.constData();
+    QVector<BBox> boxes( ThreadPool::chunkCount(getNumVertices(), MESH_GRAIN) );
+    ThreadPool::instance().parallelForChunks( getNumVertices(), MESH_GRAIN, [&]( index_t chunk, index_t begin, index_t end ) {
+        BBox box;
+        for ( index_t i = begin; i < end; ++i ) {
+            glm::vec4 point = ctm * glm::vec4( glm::vec3(vertices[i]), 1.f );
+            box += vec3( point.x, point.y, point.z );
+        }
+        boxes[chunk] = box;
+    });
     BBox box;
-    for ( int i = 0; i < getNumVertices(); ++i ) {
-        const Vertex &v = m_vertices[i];
-        glm::vec4 point = ctm * glm::vec4( glm::vec3(v), 1.f );
-        box += vec3( point.x, point.y, point.z );
+    for ( int i = 0; i < boxes.size(); ++i ) {
+        box += boxes[i];
     }
     return box;
 }
@@ -551,11 +601,20 @@ Mesh::getBBox( const glm::mat4 &ctm )
 vec3
 Mesh::getCentroid( const glm::mat4 &ctm )
 {
+    // Chunk sums added in order, so the result doesn't depend on scheduling
+    const Vertex *vertices = m_vertices.constData();
+    QVector<vec3> sums( ThreadPool::chunkCount(getNumVertices(), MESH_GRAIN) );
+    ThreadPool::instance().parallelForChunks( getNumVertices(), MESH_GRAIN, [&]( index_t chunk, index_t begin, index_t end ) {
+        vec3 c(0,0,0);
+        for ( index_t i = begin; i < end; ++i ) {
+            glm::vec4 point = ctm * glm::vec4( glm::vec3(vertices[i]), 1.f );
+            c += vec3( point.x, point.y, point.z );
+        }
+        sums[chunk] = c;
+    });
     vec3 c(0,0,0);
-    for ( int i = 0; i < getNumVertices(); ++i ) {
-        const Vertex &v = m_vertices[i];
-        glm::vec4 point = ctm * glm::vec4( glm::vec3(v), 1.f );
-        c += vec3( point.x, point.y, point.z );
+    for ( int i = 0; i < sums.size(); ++i ) {
+        c += sums[i];
     }
     return c / (float)getNumVertices();
 }
@@ -573,11 +632,13 @@ Mesh::getObjectBBox() const
 void
 Mesh::applyTransformation( const glm::mat4 &transform )
 {
-    for ( int i = 0; i < getNumVertices(); ++i ) {
-        const Vertex &v = m_vertices[i];
-        glm::vec4 point = transform * glm::vec4( glm::vec3(v), 1.f );
-        m_vertices[i] = vec3( point.x, point.y, point.z );
-    }
+    Vertex *vertices = m_vertices.data();
+    ThreadPool::instance().parallelFor( 0, getNumVertices(), MESH_GRAIN, [&]( index_t begin, index_t end ) {
+        for ( index_t i = begin; i < end; ++i ) {
+            glm::vec4 point = transform * glm::vec4( glm::vec3(vertices[i]), 1.f );
+            vertices[i] = vec3( point.x, point.y, point.z );
+        }
+    });
     computeNormals();
     deleteVBO();
 }
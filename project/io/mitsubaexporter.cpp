@@ -21,10 +21,16 @@
 #include "math.h"
 #include <fstream>
 #include <iomanip>
+#include <vector>
 #include "common/common.h"
+#include "common/hostmemory.h"
+#include "common/threadpool.h"
 #include <stdio.h>
 #include "ui/uisettings.h"
 
+// Nodes per pool task
+#define EXPORT_GRAIN 65536
+
 MitsubaExporter::MitsubaExporter()
 {
     m_fps = 24.f;
@@ -53,7 +59,7 @@ void MitsubaExporter::init()
 
 MitsubaExporter::~MitsubaExporter()
 {
-    SAFE_DELETE_ARRAY(m_nodes);
+    freeHostArray(m_nodes, m_grid.nodeCount()*sizeof(ExportNode));
 }
 
 float MitsubaExporter::getspf() {return m_spf;}
@@ -61,9 +67,24 @@ float MitsubaExporter::getLastUpdateTime() {return m_lastUpdateTime;}
 
 void MitsubaExporter::reset(Grid grid)
 {
-    SAFE_DELETE_ARRAY(m_nodes);
+    if (m_busy)
+        m_future.waitForFinished();
+    freeHostArray(m_nodes, m_grid.nodeCount()*sizeof(ExportNode));
     m_grid = grid;
-    m_nodes = new Node[m_grid.nodeCount()];
+    m_nodes = (ExportNode*) allocateHostArray(m_grid.nodeCount()*sizeof(ExportNode), (HugePages)UiSettings::hugePages());
+    // Place each worker's share of the nodes on its own socket before the
+    // device copy, which would otherwise put them all on the caller's
+    if (UiSettings::numaAware())
+        firstTouchHostArray(m_nodes, m_grid.nodeCount(), sizeof(ExportNode));
+}
+
+void MitsubaExporter::forEachNodeRange(const std::function<void(index_t, index_t)> &body)
+{
+    // With NUMA placement, every worker converts the nodes it first touched
+    if (UiSettings::numaAware())
+        ThreadPool::instance().parallelForStatic(0, m_grid.nodeCount(), body);
+    else
+        ThreadPool::instance().parallelFor(0, m_grid.nodeCount(), EXPORT_GRAIN, body);
 }
 
 void MitsubaExporter::runExportThread(float t)
@@ -76,11 +97,10 @@ void MitsubaExporter::runExportThread(float t)
 void MitsubaExporter::exportScene(float t)
 {
     m_busy = true;
-    // do work here
-    if (UiSettings::exportDensity())
-        exportDensityData(t);
-    if (UiSettings::exportVelocity())
-        exportVelocityData(t);
+    // do work here; the two volumes are written side by side on the pool
+    ThreadPool::instance().parallelInvoke(
+        [this, t]() { if (UiSettings::exportDensity()) exportDensityData(t); },
+        [this, t]() { if (UiSettings::exportVelocity()) exportVelocityData(t); } );
     // colliders are written to the scenefile from SceneIO because they only write once
     m_lastUpdateTime = t;
     m_frame += 1;
@@ -141,20 +161,18 @@ void MitsubaExporter::exportDensityData(float t)
     yres = m_grid.nodeDim().y;
     zres = m_grid.nodeDim().z;
 
-    float h = m_grid.h;
-    float v = h*h*h;
-
-    for ( int k = 0; k < zres; ++k ) {
-        for ( int j = 0; j < yres; ++j ) {
-            for ( int i = 0; i < xres; ++i ) {
-                int gIndex = (i*yres + j)*zres + k;
-                float density = m_nodes[gIndex].mass / v;
-                density *= 10000;                    // TODO, fix this when we have more particles.
-                density = std::min(1.f,density);
-                os.write((char *) &density, sizeof(float));
-            }
+    // Fill the volume in node storage order, then write it at once
+    std::vector<float> data( (size_t)xres*yres*zres );
+    forEachNodeRange( [&]( index_t begin, index_t end ) {
+        for ( index_t gIndex = begin; gIndex < end; ++gIndex ) {
+            glm::ivec3 ijk = m_grid.nodeIJK( gIndex );
+            if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), m_grid.dim) ) continue;
+            float density = halfToFloat( m_nodes[gIndex].density );
+            density *= 10000;                    // TODO, fix this when we have more particles.
+            data[((size_t)ijk.z*yres + ijk.y)*xres + ijk.x] = std::min(1.f,density);
         }
-    }
+    });
+    os.write((char *) data.data(), data.size()*sizeof(float));
     os.close();
 }
 
@@ -170,25 +188,24 @@ void MitsubaExporter::exportVelocityData(float t)
     yres = m_grid.nodeDim().y;
     zres = m_grid.nodeDim().z;
 
-    float h = m_grid.h;
-    float v = h*h*h;
-
-    for ( int k = 0; k < zres; ++k ) {
-        for ( int j = 0; j < yres; ++j ) {
-            for ( int i = 0; i < xres; ++i ) {
-                int gIndex = (i*yres + j)*zres + k;
-                vec3 velocity = vec3::min(vec3(1), vec3::abs(m_nodes[gIndex].velocity));
-                for (int c=0; c < 3; ++c) // RGB color channels
-                {
-                    os.write((char *) &velocity[c], sizeof(float));
-                }
+    std::vector<float> data( (size_t)3*xres*yres*zres );
+    forEachNodeRange( [&]( index_t begin, index_t end ) {
+        for ( index_t gIndex = begin; gIndex < end; ++gIndex ) {
+            glm::ivec3 ijk = m_grid.nodeIJK( gIndex );
+            if ( !Grid::withinBoundsInclusive(ijk, glm::ivec3(0,0,0), m_grid.dim) ) continue;
+            vec3 velocity = vec3::min(vec3(1), vec3::abs(vec3(m_nodes[gIndex].velocity)));
+            float *voxel = &data[3*(((size_t)ijk.z*yres + ijk.y)*xres + ijk.x)];
+            for (int c=0; c < 3; ++c) // RGB color channels
+            {
+                voxel[c] = velocity[c];
             }
         }
-    }
+    });
+    os.write((char *) data.data(), data.size()*sizeof(float));
     os.close();
 }
 
-Node * MitsubaExporter::getNodesPtr()
+ExportNode * MitsubaExporter::getNodesPtr()
 {
     return m_nodes;
 }
@@ -11,6 +11,7 @@
 #ifndef MITSUBAEXPORTER_H
 #define MITSUBAEXPORTER_H
 
+#include <functional>
 #include <QString>
 #include <QtXml>
 //#include <QtConcurrentRun>
@@ -38,7 +39,7 @@ public:
     float getspf();
     float getLastUpdateTime();
     void reset(Grid grid);
-    Node * getNodesPtr();
+    ExportNode * getNodesPtr();
     void runExportThread(float t);
     void exportScene(float t);
 
@@ -54,6 +55,9 @@ private:
     void exportVelocityData(float t);
     void init();
 
+    // Runs body over node index ranges on the thread pool
+    void forEachNodeRange(const std::function<void(index_t, index_t)> &body);
+
     void writeVOLHeader(std::ofstream &os, const int channels);
 
     // file format prefix this is written to, i.e. m_fileprefix = /home/evjang/teapot
@@ -63,7 +67,7 @@ private:
     float m_lastUpdateTime;
     int m_fps; // number of frames to export every second of simulation
     float m_spf; // seconds per frame
-    Node * m_nodes;
+    ExportNode * m_nodes; // filled by packExportNodes, see allocateHostArray
     Grid m_grid;
     int m_frame;
     bool m_busy;
@@ -8,13 +8,131 @@
 **
 **************************************************************************/
 
+#include <math.h>
+#include <string.h>
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QSaveFile>
 #include <QString>
-#include <QStringList>
-#include <QRegExp>
 
 #include "objparser.h"
 
 #include "common/common.h"
+#include "common/threadpool.h"
+
+// Files smaller than this per thread are parsed in fewer chunks
+#define MIN_CHUNK_SIZE (1 << 20)
+
+// Bump whenever the cache layout changes
+#define CACHE_MAGIC "SNOWMSH1"
+
+static const double POW10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+static inline bool
+isSpace( char c )
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline const char*
+skipSpace( const char *c, const char *end )
+{
+    while ( c < end && isSpace(*c) ) ++c;
+    return c;
+}
+
+static inline const char*
+skipToken( const char *c, const char *end )
+{
+    while ( c < end && !isSpace(*c) ) ++c;
+    return c;
+}
+
+static inline bool
+parseInt( const char *&c, const char *end, int &value )
+{
+    c = skipSpace( c, end );
+    bool negative = ( c < end && *c == '-' );
+    if ( c < end && (*c == '-' || *c == '+') ) ++c;
+    const char *digits = c;
+    value = 0;
+    while ( c < end && *c >= '0' && *c <= '9' ) value = 10*value + (*c++ - '0');
+    if ( negative ) value = -value;
+    return c > digits;
+}
+
+// Decimal floats with optional exponent. Digits past the 19th are dropped,
+// which is far below float precision.
+static inline bool
+parseFloat( const char *&c, const char *end, float &value )
+{
+    c = skipSpace( c, end );
+    bool negative = ( c < end && *c == '-' );
+    if ( c < end && (*c == '-' || *c == '+') ) ++c;
+
+    unsigned long long mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for ( ; c < end && *c >= '0' && *c <= '9'; ++c, any = true ) {
+        if ( digits < 19 ) {
+            mantissa = 10*mantissa + (*c - '0');
+            digits += ( mantissa > 0 );
+        } else {
+            exponent++;
+        }
+    }
+    if ( c < end && *c == '.' ) {
+        for ( ++c; c < end && *c >= '0' && *c <= '9'; ++c, any = true ) {
+            if ( digits < 19 ) {
+                mantissa = 10*mantissa + (*c - '0');
+                digits += ( mantissa > 0 );
+                exponent--;
+            }
+        }
+    }
+    if ( !any ) return false;
+
+    if ( c < end && (*c == 'e' || *c == 'E') ) {
+        int e;
+        ++c;
+        if ( !parseInt(c, end, e) ) return false;
+        exponent += e;
+    }
+
+    double result = (double)mantissa;
+    if ( exponent < 0 ) {
+        result = ( exponent >= -22 ) ? result / POW10[-exponent] : result * pow( 10.0, exponent );
+    } else if ( exponent > 0 ) {
+        result = ( exponent <= 22 ) ? result * POW10[exponent] : result * pow( 10.0, exponent );
+    }
+    value = (float)( negative ? -result : result );
+    return true;
+}
+
+template<typename T>
+static void
+writeArray( QSaveFile &file, const T *data, qint32 count )
+{
+    file.write( (const char*)&count, sizeof(count) );
+    file.write( (const char*)data, count*sizeof(T) );
+}
+
+template<typename T>
+static bool
+readArray( const char *&c, const char *end, QVector<T> &array )
+{
+    qint32 count;
+    if ( end-c < (qint64)sizeof(count) ) return false;
+    memcpy( &count, c, sizeof(count) );
+    c += sizeof(count);
+    if ( count < 0 || end-c < count*(qint64)sizeof(T) ) return false;
+    array.resize( count );
+    memcpy( array.data(), c, count*sizeof(T) );
+    c += count*sizeof(T);
+    return true;
+}
 
 void
 OBJParser::load( const QString &filename, QList<Mesh *> &meshes )
@@ -57,22 +175,58 @@ OBJParser::load()
         return false;
     }
 
+    if ( loadCache() ) {
+        return true;
+    }
+
     if ( !m_file.exists() || !m_file.open(QFile::ReadOnly) ) {
         LOG( "OBJParser: Unable to open file %s.", STR(m_file.fileName()) );
         return false;
     }
 
-    QString text = QString(m_file.readAll());
-    m_file.close();
+    qint64 size = m_file.size();
+    const char *data = ( size > 0 ) ? (const char*)m_file.map( 0, size ) : NULL;
+    if ( size > 0 && !data ) {
+        LOG( "OBJParser: Unable to map file %s.", STR(m_file.fileName()) );
+        m_file.close();
+        return false;
+    }
 
-    QStringList lines = text.split( QRegExp("[\r\n]"), QString::SkipEmptyParts );
-    int lineIndex = 0;
-    while ( lineIndex < lines.size() ) {
-        if ( !parse(lines, lineIndex) ) {
-            return false;
+    // Split at line boundaries, one chunk per thread of the pool
+    ThreadPool &pool = ThreadPool::instance();
+    int chunkCount = MAX( 1, (int)MIN((qint64)pool.workerCount()+1, size/MIN_CHUNK_SIZE) );
+    QVector<Chunk> chunks( chunkCount );
+    const char *begin = data, *end = data + size;
+    for ( int i = 0; i < chunkCount; ++i ) {
+        const char *split = ( i == chunkCount-1 ) ? end : MAX( begin, data + size*(i+1)/chunkCount );
+        if ( split < end ) {
+            const char *newline = (const char*)memchr( split, '\n', end-split );
+            split = newline ? newline+1 : end;
         }
+        chunks[i].begin = begin;
+        chunks[i].end = split;
+        begin = split;
     }
 
+    pool.parallelFor( 0, chunkCount, 1, [&]( index_t first, index_t last ) {
+        for ( index_t i = first; i < last; ++i ) parseChunk( chunks[(int)i] );
+    });
+
+    bool ok = true;
+    for ( int i = 0; i < chunkCount && ok; ++i ) {
+        if ( chunks[i].errorKind ) {
+            LOG( "Error parsing %s: %s", chunks[i].errorKind, chunks[i].errorLine.constData() );
+            ok = false;
+        } else {
+            addChunk( chunks[i] );
+        }
+    }
+
+    if ( data ) m_file.unmap( (uchar*)data );
+    m_file.close();
+
+    if ( !ok ) return false;
+
     if ( meshPending() ) addMesh();
 
     for ( QQueue<Mesh*>::iterator it = m_meshes.begin(); it != m_meshes.end(); ++it ) {
@@ -81,91 +235,213 @@ OBJParser::load()
         }
     }
 
+    saveCache();
+
     return true;
 
 }
 
-bool
-OBJParser::parse( const QStringList &lines,
-                  int &lineIndex )
-{
-    const QString &line = lines[lineIndex++];
-    switch ( line[0].toLatin1() ) {
-    case '#':
-        break;
-    case 'g': case 'o':
-        if ( !parseName(line) ) {
-            LOG( "Error parsing name: %s", STR(line) );
-            return false;
-        }
-        break;
-    case 'v':
-        switch ( line[1].toLatin1() ) {
-        case ' ': case'\t':
-            if ( !parseVertex(line) ) {
-                LOG( "Error parsing vertex: %s", STR(line) );
-                return false;
+void
+OBJParser::extendRun( Chunk &chunk, Mode mode )
+{
+    if ( chunk.segments.empty() || chunk.segments.last().mode != mode ) {
+        Segment segment;
+        segment.mode = mode;
+        segment.begin = segment.end = ( mode == VERTEX ) ? chunk.vertices.size() : chunk.tris.size();
+        chunk.segments += segment;
+    }
+}
+
+// Runs on a worker thread, so it only touches the chunk
+void
+OBJParser::parseChunk( Chunk &chunk )
+{
+    chunk.errorKind = NULL;
+
+    const char *line = chunk.begin;
+    while ( line < chunk.end && !chunk.errorKind ) {
+
+        const char *lineEnd = (const char*)memchr( line, '\n', chunk.end-line );
+        if ( !lineEnd ) lineEnd = chunk.end;
+        const char *next = ( lineEnd < chunk.end ) ? lineEnd+1 : chunk.end;
+        if ( lineEnd > line && lineEnd[-1] == '\r' ) --lineEnd;
+
+        if ( lineEnd > line ) {
+            switch ( line[0] ) {
+            case 'g': case 'o': {
+                const char *name = skipSpace( skipToken(line, lineEnd), lineEnd );
+                Segment segment;
+                segment.mode = GROUP;
+                segment.begin = segment.end = 0;
+                segment.name = ( name < lineEnd ) ? QString::fromUtf8( name, skipToken(name, lineEnd)-name ) : QString( "default" );
+                chunk.segments += segment;
+                break;
+            }
+            case 'v':
+                if ( lineEnd-line > 1 && (line[1] == ' ' || line[1] == '\t') ) {
+                    const char *c = line + 1;
+                    Vertex v;
+                    if ( parseFloat(c, lineEnd, v.x) && parseFloat(c, lineEnd, v.y) && parseFloat(c, lineEnd, v.z) ) {
+                        extendRun( chunk, VERTEX );
+                        chunk.vertices += v;
+                        chunk.segments.last().end = chunk.vertices.size();
+                    } else {
+                        chunk.errorKind = "vertex";
+                    }
+                }
+                break;
+            case 'f': {
+                // Break into triangles if necessary, keeping only the vertex indices
+                extendRun( chunk, FACE );
+                const char *c = skipToken( line, lineEnd );
+                int corners = 0, first = 0, previous = 0, index;
+                while ( (c = skipSpace(c, lineEnd)) < lineEnd ) {
+                    if ( !parseInt(c, lineEnd, index) || index == 0 ) {
+                        chunk.errorKind = "face";
+                        break;
+                    }
+                    c = skipToken( c, lineEnd );
+                    if ( index > 0 ) index--; // Note: OBJ indices start at 1
+                    if ( corners == 0 ) first = index;
+                    else if ( corners >= 2 ) chunk.tris += Mesh::Tri( first, previous, index );
+                    previous = index;
+                    corners++;
+                }
+                chunk.segments.last().end = chunk.tris.size();
+                break;
             }
+            default:
+                break;
+            }
+        }
+
+        if ( chunk.errorKind ) chunk.errorLine = QByteArray( line, lineEnd-line );
+        line = next;
+    }
+}
+
+// Replays a parsed chunk in file order
+void
+OBJParser::addChunk( const Chunk &chunk )
+{
+    for ( int i = 0; i < chunk.segments.size(); ++i ) {
+        const Segment &segment = chunk.segments[i];
+        int count = segment.end - segment.begin;
+        setMode( segment.mode );
+        switch ( segment.mode ) {
+        case GROUP:
+            m_currentName = segment.name;
+            break;
+        case VERTEX: {
+            int offset = m_vertexPool.size();
+            m_vertexPool.resize( offset + count );
+            memcpy( m_vertexPool.data() + offset, chunk.vertices.constData() + segment.begin, count*sizeof(Vertex) );
             break;
-        default:
+        }
+        case FACE: {
+            int vertexCount = m_vertexPool.size();
+            m_triPool.reserve( m_triPool.size() + count );
+            for ( int j = segment.begin; j < segment.end; ++j ) {
+                Mesh::Tri tri = chunk.tris[j];
+                for ( int k = 0; k < 3; ++k ) {
+                    if ( tri[k] < 0 ) tri[k] += vertexCount;
+                }
+                m_triPool += tri;
+            }
             break;
         }
-        break;
-    case 'f':
-        if ( !parseFace(line) ) {
-            LOG( "Error parsing face: %s", STR(line) );
-            return false;
         }
-        break;
-    default:
-        break;
     }
+}
 
-    return true;
+QString
+OBJParser::cacheFileName() const
+{
+    return m_file.fileName() + ".meshcache";
 }
 
 bool
-OBJParser::parseName( const QString &line )
+OBJParser::loadCache()
 {
-    setMode( GROUP );
-    const static QRegExp regExp( "[\\s+\n\r]" );
-    QStringList lineStrs = line.split( regExp, QString::SkipEmptyParts );
-    m_currentName = ( lineStrs.size() > 1 ) ? lineStrs[1] : "default";
+    QFileInfo source( m_file.fileName() );
+    QFile file( cacheFileName() );
+    if ( !source.exists() || !file.exists() || !file.open(QFile::ReadOnly) ) {
+        return false;
+    }
+
+    qint64 size = file.size();
+    const char *data = ( size > 0 ) ? (const char*)file.map( 0, size ) : NULL;
+    const char *c = data, *end = data + size;
+
+    qint64 stamp[2];
+    qint32 count = 0;
+    bool ok = data && size >= (qint64)( 8 + sizeof(stamp) + sizeof(count) ) && !memcmp( c, CACHE_MAGIC, 8 );
+    if ( ok ) {
+        memcpy( stamp, c+8, sizeof(stamp) );
+        memcpy( &count, c+8+sizeof(stamp), sizeof(count) );
+        c += 8 + sizeof(stamp) + sizeof(count);
+        ok = stamp[0] == source.size() && stamp[1] == source.lastModified().toMSecsSinceEpoch();
+    }
+
+    QList<Mesh*> meshes;
+    for ( int i = 0; ok && i < count; ++i ) {
+        QVector<char> name;
+        QVector<Vertex> vertices;
+        QVector<Mesh::Tri> tris;
+        QVector<Normal> normals;
+        ok = readArray( c, end, name ) && readArray( c, end, vertices ) && readArray( c, end, tris ) && readArray( c, end, normals );
+        if ( ok ) {
+            Mesh *mesh = new Mesh;
+            mesh->setName( QString::fromUtf8(name.constData(), name.size()) );
+            mesh->setFilename( m_file.fileName() );
+            mesh->setVertices( vertices );
+            mesh->setTris( tris );
+            mesh->setNormals( normals );
+            meshes += mesh;
+        }
+    }
+
+    if ( data ) file.unmap( (uchar*)data );
+    file.close();
+
+    if ( !ok ) {
+        qDeleteAll( meshes );
+        return false;
+    }
+
+    LOG( "OBJParser: loaded %d meshes from %s", meshes.size(), STR(file.fileName()) );
+    m_meshes += meshes;
     return true;
 }
 
 bool
-OBJParser::parseVertex( const QString &line )
+OBJParser::saveCache() const
 {
-    setMode( VERTEX );
-    const static QRegExp regExp( "[\\s+v]" );
-    QStringList vertexStrs = line.split( regExp, QString::SkipEmptyParts );
-    bool ok[3];
-    m_vertexPool += Vertex(vertexStrs[0].toFloat(&ok[0]), vertexStrs[1].toFloat(&ok[1]), vertexStrs[2].toFloat(&ok[2]));
-    return ok[0] && ok[1] && ok[2];
-}
+    QFileInfo source( m_file.fileName() );
+    QSaveFile file( cacheFileName() );
+    if ( !file.open(QFile::WriteOnly) ) {
+        LOG( "OBJParser: Unable to write mesh cache %s.", STR(file.fileName()) );
+        return false;
+    }
 
+    qint64 stamp[2] = { source.size(), source.lastModified().toMSecsSinceEpoch() };
+    qint32 count = m_meshes.size();
+    file.write( CACHE_MAGIC, 8 );
+    file.write( (const char*)stamp, sizeof(stamp) );
+    file.write( (const char*)&count, sizeof(count) );
+    for ( QQueue<Mesh*>::const_iterator it = m_meshes.begin(); it != m_meshes.end(); ++it ) {
+        const Mesh *mesh = *it;
+        QByteArray name = mesh->getName().toUtf8();
+        writeArray( file, name.constData(), name.size() );
+        writeArray( file, mesh->getVertices().constData(), mesh->getNumVertices() );
+        writeArray( file, mesh->getTris().constData(), mesh->getNumTris() );
+        writeArray( file, mesh->getNormals().constData(), mesh->getNumNormals() );
+    }
 
-// Parse face and break into triangles if necessary
-bool
-OBJParser::parseFace( const QString &line )
-{
-    setMode( FACE );
-    const static QRegExp regExp( "[-\\s+f]" );
-    QStringList faceStrs = line.split( regExp, QString::SkipEmptyParts );
-    int nCorners = faceStrs.size();
-    int *indices = new int[nCorners];
-    for ( int i = 0; i < nCorners; ++i ) {
-        const static QRegExp regExp2( "[/]" );
-        QStringList cornerStrs = faceStrs[i].split( regExp2, QString::KeepEmptyParts );
-        bool ok;
-        indices[i] = cornerStrs[0].toInt(&ok)-1; // Note: OBJ indices start at 1
-        if ( !ok ) return false;
-    }
-    int nTris = nCorners - 2;
-    for ( int i = 0; i < nTris; ++i )
-        m_triPool += Mesh::Tri(indices[0], indices[i+1], indices[i+2]);
-    delete [] indices;
+    if ( !file.commit() ) {
+        LOG( "OBJParser: Unable to write mesh cache %s.", STR(file.fileName()) );
+        return false;
+    }
     return true;
 }
 
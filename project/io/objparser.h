@@ -11,6 +11,17 @@
 #ifndef OBJPARSER_H
 #define OBJPARSER_H
 
+/**
+ * @brief OBJ reader and writer.
+ *
+ * The file is memory-mapped and split into chunks at line boundaries, which
+ * are tokenized in parallel without allocating per line. The chunks are then
+ * stitched together in file order. Loaded meshes, with their normals, are
+ * cached in a binary file next to the OBJ (<file>.meshcache), which is used
+ * instead of the OBJ while its size and modification time still match.
+ */
+
+#include <QByteArray>
 #include <QFile>
 #include <QString>
 #include <QQueue>
@@ -46,6 +57,26 @@ private:
 
     enum Mode { VERTEX, FACE, GROUP };
 
+    // A run of consecutive lines of one kind within a chunk
+    struct Segment
+    {
+        Mode mode;
+        int begin, end; // range in the chunk's vertices or tris
+        QString name; // GROUP only
+    };
+
+    // A piece of the file, parsed independently of the others
+    struct Chunk
+    {
+        const char *begin;
+        const char *end;
+        QVector<Vertex> vertices;
+        QVector<Mesh::Tri> tris; // negative corners are relative to the vertex count
+        QVector<Segment> segments;
+        const char *errorKind;
+        QByteArray errorLine;
+    };
+
     Mode m_mode;
 
     QFile m_file;
@@ -62,10 +93,13 @@ private:
 
     void setMode( Mode mode );
 
-    bool parse( const QStringList &lines, int &lineIndex );
-    bool parseName( const QString &line );
-    bool parseVertex( const QString &line );
-    bool parseFace( const QString &line );
+    static void parseChunk( Chunk &chunk );
+    static void extendRun( Chunk &chunk, Mode mode );
+    void addChunk( const Chunk &chunk );
+
+    QString cacheFileName() const;
+    bool loadCache();
+    bool saveCache() const;
 
     QString write( Mesh *mesh ) const;
 
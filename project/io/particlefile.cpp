@@ -0,0 +1,94 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   particlefile.cpp
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#include "io/particlefile.h"
+
+#include <algorithm>
+
+#include <QVector>
+
+#include "common/hostmemory.h"
+#include "common/math.h"
+#include "common/threadpool.h"
+#include "sim/particle.h"
+
+// The counting sort counts particles per bucket of consecutive cells, with at
+// most this many buckets however many cells the grid has
+#define MAX_BUCKETS (1 << 20)
+#define BUCKET_GRAIN 64
+
+static index_t
+cellOf( const Particle &particle, const Grid &grid )
+{
+    vec3 gridPos = ( particle.position - grid.pos ) / grid.h;
+    int i = CLAMP( (int)floorf(gridPos.x), 0, grid.dim.x-1 );
+    int j = CLAMP( (int)floorf(gridPos.y), 0, grid.dim.y-1 );
+    int k = CLAMP( (int)floorf(gridPos.z), 0, grid.dim.z-1 );
+    return Grid::getGridIndex( i, j, k, grid.dim );
+}
+
+ParticleFile::ParticleFile()
+    : m_particles(NULL), m_count(0)
+{
+}
+
+ParticleFile::~ParticleFile()
+{
+    close();
+}
+
+bool
+ParticleFile::create( const QString &path, const Particle *particles, index_t count, const Grid &grid )
+{
+    close();
+
+    Particle *mapped = (Particle*) mapHostFile( STR(path), count*sizeof(Particle) );
+    if ( !mapped ) return false;
+
+    // Counting sort by bucket: one pass to size each bucket, one to scatter,
+    // both streaming through the input. Then, if a bucket spans several cells,
+    // each bucket is sorted by cell on the thread pool. Stable throughout, so
+    // particles keep their order within a cell.
+    const index_t lastCell = grid.cellCount() - 1;
+    int shift = 0;
+    while ( (lastCell >> shift) >= MAX_BUCKETS ) ++shift;
+    const int bucketCount = (int)( lastCell >> shift ) + 1;
+    QVector<index_t> next( bucketCount+1, 0 );
+    for ( index_t i = 0; i < count; ++i ) {
+        ++next[( cellOf(particles[i], grid) >> shift ) + 1];
+    }
+    for ( int bucket = 1; bucket < next.size(); ++bucket ) {
+        next[bucket] += next[bucket-1];
+    }
+    const QVector<index_t> starts = next;
+    for ( index_t i = 0; i < count; ++i ) {
+        mapped[next[cellOf(particles[i], grid) >> shift]++] = particles[i];
+    }
+    if ( shift > 0 ) {
+        ThreadPool::instance().parallelFor( 0, bucketCount, BUCKET_GRAIN, [&]( index_t begin, index_t end ) {
+            for ( index_t bucket = begin; bucket < end; ++bucket ) {
+                std::stable_sort( mapped + starts[bucket], mapped + starts[bucket+1], [&grid]( const Particle &a, const Particle &b ) {
+                    return cellOf( a, grid ) < cellOf( b, grid );
+                });
+            }
+        });
+    }
+
+    m_particles = mapped;
+    m_count = count;
+    return true;
+}
+
+void
+ParticleFile::close()
+{
+    unmapHostFile( m_particles, m_count*sizeof(Particle) );
+    m_particles = NULL;
+    m_count = 0;
+}
@@ -0,0 +1,54 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   particlefile.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef PARTICLEFILE_H
+#define PARTICLEFILE_H
+
+/**
+ * Particles kept in a memory-mapped file instead of RAM, for runs with more of
+ * them than host memory holds (see updateStreamedParticles). They are stored
+ * sorted by grid cell in node index order, so consecutive particles are close
+ * in space and each chunk streamed to the device only touches a slab of the
+ * grid.
+ */
+
+#include <QString>
+
+#include "common/common.h"
+#include "geometry/grid.h"
+
+struct Particle;
+
+class ParticleFile
+{
+
+public:
+
+    ParticleFile();
+    ~ParticleFile();
+
+    // Writes the particles to path, sorted by their cells in grid, and maps
+    // the file. The input is read twice, front to back, so it may itself be a
+    // mapped file. Particles outside the grid go with the nearest cell.
+    bool create( const QString &path, const Particle *particles, index_t count, const Grid &grid );
+
+    // Unmaps the file, which stays on disk
+    void close();
+
+    Particle* data() { return m_particles; }
+    index_t size() const { return m_count; }
+
+private:
+
+    Particle *m_particles;
+    index_t m_count;
+
+};
+
+#endif // PARTICLEFILE_H
@@ -89,6 +89,75 @@ void SceneIO::applySimulationParameters()
             if (ok)
                 UiSettings::timeStep() = ts;
         }
+        else if (n.attribute("name").compare("profile") == 0)
+        {
+            UiSettings::profileSimulation() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("deterministic") == 0)
+        {
+            UiSettings::deterministic() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("seed") == 0)
+        {
+            UiSettings::seed() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("preconditioner") == 0)
+        {
+            UiSettings::preconditioner() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("solverTolerance") == 0)
+        {
+            bool ok;
+            float tolerance = n.attribute("value").toFloat(&ok);
+            if (ok)
+                UiSettings::solverTolerance() = tolerance;
+        }
+        else if (n.attribute("name").compare("implicitOperator") == 0)
+        {
+            UiSettings::implicitOperator() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("tiledG2P") == 0)
+        {
+            UiSettings::tiledG2P() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("numaAware") == 0)
+        {
+            UiSettings::numaAware() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("hugePages") == 0)
+        {
+            UiSettings::hugePages() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("autoDomain") == 0)
+        {
+            UiSettings::autoDomain() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("multiDomain") == 0)
+        {
+            UiSettings::multiDomain() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("sleepSteps") == 0)
+        {
+            UiSettings::sleepSteps() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("outOfCore") == 0)
+        {
+            UiSettings::outOfCore() = n.attribute("value").toInt();
+        }
+        else if (n.attribute("name").compare("sleepSpeed") == 0)
+        {
+            bool ok;
+            float speed = n.attribute("value").toFloat(&ok);
+            if (ok)
+                UiSettings::sleepSpeed() = speed;
+        }
+        else if (n.attribute("name").compare("sleepStrainRate") == 0)
+        {
+            bool ok;
+            float strainRate = n.attribute("value").toFloat(&ok);
+            if (ok)
+                UiSettings::sleepStrainRate() = strainRate;
+        }
     }
 }
 
@@ -331,6 +400,21 @@ void SceneIO::appendSimulationParameters(QDomElement root, float timeStep)
 {
     QDomElement spNode = m_document.createElement("SimulationParameters");
     appendFloat(spNode, "timeStep", timeStep);
+    appendInt(spNode, "profile", UiSettings::profileSimulation());
+    appendInt(spNode, "deterministic", UiSettings::deterministic());
+    appendInt(spNode, "seed", UiSettings::seed());
+    appendInt(spNode, "preconditioner", UiSettings::preconditioner());
+    appendFloat(spNode, "solverTolerance", UiSettings::solverTolerance());
+    appendInt(spNode, "implicitOperator", UiSettings::implicitOperator());
+    appendInt(spNode, "tiledG2P", UiSettings::tiledG2P());
+    appendInt(spNode, "numaAware", UiSettings::numaAware());
+    appendInt(spNode, "hugePages", UiSettings::hugePages());
+    appendInt(spNode, "autoDomain", UiSettings::autoDomain());
+    appendInt(spNode, "multiDomain", UiSettings::multiDomain());
+    appendInt(spNode, "sleepSteps", UiSettings::sleepSteps());
+    appendFloat(spNode, "sleepSpeed", UiSettings::sleepSpeed());
+    appendFloat(spNode, "sleepStrainRate", UiSettings::sleepStrainRate());
+    appendInt(spNode, "outOfCore", UiSettings::outOfCore());
     root.appendChild(spNode);
 }
 
@@ -9,29 +9,77 @@
 **************************************************************************/
 
 #include <QApplication>
+#include "common/communicator.h"
 #include "ui/mainwindow.h"
+#include "ui/uisettings.h"
+#include "tests/benchmarks.h"
 #include "tests/tests.h"
 #include <iostream>
 
+/*
+ * Opens the scene file argv[0] and starts simulating it. The options after it
+ * split the run across processes: start one per rank, each with the same
+ * scene and '-ranks <n> -rank <r>', optionally with '-transport shm|tcp' and
+ * '-address <address>' (see Communicator::create). Each process simulates and
+ * shows its slab of the grid, and is left holding only its own particles, so
+ * reload the scene before running it again.
+ */
+static int runScene( QApplication &a, MainWindow &w, int argc, char *argv[] )
+{
+    if ( argc % 2 == 0 ) {
+        printf( "missing value for %s\n", argv[argc-1] );
+        return 1;
+    }
+    for ( int i = 1; i+1 < argc; i += 2 ) {
+        const char *option = argv[i], *value = argv[i+1];
+        if ( !strcmp(option, "-rank") ) UiSettings::rank() = atoi( value );
+        else if ( !strcmp(option, "-ranks") ) UiSettings::ranks() = atoi( value );
+        else if ( !strcmp(option, "-transport") && !strcmp(value, "shm") ) UiSettings::transport() = Communicator::SHARED_MEMORY;
+        else if ( !strcmp(option, "-transport") && !strcmp(value, "tcp") ) UiSettings::transport() = Communicator::TCP;
+        else if ( !strcmp(option, "-address") ) UiSettings::address() = QString( value );
+        else {
+            printf( "unknown option %s %s\n", option, value );
+            return 1;
+        }
+    }
+    if ( UiSettings::rank() < 0 || UiSettings::rank() >= UiSettings::ranks() ) {
+        printf( "rank %d is out of range for %d ranks\n", UiSettings::rank(), UiSettings::ranks() );
+        return 1;
+    }
+
+    w.show();
+    a.processEvents();
+    if ( !w.openScene(QString(argv[0])) ) return 1;
+    w.startSimulation();
+    return a.exec();
+}
 
 /*
  *
- * Run with '-test' as an argument to run tests defined in tests.cpp. Run with no argument to run with GUI
+ * Run with '-test <name>' as an argument to run tests defined in tests.cpp, with '-bench [options]' to run
+ * the benchmarks in benchmarks.cpp, or with '-scene <file> [options]' to simulate a scene right away (see
+ * runScene). Run with no argument to run with GUI
  *
  */
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+    if (argc >= 2 && !strcmp(argv[1],"-bench"))  {
+        return Benchmarks::run(argc-2, argv+2);
+    }
     MainWindow w;
     if(argc < 2)  {
         w.show();
         return a.exec();
     }
-    else if (argc == 3 && !strcmp(argv[1],"-test"))  {
-        Tests::runTests(argv);
+    else if (argc >= 3 && !strcmp(argv[1],"-test"))  {
+        return Tests::runTests(argc-2, argv+2);
+    }
+    else if (argc >= 3 && !strcmp(argv[1],"-scene"))  {
+        return runScene(a, w, argc-2, argv+2);
     }
     else  {
-        printf("unknown argument %s, only support '-test <name>' as an argument. Run with empty argument list to run with gui.",argv[1]);
+        printf("unknown argument %s, only support '-test <name>', '-bench [options]' and '-scene <file> [options]' as arguments. Run with empty argument list to run with gui.",argv[1]);
     }
     return 0;
 }
@@ -4,6 +4,7 @@ uniform vec3 pos;
 uniform vec3 dim;
 uniform float h;
 uniform float density;
+uniform bool blockedNodes;
 
 in float nodeMass;
 in vec3 nodeVelocity;
@@ -29,13 +30,19 @@ void main( void )
     } else if ( mode == FORCE ) {
         nodeColor.rgb = 1000.0*abs(nodeForce);
     }
-    float i = gl_VertexID;
-    float x = floor(i/((dim.y+1)*(dim.z+1)));
-    i -= x*(dim.y+1)*(dim.z+1);
-    float y = floor(i/(dim.z+1));
-    i -= y*(dim.z+1);
-    float z = i;
-    vec4 position = vec4( pos + h * vec3( x, y, z ), 1.0 );
+    // Same as Grid::nodeIJK, 4x4x4 tiles
+    int i = gl_VertexID;
+    ivec3 nodeDim = ivec3(dim) + 1;
+    ivec3 ijk;
+    if ( blockedNodes ) {
+        ivec3 tiles = ( nodeDim + 3 ) / 4;
+        int tile = i >> 6;
+        ijk = 4 * ivec3( tile/(tiles.y*tiles.z), (tile/tiles.z)%tiles.y, tile%tiles.z );
+        ijk += ivec3( ((i>>2)&1) | ((i>>4)&2), ((i>>1)&1) | ((i>>3)&2), (i&1) | ((i>>2)&2) );
+    } else {
+        ijk = ivec3( i/(nodeDim.y*nodeDim.z), (i/nodeDim.z)%nodeDim.y, i%nodeDim.z );
+    }
+    vec4 position = vec4( pos + h * vec3( ijk ), 1.0 );
     gl_Position = gl_ModelViewProjectionMatrix * position;
     gl_PointSize = 3.0;
 }
@@ -14,46 +14,94 @@
 #include <cuda.h>
 #include <cuda_runtime.h>
 
+#include "common/common.h"
 #include "cuda/matrix.h"
+#include "geometry/grid.h"
 
+class Communicator;
+struct Node;
+struct Particle;
+
+/**
+ * Conjugate residual vectors. Each channel is its own contiguous device array,
+ * so the solver's vector operations only stream the arrays they use. Owned on
+ * the host (see createNodeCaches) and passed to kernels by value; kernels pick
+ * their channels at compile time with get<Offset>().
+ *
+ * With a preconditioner, Z holds the preconditioned residual, AR holds A*Z and
+ * Q holds M^-1*AP. DINV is the inverse diagonal of the operator and TMP is
+ * multigrid scratch. Without one, Z and Q alias R and AP.
+ *
+ * WARM is the only channel that outlives a step: it keeps the last solve's
+ * correction v - v* to warm start the next one, so it isn't cleared.
+ *
+ * createNodeCaches only allocates the channels of a mask (see MemoryPlan); the
+ * others stay NULL.
+ */
 struct NodeCache
 {
-    enum Offset { R, AR, P, AP, V, DF };
-
-    // Data used by Conjugate Residual Method
-    vec3 r;
-    vec3 Ar;
-    vec3 p;
-    vec3 Ap;
-    vec3 v;
-    vec3 df;
-    double scratch;
-    __host__ __device__ vec3& operator [] ( Offset i )
-    {
-        switch ( i ) {
-        case R: return r;
-        case AR: return Ar;
-        case P: return p;
-        case AP: return Ap;
-        case V: return v;
-        case DF: return df;
-        }
-        return r;
-    }
+    enum Offset { R, AR, P, AP, V, DF, Z, Q, DINV, TMP, WARM, CHANNEL_COUNT };
+
+    // Channel masks hold one bit per Offset, plus SCRATCH for the scratch array
+    enum Mask { SCRATCH = 1 << CHANNEL_COUNT, ALL_CHANNELS = ( SCRATCH << 1 ) - 1 };
+
+    vec3 *channels[CHANNEL_COUNT];
+    double *scratch;
+
+    template<Offset O>
+    __host__ __device__ vec3* get() const { return channels[O]; }
 
-    __host__ __device__ vec3 operator [] ( Offset i ) const
+    __host__ __device__ static unsigned int bit( Offset o ) { return 1u << o; }
+
+    __host__ __device__ static size_t bytesPerNode( unsigned int channels = ALL_CHANNELS )
     {
-        switch ( i ) {
-        case R: return r;
-        case AR: return Ar;
-        case P: return p;
-        case AP: return Ap;
-        case V: return v;
-        case DF: return df;
+        size_t bytes = ( channels & SCRATCH ) ? sizeof(double) : 0;
+        for ( int i = 0; i < CHANNEL_COUNT; ++i ) {
+            if ( channels & (1u << i) ) bytes += sizeof(vec3);
         }
-        return r;
+        return bytes;
     }
+};
+
+enum Preconditioner
+{
+    NO_PRECONDITIONER,
+    JACOBI_PRECONDITIONER,
+    MULTIGRID_PRECONDITIONER
+};
+
+// Solver iterations per step, however far the residual is from the tolerance
+#define MAX_ITERATIONS 15
+
+#define MULTIGRID_MAX_LEVELS 4
+#define MULTIGRID_MIN_DIM 4
 
+// The V-cycle only smooths, restricts and prolongs on coarse levels
+#define MULTIGRID_CHANNELS ( (1u << NodeCache::R) | (1u << NodeCache::AR) | (1u << NodeCache::V) | \
+                             (1u << NodeCache::DF) | (1u << NodeCache::DINV) )
+
+/**
+ * One coarse level of the multigrid preconditioner. Its grid has twice the
+ * spacing of the level above. Only the masses of its nodes are used, which
+ * keeps computeEu unchanged. Its caches hold MULTIGRID_CHANNELS.
+ */
+struct MultigridLevel
+{
+    Grid grid;
+    Grid *devGrid;
+    Node *nodes;
+    NodeCache caches;
+    index_t nodeCapacity; // nodes allocated, and the stride of the channels
+};
+
+/**
+ * Coarse levels below the simulation grid, coarsest last. Owned on the host
+ * like ParticleBins (see createMultigrid).
+ */
+struct Multigrid
+{
+    int levelCount;
+    MultigridLevel levels[MULTIGRID_MAX_LEVELS];
 };
 
 struct ParticleCache
@@ -61,12 +109,195 @@ struct ParticleCache
     // Data used during initial node computations
     mat3 *sigmas;
 
-    // Data used during implicit node velocity update
+    // Data used during implicit node velocity update. Aps is only written
+    // in deterministic mode; otherwise Ap never leaves registers.
     mat3 *Aps;
     mat3 *FeHats;
     mat3 *ReHats;
     mat3 *SeHats;
-    mat3 *dFs;
+};
+
+/**
+ * The device buffers a run needs, worked out from its mode by planMemory.
+ * Buffers the mode never touches aren't allocated: an explicit run has no node
+ * caches and only sigmas among the particle caches. Buffers whose lifetimes
+ * don't overlap share memory: sigmas is dead once P2G is done, before the
+ * implicit solve first writes FeHats, so the two alias. Temporaries of the
+ * setup passes (initializeParticleVolumes) come out of a DeviceArena of
+ * arenaBytes.
+ */
+struct MemoryPlan
+{
+    unsigned int nodeChannels; // NodeCache mask of the simulation grid, 0 if explicit
+    bool implicitCaches; // FeHats, ReHats and SeHats
+    bool aps; // Aps, only gathered by deterministic implicit solves
+    size_t arenaBytes;
+
+    // Per particle, counting sigmas once when it aliases FeHats
+    __host__ __device__ size_t particleCacheBytes() const
+    {
+        return ( implicitCaches ? 3 : 1 )*sizeof(mat3) + ( aps ? sizeof(mat3) : 0 );
+    }
+};
+
+/**
+ * Grow-only device memory for temporaries, the device side of ScratchArena.
+ * Allocations are served from one block and all released at once by
+ * clearDeviceArena; the block is kept for the next user. Owned on the host
+ * (see reserveDeviceArena). Every allocation is rounded up to the alignment,
+ * so reserve one alignment of slack per allocation.
+ */
+#define DEVICE_ARENA_ALIGNMENT 256
+
+struct DeviceArena
+{
+    char *data;
+    size_t capacity;
+    size_t offset;
+};
+
+/**
+ * Particles grouped by the first grid node of their 4x4x4 stencil. In
+ * deterministic mode, each node gathers from the 64 bins that can reach it,
+ * in a fixed order, instead of particles scattering to nodes with atomics.
+ * G2P reads the grid tile by tile whenever bins exist. Device arrays, owned
+ * on the host like ParticleCache.
+ */
+#define G2P_TILE 4
+#define G2P_TILE_BINS ( G2P_TILE*G2P_TILE*G2P_TILE )
+#define G2P_HALO ( G2P_TILE+3 )
+#define G2P_HALO_NODES ( G2P_HALO*G2P_HALO*G2P_HALO )
+
+struct ParticleBins
+{
+    index_t *keys; // bin of each particle, sorted
+    index_t *indices; // particle indices in bin order
+    index_t *starts; // first entry of each bin in indices
+    index_t *ends; // one past the last entry of each bin
+    index_t count; // number of bins, including the one for unreachable particles
+    index_t tileCount; // tiles of G2P_TILE^3 bins for the tiled G2P
+    index_t particleCapacity; // entries allocated in keys and indices
+    index_t binCapacity; // entries allocated in starts and ends
+};
+
+enum ImplicitOperator
+{
+    AUTO_OPERATOR,
+    MATRIX_FREE_OPERATOR,
+    ASSEMBLED_OPERATOR
+};
+
+// Two nodes are coupled if some particle's 4x4x4 stencil holds both
+#define STIFFNESS_RADIUS 3
+#define STIFFNESS_SLOTS 343
+
+/**
+ * The force Jacobian df/du assembled over the active nodes (mass > 0), as a
+ * block sparse matrix of 3x3 blocks. Row r belongs to node rowNodes[r] and has
+ * one block slot per offset in [-3,3]^3; the column is the node at that offset.
+ * Blocks are stored slot-major (blocks[slot*capacity+row]) so neighboring
+ * rows are read together. Device arrays, owned on the host like ParticleBins
+ * (see createStiffnessMatrix).
+ */
+struct StiffnessMatrix
+{
+    ImplicitOperator mode;
+    index_t *nodeRows; // row of each node, or -1
+    index_t *rowNodes; // node of each row
+    mat3 *blocks;
+    index_t rowCount;
+    index_t capacity; // rows allocated in blocks
+    // For AUTO_OPERATOR: applications of E on the grid in the last solve, and
+    // the measured cost of each path in ms, zero until measured
+    int lastSweeps;
+    float matrixFreeCost; // per particle and sweep
+    float assemblyCost; // per particle
+    float productCost; // per row and sweep
+    cudaEvent_t timing[2];
+};
+
+/**
+ * One process's part of a grid split across processes (see createHalo). Each
+ * rank owns a slab of cells along x, with the particles in it, and simulates
+ * the slab on a local grid with HALO_CELLS more cells on either side. Stencils
+ * of particles on either side of a slab boundary reach the band of 2*HALO_CELLS+1
+ * node planes around it, which both neighbors hold, so scattered values there
+ * are summed with the neighbor's after every scatter. Bands and ghosts are
+ * whole node planes, addressed through Grid::nodeIndex, so they hold for any
+ * node layout. Dot products only count the nodes a rank owns. Owned on the
+ * host.
+ */
+#define HALO_CELLS 2
+
+struct Halo
+{
+    Communicator *communicator;
+    Grid grid; // the local slab
+    int lowerRank, upperRank; // neighbors, -1 at the ends of the grid
+    int ownedBegin, ownedEnd; // cells of the whole grid along x
+    index_t bandNodes; // nodes in a band
+    index_t lowerGhosts, upperGhosts; // leading and trailing local nodes owned by the neighbors
+    char *sendBuffer, *receiveBuffer; // pinned host memory for a band of nodes
+    char *devBand; // the neighbor's band on the device
+    // Pinned host memory for the particles leaving upward and downward, and
+    // for those arriving, grown as needed by migrateParticles
+    Particle *outgoing[2], *incoming;
+    index_t migrationCapacity; // particles each of them holds
+};
+
+/**
+ * Device side of streaming particles that don't fit on the device, or in RAM
+ * (see ParticleFile), through it in chunks of chunkSize. Each buffer has its
+ * own stream: while one chunk is transferred and processed, the host copies
+ * the next one from the file into the other buffer's pinned staging memory.
+ * Only explicit steps are streamed, since every solver iteration would be
+ * another pass over the particles. Owned on the host (see
+ * createParticleStream).
+ */
+#define PARTICLE_STREAM_BUFFERS 2
+
+struct ParticleStream
+{
+    index_t chunkSize;
+    cudaStream_t streams[PARTICLE_STREAM_BUFFERS];
+    Particle *staging[PARTICLE_STREAM_BUFFERS]; // pinned host memory
+    Particle *chunks[PARTICLE_STREAM_BUFFERS];
+    ParticleCache caches[PARTICLE_STREAM_BUFFERS]; // sigmas of each chunk
+    ParticleCache *devCaches[PARTICLE_STREAM_BUFFERS];
+};
+
+/**
+ * Blocks of SLEEP_BLOCK^3 grid cells that have come to rest (see
+ * createSleepState). A block whose nodes stay below the speed and strain rate
+ * thresholds for `steps` steps in a row falls asleep, and its nodes are then
+ * held still, like a sticky collider. Particles in a block that sleeps along
+ * with all its neighbors only reach sleeping nodes, so they are moved behind
+ * the awake ones and left out of the step entirely. Motion in a block or its
+ * neighbors, from particles or a moving collider, wakes it. Device arrays,
+ * owned on the host.
+ */
+#define SLEEP_BLOCK 4
+
+struct SleepState
+{
+    Grid grid;
+    glm::ivec3 blocks;
+    int steps;
+    float speed; // m/s
+    float strainRate; // 1/s
+
+    int *disturbed; // per block, this step
+    int *calmSteps; // per block, in a row
+    bool *asleep; // per block
+    bool *dormant; // per block: asleep, and so are its neighbors
+    int *changed; // whether a dormant flag flipped this step
+    index_t blockCapacity; // blocks allocated in the arrays above
+
+    // Pinned copy of changed, read by the next step once copied
+    int *hostChanged;
+    cudaEvent_t changedCopied;
+
+    index_t awakeParticles; // in front of the dormant ones, -1 if all are awake
 };
 
 #endif // CACHES_H
@@ -9,48 +9,124 @@
 **************************************************************************/
 
 #include <GL/gl.h>
+#include <limits.h>
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QThread>
 
 #include "common/common.h"
+#include "common/communicator.h"
+#include "common/hostmemory.h"
+#include "common/threadpool.h"
 #include "io/mitsubaexporter.h"
+#include "io/particlefile.h"
 #include "sim/caches.h"
 #include "sim/implicitcollider.h"
 #include "sim/engine.h"
 #include "sim/particlesystem.h"
 #include "sim/particlegrid.h"
 #include "sim/particlegridnode.h"
+#include "sim/profiler.h"
 #include "ui/uisettings.h"
 
 #include "cuda/functions.h"
 
+#include "glm/common.hpp"
+#include "glm/vector_relational.hpp"
+
 #include <cuda.h>
 #include <cuda_runtime.h>
 #include <helper_functions.h>
 #include <helper_cuda.h>
 
-#define TICKS 10
+#define SNAPSHOT_DIRTY 0x4
+#define SNAPSHOT_INDEX 0x3
+// Particles per pool task when sampling the particle file for a snapshot
+#define SAMPLE_GRAIN 4096
+
+/**
+ * Thin QThread wrapper that runs Engine::simulate() until the engine is
+ * stopped or the simulation reaches UiSettings::maxTime() (as of its start).
+ */
+class SimulationThread : public QThread
+{
+public:
+
+    SimulationThread( Engine *engine ) : QThread(), m_engine(engine) {}
+
+protected:
+
+    virtual void run() { m_engine->simulate(); }
+
+private:
+
+    Engine *m_engine;
+
+};
 
 Engine::Engine()
-    : m_particleSystem(NULL),
+    : m_thread(NULL),
+      m_run(0),
+      m_particleSystem(NULL),
       m_particleGrid(NULL),
+      m_devParticles(NULL),
+      m_snapshotBack(0),
+      m_snapshotFront(1),
+      m_snapshotMiddle(2),
+      m_guiStream(NULL),
+      m_snapshotTime(0.f),
+      m_localParticles(0),
+      m_particleCapacity(0),
+      m_communicator(NULL),
+      m_halo(NULL),
+      m_particleFile(NULL),
+      m_particleStream(NULL),
+      m_hostSnapshotSample(NULL),
+      m_sampleEvent(NULL),
+      m_devExportNodes(NULL),
+      m_devBlockFlags(NULL),
+      m_devBlockDomains(NULL),
+      m_devDomainsEscaped(NULL),
+      m_hostDomainsEscaped(NULL),
       m_time(0.f),
+      m_steps(0),
+      m_solverIterations(0),
       m_running(false),
       m_paused(false),
-      m_exporter(NULL)
+      m_simulationPaused(false),
+      m_export(false),
+      m_exporter(NULL),
+      m_outputPrefix("snow")
 {
     m_particleSystem = new ParticleSystem;
     m_particleGrid =  new ParticleGrid;
 
     m_hostParticleCache = NULL;
+    m_arena = NULL;
+
+    for ( int i = 0; i < 3; ++i ) {
+        m_devParticleSnapshots[i] = NULL;
+        m_devNodeSnapshots[i] = NULL;
+        m_snapshotEvents[i] = NULL;
+        m_snapshotTimes[i] = 0.f;
+        m_snapshotParticles[i] = 0;
+        m_snapshotCapacities[i] = 0;
+    }
 
-    assert( connect(&m_ticker, SIGNAL(timeout()), this, SLOT(update())) );
+    m_thread = new SimulationThread( this );
+    assert( connect(this, SIGNAL(simulationCompleted(int)), this, SLOT(simulationFinished(int)), Qt::QueuedConnection) );
 }
 
 Engine::~Engine()
 {
     if ( m_running ) stop();
+    SAFE_DELETE( m_thread );
     SAFE_DELETE( m_particleSystem );
     SAFE_DELETE( m_particleGrid );
     SAFE_DELETE( m_hostParticleCache );
+    SAFE_DELETE( m_arena );
     SAFE_DELETE( m_exporter );
 }
 
@@ -75,6 +151,7 @@ void Engine::addParticleSystem( const ParticleSystem &particles )
 void Engine::clearParticleSystem()
 {
     m_particleSystem->clear();
+    m_particleSystem->setRenderCount( -1 );
 }
 
 void Engine::clearParticleGrid()
@@ -84,6 +161,7 @@ void Engine::clearParticleGrid()
 
 void Engine::initExporter( QString fprefix )
 {
+    m_outputPrefix = fprefix;
     m_exporter = new MitsubaExporter( fprefix, UiSettings::exportFPS() );
 }
 
@@ -91,14 +169,39 @@ bool Engine::start( bool exportVolume )
 {
     if ( m_particleSystem->size() > 0 && !m_grid.empty() && !m_running ) {
 
+        // Before the exporter places its nodes, so first touch sees the pinned workers
+        ThreadPool::instance().setPinned( UiSettings::numaAware() );
+
         if ( (m_export = exportVolume) ) m_exporter->reset( m_grid );
 
+        m_settings.timeStep = UiSettings::timeStep();
+        m_settings.maxTime = UiSettings::maxTime();
+        m_settings.implicit = UiSettings::implicit();
+        m_settings.deterministic = UiSettings::deterministic();
+        m_settings.preconditioner = UiSettings::preconditioner();
+        m_settings.solverTolerance = UiSettings::solverTolerance();
+        m_settings.implicitOperator = UiSettings::implicitOperator();
+        m_settings.tiledG2P = UiSettings::tiledG2P();
+        m_settings.autoDomain = UiSettings::autoDomain();
+        m_settings.multiDomain = UiSettings::multiDomain();
+        m_settings.sleepSteps = UiSettings::sleepSteps();
+        m_settings.sleepSpeed = UiSettings::sleepSpeed();
+        m_settings.sleepStrainRate = UiSettings::sleepStrainRate();
+
         initializeCudaResources();
         m_running = true;
 
         LOG( "SIMULATION STARTED" );
+        m_steps = 0;
+        m_solverIterations = 0;
+
+        Profiler::setEnabled( UiSettings::profileSimulation() );
+        Profiler::clear();
 
-        m_ticker.start(TICKS);
+        m_commands.clear();
+        m_simulationPaused = m_paused;
+        ++m_run;
+        m_thread->start();
         return true;
 
     } else {
@@ -119,23 +222,38 @@ bool Engine::start( bool exportVolume )
 
 void Engine::stop()
 {
+    if ( !m_running ) return;
     LOG( "SIMULATION STOPPED" );
-    m_ticker.stop();
+    postCommand( STOP );
+    m_thread->wait();
+    acquireSnapshot();
+    copySnapshotToBuffers();
     freeCudaResources();
     m_running = false;
+
+    LOGIF( m_steps > 0 && m_settings.implicit, "Implicit solve took %.1f iterations per step on average.", double(m_solverIterations)/m_steps );
+
+    if ( Profiler::enabled() ) {
+        Profiler::logSummary();
+        Profiler::exportChromeTrace( STR(QString("%1_profile.json").arg(m_outputPrefix)) );
+        Profiler::exportCSV( STR(QString("%1_profile.csv").arg(m_outputPrefix)) );
+        Profiler::setEnabled( false );
+    }
 }
 
 void Engine::pause()
 {
-    m_ticker.stop();
-    m_paused = true;
+    if ( !m_paused ) {
+        m_paused = true;
+        if ( m_running ) postCommand( PAUSE );
+    }
 }
 
 void Engine::resume()
 {
     if ( m_paused ) {
         m_paused = false;
-        if ( m_running ) m_ticker.start(TICKS);
+        if ( m_running ) postCommand( RESUME );
     }
 }
 
@@ -146,6 +264,7 @@ void Engine::reset()
         clearParticleSystem();
         clearParticleGrid();
         m_time = 0.f;
+        m_snapshotTime = 0.f;
     }
 }
 
@@ -154,128 +273,985 @@ bool Engine::isRunning()
     return m_running;
 }
 
-void Engine::update()
+void Engine::simulationFinished( int run )
 {
-    if ( !m_busy && m_running && !m_paused ) {
-
-        m_busy = true;
+    // The worker exits on its own once maxTime is reached
+    if ( m_running && run == m_run ) stop();
+}
 
-        cudaGraphicsMapResources( 1, &m_particlesResource, 0 );
-        Particle *devParticles;
-        size_t size;
-        checkCudaErrors( cudaGraphicsResourceGetMappedPointer( (void**)&devParticles, &size, m_particlesResource ) );
-        checkCudaErrors( cudaDeviceSynchronize() );
+void Engine::postCommand( Command command )
+{
+    QMutexLocker locker( &m_commandMutex );
+    m_commands.enqueue( command );
+    m_commandCondition.wakeOne();
+}
 
-        if ( (int)(size/sizeof(Particle)) != m_particleSystem->size() ) {
-            LOG( "Particle resource error : %lu bytes (%lu expected)", size, m_particleSystem->size()*sizeof(Particle) );
+// Drains the command queue, blocking while paused. Returns false once the
+// worker should exit.
+bool Engine::processCommands()
+{
+    QMutexLocker locker( &m_commandMutex );
+    bool &paused = m_simulationPaused;
+    do {
+        while ( !m_commands.empty() ) {
+            switch ( m_commands.dequeue() ) {
+            case PAUSE:
+                if ( !paused ) LOG( "Simulation paused..." );
+                paused = true;
+                break;
+            case RESUME:
+                paused = false;
+                break;
+            case STOP:
+                paused = false;
+                return false;
+            }
         }
+        if ( paused ) m_commandCondition.wait( &m_commandMutex );
+    } while ( paused );
+    return true;
+}
 
-        cudaGraphicsMapResources( 1, &m_nodesResource, 0 );
-        Node *devNodes;
-        checkCudaErrors( cudaGraphicsResourceGetMappedPointer( (void**)&devNodes, &size, m_nodesResource ) );
-        checkCudaErrors( cudaDeviceSynchronize() );
+void Engine::simulate()
+{
+    while ( processCommands() ) {
 
-        if ( (int)(size/sizeof(Node)) != m_particleGrid->size() ) {
-            LOG( "Grid nodes resource error : %lu bytes (%lu expected)", size, m_particleGrid->size()*sizeof(Node) );
+        step();
+        // Only once the GUI took the last snapshot, so publishing keeps pace
+        // with rendering rather than with the steps
+        if ( !(m_snapshotMiddle.load() & SNAPSHOT_DIRTY) ) publishSnapshot();
+
+        if ( m_time >= m_settings.maxTime )
+        {
+            LOG( "Simulation Completed" );
+            emit simulationCompleted( m_run );
+            break;
         }
 
-        updateParticles( devParticles, m_devParticleCache, m_hostParticleCache, m_particleSystem->size(), m_devGrid,
-                         devNodes, m_devNodeCaches, m_grid.nodeCount(), m_devColliders, m_colliders.size(),
-                         UiSettings::timeStep(), UiSettings::implicit() );
+    }
 
-//        updateColliders(); //updating collider positions on cpu side
+    // Whatever the GUI took last, it gets the final state when it stops
+    publishSnapshot();
+}
 
-        if (m_export && (m_time - m_exporter->getLastUpdateTime() >= m_exporter->getspf()))
-        {
-            cudaMemcpy(m_exporter->getNodesPtr(), devNodes, m_grid.nodeCount() * sizeof(Node), cudaMemcpyDeviceToHost);
-            m_exporter->runExportThread(m_time);
+void Engine::step()
+{
+    Profiler::beginFrame( m_time );
+
+    if ( !m_halo && !m_particleStream && (m_settings.autoDomain || m_settings.multiDomain) ) updateDomains();
+
+    if ( m_particleStream ) {
+        // One domain, the whole grid, explicit
+        Domain &domain = m_domains[0];
+        updateStreamedParticles( m_particleFile->data(), m_localParticles, m_particleStream, domain.devGrid, domain.devNodes,
+                                 domain.grid.nodeCount(), m_devColliders, m_colliders.size(), m_settings.timeStep );
+        ++m_steps;
+    } else {
+        stepDomains();
+    }
+
+//    updateColliders(); //updating collider positions on cpu side
+
+    if (m_export && (m_time - m_exporter->getLastUpdateTime() >= m_exporter->getspf()))
+    {
+        PROFILE_SCOPE( "export" );
+        packExportNodes( gridNodes(), m_grid.nodeCount(), m_grid.h*m_grid.h*m_grid.h, m_devExportNodes );
+        cudaMemcpy(m_exporter->getNodesPtr(), m_devExportNodes, m_grid.nodeCount() * sizeof(ExportNode), cudaMemcpyDeviceToHost);
+        m_exporter->runExportThread(m_time);
+    }
+
+    m_time += m_settings.timeStep;
+
+    Profiler::endFrame();
+}
+
+// Steps the particles on the device. Domains share no nodes, so each is a
+// simulation of its own, on streams of its own: every domain's stages up to
+// the implicit solve are enqueued before any of them is waited for. They only
+// share the colliders, which are moved up front when there are several.
+void Engine::stepDomains()
+{
+    const bool sharedColliders = m_domains.size() > 1;
+    if ( sharedColliders ) moveColliders( m_devColliders, m_colliders.size(), m_settings.timeStep );
+    QVector<index_t> awake( m_domains.size() );
+    for ( int i = 0; i < m_domains.size(); ++i ) {
+        Domain &domain = m_domains[i];
+        awake[i] = beginParticleUpdate( m_devParticles + domain.firstParticle, domain.devParticleCache, domain.hostParticleCache,
+                                        domain.particleCount, domain.devGrid, domain.devNodes, *domain.nodeCaches,
+                                        domain.grid.nodeCount(), m_devColliders, m_colliders.size(), !sharedColliders,
+                                        m_settings.timeStep, m_settings.implicit, m_settings.solverTolerance,
+                                        (Preconditioner)m_settings.preconditioner, domain.multigrid, domain.stiffness,
+                                        domain.particleBins, m_settings.deterministic, m_halo, domain.sleep, domain.graph );
+    }
+    int iterations = 0;
+    for ( int i = 0; i < m_domains.size(); ++i ) {
+        Domain &domain = m_domains[i];
+        iterations = qMax( iterations, finishParticleUpdate(m_devParticles + domain.firstParticle, domain.devParticleCache, domain.hostParticleCache,
+                                                            awake[i], domain.devGrid, domain.devNodes, *domain.nodeCaches,
+                                                            domain.grid.nodeCount(), m_devColliders, m_colliders.size(), !sharedColliders,
+                                                            m_settings.timeStep, m_settings.implicit, m_settings.solverTolerance,
+                                                            (Preconditioner)m_settings.preconditioner, domain.multigrid, domain.stiffness,
+                                                            domain.particleBins, m_settings.deterministic, m_halo, domain.sleep, domain.graph) );
+    }
+    m_solverIterations += iterations;
+    ++m_steps;
+
+    if ( m_halo ) {
+        Domain &slab = m_domains[0];
+        const index_t capacity = m_particleCapacity;
+        m_localParticles = migrateParticles( &m_devParticles, m_localParticles, &m_particleCapacity, m_grid, m_halo, m_arena );
+        if ( m_particleCapacity != capacity ) growParticleCaches();
+        slab.particleCount = m_localParticles;
+        if ( slab.particleBins ) resizeParticleBins( slab.particleBins, slab.particleCount, slab.grid );
+    } else if ( m_settings.multiDomain ) {
+        checkDomains();
+    }
+}
+
+// Copies the working state into the back snapshot buffer and swaps it with the
+// middle one. The copies are only enqueued, behind the step; the GUI waits for
+// them through the snapshot's event.
+void Engine::publishSnapshot()
+{
+    PROFILE_SCOPE( "publishSnapshot" );
+    index_t numParticles = m_localParticles;
+    if ( m_particleFile ) {
+        numParticles = uploadParticleSample( m_devParticleSnapshots[m_snapshotBack] );
+    } else {
+        // The worker owns the back buffer, so it can grow it after migration
+        if ( m_localParticles > m_snapshotCapacities[m_snapshotBack] ) {
+            checkCudaErrors( cudaFree(m_devParticleSnapshots[m_snapshotBack]) );
+            checkCudaErrors( cudaMalloc((void**)&m_devParticleSnapshots[m_snapshotBack], m_particleCapacity*sizeof(Particle)) );
+            m_snapshotCapacities[m_snapshotBack] = m_particleCapacity;
         }
+        checkCudaErrors( cudaMemcpyAsync(m_devParticleSnapshots[m_snapshotBack], m_devParticles, m_localParticles*sizeof(Particle), cudaMemcpyDeviceToDevice) );
+    }
+    const Node *nodes = gridNodes();
+    if ( nodes != m_devNodeSnapshots[m_snapshotBack] ) {
+        checkCudaErrors( cudaMemcpyAsync(m_devNodeSnapshots[m_snapshotBack], nodes, m_grid.nodeCount()*sizeof(Node), cudaMemcpyDeviceToDevice) );
+    }
+    checkCudaErrors( cudaEventRecord(m_snapshotEvents[m_snapshotBack]) );
+    m_snapshotTimes[m_snapshotBack] = m_time;
+    m_snapshotParticles[m_snapshotBack] = numParticles;
+    int middle = m_snapshotMiddle.fetchAndStoreOrdered( m_snapshotBack | SNAPSHOT_DIRTY );
+    m_snapshotBack = middle & SNAPSHOT_INDEX;
+}
+
+// Gathers every so many particles of the particle file on the pool, up to a
+// stream chunk of them, and enqueues their upload into snapshot. Returns how
+// many there are.
+index_t Engine::uploadParticleSample( Particle *snapshot )
+{
+    const Particle *particles = m_particleFile->data();
+    const index_t total = m_localParticles, count = m_particleStream->chunkSize;
+    checkCudaErrors( cudaEventSynchronize(m_sampleEvent) );
+    ThreadPool::instance().parallelFor( 0, count, SAMPLE_GRAIN, [&]( index_t begin, index_t end ) {
+        for ( index_t i = begin; i < end; ++i ) m_hostSnapshotSample[i] = particles[i*total/count];
+    });
+    checkCudaErrors( cudaMemcpyAsync(snapshot, m_hostSnapshotSample, count*sizeof(Particle), cudaMemcpyHostToDevice) );
+    checkCudaErrors( cudaEventRecord(m_sampleEvent) );
+    return count;
+}
 
-        checkCudaErrors( cudaGraphicsUnmapResources( 1, &m_particlesResource, 0 ) );
-        checkCudaErrors( cudaGraphicsUnmapResources( 1, &m_nodesResource, 0 ) );
-        checkCudaErrors( cudaDeviceSynchronize() );
+// Swaps the front snapshot buffer with the middle one if the worker has published since the last swap
+bool Engine::acquireSnapshot()
+{
+    if ( !(m_snapshotMiddle.load() & SNAPSHOT_DIRTY) ) return false;
+    int middle = m_snapshotMiddle.fetchAndStoreOrdered( m_snapshotFront );
+    m_snapshotFront = middle & SNAPSHOT_INDEX;
+    m_snapshotTime = m_snapshotTimes[m_snapshotFront];
+    return true;
+}
 
-        m_time += UiSettings::timeStep();
+// Copies the front snapshot into the VBOs on the GUI's stream, once the
+// worker's copies into it are done. Returns with the copies finished, so the
+// front buffer can go back to the worker on the next acquireSnapshot.
+void Engine::copySnapshotToBuffers()
+{
+    size_t size;
 
-        if (m_time >= UiSettings::maxTime()) // user can adjust max export time dynamically
-        {
-            stop();
-            LOG( "Simulation Completed" );
+    checkCudaErrors( cudaStreamWaitEvent(m_guiStream, m_snapshotEvents[m_snapshotFront], 0) );
+    cudaGraphicsMapResources( 1, &m_particlesResource, m_guiStream );
+    Particle *vboParticles;
+    checkCudaErrors( cudaGraphicsResourceGetMappedPointer( (void**)&vboParticles, &size, m_particlesResource ) );
+    if ( size/sizeof(Particle) != (size_t)m_particleSystem->size() ) {
+        LOG( "Particle resource error : %lu bytes (%lu expected)", size, m_particleSystem->size()*sizeof(Particle) );
+    }
+    // A distributed run only shows this rank's particles
+    index_t numParticles = m_snapshotParticles[m_snapshotFront];
+    checkCudaErrors( cudaMemcpyAsync(vboParticles, m_devParticleSnapshots[m_snapshotFront], numParticles*sizeof(Particle), cudaMemcpyDeviceToDevice, m_guiStream) );
+    checkCudaErrors( cudaGraphicsUnmapResources( 1, &m_particlesResource, m_guiStream ) );
+    m_particleSystem->setRenderCount( numParticles );
+
+    if ( UiSettings::showGridData() ) {
+        cudaGraphicsMapResources( 1, &m_nodesResource, m_guiStream );
+        Node *vboNodes;
+        checkCudaErrors( cudaGraphicsResourceGetMappedPointer( (void**)&vboNodes, &size, m_nodesResource ) );
+        if ( size/sizeof(Node) != (size_t)m_particleGrid->size() ) {
+            LOG( "Grid nodes resource error : %lu bytes (%lu expected)", size, m_particleGrid->size()*sizeof(Node) );
         }
+        checkCudaErrors( cudaMemcpyAsync(vboNodes, m_devNodeSnapshots[m_snapshotFront], m_grid.nodeCount()*sizeof(Node), cudaMemcpyDeviceToDevice, m_guiStream) );
+        checkCudaErrors( cudaGraphicsUnmapResources( 1, &m_nodesResource, m_guiStream ) );
+    }
+    checkCudaErrors( cudaStreamSynchronize(m_guiStream) );
+}
 
-        m_busy = false;
+// Domains start on whole blocks of the grid's cells, so they stay on its lattice
+#define DOMAIN_BLOCK 8
+// Cells kept around the particles: the stencil reaches two nodes past a
+// particle's cell, and particles move less than a cell per step
+#define DOMAIN_MARGIN 4
+// Steps between full reclusterings with UiSettings::multiDomain, which catch
+// clusters that split or shrink. Particles leaving their domain trigger one
+// sooner.
+#define DOMAIN_CLUSTER_STEPS 32
 
-    } else {
+// Cells of grid covered by domain, [lo, hi)
+static void domainCells( const Grid &grid, const Grid &domain, glm::ivec3 &lo, glm::ivec3 &hi )
+{
+    lo = glm::ivec3( vec3::round((domain.pos - grid.pos) / grid.h) );
+    hi = lo + domain.dim;
+}
+
+// The part of grid covering cells [lo, hi)
+static Grid cellsDomain( const Grid &grid, const glm::ivec3 &lo, const glm::ivec3 &hi )
+{
+    Grid domain = grid;
+    domain.dim = glm::max( hi - lo, glm::ivec3(1) );
+    domain.pos = grid.pos + grid.h * vec3( lo );
+    return domain;
+}
+
+/**
+ * Fits a domain around the particle bounds min/max, inside grid and on its
+ * lattice. Returns false if the current domain can stay: it still holds the
+ * particles with their margin, and isn't more than twice the size of a fresh
+ * fit. Otherwise the fresh fit, which has a block of slack on every side so
+ * that it doesn't move again right away, goes to domain.
+ */
+static bool fitDomain( const Grid &grid, const Grid &current, const vec3 &min, const vec3 &max, Grid &domain )
+{
+    // Particle bounds in cells of the grid, clamped so that stray particles can't overflow
+    const vec3 lower = vec3::max( vec3(0,0,0), (min - grid.pos) / grid.h );
+    const vec3 upper = vec3::min( vec3(grid.dim), (max - grid.pos) / grid.h );
+    glm::ivec3 needLo = glm::max( glm::ivec3(floorf(lower.x), floorf(lower.y), floorf(lower.z)) - DOMAIN_MARGIN, glm::ivec3(0) );
+    glm::ivec3 needHi = glm::min( glm::ivec3(ceilf(upper.x), ceilf(upper.y), ceilf(upper.z)) + DOMAIN_MARGIN, grid.dim );
+
+    glm::ivec3 lo = ( glm::max(needLo - DOMAIN_BLOCK, glm::ivec3(0)) / DOMAIN_BLOCK ) * DOMAIN_BLOCK;
+    glm::ivec3 hi = glm::min( ((needHi + DOMAIN_BLOCK + DOMAIN_BLOCK-1) / DOMAIN_BLOCK) * DOMAIN_BLOCK, grid.dim );
+    domain = cellsDomain( grid, lo, hi );
+
+    glm::ivec3 currentLo, currentHi;
+    domainCells( grid, current, currentLo, currentHi );
+    bool holds = glm::all( glm::lessThanEqual(currentLo, needLo) ) && glm::all( glm::greaterThanEqual(currentHi, needHi) );
+    return !holds || current.cellCount() > 2*domain.cellCount();
+}
 
-        if ( !m_running ) {
-            LOG( "Simulation not running..." );
+// Blocks [lo, hi) of the grid
+struct BlockBox
+{
+    glm::ivec3 lo, hi;
+};
+
+static bool boxesTouch( const BlockBox &a, const BlockBox &b )
+{
+    return glm::all( glm::lessThanEqual(a.lo, b.hi) ) && glm::all( glm::lessThanEqual(b.lo, a.hi) );
+}
+
+static glm::ivec3 blockCount( const Grid &grid )
+{
+    return ( grid.dim + DOMAIN_BLOCK-1 ) / DOMAIN_BLOCK;
+}
+
+// Blocks in all, which the host keeps in QVectors, so at most INT_MAX
+static index_t blockTotal( const glm::ivec3 &blocks )
+{
+    return (index_t)blocks.x*blocks.y*blocks.z;
+}
+
+/**
+ * Boxes of the clusters of flagged blocks, connected through faces, edges or
+ * corners. The flags include the particles' margin, so the stencils of two
+ * clusters never reach the same node.
+ */
+static void findBlockClusters( const bool *flags, const glm::ivec3 &blocks, QVector<BlockBox> &clusters )
+{
+    QVector<bool> visited( blockTotal(blocks), false );
+    QVector<glm::ivec3> stack;
+    for ( int i = 0; i < blocks.x; ++i ) {
+        for ( int j = 0; j < blocks.y; ++j ) {
+            for ( int k = 0; k < blocks.z; ++k ) {
+                index_t index = Grid::getGridIndex( i, j, k, blocks );
+                if ( !flags[index] || visited[index] ) continue;
+                visited[index] = true;
+                BlockBox box;
+                box.lo = glm::ivec3( i, j, k );
+                box.hi = box.lo + 1;
+                stack += box.lo;
+                while ( !stack.empty() ) {
+                    glm::ivec3 block = stack.last();
+                    stack.pop_back();
+                    box.lo = glm::min( box.lo, block );
+                    box.hi = glm::max( box.hi, block+1 );
+                    for ( int di = -1; di <= 1; ++di ) {
+                        for ( int dj = -1; dj <= 1; ++dj ) {
+                            for ( int dk = -1; dk <= 1; ++dk ) {
+                                glm::ivec3 neighbor = block + glm::ivec3( di, dj, dk );
+                                if ( !Grid::withinBoundsInclusive(neighbor, glm::ivec3(0), blocks-1) ) continue;
+                                index_t neighborIndex = Grid::getGridIndex( neighbor, blocks );
+                                if ( !flags[neighborIndex] || visited[neighborIndex] ) continue;
+                                visited[neighborIndex] = true;
+                                stack += neighbor;
+                            }
+                        }
+                    }
+                }
+                clusters += box;
+            }
         }
-        if ( m_paused ) {
-            LOG( "Simulation paused..." );
+    }
+}
+
+/**
+ * Domain boxes for the clusters: each cluster's box with a block of slack, and
+ * boxes that touch merged until they are all at least a block apart. So
+ * clusters that approach each other end up sharing a domain.
+ */
+static void mergeClusterBoxes( const QVector<BlockBox> &clusters, const glm::ivec3 &blocks, QVector<BlockBox> &boxes )
+{
+    boxes.clear();
+    for ( int i = 0; i < clusters.size(); ++i ) {
+        BlockBox box;
+        box.lo = glm::max( clusters[i].lo - 1, glm::ivec3(0) );
+        box.hi = glm::min( clusters[i].hi + 1, blocks );
+        boxes += box;
+    }
+    bool merged = true;
+    while ( merged ) {
+        merged = false;
+        for ( int i = 0; i < boxes.size() && !merged; ++i ) {
+            for ( int j = i+1; j < boxes.size() && !merged; ++j ) {
+                if ( !boxesTouch(boxes[i], boxes[j]) ) continue;
+                boxes[i].lo = glm::min( boxes[i].lo, boxes[j].lo );
+                boxes[i].hi = glm::max( boxes[i].hi, boxes[j].hi );
+                boxes.remove( j );
+                merged = true;
+            }
         }
+    }
+}
 
+// Caches of the particles from first on. Buffers that aren't allocated stay NULL.
+static ParticleCache particleCacheRange( const ParticleCache &cache, index_t first )
+{
+    ParticleCache range = cache;
+    mat3 **buffers[] = { &range.sigmas, &range.Aps, &range.FeHats, &range.ReHats, &range.SeHats };
+    for ( int i = 0; i < 5; ++i ) {
+        if ( *buffers[i] ) *buffers[i] += first;
     }
+    return range;
 }
 
 void Engine::initializeCudaResources()
 {
     LOG( "Initializing CUDA resources..." );
 
-    // Particles
-    registerVBO( &m_particlesResource, m_particleSystem->vbo() );
-    float particlesSize = m_particleSystem->size()*sizeof(Particle) / 1e6;
-    LOG( "Allocated %.2f MB for particle system.", particlesSize );
+    index_t numNodes = m_grid.nodeCount();
+    index_t numParticles = m_particleSystem->size();
 
-    int numNodes = m_grid.nodeCount();
-    int numParticles = m_particleSystem->size();
+    // A distributed run only keeps its slab of the grid, and the particles in it
+    Grid slab;
+    const bool distributed = UiSettings::ranks() > 1 && joinRanks( slab );
 
-    // Grid Nodes
-    registerVBO( &m_nodesResource, m_particleGrid->vbo() );
-    float nodesSize =  numNodes*sizeof(Node) / 1e6;
-    LOG( "Allocating %.2f MB for grid nodes.", nodesSize );
+    // Particles. Out of core, only the snapshots are on the device, sampled.
+    registerVBO( &m_particlesResource, m_particleSystem->vbo() );
+    if ( UiSettings::outOfCore() > 0 ) {
+        bool supported = !m_settings.implicit && !m_settings.deterministic && UiSettings::ranks() <= 1;
+        LOGIF( !supported, "Out-of-core runs are explicit, nondeterministic and single-process; keeping the particles on the device." );
+        if ( supported && createParticleFile() ) {
+            m_particleStream = new ParticleStream;
+            createParticleStream( m_particleStream, MIN((index_t)UiSettings::outOfCore(), numParticles) );
+            LOG( "Streaming the particles through the device %lld at a time.", (long long)m_particleStream->chunkSize );
+        }
+    }
+    // Start from whatever is in the particle VBO (the result of a previous
+    // run, if any). A distributed run leaves room for a quarter more particles
+    // to arrive; migrateParticles grows it if need be.
+    m_localParticles = m_particleCapacity = numParticles;
+    if ( !m_particleFile ) {
+        Particle *vboParticles = mapParticleVBO();
+        if ( distributed ) {
+            m_localParticles = copySlabParticles( vboParticles, numParticles, m_grid, *m_halo, NULL );
+            m_particleCapacity = MAX( m_localParticles + m_localParticles/4, (index_t)1 );
+            checkCudaErrors(cudaMalloc( (void**)&m_devParticles, m_particleCapacity*sizeof(Particle) ));
+            copySlabParticles( vboParticles, numParticles, m_grid, *m_halo, m_devParticles );
+        } else {
+            checkCudaErrors(cudaMalloc( (void**)&m_devParticles, numParticles*sizeof(Particle) ));
+            checkCudaErrors( cudaMemcpy(m_devParticles, vboParticles, numParticles*sizeof(Particle), cudaMemcpyDeviceToDevice) );
+        }
+        checkCudaErrors( cudaGraphicsUnmapResources(1, &m_particlesResource, 0) );
+    }
+    index_t snapshotParticles = m_particleCapacity;
+    if ( m_particleFile ) {
+        snapshotParticles = m_particleStream->chunkSize;
+        checkCudaErrors(cudaMallocHost( (void**)&m_hostSnapshotSample, snapshotParticles*sizeof(Particle) ));
+        checkCudaErrors( cudaEventCreateWithFlags(&m_sampleEvent, cudaEventDisableTiming) );
+    }
+    float particlesSize = ( 3*snapshotParticles + (m_particleFile ? 0 : m_particleCapacity) )*sizeof(Particle) / 1e6;
+    for ( int i = 0; i < 3; ++i ) {
+        checkCudaErrors(cudaMalloc( (void**)&m_devParticleSnapshots[i], snapshotParticles*sizeof(Particle) ));
+        m_snapshotCapacities[i] = snapshotParticles;
+    }
+    LOG( "Allocated %.2f MB for particle system and snapshots.", particlesSize );
 
-    // Grid
-    checkCudaErrors(cudaMalloc( (void**)&m_devGrid, sizeof(Grid) ));
-    checkCudaErrors(cudaMemcpy( m_devGrid, &m_grid, sizeof(Grid), cudaMemcpyHostToDevice ));
+    // Grid node snapshots, always in the layout of the whole grid
+    registerVBO( &m_nodesResource, m_particleGrid->vbo() );
+    float snapshotsSize =  3*numNodes*sizeof(Node) / 1e6;
+    for ( int i = 0; i < 3; ++i ) {
+        checkCudaErrors(cudaMalloc( (void**)&m_devNodeSnapshots[i], numNodes*sizeof(Node) ));
+        checkCudaErrors(cudaMemset( m_devNodeSnapshots[i], 0, numNodes*sizeof(Node) ));
+    }
+    LOG( "Allocating %.2f MB for grid node snapshots.", snapshotsSize );
 
+    m_snapshotBack = 0;
+    m_snapshotFront = 1;
+    m_snapshotMiddle.store( 2 );
+    for ( int i = 0; i < 3; ++i ) {
+        checkCudaErrors( cudaEventCreateWithFlags(&m_snapshotEvents[i], cudaEventDisableTiming) );
+    }
+    checkCudaErrors( cudaStreamCreateWithFlags(&m_guiStream, cudaStreamNonBlocking) );
 
     // Colliders
     checkCudaErrors(cudaMalloc( (void**)&m_devColliders, m_colliders.size()*sizeof(ImplicitCollider) ));
     checkCudaErrors(cudaMemcpy( m_devColliders, m_colliders.data(), m_colliders.size()*sizeof(ImplicitCollider), cudaMemcpyHostToDevice ));
 
-    // Caches
-    checkCudaErrors(cudaMalloc( (void**)&m_devNodeCaches, numNodes*sizeof(NodeCache)) );
-    checkCudaErrors(cudaMemset( m_devNodeCaches, 0, numNodes*sizeof(NodeCache)) );
-    float nodeCachesSize = numNodes*sizeof(NodeCache) / 1e6;
-    LOG( "Allocating %.2f MB for implicit update node cache.", nodeCachesSize );
-
+    // Particle caches, sized for the active mode
+    MemoryPlan plan;
+    planDomainMemory( m_grid, &plan );
     SAFE_DELETE( m_hostParticleCache );
     m_hostParticleCache = new ParticleCache;
-    cudaMalloc( (void**)&m_hostParticleCache->sigmas, numParticles*sizeof(mat3) );
-    cudaMalloc( (void**)&m_hostParticleCache->Aps, numParticles*sizeof(mat3) );
-    cudaMalloc( (void**)&m_hostParticleCache->FeHats, numParticles*sizeof(mat3) );
-    cudaMalloc( (void**)&m_hostParticleCache->ReHats, numParticles*sizeof(mat3) );
-    cudaMalloc( (void**)&m_hostParticleCache->SeHats, numParticles*sizeof(mat3) );
-    cudaMalloc( (void**)&m_hostParticleCache->dFs, numParticles*sizeof(mat3) );
-    cudaMalloc( (void**)&m_devParticleCache, sizeof(ParticleCache) );
-    cudaMemcpy( m_devParticleCache, m_hostParticleCache, sizeof(ParticleCache), cudaMemcpyHostToDevice );
-    float particleCachesSize = numParticles*6*sizeof(mat3) / 1e6;
-    LOG( "Allocating %.2f MB for implicit update particle caches.", particleCachesSize );
-
-    LOG( "Allocated %.2f MB in total", particlesSize + nodesSize + nodeCachesSize + particleCachesSize );
+    // The particle stream has caches of its own, for its chunks
+    index_t cachedParticles = m_particleStream ? 0 : m_particleCapacity;
+    createParticleCache( m_hostParticleCache, cachedParticles, plan );
+    float particleCachesSize = cachedParticles*plan.particleCacheBytes() / 1e6;
+    LOG( "Allocating %.2f MB for particle caches.", particleCachesSize );
+
+    // Volume export
+    float exportSize = 0.f;
+    if ( m_export ) {
+        exportSize = numNodes*sizeof(ExportNode) / 1e6;
+        checkCudaErrors(cudaMalloc( (void**)&m_devExportNodes, numNodes*sizeof(ExportNode) ));
+        LOG( "Allocating %.2f MB for volume export.", exportSize );
+    }
+
+    // Temporaries of the setup passes, and of sorting the particles by domain
+    if ( !m_arena ) {
+        m_arena = new DeviceArena;
+        m_arena->data = NULL;
+        m_arena->capacity = m_arena->offset = 0;
+    }
+
+    // Everything sized by the grid nodes belongs to the domains
+    QVector<Grid> domains;
+    if ( distributed || m_particleStream ) {
+        LOGIF( m_settings.autoDomain || m_settings.multiDomain || m_settings.sleepSteps > 0,
+               "Distributed and out-of-core runs simulate their whole slab or grid, awake; ignoring autoDomain, multiDomain and sleepSteps." );
+        domains += distributed ? slab : m_grid;
+    } else if ( m_settings.multiDomain && blockTotal(blockCount(m_grid)) > INT_MAX ) {
+        LOG( "Too many blocks of %d cells to cluster; fitting one domain instead of multiDomain.", DOMAIN_BLOCK );
+        fitDomains( domains );
+    } else if ( m_settings.multiDomain ) {
+        index_t numBlocks = blockTotal( blockCount(m_grid) );
+        checkCudaErrors(cudaMalloc( (void**)&m_devBlockFlags, numBlocks*sizeof(bool) ));
+        checkCudaErrors(cudaMalloc( (void**)&m_devBlockDomains, numBlocks*sizeof(int) ));
+        checkCudaErrors(cudaMalloc( (void**)&m_devDomainsEscaped, sizeof(int) ));
+        checkCudaErrors(cudaMallocHost( (void**)&m_hostDomainsEscaped, sizeof(int) ));
+        *m_hostDomainsEscaped = 0;
+        clusterDomains( domains );
+    } else if ( m_settings.autoDomain ) {
+        fitDomains( domains );
+    } else {
+        domains += m_grid;
+    }
+    float domainSize = setDomains( domains, true );
+    if ( m_domains.size() > 1 ) {
+        index_t cells = 0;
+        for ( int i = 0; i < m_domains.size(); ++i ) cells += m_domains[i].grid.cellCount();
+        LOG( "Simulating %d domains covering %.0f%% of the %d x %d x %d grid.", m_domains.size(), 100.0*cells/m_grid.cellCount(),
+             m_grid.dim.x, m_grid.dim.y, m_grid.dim.z );
+    } else if ( distributed ) {
+        LOG( "Rank %d simulating %lld particles on a %d x %d x %d slab of the grid.", UiSettings::rank(), (long long)m_localParticles,
+             slab.dim.x, slab.dim.y, slab.dim.z );
+    } else if ( m_domains[0].grid.dim != m_grid.dim ) {
+        const Grid &domain = m_domains[0].grid;
+        LOG( "Simulating a %d x %d x %d domain of the %d x %d x %d grid.", domain.dim.x, domain.dim.y, domain.dim.z,
+             m_grid.dim.x, m_grid.dim.y, m_grid.dim.z );
+    }
+
+    // Temporaries of the setup passes below, which take one domain at a time
+    const Grid *largest = &m_domains[0].grid;
+    for ( int i = 1; i < m_domains.size(); ++i ) {
+        if ( m_domains[i].grid.nodeCount() > largest->nodeCount() ) largest = &m_domains[i].grid;
+    }
+    planDomainMemory( *largest, &plan );
+    reserveDeviceArena( m_arena, plan.arenaBytes );
+    float arenaSize = m_arena->capacity / 1e6;
+
+    LOG( "Allocated %.2f MB in total", particlesSize + snapshotsSize + particleCachesSize + exportSize + domainSize + arenaSize );
 
     LOG( "Computing particle volumes..." );
-    cudaGraphicsMapResources( 1, &m_particlesResource, 0 );
-    Particle *devParticles;
+    if ( m_particleStream ) {
+        initializeStreamedParticleVolumes( m_particleFile->data(), numParticles, m_domains[0].devGrid, m_domains[0].grid.nodeCount(),
+                                           m_particleStream, m_arena );
+    }
+    for ( int i = 0; i < m_domains.size() && !m_particleStream; ++i ) {
+        const Domain &domain = m_domains[i];
+        initializeParticleVolumes( m_devParticles + domain.firstParticle, domain.particleCount, domain.devGrid, domain.grid.nodeCount(),
+                                   m_settings.deterministic ? domain.particleBins : NULL, m_halo, m_arena );
+    }
+
+    for ( int i = 0; i < 3; ++i ) {
+        if ( m_particleFile ) {
+            m_snapshotParticles[i] = uploadParticleSample( m_devParticleSnapshots[i] );
+        } else {
+            checkCudaErrors( cudaMemcpy(m_devParticleSnapshots[i], m_devParticles, m_localParticles*sizeof(Particle), cudaMemcpyDeviceToDevice) );
+            m_snapshotParticles[i] = m_localParticles;
+        }
+    }
+    // No events are recorded for these, so the GUI couldn't wait for them
+    checkCudaErrors( cudaDeviceSynchronize() );
+
+    LOG( "Initialization complete." );
+}
+
+// Multigrid levels aren't built when deterministic
+void Engine::planDomainMemory( const Grid &domain, MemoryPlan *plan ) const
+{
+    const bool multigrid = m_settings.implicit && m_settings.preconditioner == MULTIGRID_PRECONDITIONER && !m_settings.deterministic;
+    planMemory( plan, domain.nodeCount(), m_settings.implicit, (Preconditioner)m_settings.preconditioner, multigrid, m_settings.deterministic );
+}
+
+// Replaces the domains, sorting the particles by domain if there are several,
+// and returns the MB allocated for them. Each new domain takes over the buffers
+// of the old one in its slot if it fits in them, and the solver's warm start is
+// carried over to wherever the new domains overlap the old. Resource sizes are
+// only logged for a single domain.
+float Engine::setDomains( const QVector<Grid> &domains, bool log )
+{
+    QVector<Domain> old = m_domains;
+    m_domains.clear();
+
+    // Park each old warm start in its R channel, which the new domain in the
+    // same slot may be about to reuse along with WARM
+    const bool warm = m_settings.implicit && !old.empty() && old[0].nodeCaches->get<NodeCache::WARM>();
+    for ( int i = 0; warm && i < old.size(); ++i ) {
+        const NodeCache &caches = *old[i].nodeCaches;
+        checkCudaErrors( cudaMemcpy(caches.get<NodeCache::R>(), caches.get<NodeCache::WARM>(),
+                                    old[i].grid.nodeCount()*sizeof(vec3), cudaMemcpyDeviceToDevice) );
+    }
+
+    QVector<index_t> counts( domains.size() );
+    if ( domains.size() == 1 ) {
+        counts[0] = m_localParticles;
+    } else {
+        glm::ivec3 blocks = blockCount( m_grid );
+        QVector<int> blockDomains( blockTotal(blocks), 0 );
+        for ( int d = 0; d < domains.size(); ++d ) {
+            glm::ivec3 lo, hi;
+            domainCells( m_grid, domains[d], lo, hi );
+            lo /= DOMAIN_BLOCK;
+            hi = ( hi + DOMAIN_BLOCK-1 ) / DOMAIN_BLOCK;
+            for ( int i = lo.x; i < hi.x; ++i )
+                for ( int j = lo.y; j < hi.y; ++j )
+                    for ( int k = lo.z; k < hi.z; ++k )
+                        blockDomains[Grid::getGridIndex(i, j, k, blocks)] = d;
+        }
+        checkCudaErrors( cudaMemcpy(m_devBlockDomains, blockDomains.data(), blockDomains.size()*sizeof(int), cudaMemcpyHostToDevice) );
+        // Only reallocates if the arena is too small, which the first sort settles
+        reserveDeviceArena( m_arena, domainSortBytes(m_particleSystem->size(), domains.size()) );
+        sortParticlesByDomain( m_devParticles, m_particleSystem->size(), m_grid, DOMAIN_BLOCK, m_devBlockDomains, domains.size(), counts.data(),
+                               m_arena );
+    }
+
+    float size = 0.f;
+    index_t first = 0;
+    QVector<bool> retired( old.size(), true );
+    for ( int i = 0; i < domains.size(); ++i ) {
+        Domain domain;
+        domain.grid = domains[i];
+        domain.firstParticle = first;
+        domain.particleCount = counts[i];
+        first += counts[i];
+        if ( i < old.size() && reuseDomainResources(domain, old[i]) ) {
+            retired[i] = false;
+        } else {
+            // Leave room to grow, unless this is the first fit
+            index_t numNodes = domain.grid.nodeCount();
+            index_t capacity = old.empty() ? numNodes : numNodes + numNodes/4;
+            size += allocateDomainResources( domain, capacity, log && domains.size() == 1 );
+        }
+        m_domains += domain;
+    }
+
+    for ( int i = 0; warm && i < m_domains.size(); ++i ) {
+        vec3 *start = m_domains[i].nodeCaches->get<NodeCache::WARM>();
+        checkCudaErrors( cudaMemset(start, 0, m_domains[i].grid.nodeCount()*sizeof(vec3)) );
+        for ( int j = 0; j < old.size(); ++j ) {
+            remapNodeValues( old[j].nodeCaches->get<NodeCache::R>(), old[j].grid, start, m_domains[i].grid );
+        }
+    }
+
+    for ( int i = 0; i < old.size(); ++i ) {
+        if ( retired[i] ) freeDomainResources( old[i] );
+    }
+    return size;
+}
+
+// Allocates the working nodes and everything else sized by the domain, with
+// room for nodeCapacity nodes, and returns the total in MB
+float Engine::allocateDomainResources( Domain &domain, index_t nodeCapacity, bool log )
+{
+    index_t numNodes = nodeCapacity;
+    index_t numParticles = domain.particleCount;
+    domain.nodeCapacity = nodeCapacity;
+
+    checkCudaErrors(cudaMalloc( (void**)&domain.devGrid, sizeof(Grid) ));
+    checkCudaErrors(cudaMemcpy( domain.devGrid, &domain.grid, sizeof(Grid), cudaMemcpyHostToDevice ));
+
+    domain.hostParticleCache = new ParticleCache( particleCacheRange(*m_hostParticleCache, domain.firstParticle) );
+    checkCudaErrors( cudaMalloc((void**)&domain.devParticleCache, sizeof(ParticleCache)) );
+    checkCudaErrors( cudaMemcpy(domain.devParticleCache, domain.hostParticleCache, sizeof(ParticleCache), cudaMemcpyHostToDevice) );
+
+    // Grid Nodes
+    float nodesSize =  numNodes*sizeof(Node) / 1e6;
+    checkCudaErrors(cudaMalloc( (void**)&domain.devNodes, numNodes*sizeof(Node) ));
+    checkCudaErrors(cudaMemset( domain.devNodes, 0, numNodes*sizeof(Node) ));
+    LOGIF( log, "Allocating %.2f MB for grid nodes.", nodesSize );
+
+    // Node caches, sized for the active mode
+    MemoryPlan plan;
+    planDomainMemory( domain.grid, &plan );
+    domain.nodeCaches = new NodeCache;
+    createNodeCaches( domain.nodeCaches, numNodes, plan.nodeChannels );
+    float nodeCachesSize = numNodes*NodeCache::bytesPerNode( plan.nodeChannels ) / 1e6;
+    LOGIF( log && plan.nodeChannels, "Allocating %.2f MB for implicit update node cache.", nodeCachesSize );
+
+    // Deterministic mode and tiled G2P
+    float binsSize = 0.f;
+    domain.particleBins = NULL;
+    if ( (m_settings.deterministic || m_settings.tiledG2P) && !m_particleStream ) {
+        domain.particleBins = new ParticleBins;
+        createParticleBins( domain.particleBins, numParticles, domain.grid );
+        binsSize = ( 2*numParticles + 2*domain.particleBins->count )*sizeof(index_t) / 1e6;
+        LOGIF( log, "Allocating %.2f MB for particle bins.", binsSize );
+    }
+
+    // Multigrid preconditioner
+    float multigridSize = 0.f;
+    domain.multigrid = NULL;
+    if ( m_settings.implicit && m_settings.preconditioner == MULTIGRID_PRECONDITIONER ) {
+        if ( m_settings.deterministic ) {
+            LOGIF( log, "The multigrid preconditioner isn't deterministic; using Jacobi." );
+        } else {
+            domain.multigrid = new Multigrid;
+            createMultigrid( domain.multigrid, domain.grid );
+            for ( int i = 0; i < domain.multigrid->levelCount; ++i ) {
+                multigridSize += domain.multigrid->levels[i].grid.nodeCount()*( sizeof(Node) + NodeCache::bytesPerNode(MULTIGRID_CHANNELS) ) / 1e6;
+            }
+            LOGIF( log, "Allocating %.2f MB for %d multigrid levels.", multigridSize, domain.multigrid->levelCount );
+        }
+    }
+
+    // Assembled stiffness matrix. Its blocks are allocated when first assembled
+    domain.stiffness = NULL;
+    if ( m_settings.implicit && m_settings.implicitOperator != MATRIX_FREE_OPERATOR ) {
+        if ( m_settings.deterministic ) {
+            LOGIF( log && m_settings.implicitOperator == ASSEMBLED_OPERATOR, "The assembled stiffness matrix isn't deterministic; staying matrix-free." );
+        } else {
+            domain.stiffness = new StiffnessMatrix;
+            createStiffnessMatrix( domain.stiffness, numNodes, (ImplicitOperator)m_settings.implicitOperator );
+        }
+    }
+
+    domain.graph = createStepGraph();
+
+    // Resting snow, which would reorder a slab's particles
+    domain.sleep = NULL;
+    if ( m_settings.sleepSteps > 0 && !m_halo && !m_particleStream ) {
+        domain.sleep = new SleepState;
+        createSleepState( domain.sleep, domain.grid, m_settings.sleepSteps, m_settings.sleepSpeed, m_settings.sleepStrainRate );
+    }
+
+    return nodesSize + nodeCachesSize + binsSize + multigridSize;
+}
+
+// Moves the buffers of old over to domain if its nodes fit in them. Everything
+// but the nodes is resized in place. Returns false, leaving old alone, if not.
+bool Engine::reuseDomainResources( Domain &domain, const Domain &old )
+{
+    if ( domain.grid.nodeCount() > old.nodeCapacity ) return false;
+
+    domain.nodeCapacity = old.nodeCapacity;
+    domain.devGrid = old.devGrid;
+    domain.devNodes = old.devNodes;
+    domain.nodeCaches = old.nodeCaches;
+    domain.hostParticleCache = old.hostParticleCache;
+    domain.devParticleCache = old.devParticleCache;
+    domain.particleBins = old.particleBins;
+    domain.multigrid = old.multigrid;
+    domain.stiffness = old.stiffness;
+    domain.sleep = old.sleep;
+    domain.graph = old.graph;
+
+    checkCudaErrors( cudaMemcpy(domain.devGrid, &domain.grid, sizeof(Grid), cudaMemcpyHostToDevice) );
+    *domain.hostParticleCache = particleCacheRange( *m_hostParticleCache, domain.firstParticle );
+    checkCudaErrors( cudaMemcpy(domain.devParticleCache, domain.hostParticleCache, sizeof(ParticleCache), cudaMemcpyHostToDevice) );
+
+    if ( domain.particleBins ) resizeParticleBins( domain.particleBins, domain.particleCount, domain.grid );
+    if ( domain.multigrid ) resizeMultigrid( domain.multigrid, domain.grid );
+    if ( domain.sleep ) resetSleepState( domain.sleep, domain.grid );
+    return true;
+}
+
+void Engine::freeDomainResources( Domain &domain )
+{
+    cudaFree( domain.devGrid );
+    cudaFree( domain.devNodes );
+    cudaFree( domain.devParticleCache );
+    SAFE_DELETE( domain.hostParticleCache );
+
+    destroyNodeCaches( domain.nodeCaches );
+    SAFE_DELETE( domain.nodeCaches );
+
+    if ( domain.particleBins ) {
+        destroyParticleBins( domain.particleBins );
+        SAFE_DELETE( domain.particleBins );
+    }
+
+    if ( domain.multigrid ) {
+        destroyMultigrid( domain.multigrid );
+        SAFE_DELETE( domain.multigrid );
+    }
+
+    if ( domain.stiffness ) {
+        destroyStiffnessMatrix( domain.stiffness );
+        SAFE_DELETE( domain.stiffness );
+    }
+
+    if ( domain.sleep ) {
+        destroySleepState( domain.sleep );
+        SAFE_DELETE( domain.sleep );
+    }
+
+    destroyStepGraph( domain.graph );
+    domain.graph = NULL;
+}
+
+// Where out-of-core runs keep their particles, one file per process
+static QString particleFilePath()
+{
+    return QDir::temp().filePath( QString("snow_%1.particles").arg(QCoreApplication::applicationPid()) );
+}
+
+// Maps the particle VBO for CUDA and returns it; the caller unmaps it
+Particle* Engine::mapParticleVBO()
+{
     size_t size;
-    checkCudaErrors( cudaGraphicsResourceGetMappedPointer( (void**)&devParticles, &size, m_particlesResource ) );
-    if ( (int)(size/sizeof(Particle)) != m_particleSystem->size() ) {
+    checkCudaErrors( cudaGraphicsMapResources(1, &m_particlesResource, 0) );
+    Particle *vboParticles;
+    checkCudaErrors( cudaGraphicsResourceGetMappedPointer( (void**)&vboParticles, &size, m_particlesResource ) );
+    if ( size/sizeof(Particle) != (size_t)m_particleSystem->size() ) {
         LOG( "Particle resource error : %lu bytes (%lu expected)", size, m_particleSystem->size()*sizeof(Particle) );
     }
-    initializeParticleVolumes( devParticles, m_particleSystem->size(), m_devGrid, numNodes );
+    return vboParticles;
+}
+
+// Writes the particles in the VBO to a ParticleFile for an out-of-core run.
+// On the way, they pass through a second mapped file rather than host memory.
+bool Engine::createParticleFile()
+{
+    const index_t count = m_particleSystem->size();
+    const QString unsortedPath = particleFilePath() + ".unsorted";
+    Particle *unsorted = (Particle*) mapHostFile( STR(unsortedPath), count*sizeof(Particle) );
+    if ( !unsorted ) {
+        LOG( "Couldn't write %s; keeping the particles on the device.", STR(unsortedPath) );
+        return false;
+    }
+    Particle *vboParticles = mapParticleVBO();
+    checkCudaErrors( cudaMemcpy(unsorted, vboParticles, count*sizeof(Particle), cudaMemcpyDeviceToHost) );
     checkCudaErrors( cudaGraphicsUnmapResources(1, &m_particlesResource, 0) );
 
-    LOG( "Initialization complete." );
+    m_particleFile = new ParticleFile;
+    bool created = m_particleFile->create( particleFilePath(), unsorted, count, m_grid );
+    unmapHostFile( unsorted, count*sizeof(Particle) );
+    QFile::remove( unsortedPath );
+    if ( created ) return true;
+    LOG( "Couldn't write %s; keeping the particles on the device.", STR(particleFilePath()) );
+    SAFE_DELETE( m_particleFile );
+    return false;
+}
+
+// Connects to the other processes of a distributed run (UiSettings::rank of
+// UiSettings::ranks) and returns this one's slab of the grid. Falls back to
+// simulating everything here if that fails.
+bool Engine::joinRanks( Grid &slab )
+{
+    QString address = UiSettings::address();
+    if ( address.isEmpty() ) {
+        address = ( UiSettings::transport() == Communicator::TCP ) ? QString( "127.0.0.1:47200" ) : QString( "snow_run" );
+    }
+    LOG( "Rank %d of %d waiting for the others at %s...", UiSettings::rank(), UiSettings::ranks(), STR(address) );
+    m_communicator = Communicator::create( (Communicator::Transport)UiSettings::transport(), UiSettings::rank(), UiSettings::ranks(),
+                                           address.toStdString() );
+    if ( m_communicator ) {
+        m_halo = new Halo;
+        if ( createHalo(m_halo, m_communicator, m_grid, &slab) ) return true;
+        SAFE_DELETE( m_halo );
+        SAFE_DELETE( m_communicator );
+    }
+    LOG( "Couldn't start the distributed run; simulating the whole grid on this process." );
+    return false;
+}
+
+void Engine::leaveRanks()
+{
+    if ( m_halo ) {
+        destroyHalo( m_halo );
+        SAFE_DELETE( m_halo );
+    }
+    SAFE_DELETE( m_communicator );
+}
+
+void Engine::freeDomains()
+{
+    for ( int i = 0; i < m_domains.size(); ++i ) {
+        freeDomainResources( m_domains[i] );
+    }
+    m_domains.clear();
+}
+
+// A single domain around all the particles. Returns false if the current one can stay.
+bool Engine::fitDomains( QVector<Grid> &domains ) const
+{
+    vec3 min, max;
+    computeParticleBounds( m_devParticles, m_particleSystem->size(), min, max );
+    Grid domain;
+    bool changed = fitDomain( m_grid, m_domains.empty() ? m_grid : m_domains[0].grid, min, max, domain );
+    if ( !changed && !m_domains.empty() ) return false;
+    domains.clear();
+    domains += domain;
+    return true;
+}
+
+/**
+ * A domain around each cluster of particles, from the occupancy of the grid's
+ * blocks. Returns false if the current domains can stay: each cluster is still
+ * inside one of them, and together they aren't more than twice the size of a
+ * fresh fit (which catches clusters that split or shrink).
+ */
+bool Engine::clusterDomains( QVector<Grid> &domains ) const
+{
+    glm::ivec3 blocks = blockCount( m_grid );
+    markOccupiedBlocks( m_devParticles, m_particleSystem->size(), m_grid, DOMAIN_BLOCK, DOMAIN_MARGIN, m_devBlockFlags );
+    QVector<bool> flags( blockTotal(blocks) );
+    checkCudaErrors( cudaMemcpy(flags.data(), m_devBlockFlags, flags.size()*sizeof(bool), cudaMemcpyDeviceToHost) );
+
+    QVector<BlockBox> clusters, boxes;
+    findBlockClusters( flags.data(), blocks, clusters );
+    if ( clusters.empty() ) return false;
+    mergeClusterBoxes( clusters, blocks, boxes );
+
+    domains.clear();
+    index_t fitCells = 0;
+    for ( int i = 0; i < boxes.size(); ++i ) {
+        domains += cellsDomain( m_grid, boxes[i].lo*DOMAIN_BLOCK, glm::min(boxes[i].hi*DOMAIN_BLOCK, m_grid.dim) );
+        fitCells += domains.last().cellCount();
+    }
+
+    bool holds = !m_domains.empty();
+    index_t currentCells = 0;
+    for ( int i = 0; i < m_domains.size(); ++i ) currentCells += m_domains[i].grid.cellCount();
+    for ( int c = 0; c < clusters.size() && holds; ++c ) {
+        glm::ivec3 needLo = clusters[c].lo*DOMAIN_BLOCK, needHi = glm::min( clusters[c].hi*DOMAIN_BLOCK, m_grid.dim );
+        bool inside = false;
+        for ( int i = 0; i < m_domains.size() && !inside; ++i ) {
+            glm::ivec3 lo, hi;
+            domainCells( m_grid, m_domains[i].grid, lo, hi );
+            inside = glm::all( glm::lessThanEqual(lo, needLo) ) && glm::all( glm::greaterThanEqual(hi, needHi) );
+        }
+        holds = inside;
+    }
+    return !holds || currentCells > 2*fitCells;
+}
+
+// Refits the domains to the particles, and resizes what is sized by them when
+// they change.
+void Engine::updateDomains()
+{
+    PROFILE_SCOPE( "updateDomains" );
+    QVector<Grid> domains;
+    bool changed;
+    if ( m_devBlockFlags ) {
+        // The copy of the flag was queued behind the last step
+        checkCudaErrors( cudaStreamSynchronize(0) );
+        bool escaped = *m_hostDomainsEscaped;
+        if ( !escaped && m_steps % DOMAIN_CLUSTER_STEPS != 0 ) return;
+        changed = clusterDomains( domains );
+        // Particles that crossed into another domain's cells have to be resorted
+        // even if the domains themselves can stay
+        changed = changed || ( escaped && !domains.empty() );
+    } else {
+        changed = fitDomains( domains );
+    }
+    if ( !changed ) return;
+    setDomains( domains, false );
+    if ( m_domains.size() == 1 ) {
+        const Grid &domain = m_domains[0].grid;
+        LOG( "Domain moved to %d x %d x %d cells at (%g, %g, %g).", domain.dim.x, domain.dim.y, domain.dim.z,
+             domain.pos.x, domain.pos.y, domain.pos.z );
+    } else {
+        LOG( "Particles regrouped into %d domains.", m_domains.size() );
+    }
+}
+
+// Flags the particles that came too close to the edge of their domain in the
+// last step, for the next updateDomains, without waiting for the device
+void Engine::checkDomains()
+{
+    checkCudaErrors( cudaMemsetAsync(m_devDomainsEscaped, 0, sizeof(int)) );
+    for ( int i = 0; i < m_domains.size(); ++i ) {
+        const Domain &domain = m_domains[i];
+        flagEscapedParticles( m_devParticles + domain.firstParticle, domain.particleCount, m_grid, domain.grid, DOMAIN_MARGIN, m_devDomainsEscaped );
+    }
+    checkCudaErrors( cudaMemcpyAsync(m_hostDomainsEscaped, m_devDomainsEscaped, sizeof(int), cudaMemcpyDeviceToHost) );
+}
+
+// The working nodes in the layout of the whole grid. Smaller domains are
+// expanded into the back snapshot, which the worker owns.
+const Node* Engine::gridNodes()
+{
+    if ( m_domains.size() == 1 && m_domains[0].grid.dim == m_grid.dim ) return m_domains[0].devNodes;
+    Node *nodes = m_devNodeSnapshots[m_snapshotBack];
+    checkCudaErrors( cudaMemset(nodes, 0, m_grid.nodeCount()*sizeof(Node)) );
+    for ( int i = 0; i < m_domains.size(); ++i ) {
+        expandDomainNodes( m_domains[i].devNodes, m_domains[i].grid, nodes, m_grid );
+    }
+    return nodes;
+}
+
+// After migrateParticles grew the particles. The caches only hold values
+// within a step, so nothing is carried over.
+void Engine::growParticleCaches()
+{
+    MemoryPlan plan;
+    planDomainMemory( m_grid, &plan );
+    destroyParticleCache( m_hostParticleCache );
+    createParticleCache( m_hostParticleCache, m_particleCapacity, plan );
+    for ( int i = 0; i < m_domains.size(); ++i ) {
+        Domain &domain = m_domains[i];
+        *domain.hostParticleCache = particleCacheRange( *m_hostParticleCache, domain.firstParticle );
+        checkCudaErrors( cudaMemcpy(domain.devParticleCache, domain.hostParticleCache, sizeof(ParticleCache), cudaMemcpyHostToDevice) );
+    }
 }
 
 void Engine::freeCudaResources()
@@ -283,25 +1259,64 @@ void Engine::freeCudaResources()
     LOG( "Freeing CUDA resources..." );
     unregisterVBO( m_particlesResource );
     unregisterVBO( m_nodesResource );
-    cudaFree( m_devGrid );
     cudaFree( m_devColliders );
-    cudaFree( m_devNodeCaches );
+
+    freeDomains();
+    leaveRanks();
+
+    cudaFree( m_devBlockFlags );
+    cudaFree( m_devBlockDomains );
+    cudaFree( m_devDomainsEscaped );
+    cudaFreeHost( m_hostDomainsEscaped );
+    m_devBlockFlags = NULL;
+    m_devBlockDomains = NULL;
+    m_devDomainsEscaped = NULL;
+    m_hostDomainsEscaped = NULL;
+
+    cudaFree( m_devParticles );
+    m_devParticles = NULL;
+    if ( m_particleStream ) {
+        destroyParticleStream( m_particleStream );
+        SAFE_DELETE( m_particleStream );
+    }
+    cudaFreeHost( m_hostSnapshotSample );
+    cudaEventDestroy( m_sampleEvent );
+    m_hostSnapshotSample = NULL;
+    m_sampleEvent = NULL;
+    if ( m_particleFile ) {
+        m_particleFile->close();
+        QFile::remove( particleFilePath() );
+        SAFE_DELETE( m_particleFile );
+    }
+    for ( int i = 0; i < 3; ++i ) {
+        cudaFree( m_devParticleSnapshots[i] );
+        cudaFree( m_devNodeSnapshots[i] );
+        cudaEventDestroy( m_snapshotEvents[i] );
+        m_devParticleSnapshots[i] = NULL;
+        m_devNodeSnapshots[i] = NULL;
+        m_snapshotEvents[i] = NULL;
+    }
+    cudaStreamDestroy( m_guiStream );
+    m_guiStream = NULL;
 
     // Free the particle cache using the host structure
-    cudaFree( m_hostParticleCache->sigmas );
-    cudaFree( m_hostParticleCache->Aps );
-    cudaFree( m_hostParticleCache->FeHats );
-    cudaFree( m_hostParticleCache->ReHats );
-    cudaFree( m_hostParticleCache->SeHats );
-    cudaFree( m_hostParticleCache->dFs );
+    destroyParticleCache( m_hostParticleCache );
     SAFE_DELETE( m_hostParticleCache );
-    cudaFree( m_devParticleCache );
+
+    if ( m_arena ) {
+        destroyDeviceArena( m_arena );
+        SAFE_DELETE( m_arena );
+    }
+
+    cudaFree( m_devExportNodes );
+    m_devExportNodes = NULL;
 
     cudaFree( m_devMaterial );
 }
 
 void Engine::render()
 {
+    if ( m_running && acquireSnapshot() ) copySnapshotToBuffers();
     if ( UiSettings::showParticles() ) m_particleSystem->render();
     if ( UiSettings::showGridData() && m_running ) m_particleGrid->render();
 }
@@ -14,11 +14,22 @@
 /**
  * @brief class that handles simulation and update of the ParticleSystem.
  * Simulates the ParticleSystem without drawing
+ *
+ * The simulation runs on its own thread (see SimulationThread in engine.cpp)
+ * as fast as the solver allows. After a step, if the GUI took the last one,
+ * the worker publishes the particle and node state into a triple-buffered
+ * device snapshot, which the GUI thread copies into the OpenGL buffers when
+ * it renders. Pause, resume
+ * and stop requests are passed to the worker through a small command queue.
  */
 
+#include <QAtomicInt>
+#include <QMutex>
 #include <QObject>
-#include <QTimer>
+#include <QQueue>
+#include <QString>
 #include <QVector>
+#include <QWaitCondition>
 
 #include "common/renderable.h"
 #include "geometry/grid.h"
@@ -26,16 +37,33 @@
 #include "sim/material.h"
 
 struct cudaGraphicsResource;
+struct CUevent_st;
+struct CUstream_st;
 
+class Communicator;
+class ParticleFile;
+
+struct DeviceArena;
+struct ExportNode;
+struct Halo;
+struct MemoryPlan;
+struct Multigrid;
 struct Node;
 struct NodeCache;
 struct Particle;
+struct ParticleBins;
+struct StiffnessMatrix;
 struct ParticleCache;
 struct ParticleGrid;
+struct ParticleStream;
 struct ParticleSystem;
+struct SleepState;
 
 struct MitsubaExporter;
 
+class SimulationThread;
+class StepGraph;
+
 class Engine : public QObject, public Renderable
 {
 
@@ -53,7 +81,8 @@ public:
     void stop();
     void reset();
 
-    float getSimulationTime() { return m_time; }
+    // Time of the last snapshot the GUI acquired
+    float getSimulationTime() { return m_snapshotTime; }
 
     void addParticleSystem( const ParticleSystem &particles );
     void clearParticleSystem();
@@ -82,44 +111,221 @@ public:
     virtual BBox getBBox( const glm::mat4 &ctm );
     virtual vec3 getCentroid( const glm::mat4 &ctm );
 
-public slots:
+signals:
+
+    // Emitted by the simulation thread when run reaches UiSettings::maxTime(),
+    // as it was when the run started
+    void simulationCompleted( int run );
 
-    void update();
+private slots:
+
+    // Called on the GUI thread once the simulation thread has finished a run
+    void simulationFinished( int run );
 
 private:
 
-    QTimer m_ticker;
+    friend class SimulationThread;
+
+    enum Command { PAUSE, RESUME, STOP };
+
+    // Worker thread and the commands waiting for it
+    SimulationThread *m_thread;
+    QMutex m_commandMutex;
+    QWaitCondition m_commandCondition;
+    QQueue<Command> m_commands;
+
+    // Counts the runs started, so a queued simulationCompleted from a run
+    // that was already stopped can't stop the next one
+    int m_run;
+
+    // The UiSettings a run simulates with, copied when it starts, so that the
+    // worker never reads settings the GUI may be changing under it
+    struct Settings
+    {
+        float timeStep;
+        float maxTime;
+        bool implicit;
+        bool deterministic;
+        int preconditioner;
+        float solverTolerance;
+        int implicitOperator;
+        bool tiledG2P;
+        bool autoDomain;
+        bool multiDomain;
+        int sleepSteps;
+        float sleepSpeed;
+        float sleepStrainRate;
+    };
+    Settings m_settings;
 
     // CPU data structures
     ParticleSystem *m_particleSystem;
     ParticleGrid *m_particleGrid;
     Grid m_grid;
+
+    /**
+     * Part of m_grid simulated on its own nodes, by the particles in
+     * [firstParticle, firstParticle+particleCount). Everything sized by the
+     * grid nodes belongs to a domain.
+     */
+    struct Domain
+    {
+        Grid grid;
+        index_t firstParticle;
+        index_t particleCount;
+        index_t nodeCapacity; // nodes allocated in devNodes and nodeCaches
+
+        Grid *devGrid;
+        Node *devNodes;
+        NodeCache *nodeCaches; // host struct of device channels
+
+        // Views of the domain's particles in the engine's particle caches
+        ParticleCache *hostParticleCache;
+        ParticleCache *devParticleCache;
+
+        // Only allocated in deterministic mode or with the tiled G2P
+        ParticleBins *particleBins;
+
+        // Only allocated with the multigrid preconditioner
+        Multigrid *multigrid;
+
+        // Only allocated when the implicit solve may assemble its matrix
+        StiffnessMatrix *stiffness;
+
+        // Only allocated with UiSettings::sleepSteps. Starts over, all awake,
+        // whenever the domains change.
+        SleepState *sleep;
+
+        // Streams of the domain's step, so that domains overlap on the device
+        StepGraph *graph;
+    };
+
+    // All of m_grid, or with UiSettings::autoDomain a block-aligned box around
+    // the particles, or with UiSettings::multiDomain one around each cluster of
+    // them. Domains never share nodes.
+    QVector<Domain> m_domains;
     QVector<ImplicitCollider> m_colliders;
 
     // CUDA pointers
     cudaGraphicsResource *m_particlesResource; // Particles
     cudaGraphicsResource *m_nodesResource; // Particle grid nodes
-    Grid *m_devGrid;
-
-    NodeCache *m_devNodeCaches;
 
+    // Working state owned by the simulation thread. With several domains the
+    // particles are sorted by domain.
+    Particle *m_devParticles;
+
+    // Triple-buffered snapshot of m_devParticles and the domain nodes. The worker owns the
+    // back buffer, the GUI owns the front buffer, and the two swap with the middle
+    // one atomically. m_snapshotMiddle holds the middle index plus a dirty bit.
+    Particle *m_devParticleSnapshots[3];
+    Node *m_devNodeSnapshots[3];
+    int m_snapshotBack;
+    int m_snapshotFront;
+    QAtomicInt m_snapshotMiddle;
+    // Recorded behind the worker's copies into each snapshot, for the GUI's
+    // copies out of it to wait on, on a stream of the GUI's own
+    CUevent_st *m_snapshotEvents[3];
+    CUstream_st *m_guiStream;
+
+    // m_time of each snapshot, and of the front one for the GUI
+    float m_snapshotTimes[3];
+    float m_snapshotTime;
+    // Particles in each snapshot, which is all of them unless distributed or
+    // out of core, and particles each snapshot holds
+    index_t m_snapshotParticles[3];
+    index_t m_snapshotCapacities[3];
+
+    // Particles this process simulates, the first of m_devParticles, and
+    // particles m_devParticles and the particle caches hold. Only distributed
+    // runs hold more than they simulate, for particles arriving.
+    index_t m_localParticles;
+    index_t m_particleCapacity;
+
+    // Only with UiSettings::ranks above 1: this process simulates one slab of
+    // m_grid (see createHalo) and trades particles with the neighboring ranks
+    // after every step
+    Communicator *m_communicator;
+    Halo *m_halo;
+
+    // Only with UiSettings::outOfCore: the working particles stay in a file on
+    // the host, and are streamed through the device every step, instead of
+    // living in m_devParticles
+    ParticleFile *m_particleFile;
+    ParticleStream *m_particleStream;
+    // The snapshots then only hold an even sample of the file, a stream chunk
+    // of it at most, gathered here (pinned) and uploaded behind the step. The
+    // event is recorded behind the upload, before the buffer is refilled.
+    Particle *m_hostSnapshotSample;
+    CUevent_st *m_sampleEvent;
+
+    // Only the buffers the mode needs (see planMemory)
     ParticleCache *m_hostParticleCache;
-    ParticleCache *m_devParticleCache;
+
+    // Temporaries of the one-time setup passes
+    DeviceArena *m_arena;
+
+    // Only allocated when exporting volumes
+    ExportNode *m_devExportNodes;
+
+    // Only allocated with UiSettings::multiDomain: block occupancy and the
+    // domain of each block
+    bool *m_devBlockFlags;
+    int *m_devBlockDomains;
+    // Set after each step if a particle came too close to the edge of its
+    // domain, and copied back to pinned memory for the next updateDomains
+    int *m_devDomainsEscaped;
+    int *m_hostDomainsEscaped;
 
     ImplicitCollider *m_devColliders;
     Material *m_devMaterial;
 
     float m_time;
 
-    bool m_busy;
+    // Solver iterations over the run, to report on stop
+    int m_steps;
+    int m_solverIterations;
+
     bool m_running;
     bool m_paused;
+    bool m_simulationPaused; // worker's view of m_paused, guarded by m_commandMutex
     bool m_export;
 
     MitsubaExporter * m_exporter;
 
+    // Prefix for exported volumes and profiler output
+    QString m_outputPrefix;
+
     void initializeCudaResources();
     void freeCudaResources();
+    void planDomainMemory( const Grid &domain, MemoryPlan *plan ) const;
+    float setDomains( const QVector<Grid> &domains, bool log );
+    float allocateDomainResources( Domain &domain, index_t nodeCapacity, bool log );
+    bool reuseDomainResources( Domain &domain, const Domain &old );
+    void freeDomainResources( Domain &domain );
+    void freeDomains();
+    bool joinRanks( Grid &slab );
+    Particle* mapParticleVBO();
+    bool createParticleFile();
+    void leaveRanks();
+
+    // Simulation thread
+    void simulate();
+    bool processCommands();
+    void step();
+    void stepDomains();
+    bool fitDomains( QVector<Grid> &domains ) const;
+    bool clusterDomains( QVector<Grid> &domains ) const;
+    void updateDomains();
+    void checkDomains();
+    const Node* gridNodes();
+    void growParticleCaches();
+    index_t uploadParticleSample( Particle *snapshot );
+    void publishSnapshot();
+
+    // GUI thread
+    void postCommand( Command command );
+    bool acquireSnapshot();
+    void copySnapshotToBuffers();
 
 };
 
@@ -17,6 +17,12 @@
 #include "material.h"
 #include "cuda/matrix.h"
 
+// The snow model only uses det(Fp), so particles just track the plastic
+// Jacobian. Define FULL_PLASTIC_F for models that need the whole plastic
+// deformation gradient (costs 36 bytes per particle and two matrix products
+// per step).
+// #define FULL_PLASTIC_F
+
 struct Particle
 {
     vec3 position;
@@ -24,7 +30,10 @@ struct Particle
     float mass;
     float volume;
     mat3 elasticF;
+#ifdef FULL_PLASTIC_F
     mat3 plasticF;
+#endif
+    float plasticJ; // det(plasticF)
     Material material;
 
     __host__ __device__ Particle()
@@ -34,7 +43,10 @@ struct Particle
         mass = 1e-6;
         volume = 1e-9;
         elasticF = mat3( 1.f );
+#ifdef FULL_PLASTIC_F
         plasticF = mat3( 1.f );
+#endif
+        plasticJ = 1.f;
         material = Material(); // default
     }
 };
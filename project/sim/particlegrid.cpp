@@ -8,6 +8,8 @@
 **
 **************************************************************************/
 
+#include <cstddef>
+
 #include <GL/glew.h>
 #include <GL/gl.h>
 #include <QGLShaderProgram>
@@ -56,6 +58,7 @@ ParticleGrid::render()
             shader->setUniformValue( "pos", m_grid.pos.x, m_grid.pos.y, m_grid.pos.z );
             shader->setUniformValue( "dim", (float)m_grid.dim.x, (float)m_grid.dim.y, (float)m_grid.dim.z );
             shader->setUniformValue( "h", m_grid.h );
+            shader->setUniformValue( "blockedNodes", (GLint)Grid::blockedNodes() );
             shader->setUniformValue( "density", UiSettings::fillDensity() );
             shader->setUniformValue( "mode", UiSettings::showGridDataMode() );
         } else {
@@ -79,7 +82,7 @@ ParticleGrid::render()
 
         glBindVertexArray( m_glVAO );
         glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, m_glIndices );
-        glDrawElements( GL_POINTS, m_size, GL_UNSIGNED_INT, (void*)(0) );
+        glDrawElements( GL_POINTS, (GLsizei)m_size, GL_UNSIGNED_INT, (void*)(0) );
         glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
         glBindVertexArray( 0 );
 
@@ -127,11 +130,11 @@ ParticleGrid::buildBuffers()
 
     // Velocity attribute
     glEnableVertexAttribArray( 1 );
-    glVertexAttribPointer( 1, 3, GL_FLOAT, GL_FALSE, sizeof(Node), (void*)(sizeof(GLfloat)) );
+    glVertexAttribPointer( 1, 3, GL_FLOAT, GL_FALSE, sizeof(Node), (void*)(offsetof(Node, velocity)) );
 
     // Force attribute
     glEnableVertexAttribArray( 2 );
-    glVertexAttribPointer( 2, 3, GL_FLOAT, GL_FALSE, sizeof(Node), (void*)(sizeof(GLfloat)+2*sizeof(vec3)) );
+    glVertexAttribPointer( 2, 3, GL_FLOAT, GL_FALSE, sizeof(Node), (void*)(offsetof(Node, force)) );
 
     glBindVertexArray( 0 );
     glBindBuffer( GL_ARRAY_BUFFER, 0 );
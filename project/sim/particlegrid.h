@@ -36,8 +36,8 @@ public:
 
     GLuint vbo() { if ( !hasBuffers() ) buildBuffers(); return m_glVBO; }
 
-    inline int size() const { return m_size; }
-    inline int nodeCount() const { return m_size; }
+    inline index_t size() const { return m_size; }
+    inline index_t nodeCount() const { return m_size; }
 
     virtual BBox getBBox( const glm::mat4 &ctm );
     virtual vec3 getCentroid( const glm::mat4 &ctm );
@@ -52,7 +52,7 @@ protected:
     static QGLShaderProgram* shader();
 
     Grid m_grid;
-    int m_size;
+    index_t m_size;
     GLuint m_glIndices;
     GLuint m_glVBO;
     GLuint m_glVAO;
@@ -13,16 +13,43 @@
 
 #include "geometry/grid.h"
 
+#include "cuda/half.h"
 #include "cuda/matrix.h"
 #include "cuda/vector.h"
 
+// Node fields that P2G accumulates with atomics (mass, velocity, force) have
+// to stay float, but velocityChange is only written by the grid update and
+// read back in G2P. Building with CONFIG+=half_nodes (see snow.pro) defines
+// HALF_NODE_STORAGE, which stores it at half precision and shrinks Node from
+// 40 to 36 bytes (grid clears, snapshots and G2P reads). It holds the
+// pre-update velocity until the update turns it into the change, so the FLIP
+// part of G2P is off by up to 2^-11 of the node speed each step (see the
+// 'halfNodes' test).
+
+#ifdef HALF_NODE_STORAGE
+typedef hvec3 nodevec3;
+#else
+typedef vec3 nodevec3;
+#endif
+
 struct Node
 {  
     float mass;
     vec3 velocity;
-    vec3 velocityChange; // v_n+1 - v_n (store this value through steps 4,5,6)
+    nodevec3 velocityChange; // v_n+1 - v_n (store this value through steps 4,5,6)
     vec3 force;
     Node() : mass(0), velocity(0,0,0), force(0,0,0) {}
 };
 
+/**
+ * The node channels the volume exporter writes, packed at half precision.
+ * Copying these instead of whole Nodes cuts the device to host transfer for
+ * each exported frame from 40 to 8 bytes per node.
+ */
+struct ExportNode
+{
+    half_t density;
+    hvec3 velocity;
+};
+
 #endif // PARTICLEGRIDNODE_H
@@ -10,18 +10,25 @@
 
 #include "sim/particlesystem.h"
 
+#include <cstddef>
+
 #include <GL/glew.h>
 #include <GL/gl.h>
 #include <QGLShaderProgram>
 
 #include "common/common.h"
+#include "common/threadpool.h"
 #include "geometry/bbox.h"
 #include "ui/uisettings.h"
 
+// Particles per pool task
+#define PARTICLE_GRAIN 16384
+
 ParticleSystem::ParticleSystem()
 {
     m_glVBO = 0;
     m_glVAO = 0;
+    m_renderCount = -1;
 }
 
 ParticleSystem::~ParticleSystem()
@@ -58,7 +65,7 @@ ParticleSystem::render()
     glHint( GL_POINT_SMOOTH_HINT, GL_NICEST );
 
     glBindVertexArray( m_glVAO );
-    glDrawArrays( GL_POINTS, 0, m_particles.size() );
+    glDrawArrays( GL_POINTS, 0, ( m_renderCount >= 0 ) ? MIN(m_renderCount, m_particles.size()) : m_particles.size() );
     glBindVertexArray( 0 );
 
     if ( shader ) {
@@ -109,11 +116,9 @@ ParticleSystem::buildBuffers()
     // Volume attribute
     glEnableVertexAttribArray( 3 );
     glVertexAttribPointer( 3, 1, GL_FLOAT, GL_FALSE, sizeof(Particle), (void*)offset );
-    offset += sizeof(GLfloat);
-    offset += 2*sizeof(mat3);
 
     // lambda (stiffness) attribute
-    offset += 2*sizeof(GLfloat); // skip to material.xi
+    offset = offsetof( Particle, material ) + 2*sizeof(GLfloat); // skip to material.xi
     glEnableVertexAttribArray(4);
     glVertexAttribPointer( 4, 1, GL_FLOAT, GL_FALSE, sizeof(Particle), (void*)offset);
     offset += sizeof(GLfloat);
@@ -139,11 +144,20 @@ ParticleSystem::deleteBuffers()
 BBox
 ParticleSystem::getBBox( const glm::mat4 &ctm )
 {
+    const Particle *particles = m_particles.constData();
+    QVector<BBox> boxes( ThreadPool::chunkCount(m_particles.size(), PARTICLE_GRAIN) );
+    ThreadPool::instance().parallelForChunks( m_particles.size(), PARTICLE_GRAIN, [&]( index_t chunk, index_t begin, index_t end ) {
+        BBox box;
+        for ( index_t i = begin; i < end; ++i ) {
+            const vec3 &p = particles[i].position;
+            glm::vec4 point = ctm * glm::vec4( glm::vec3(p), 1.f );
+            box += vec3( point.x, point.y, point.z );
+        }
+        boxes[chunk] = box;
+    });
     BBox box;
-    for ( int i = 0; i < m_particles.size(); ++i ) {
-        const vec3 &p = m_particles[i].position;
-        glm::vec4 point = ctm * glm::vec4( glm::vec3(p), 1.f );
-        box += vec3( point.x, point.y, point.z );
+    for ( int i = 0; i < boxes.size(); ++i ) {
+        box += boxes[i];
     }
     return box;
 }
@@ -151,11 +165,21 @@ ParticleSystem::getBBox( const glm::mat4 &ctm )
 vec3
 ParticleSystem::getCentroid( const glm::mat4 &ctm )
 {
+    // Chunk sums added in order, so the result doesn't depend on scheduling
+    const Particle *particles = m_particles.constData();
+    QVector<vec3> sums( ThreadPool::chunkCount(m_particles.size(), PARTICLE_GRAIN) );
+    ThreadPool::instance().parallelForChunks( m_particles.size(), PARTICLE_GRAIN, [&]( index_t chunk, index_t begin, index_t end ) {
+        vec3 c(0,0,0);
+        for ( index_t i = begin; i < end; ++i ) {
+            const vec3 p = particles[i].position;
+            glm::vec4 point = ctm * glm::vec4( glm::vec3(p), 1.f );
+            c += vec3( point.x, point.y, point.z );
+        }
+        sums[chunk] = c;
+    });
     vec3 c(0,0,0);
-    for ( int i = 0; i < m_particles.size(); ++i ) {
-        const vec3 p = m_particles[i].position;
-        glm::vec4 point = ctm * glm::vec4( glm::vec3(p), 1.f );
-        c += vec3( point.x, point.y, point.z );
+    for ( int i = 0; i < sums.size(); ++i ) {
+        c += sums[i];
     }
     return c / (float)m_particles.size();
 }
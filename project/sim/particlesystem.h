@@ -32,6 +32,9 @@ public:
     inline int size() const { return m_particles.size(); }
     inline void resize( int n ) { m_particles.resize(n); }
 
+    // Only draws the first count particles, or all of them if count is negative
+    void setRenderCount( int count ) { m_renderCount = count; }
+
     Particle* data() { return m_particles.data(); }
     const QVector<Particle>& getParticles() const { return m_particles; }
     QVector<Particle>& particles() { return m_particles; }
@@ -61,6 +64,7 @@ protected:
     QVector<Particle> m_particles;
     GLuint m_glVBO;
     GLuint m_glVAO;
+    int m_renderCount;
 
 };
 
@@ -0,0 +1,241 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   profiler.cpp
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include "common/common.h"
+#include "common/math.h"
+#include "sim/profiler.h"
+
+// Timeline events and per-frame statistics are capped so long runs don't
+// grow without bound. Totals are always kept.
+#define MAX_TRACE_EVENTS (1 << 21)
+#define MAX_FRAMES (1 << 16)
+
+bool Profiler::ENABLED = false;
+double Profiler::ORIGIN = 0.0;
+int Profiler::FRAME_COUNT = 0;
+double Profiler::FRAME_START = 0.0;
+
+std::vector<Profiler::Event> Profiler::EVENTS;
+std::vector<Profiler::Frame> Profiler::FRAMES;
+std::vector<Profiler::OpenScope> Profiler::STACK;
+std::map<std::string, Profiler::Stat> Profiler::TOTALS;
+
+void
+Profiler::Stat::add( double t )
+{
+    min = ( calls == 0 || t < min ) ? t : min;
+    max = ( calls == 0 || t > max ) ? t : max;
+    total += t;
+    calls++;
+}
+
+double
+Profiler::now()
+{
+    timeval tv;
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec*1e6 + tv.tv_usec - ORIGIN;
+}
+
+void
+Profiler::sync()
+{
+    cudaDeviceSynchronize();
+}
+
+void
+Profiler::setEnabled( bool enabled )
+{
+    if ( enabled && !ENABLED ) clear();
+    ENABLED = enabled;
+}
+
+void
+Profiler::clear()
+{
+    EVENTS.clear();
+    FRAMES.clear();
+    STACK.clear();
+    TOTALS.clear();
+    FRAME_COUNT = 0;
+    ORIGIN = 0.0;
+    ORIGIN = now();
+}
+
+void
+Profiler::beginFrame( float simTime )
+{
+    if ( !ENABLED ) return;
+    sync();
+    FRAME_START = now();
+    if ( FRAMES.size() < MAX_FRAMES ) {
+        Frame frame;
+        frame.index = FRAME_COUNT;
+        frame.simTime = simTime;
+        frame.start = FRAME_START;
+        frame.duration = 0.0;
+        FRAMES.push_back( frame );
+    }
+    ++FRAME_COUNT;
+}
+
+// The frame being recorded, or NULL past MAX_FRAMES
+Profiler::Frame*
+Profiler::currentFrame()
+{
+    return ( !FRAMES.empty() && FRAMES.back().index == FRAME_COUNT-1 ) ? &FRAMES.back() : NULL;
+}
+
+void
+Profiler::endFrame()
+{
+    if ( !ENABLED || FRAME_COUNT == 0 ) return;
+    sync();
+    double duration = now() - FRAME_START;
+    if ( Frame *frame = currentFrame() ) frame->duration = duration;
+    TOTALS["frame"].add( duration );
+}
+
+void
+Profiler::begin( const char *name )
+{
+    if ( !ENABLED ) return;
+    sync();
+    OpenScope scope;
+    scope.name = name;
+    scope.start = now();
+    STACK.push_back( scope );
+}
+
+void
+Profiler::end()
+{
+    // Scopes opened before enabling were never pushed, and enabling clears
+    // the ones still open from before disabling
+    if ( !ENABLED || STACK.empty() ) return;
+    sync();
+    double t = now();
+    const OpenScope scope = STACK.back();
+    STACK.pop_back();
+
+    double duration = t - scope.start;
+    TOTALS[scope.name].add( duration );
+    if ( Frame *frame = currentFrame() ) frame->stages[scope.name].add( duration );
+
+    if ( EVENTS.size() < MAX_TRACE_EVENTS ) {
+        Event event;
+        event.name = scope.name;
+        event.phase = 'X';
+        event.start = scope.start;
+        event.duration = duration;
+        event.depth = STACK.size();
+        EVENTS.push_back( event );
+    }
+}
+
+void
+Profiler::counter( const char *name, double value )
+{
+    if ( !ENABLED || EVENTS.size() >= MAX_TRACE_EVENTS ) return;
+    Event event;
+    event.name = name;
+    event.phase = 'C';
+    event.start = now();
+    event.duration = value;
+    event.depth = STACK.size();
+    EVENTS.push_back( event );
+}
+
+double
+Profiler::totalTime( const char *name, int *calls )
+{
+    std::map<std::string, Stat>::const_iterator it = TOTALS.find( name );
+    if ( calls ) *calls = ( it != TOTALS.end() ) ? it->second.calls : 0;
+    return ( it != TOTALS.end() ) ? it->second.total/1e3 : 0.0;
+}
+
+bool
+Profiler::exportChromeTrace( const char *filename )
+{
+    FILE *file = fopen( filename, "w" );
+    if ( !file ) {
+        LOG( "Profiler: Unable to open file %s.", filename );
+        return false;
+    }
+
+    fprintf( file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+    bool first = true;
+    for ( unsigned int i = 0; i < FRAMES.size(); ++i, first = false ) {
+        const Frame &frame = FRAMES[i];
+        fprintf( file, "%s{\"name\":\"frame %d\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"simTime\":%g}}",
+                 first ? "" : ",\n", frame.index, frame.start, frame.duration, frame.simTime );
+    }
+    for ( unsigned int i = 0; i < EVENTS.size(); ++i, first = false ) {
+        const Event &event = EVENTS[i];
+        if ( event.phase == 'C' ) {
+            fprintf( file, "%s{\"name\":\"%s\",\"ph\":\"C\",\"pid\":0,\"tid\":1,\"ts\":%.3f,\"args\":{\"value\":%.10g}}",
+                     first ? "" : ",\n", event.name, event.start, event.duration );
+        } else {
+            fprintf( file, "%s{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":0,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"depth\":%d}}",
+                     first ? "" : ",\n", event.name, event.start, event.duration, event.depth );
+        }
+    }
+    fprintf( file, "\n]}\n" );
+    fclose( file );
+
+    LOGIF( EVENTS.size() >= MAX_TRACE_EVENTS, "Profiler: trace truncated to %d events.", MAX_TRACE_EVENTS );
+    LOG( "Profiler: trace written to %s", filename );
+    return true;
+}
+
+bool
+Profiler::exportCSV( const char *filename )
+{
+    FILE *file = fopen( filename, "w" );
+    if ( !file ) {
+        LOG( "Profiler: Unable to open file %s.", filename );
+        return false;
+    }
+
+    fprintf( file, "frame,sim_time,stage,calls,total_ms,min_ms,max_ms\n" );
+    for ( unsigned int i = 0; i < FRAMES.size(); ++i ) {
+        const Frame &frame = FRAMES[i];
+        fprintf( file, "%d,%g,frame,1,%.6f,%.6f,%.6f\n", frame.index, frame.simTime,
+                 frame.duration/1e3, frame.duration/1e3, frame.duration/1e3 );
+        for ( std::map<std::string, Stat>::const_iterator it = frame.stages.begin(); it != frame.stages.end(); ++it ) {
+            const Stat &stat = it->second;
+            fprintf( file, "%d,%g,%s,%d,%.6f,%.6f,%.6f\n", frame.index, frame.simTime, it->first.c_str(),
+                     stat.calls, stat.total/1e3, stat.min/1e3, stat.max/1e3 );
+        }
+    }
+    fclose( file );
+
+    LOGIF( FRAME_COUNT > MAX_FRAMES, "Profiler: summary truncated to the first %d of %d frames.", MAX_FRAMES, FRAME_COUNT );
+    LOG( "Profiler: frame summary written to %s", filename );
+    return true;
+}
+
+void
+Profiler::logSummary()
+{
+    std::map<std::string, Stat>::const_iterator frame = TOTALS.find( "frame" );
+    double frameTotal = ( frame != TOTALS.end() ) ? frame->second.total : 0.0;
+    LOG( "Profiler: %d frames, %.2f ms/frame", FRAME_COUNT, FRAME_COUNT == 0 ? 0.0 : frameTotal/1e3/FRAME_COUNT );
+    for ( std::map<std::string, Stat>::const_iterator it = TOTALS.begin(); it != TOTALS.end(); ++it ) {
+        const Stat &stat = it->second;
+        LOG( "    %-28s %8d calls %10.3f ms %8.3f ms/call %6.2f%%", it->first.c_str(), stat.calls, stat.total/1e3,
+             stat.total/1e3/MAX(stat.calls,1), ( frameTotal > 0.0 ) ? 100.0*stat.total/frameTotal : 0.0 );
+    }
+}
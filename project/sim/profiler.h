@@ -0,0 +1,129 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   profiler.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+/**
+ * @brief Per-stage simulation profiler.
+ *
+ * Stages are timed with PROFILE_SCOPE( "name" ), which opens a ScopedTimer for
+ * the rest of the enclosing block. Names must be string literals since only
+ * the pointer is stored. Scopes may nest. When the profiler is enabled, every
+ * scope boundary synchronizes the device so that kernel time is attributed to
+ * the stage that launched it.
+ *
+ * Samples are grouped into frames (one simulation step each) by
+ * Profiler::beginFrame()/endFrame(). The recorded timeline can be written as a
+ * Chrome trace (chrome://tracing, Perfetto) and the per-frame stage totals as
+ * CSV. Both are capped, so long runs keep only the first frames and events;
+ * the totals cover every frame.
+ *
+ * Only the simulation thread records. Exports must happen once it has stopped.
+ *
+ * This header is also compiled by nvcc, so it sticks to C++03.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+
+class Profiler
+{
+
+public:
+
+    static void setEnabled( bool enabled );
+    static bool enabled() { return ENABLED; }
+
+    static void clear();
+
+    static void beginFrame( float simTime );
+    static void endFrame();
+
+    static void begin( const char *name );
+    static void end();
+
+    // Records a named value (e.g. a solver residual) at the current time
+    static void counter( const char *name, double value );
+
+    // Total time in milliseconds spent in a stage since clear(), or zero if it never ran
+    static double totalTime( const char *name, int *calls = NULL );
+
+    static bool exportChromeTrace( const char *filename );
+    static bool exportCSV( const char *filename );
+    static void logSummary();
+
+private:
+
+    struct Event
+    {
+        const char *name;
+        char phase; // 'X' complete event, 'C' counter
+        double start; // microseconds since clear()
+        double duration; // microseconds, or counter value
+        int depth;
+    };
+
+    struct Stat
+    {
+        int calls;
+        double total;
+        double min;
+        double max;
+        Stat() : calls(0), total(0.0), min(0.0), max(0.0) {}
+        void add( double t );
+    };
+
+    struct Frame
+    {
+        int index;
+        float simTime;
+        double start;
+        double duration;
+        std::map<std::string, Stat> stages;
+    };
+
+    struct OpenScope
+    {
+        const char *name;
+        double start;
+    };
+
+    static bool ENABLED;
+    static double ORIGIN;
+    static int FRAME_COUNT; // since clear(), recorded in FRAMES or not
+    static double FRAME_START;
+
+    static std::vector<Event> EVENTS;
+    static std::vector<Frame> FRAMES;
+    static std::vector<OpenScope> STACK;
+    static std::map<std::string, Stat> TOTALS;
+
+    static double now();
+    static void sync();
+    static Frame* currentFrame();
+
+};
+
+class ScopedTimer
+{
+
+public:
+
+    ScopedTimer( const char *name ) { Profiler::begin( name ); }
+    ~ScopedTimer() { Profiler::end(); }
+
+};
+
+#define PROFILE_CONCAT_( A, B ) A##B
+#define PROFILE_CONCAT( A, B ) PROFILE_CONCAT_( A, B )
+#define PROFILE_SCOPE( NAME ) ScopedTimer PROFILE_CONCAT( _scopedTimer, __LINE__ )( NAME )
+
+#endif // PROFILER_H
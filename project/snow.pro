@@ -10,7 +10,7 @@ QT       += core gui opengl xml
 LIBS += -lGLEW -lGLEWmx
 DEFINES += GL_GLEXT_PROTOTYPES
 
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets concurrent
 
 TEMPLATE = app
 TARGET = snow
@@ -30,6 +30,8 @@ SOURCES += \
     scene/scene.cpp \
     scene/scenenode.cpp \
     tests/tests.cpp \
+    tests/benchmarks.cpp \
+    tests/scenes.cpp \
     geometry/bbox.cpp \
     sim/engine.cpp \
     io/sceneio.cpp \
@@ -46,7 +48,12 @@ SOURCES += \
     ui/collapsiblebox.cpp \
     scene/scenecollider.cpp \
     sim/implicitcollider.cpp \
-    ui/tools/velocitytool.cpp
+    ui/tools/velocitytool.cpp \
+    sim/profiler.cpp \
+    common/threadpool.cpp \
+    common/hostmemory.cpp \
+    common/communicator.cpp \
+    io/particlefile.cpp
 
 HEADERS  += \
     ui/mainwindow.h \
@@ -61,13 +68,19 @@ HEADERS  += \
     geometry/mesh.h \
     io/objparser.h \
     io/mitsubaexporter.h \
+    io/particlefile.h \
     scene/scene.h \
     scene/scenenode.h \
     common/renderable.h \
     common/types.h \
     tests/tests.h \
+    tests/benchmarks.h \
+    tests/scenes.h \
     geometry/bbox.h \
     common/math.h \
+    common/threadpool.h \
+    common/hostmemory.h \
+    common/communicator.h \
     geometry/grid.h \
     sim/engine.h \
     io/sceneio.h \
@@ -95,13 +108,19 @@ HEADERS  += \
     cuda/vector.h \
     cuda/matrix.h \
     cuda/quaternion.h \
+    cuda/half.h \
+    cuda/preconditioner.h \
+    cuda/stepgraph.h \
+    cuda/halo.h \
+    cuda/sleep.h \
     cuda/weighting.h \
     cuda/noise.h \
     scene/scenecollider.h \
     sim/implicitcollider.h \
     cuda/snowtypes.h \
     cuda/helpers.h \
-    ui/tools/velocitytool.h
+    ui/tools/velocitytool.h \
+    sim/profiler.h
 
 FORMS    += ui/mainwindow.ui
 
@@ -119,7 +138,8 @@ CUDA_SOURCES += cuda/snow.cu \
 #    cuda/wil_tests.cu \
     cuda/simulation.cu \
     cuda/cr_tests.cu \
-    cuda/mem_tests.cu
+    cuda/mem_tests.cu \
+    cuda/benchmarks.cu
 
 CUDA_DIR = /contrib/projects/cuda5-toolkit
 INCLUDEPATH += $$CUDA_DIR/include
@@ -128,6 +148,9 @@ QMAKE_LIBDIR += $$CUDA_DIR/lib64
 
 LIBS += -lcudart -lcuda
 
+# shm_open for the shared memory communicator
+unix: LIBS += -lrt
+
 OTHER_FILES += \
     CUDA_notes.txt \
     cuda/snow.cu \
@@ -140,6 +163,7 @@ OTHER_FILES += \
     cuda/simulation.cu \
     cuda/cr_tests.cu \
     cuda/mem_tests.cu \
+    cuda/benchmarks.cu \
     resources/shaders/particlesystem.vert \
     resources/shaders/particlesystem.frag \
     resources/shaders/particlegrid.frag \
@@ -157,6 +181,15 @@ CUDA_ARCH = sm_21
 # custom NVCC flags
 NVCCFLAGS = --compiler-options -fno-strict-aliasing -use_fast_math --ptxas-options=-v
 
+# Node storage options, for the host and device code alike. Run 'snow -test all'
+# on each build.
+#   CONFIG+=blocked_nodes   4x4x4 tiles of nodes (see geometry/grid.h)
+#   CONFIG+=half_nodes      half precision velocityChange (see sim/particlegridnode.h)
+blocked_nodes: NODE_DEFINES += BLOCKED_NODES
+half_nodes: NODE_DEFINES += HALF_NODE_STORAGE
+DEFINES += $$NODE_DEFINES
+for(define, NODE_DEFINES): NVCCFLAGS += -D$$define
+
 # Prepare the extra compiler configuration (taken from the nvidia forum - i'm not an expert in this part)
 CUDA_INC = $$join(INCLUDEPATH,' -I','-I',' ') -I$$_PRO_FILE_PWD_
 
@@ -0,0 +1,779 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   benchmarks.cpp
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#include "tests/benchmarks.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QVector>
+
+#include "common/common.h"
+#include "common/communicator.h"
+#include "geometry/grid.h"
+#include "io/mitsubaexporter.h"
+#include "io/particlefile.h"
+#include "sim/caches.h"
+#include "sim/implicitcollider.h"
+#include "sim/particle.h"
+#include "sim/particlegridnode.h"
+#include "sim/profiler.h"
+#include "tests/scenes.h"
+#include "ui/uisettings.h"
+
+#include "cuda/functions.h"
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <helper_functions.h>
+#include <helper_cuda.h>
+
+extern "C"
+{
+    float benchmarkSVD( int count, int iterations );
+    float benchmarkPD( int count, int iterations );
+    float benchmarkWeights( int count, int iterations, bool separable );
+}
+
+// Fixed so that results stay comparable across commits and settings, like
+// the scenes (see tests/scenes.h)
+#define BENCHMARK_SOLVER_TOLERANCE 1e-3f
+
+// Cells of the 4x4x4 stencil each particle touches in P2G and G2P
+#define STENCIL_SIZE 64
+
+namespace
+{
+
+struct Options
+{
+    int particles;
+    int grid;
+    int iterations;
+    float tolerance;
+    QString filter;
+    QString out;
+    QString baseline;
+
+    // Distributed runs
+    int ranks;
+    int rank;
+    Communicator::Transport transport;
+    QString address;
+    bool launch;
+};
+
+struct Result
+{
+    QString name;
+    QString unit;
+    double count; // items per iteration
+    int iterations;
+    double ms; // total over all iterations
+    double bytes; // nominal traffic per iteration
+
+    double rate() const { return ( ms > 0.0 ) ? count*iterations/(ms/1e3) : 0.0; }
+    double gbps() const { return ( ms > 0.0 ) ? bytes*iterations/(ms/1e3)/1e9 : 0.0; }
+};
+
+Result
+makeResult( const QString &name, const QString &unit, double count, int iterations, double ms, double bytes )
+{
+    Result result;
+    result.name = name;
+    result.unit = unit;
+    result.count = count;
+    result.iterations = iterations;
+    result.ms = ms;
+    result.bytes = bytes;
+    printf( "    %-14s %10.3f ms %12.4g %s/s %8.2f GB/s\n", STR(name), ms/iterations, result.rate(), STR(unit), result.gbps() );
+    fflush( stdout );
+    return result;
+}
+
+// UV sphere in the mesh VBO layout (position, normal per vertex)
+QVector<vec3>
+createSphereMesh( const Grid &grid, int stacks, int slices )
+{
+    vec3 center = grid.pos + 0.5f*grid.h*vec3( grid.dim.x, grid.dim.y, grid.dim.z );
+    float radius = 0.4f * grid.h * MIN( grid.dim.x, MIN(grid.dim.y, grid.dim.z) );
+
+    QVector<vec3> points;
+    for ( int i = 0; i <= stacks; ++i ) {
+        float theta = M_PI * i / stacks;
+        for ( int j = 0; j <= slices; ++j ) {
+            float phi = 2.f * M_PI * j / slices;
+            points += vec3( sinf(theta)*cosf(phi), cosf(theta), sinf(theta)*sinf(phi) );
+        }
+    }
+
+    QVector<vec3> tris;
+    for ( int i = 0; i < stacks; ++i ) {
+        for ( int j = 0; j < slices; ++j ) {
+            int a = i*(slices+1) + j, b = a + slices + 1;
+            int quad[6] = { a, b, a+1, a+1, b, b+1 };
+            for ( int k = 0; k < 6; ++k ) {
+                tris += center + radius*points[quad[k]];
+                tris += points[quad[k]];
+            }
+        }
+    }
+    return tris;
+}
+
+bool
+benchmarkDecompositions( const Options &options, QVector<Result> &results )
+{
+    int n = options.particles, iterations = options.iterations;
+    results += makeResult( "computeSVD", "matrices", n, iterations, benchmarkSVD(n, iterations), 2.0*n*sizeof(mat3) );
+    results += makeResult( "computePD", "matrices", n, iterations, benchmarkPD(n, iterations), 2.0*n*sizeof(mat3) );
+    results += makeResult( "weights", "particles", n, iterations, benchmarkWeights(n, iterations, false), 2.0*n*sizeof(vec3) );
+    results += makeResult( "weights/separable", "particles", n, iterations, benchmarkWeights(n, iterations, true), 2.0*n*sizeof(vec3) );
+    return true;
+}
+
+/*
+ * Runs full implicit steps on a synthetic cloud and splits the time per stage
+ * with the profiler, so each stage is timed exactly as the engine runs it.
+ * Results get the given suffix, or aren't reported if results is NULL. With
+ * sleepSteps, blocks that stay calm that long sleep, and as many extra warm up
+ * steps give them the chance. Returns the final particle and node state.
+ */
+QByteArray
+runSteps( const Options &options, const QVector<Particle> &particles, bool deterministic, bool tiledG2P, int sleepSteps,
+          Preconditioner preconditioner, ImplicitOperator implicitOperator, const QString &suffix, QVector<Result> *results )
+{
+    SceneOptions sceneOptions;
+    sceneOptions.tolerance = BENCHMARK_SOLVER_TOLERANCE;
+    sceneOptions.preconditioner = preconditioner;
+    sceneOptions.implicitOperator = implicitOperator;
+    sceneOptions.deterministic = deterministic;
+    sceneOptions.tiledG2P = tiledG2P;
+    sceneOptions.sleepSteps = sleepSteps;
+    Scene scene;
+    createScene( &scene, particles, createGrid(options.grid), sceneOptions );
+    index_t numParticles = scene.numParticles, numNodes = scene.numNodes;
+
+    // Warm up
+    for ( int i = 0; i <= sleepSteps; ++i ) stepScene( &scene );
+
+    bool wasEnabled = Profiler::enabled();
+    Profiler::setEnabled( true );
+    Profiler::clear();
+    for ( int i = 0; i < options.iterations; ++i ) {
+        Profiler::beginFrame( i*SCENE_TIME_STEP );
+        stepScene( &scene );
+        Profiler::endFrame();
+    }
+
+    // Every solver iteration, plus the initial residual, applies the implicit operator once
+    int iterations = options.iterations, operatorCalls;
+    Profiler::totalTime( "computeEu", &operatorCalls );
+    double crSweeps = double(operatorCalls) / iterations;
+
+    double particleBytes = numParticles * double(sizeof(Particle));
+    double stencilBytes = numParticles * double(STENCIL_SIZE);
+    double binBytes = scene.devBins ? 4.0*numParticles*sizeof(index_t) + 2.0*scene.bins.count*sizeof(index_t) : 0.0;
+    double p2gBytes = particleBytes + numParticles*sizeof(mat3) + 2.0*stencilBytes*(sizeof(float)+2*sizeof(vec3));
+    double gridBytes = 2.0*numNodes*sizeof(Node);
+    // The fused operator only reads FeHat, ReHat and SeHat per particle; Ap round trips in deterministic mode
+    double apBytes = deterministic ? 2.0*numParticles*sizeof(mat3) : 0.0;
+    double crBytes = crSweeps*( particleBytes + 3.0*numParticles*sizeof(mat3) + apBytes + 2.0*numNodes*NodeCache::bytesPerNode() );
+    double g2pBytes = 2.0*particleBytes + stencilBytes*2*sizeof(vec3);
+    double sigmaBytes = particleBytes + numParticles*sizeof(mat3);
+
+    if ( results ) {
+        if ( scene.devBins ) {
+            *results += makeResult( "binParticles"+suffix, "particles", numParticles, iterations, Profiler::totalTime("binParticles"), binBytes );
+        }
+        *results += makeResult( "computeSigma"+suffix, "particles", numParticles, iterations, Profiler::totalTime("computeSigma"), sigmaBytes );
+        *results += makeResult( "P2G"+suffix, "particles", numParticles, iterations, Profiler::totalTime("P2G"), p2gBytes );
+        *results += makeResult( "gridUpdate"+suffix, "nodes", numNodes, iterations, Profiler::totalTime("gridUpdate"), gridBytes );
+        *results += makeResult( "crSolve"+suffix, "particles", numParticles, iterations, Profiler::totalTime("implicitSolve"), crBytes );
+        *results += makeResult( "G2P"+suffix, "particles", numParticles, iterations, Profiler::totalTime("G2P"), g2pBytes );
+        if ( scene.devSleep ) {
+            *results += makeResult( "updateSleep"+suffix, "nodes", numNodes, iterations, Profiler::totalTime("updateSleep"), gridBytes/2 );
+        }
+        *results += makeResult( "step"+suffix, "particles", numParticles, iterations, Profiler::totalTime("frame"),
+                                binBytes + sigmaBytes + p2gBytes + gridBytes + crBytes + g2pBytes );
+    }
+    Profiler::setEnabled( wasEnabled );
+
+    QByteArray state = sceneState( scene );
+    if ( scene.devSleep ) {
+        index_t awake = scene.sleep.awakeParticles;
+        printf( "    %lld of %lld particles awake at the end\n", (long long)( awake < 0 ? numParticles : awake ), (long long)numParticles );
+    }
+    destroyScene( &scene );
+
+    return state;
+}
+
+bool
+benchmarkStep( const Options &options, QVector<Result> &results )
+{
+    runSteps( options, createParticleCloud(options.particles, createGrid(options.grid)), false, false, 0, JACOBI_PRECONDITIONER, AUTO_OPERATOR, "", &results );
+    return true;
+}
+
+/*
+ * Times deterministic mode against the default one, and checks that two runs
+ * from the same particles end in byte-identical states. Deterministic mode
+ * always applies the operator matrix-free, so the default step it is compared
+ * with does too.
+ */
+bool
+benchmarkDeterministic( const Options &options, QVector<Result> &results )
+{
+    QVector<Particle> particles = createParticleCloud( options.particles, createGrid(options.grid) );
+    QVector<Result> regular, deterministic;
+    runSteps( options, particles, false, false, 0, JACOBI_PRECONDITIONER, MATRIX_FREE_OPERATOR, "", &regular );
+    QByteArray first = runSteps( options, particles, true, false, 0, JACOBI_PRECONDITIONER, MATRIX_FREE_OPERATOR, "/deterministic", &deterministic );
+    QByteArray second = runSteps( options, particles, true, false, 0, JACOBI_PRECONDITIONER, MATRIX_FREE_OPERATOR, "", NULL );
+    results += deterministic;
+
+    // The whole step is the last result of each run
+    printf( "    deterministic step costs %.2fx the default step\n", deterministic.last().ms/regular.last().ms );
+
+    bool identical = ( first == second );
+    printf( "    repeated run %s\n", identical ? "is byte-identical" : "DIFFERS" );
+    return identical;
+}
+
+/*
+ * Solves with each preconditioner and reports the solver iterations per step
+ * next to the solve time.
+ */
+bool
+benchmarkPreconditioners( const Options &options, QVector<Result> &results )
+{
+    QVector<Particle> particles = createParticleCloud( options.particles, createGrid(options.grid) );
+    const char *names[] = { "none", "jacobi", "multigrid" };
+    for ( int i = NO_PRECONDITIONER; i <= MULTIGRID_PRECONDITIONER; ++i ) {
+        QVector<Result> stages;
+        runSteps( options, particles, false, false, 0, (Preconditioner)i, AUTO_OPERATOR, QString("/")+names[i], &stages );
+        for ( int j = 0; j < stages.size(); ++j ) {
+            if ( stages[j].name.startsWith("crSolve") ) results += stages[j];
+        }
+        int iterations;
+        Profiler::totalTime( "crIteration", &iterations );
+        printf( "    %s: %.1f solver iterations per step\n", names[i], double(iterations)/options.iterations );
+    }
+    return true;
+}
+
+/*
+ * Solves matrix-free and with the assembled stiffness matrix. The assembled
+ * solve time includes assembly, which is also reported on its own.
+ */
+bool
+benchmarkOperators( const Options &options, QVector<Result> &results )
+{
+    QVector<Particle> particles = createParticleCloud( options.particles, createGrid(options.grid) );
+    const char *names[] = { "matrixFree", "assembled" };
+    const ImplicitOperator operators[] = { MATRIX_FREE_OPERATOR, ASSEMBLED_OPERATOR };
+    for ( int i = 0; i < 2; ++i ) {
+        QVector<Result> stages;
+        runSteps( options, particles, false, false, 0, JACOBI_PRECONDITIONER, operators[i], QString("/")+names[i], &stages );
+        for ( int j = 0; j < stages.size(); ++j ) {
+            if ( stages[j].name.startsWith("crSolve") ) results += stages[j];
+        }
+    }
+    results += makeResult( "assembleStiffness", "particles", options.particles, options.iterations, Profiler::totalTime("assembleStiffness"), 0.0 );
+    return true;
+}
+
+/*
+ * Runs G2P straight from the grid and tile by tile. The tiled step pays for
+ * binning the particles, which is reported next to it.
+ */
+bool
+benchmarkTiledG2P( const Options &options, QVector<Result> &results )
+{
+    QVector<Particle> particles = createParticleCloud( options.particles, createGrid(options.grid) );
+    const char *names[] = { "global", "tiled" };
+    for ( int i = 0; i < 2; ++i ) {
+        QVector<Result> stages;
+        runSteps( options, particles, false, i == 1, 0, JACOBI_PRECONDITIONER, AUTO_OPERATOR, QString("/")+names[i], &stages );
+        for ( int j = 0; j < stages.size(); ++j ) {
+            if ( stages[j].name.startsWith("G2P") || stages[j].name.startsWith("binParticles") ) results += stages[j];
+        }
+    }
+    return true;
+}
+
+/*
+ * Runs a layer of resting snow, hit by a falling ball, with every particle
+ * awake and with resting blocks put to sleep.
+ */
+bool
+benchmarkSleep( const Options &options, QVector<Result> &results )
+{
+    QVector<Particle> particles = createRestingSnow( options.particles, createGrid(options.grid) );
+    const char *names[] = { "awake", "asleep" };
+    double ms[2] = { 0.0, 0.0 };
+    for ( int i = 0; i < 2; ++i ) {
+        QVector<Result> stages;
+        runSteps( options, particles, false, false, i == 1 ? 4 : 0, JACOBI_PRECONDITIONER, AUTO_OPERATOR, QString("/")+names[i], &stages );
+        for ( int j = 0; j < stages.size(); ++j ) {
+            if ( stages[j].name.startsWith("step") ) ms[i] = stages[j].ms;
+            if ( stages[j].name.startsWith("step") || stages[j].name.startsWith("updateSleep") ) results += stages[j];
+        }
+    }
+    if ( ms[1] > 0.0 ) printf( "    sleeping step is %.2fx as fast\n", ms[0]/ms[1] );
+    return true;
+}
+
+bool
+benchmarkVoxelize( const Options &options, QVector<Result> &results )
+{
+    Grid grid = createGrid( options.grid );
+    QVector<vec3> tris = createSphereMesh( grid, 32, 64 );
+    int triCount = tris.size() / 6;
+    index_t cellCount = grid.cellCount();
+
+    void *devTris;
+    checkCudaErrors( cudaMalloc(&devTris, tris.size()*sizeof(vec3)) );
+    checkCudaErrors( cudaMemcpy(devTris, tris.data(), tris.size()*sizeof(vec3), cudaMemcpyHostToDevice) );
+    bool *devFlags;
+    checkCudaErrors( cudaMalloc((void**)&devFlags, cellCount*sizeof(bool)) );
+
+    voxelizeMesh( devTris, triCount, grid, devFlags );
+    QElapsedTimer timer;
+    timer.start();
+    for ( int i = 0; i < options.iterations; ++i ) {
+        voxelizeMesh( devTris, triCount, grid, devFlags );
+    }
+    double ms = timer.nsecsElapsed() / 1e6;
+
+    results += makeResult( "voxelize", "cells", cellCount, options.iterations, ms,
+                           tris.size()*sizeof(vec3) + 2.0*cellCount*sizeof(bool) );
+
+    checkCudaErrors( cudaFree(devFlags) );
+    checkCudaErrors( cudaFree(devTris) );
+    return true;
+}
+
+bool
+benchmarkExport( const Options &options, QVector<Result> &results )
+{
+    Grid grid = createGrid( options.grid );
+    index_t numNodes = grid.nodeCount();
+
+    QDir dir( QDir::temp().filePath("snow_benchmark") );
+    dir.mkpath( "." );
+    MitsubaExporter exporter( dir.filePath("export"), 24 );
+    exporter.reset( grid );
+    ExportNode *nodes = exporter.getNodesPtr();
+    float cellVolume = grid.h*grid.h*grid.h;
+    for ( index_t i = 0; i < numNodes; ++i ) {
+        nodes[i].density = floatToHalf( 1e-4f * random01() / cellVolume );
+        nodes[i].velocity = vec3( random01(), random01(), random01() );
+    }
+
+    bool exportDensity = UiSettings::exportDensity();
+    bool exportVelocity = UiSettings::exportVelocity();
+    UiSettings::exportDensity() = true;
+    UiSettings::exportVelocity() = true;
+
+    QElapsedTimer timer;
+    timer.start();
+    for ( int i = 0; i < options.iterations; ++i ) {
+        exporter.exportScene( i/24.f );
+    }
+    double ms = timer.nsecsElapsed() / 1e6;
+
+    UiSettings::exportDensity() = exportDensity;
+    UiSettings::exportVelocity() = exportVelocity;
+    dir.removeRecursively();
+
+    // Packed node data read, plus one density and three velocity channels written
+    results += makeResult( "export", "nodes", numNodes, options.iterations, ms, numNodes*(double(sizeof(ExportNode)) + 4*sizeof(float)) );
+    return true;
+}
+
+/*
+ * Runs explicit steps with the particles in a memory-mapped file, streamed
+ * through the device in eight chunks, against the same steps with every
+ * particle on the device. Checks that both runs end with the same particles.
+ */
+bool
+benchmarkOutOfCore( const Options &options, QVector<Result> &results )
+{
+    Grid grid = createGrid( options.grid );
+    index_t numNodes = grid.nodeCount();
+    ImplicitCollider ground( HALF_PLANE, grid.pos, vec3(0.f, 1.f, 0.f) );
+    QVector<Particle> cloud = createParticleCloud( options.particles, grid );
+
+    QDir dir( QDir::temp().filePath("snow_benchmark") );
+    dir.mkpath( "." );
+    ParticleFile file;
+    if ( !file.create(dir.filePath("particles"), cloud.data(), cloud.size(), grid) ) {
+        dir.removeRecursively();
+        return false;
+    }
+    index_t numParticles = file.size();
+
+    MemoryPlan plan;
+    planMemory( &plan, numNodes, false, JACOBI_PRECONDITIONER, false, false );
+    DeviceArena arena = { NULL, 0, 0 };
+    reserveDeviceArena( &arena, plan.arenaBytes );
+
+    Node *devNodes;
+    checkCudaErrors( cudaMalloc((void**)&devNodes, numNodes*sizeof(Node)) );
+    Grid *devGrid;
+    checkCudaErrors( cudaMalloc((void**)&devGrid, sizeof(Grid)) );
+    checkCudaErrors( cudaMemcpy(devGrid, &grid, sizeof(Grid), cudaMemcpyHostToDevice) );
+    ImplicitCollider *devColliders;
+    checkCudaErrors( cudaMalloc((void**)&devColliders, sizeof(ImplicitCollider)) );
+    checkCudaErrors( cudaMemcpy(devColliders, &ground, sizeof(ImplicitCollider), cudaMemcpyHostToDevice) );
+
+    bool wasEnabled = Profiler::enabled();
+    Profiler::setEnabled( true );
+
+    // Every particle on the device, in the file's order
+    QVector<Particle> inMemory( numParticles );
+    {
+        Particle *devParticles;
+        checkCudaErrors( cudaMalloc((void**)&devParticles, numParticles*sizeof(Particle)) );
+        checkCudaErrors( cudaMemcpy(devParticles, file.data(), numParticles*sizeof(Particle), cudaMemcpyHostToDevice) );
+        NodeCache nodeCaches;
+        createNodeCaches( &nodeCaches, numNodes, plan.nodeChannels );
+        ParticleCache hostParticleCache, *devParticleCache;
+        createParticleCache( &hostParticleCache, numParticles, plan );
+        checkCudaErrors( cudaMalloc((void**)&devParticleCache, sizeof(ParticleCache)) );
+        checkCudaErrors( cudaMemcpy(devParticleCache, &hostParticleCache, sizeof(ParticleCache), cudaMemcpyHostToDevice) );
+
+        initializeParticleVolumes( devParticles, numParticles, devGrid, numNodes, NULL, NULL, &arena );
+        StepGraph *graph = createStepGraph();
+        Profiler::clear();
+        for ( int i = 0; i < options.iterations; ++i ) {
+            Profiler::beginFrame( i*SCENE_TIME_STEP );
+            updateParticles( devParticles, devParticleCache, &hostParticleCache, numParticles, devGrid,
+                             devNodes, nodeCaches, numNodes, devColliders, 1, true, SCENE_TIME_STEP, false, BENCHMARK_SOLVER_TOLERANCE,
+                             JACOBI_PRECONDITIONER, NULL, NULL, NULL, false, NULL, NULL, graph );
+            Profiler::endFrame();
+        }
+        destroyStepGraph( graph );
+        checkCudaErrors( cudaMemcpy(inMemory.data(), devParticles, numParticles*sizeof(Particle), cudaMemcpyDeviceToHost) );
+
+        destroyParticleCache( &hostParticleCache );
+        checkCudaErrors( cudaFree(devParticleCache) );
+        destroyNodeCaches( &nodeCaches );
+        checkCudaErrors( cudaFree(devParticles) );
+    }
+    double inMemoryMs = Profiler::totalTime( "frame" );
+
+    // The first run moved the collider
+    checkCudaErrors( cudaMemcpy(devColliders, &ground, sizeof(ImplicitCollider), cudaMemcpyHostToDevice) );
+    ParticleStream stream;
+    createParticleStream( &stream, (numParticles+7)/8 );
+    initializeStreamedParticleVolumes( file.data(), numParticles, devGrid, numNodes, &stream, &arena );
+    Profiler::clear();
+    for ( int i = 0; i < options.iterations; ++i ) {
+        Profiler::beginFrame( i*SCENE_TIME_STEP );
+        updateStreamedParticles( file.data(), numParticles, &stream, devGrid, devNodes, numNodes, devColliders, 1, SCENE_TIME_STEP );
+        Profiler::endFrame();
+    }
+    double streamedMs = Profiler::totalTime( "frame" );
+    Profiler::setEnabled( wasEnabled );
+
+    // Particles are read in P2G, and read and written in G2P
+    double particleBytes = 3.0*numParticles*sizeof(Particle);
+    results += makeResult( "step/inMemory", "particles", numParticles, options.iterations, inMemoryMs, particleBytes );
+    results += makeResult( "step/streamed", "particles", numParticles, options.iterations, streamedMs, particleBytes );
+    printf( "    streamed step costs %.2fx the in-memory step\n", streamedMs/inMemoryMs );
+
+    // P2G adds in a different order, so only up to rounding
+    float maxDistance = 0.f;
+    for ( index_t i = 0; i < numParticles; ++i ) {
+        maxDistance = qMax( maxDistance, vec3::length(file.data()[i].position - inMemory[i].position) );
+    }
+    bool matches = ( maxDistance <= 1e-3f*grid.h );
+    printf( "    streamed particles %s in-memory ones (%g cells apart at most)\n", matches ? "match" : "DIFFER FROM", maxDistance/grid.h );
+
+    destroyParticleStream( &stream );
+    checkCudaErrors( cudaFree(devColliders) );
+    checkCudaErrors( cudaFree(devGrid) );
+    checkCudaErrors( cudaFree(devNodes) );
+    destroyDeviceArena( &arena );
+    file.close();
+    dir.removeRecursively();
+    return matches;
+}
+
+/*
+ * Splits the grid into slabs across options.ranks processes, which exchange
+ * halos over the chosen transport, and runs implicit steps with particle
+ * migration after each. Unless told otherwise, rank 0 starts the other ranks
+ * on this machine, running just this suite. Checks that the particle count
+ * and mass over all ranks are conserved (see runDistributedScene).
+ */
+bool
+benchmarkDistributed( const Options &options, QVector<Result> &results )
+{
+    if ( options.ranks < 2 ) {
+        printf( "    skipped, run with -ranks 2 or more\n" );
+        return true;
+    }
+
+    QString address = options.address;
+    if ( address.isEmpty() ) {
+        address = ( options.transport == Communicator::TCP ) ? QString( "127.0.0.1:47100" )
+                                                              : QString( "snow_bench_%1" ).arg( QCoreApplication::applicationPid() );
+    }
+
+    QVector<QProcess*> processes;
+    if ( options.rank == 0 && options.launch ) {
+        for ( int r = 1; r < options.ranks; ++r ) {
+            QStringList arguments;
+            arguments << "-bench" << "-filter" << "distributed"
+                      << "-particles" << QString::number( options.particles )
+                      << "-grid" << QString::number( options.grid )
+                      << "-iterations" << QString::number( options.iterations )
+                      << "-ranks" << QString::number( options.ranks ) << "-rank" << QString::number( r )
+                      << "-transport" << ( options.transport == Communicator::TCP ? "tcp" : "shm" )
+                      << "-address" << address;
+            QProcess *process = new QProcess;
+            process->setProcessChannelMode( QProcess::ForwardedChannels );
+            process->start( QCoreApplication::applicationFilePath(), arguments );
+            processes += process;
+        }
+    }
+
+    bool passed = false;
+    Communicator *communicator = Communicator::create( options.transport, options.rank, options.ranks, address.toStdString() );
+    if ( communicator ) {
+        bool wasEnabled = Profiler::enabled();
+        Profiler::setEnabled( true );
+        Profiler::clear();
+        DistributedRun run;
+        if ( runDistributedScene(communicator, options.particles, options.grid, vec3(0.f, -1.f, 0.f), options.iterations,
+                                 BENCHMARK_SOLVER_TOLERANCE, &run) ) {
+            passed = run.conserved;
+            if ( options.rank == 0 ) {
+                QString suffix = QString( "/%1ranks" ).arg( options.ranks );
+                double bandBytes = 2.0*run.bandNodes*( sizeof(Node) + sizeof(vec3) );
+                results += makeResult( "haloExchange"+suffix, "nodes", run.bandNodes, options.iterations, Profiler::totalTime("haloExchange"), bandBytes );
+                results += makeResult( "migrate"+suffix, "particles", run.particles, options.iterations, Profiler::totalTime("migrateParticles"),
+                                       2.0*run.particles*sizeof(Particle) );
+                results += makeResult( "step"+suffix, "particles", options.particles, options.iterations, Profiler::totalTime("frame"), 0.0 );
+                printf( "    %.0f particles and %g mass over all ranks %s, node mass within %g of it\n", run.count, run.mass,
+                        passed ? "conserved" : "NOT CONSERVED", run.nodeMassError );
+            }
+        }
+        Profiler::setEnabled( wasEnabled );
+        communicator->barrier();
+        delete communicator;
+    }
+
+    for ( int i = 0; i < processes.size(); ++i ) {
+        processes[i]->waitForFinished( -1 );
+        passed = passed && processes[i]->exitCode() == 0;
+        delete processes[i];
+    }
+    return passed;
+}
+
+QString
+currentCommit()
+{
+    QProcess git;
+    git.setWorkingDirectory( PROJECT_PATH );
+    git.start( "git", QStringList() << "rev-parse" << "--short" << "HEAD" );
+    if ( !git.waitForFinished(2000) || git.exitCode() != 0 ) return "unknown";
+    return QString( git.readAllStandardOutput() ).trimmed();
+}
+
+QString
+deviceName()
+{
+    int device;
+    cudaDeviceProp properties;
+    if ( cudaGetDevice(&device) != cudaSuccess || cudaGetDeviceProperties(&properties, device) != cudaSuccess ) return "unknown";
+    return QString( properties.name );
+}
+
+bool
+writeResults( const QString &filename, const Options &options, const QVector<Result> &results )
+{
+    QJsonArray array;
+    for ( int i = 0; i < results.size(); ++i ) {
+        const Result &result = results[i];
+        QJsonObject object;
+        object["name"] = result.name;
+        object["unit"] = result.unit;
+        object["count"] = result.count;
+        object["iterations"] = result.iterations;
+        object["ms"] = result.ms;
+        object["bytes"] = result.bytes;
+        object["rate"] = result.rate();
+        object["gbps"] = result.gbps();
+        array.append( object );
+    }
+
+    QJsonObject root;
+    root["commit"] = currentCommit();
+    root["device"] = deviceName();
+    root["particles"] = options.particles;
+    root["grid"] = options.grid;
+    root["iterations"] = options.iterations;
+    root["results"] = array;
+
+    QFile file( filename );
+    if ( !file.open(QFile::WriteOnly | QFile::Truncate) ) {
+        LOG( "Benchmarks: Unable to open file %s.", STR(filename) );
+        return false;
+    }
+    file.write( QJsonDocument(root).toJson() );
+    file.close();
+    LOG( "Benchmarks: results written to %s", STR(filename) );
+    return true;
+}
+
+// Returns the number of benchmarks that got slower than the tolerance allows
+int
+compareResults( const QString &filename, const Options &options, const QVector<Result> &results )
+{
+    QFile file( filename );
+    if ( !file.open(QFile::ReadOnly) ) {
+        LOG( "Benchmarks: Unable to open baseline %s.", STR(filename) );
+        return 0;
+    }
+    QJsonObject root = QJsonDocument::fromJson( file.readAll() ).object();
+    file.close();
+
+    LOGIF( root["particles"].toInt() != options.particles || root["grid"].toInt() != options.grid,
+           "Benchmarks: baseline was run with %d particles on a %d^3 grid; rates may not be comparable.",
+           root["particles"].toInt(), root["grid"].toInt() );
+
+    QJsonArray array = root["results"].toArray();
+    printf( "\nCompared to %s (%s on %s):\n", STR(filename), STR(root["commit"].toString()), STR(root["device"].toString()) );
+
+    int regressions = 0;
+    for ( int i = 0; i < results.size(); ++i ) {
+        const Result &result = results[i];
+        for ( int j = 0; j < array.size(); ++j ) {
+            QJsonObject baseline = array[j].toObject();
+            if ( baseline["name"].toString() != result.name ) continue;
+            double before = baseline["rate"].toDouble();
+            double change = ( before > 0.0 ) ? 100.0*( result.rate()/before - 1.0 ) : 0.0;
+            bool regressed = change < -options.tolerance;
+            regressions += regressed;
+            printf( "    %-14s %12.4g -> %12.4g %s/s %+7.1f%%%s\n", STR(result.name), before, result.rate(),
+                    STR(result.unit), change, regressed ? "  REGRESSION" : "" );
+        }
+    }
+    return regressions;
+}
+
+bool
+parseOptions( int argc, char *argv[], Options &options )
+{
+    options.particles = 100000;
+    options.grid = 64;
+    options.iterations = 10;
+    options.tolerance = 5.f;
+    options.out = "benchmarks.json";
+    options.ranks = 1;
+    options.rank = 0;
+    options.transport = Communicator::SHARED_MEMORY;
+    options.launch = true;
+
+    for ( int i = 0; i < argc; ++i ) {
+        if ( i+1 >= argc ) {
+            printf( "Error: missing value for %s\n", argv[i] );
+            return false;
+        }
+        const char *option = argv[i], *value = argv[++i];
+        if ( !strcmp(option, "-particles") ) options.particles = atoi( value );
+        else if ( !strcmp(option, "-grid") ) options.grid = atoi( value );
+        else if ( !strcmp(option, "-iterations") ) options.iterations = atoi( value );
+        else if ( !strcmp(option, "-tolerance") ) options.tolerance = atof( value );
+        else if ( !strcmp(option, "-filter") ) options.filter = value;
+        else if ( !strcmp(option, "-out") ) options.out = value;
+        else if ( !strcmp(option, "-baseline") ) options.baseline = value;
+        else if ( !strcmp(option, "-ranks") ) options.ranks = atoi( value );
+        else if ( !strcmp(option, "-rank") ) options.rank = atoi( value );
+        else if ( !strcmp(option, "-address") ) options.address = value;
+        else if ( !strcmp(option, "-launch") ) options.launch = atoi( value ) != 0;
+        else if ( !strcmp(option, "-transport") && !strcmp(value, "shm") ) options.transport = Communicator::SHARED_MEMORY;
+        else if ( !strcmp(option, "-transport") && !strcmp(value, "tcp") ) options.transport = Communicator::TCP;
+        else {
+            printf( "Error: unknown benchmark option %s\n", option );
+            return false;
+        }
+    }
+
+    if ( options.particles <= 0 || options.grid <= 0 || options.iterations <= 0 ) {
+        printf( "Error: -particles, -grid and -iterations must be positive\n" );
+        return false;
+    }
+    if ( options.ranks <= 0 || options.rank < 0 || options.rank >= options.ranks ) {
+        printf( "Error: -rank must be in [0, -ranks)\n" );
+        return false;
+    }
+    return true;
+}
+
+}
+
+int
+Benchmarks::run( int argc, char *argv[] )
+{
+    Options options;
+    if ( !parseOptions(argc, argv, options) ) return 2;
+
+    // Same synthetic data on every run
+    srand( 1 );
+
+    struct { const char *name; bool (*run)( const Options&, QVector<Result>& ); } suites[] = {
+        { "decompositions", benchmarkDecompositions },
+        { "step", benchmarkStep },
+        { "deterministic", benchmarkDeterministic },
+        { "preconditioners", benchmarkPreconditioners },
+        { "operators", benchmarkOperators },
+        { "tiledG2P", benchmarkTiledG2P },
+        { "sleep", benchmarkSleep },
+        { "voxelize", benchmarkVoxelize },
+        { "export", benchmarkExport },
+        { "outOfCore", benchmarkOutOfCore },
+        { "distributed", benchmarkDistributed }
+    };
+
+    // The other ranks of a distributed run only report to rank 0
+    const bool report = ( options.rank == 0 );
+
+    if ( report ) printf( "Running benchmarks: %d particles, %d^3 grid, %d iterations on %s\n",
+            options.particles, options.grid, options.iterations, STR(deviceName()) );
+
+    QVector<Result> results;
+    int failures = 0;
+    for ( unsigned int i = 0; i < sizeof(suites)/sizeof(suites[0]); ++i ) {
+        if ( !options.filter.isEmpty() && !QString(suites[i].name).contains(options.filter) ) continue;
+        if ( report ) printf( "%s\n", suites[i].name );
+        failures += !suites[i].run( options, results );
+    }
+
+    if ( report ) writeResults( options.out, options, results );
+    int regressions = ( options.baseline.isEmpty() || !report ) ? 0 : compareResults( options.baseline, options, results );
+    LOGIF( regressions > 0, "Benchmarks: %d regression(s) beyond %.1f%%.", regressions, options.tolerance );
+    LOGIF( failures > 0, "Benchmarks: %d suite(s) failed.", failures );
+    return ( regressions > 0 || failures > 0 ) ? 1 : 0;
+}
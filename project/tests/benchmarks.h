@@ -0,0 +1,55 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   benchmarks.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+/**
+ * @brief Microbenchmarks for the simulation kernels.
+ *
+ * Run with 'snow -bench [options]':
+ *
+ *     -particles N     size of the synthetic particle cloud (default 100000)
+ *     -grid N          grid resolution, N^3 cells (default 64)
+ *     -iterations N    timed repetitions per benchmark (default 10)
+ *     -filter NAME     only run the suites (decompositions, step, deterministic,
+ *                      preconditioners, operators, tiledG2P, sleep, voxelize,
+ *                      export, outOfCore, distributed) whose name contains NAME
+ *     -out FILE        where to write the JSON results (default benchmarks.json)
+ *     -baseline FILE   compare against results saved by an earlier run
+ *     -tolerance PCT   slowdown that counts as a regression (default 5)
+ *
+ * The distributed suite splits the grid across processes, and is skipped
+ * unless -ranks is 2 or more:
+ *
+ *     -ranks N         number of processes (default 1)
+ *     -transport T     shm (default) or tcp
+ *     -address A       shared memory segment name, or host[,host...]:port
+ *     -rank R          rank of this process (default 0)
+ *     -launch 0|1      whether rank 0 starts the other ranks here (default 1)
+ *
+ * Every benchmark reports items per second (particles, matrices, cells or
+ * nodes) and GB/s of nominal traffic, i.e. one read of each input and one
+ * write of each output the stage touches. The deterministic suite also
+ * checks that repeated runs end in byte-identical states, the outOfCore one
+ * that streamed particles end where in-memory ones do, and the distributed
+ * one that particles and mass are conserved across ranks. The exit code is
+ * nonzero if that check fails or any benchmark regressed against the baseline.
+ */
+
+class Benchmarks
+{
+
+public:
+
+    static int run( int argc, char *argv[] );
+
+};
+
+#endif // BENCHMARKS_H
@@ -0,0 +1,320 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   scenes.cpp
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#include "tests/scenes.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "common/communicator.h"
+#include "sim/implicitcollider.h"
+#include "sim/particlegridnode.h"
+#include "sim/profiler.h"
+
+#include "cuda/functions.h"
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <helper_functions.h>
+#include <helper_cuda.h>
+
+Grid
+createGrid( int resolution )
+{
+    Grid grid;
+    grid.dim = glm::ivec3( resolution, resolution, resolution );
+    grid.pos = vec3( 0.f, 0.f, 0.f );
+    grid.h = 1.f / resolution;
+    return grid;
+}
+
+float
+random01()
+{
+    return float(rand()) / RAND_MAX;
+}
+
+QVector<Particle>
+createParticleCloud( int count, const Grid &grid, const vec3 &velocity )
+{
+    vec3 center = grid.pos + 0.5f*grid.h*vec3( grid.dim.x, grid.dim.y, grid.dim.z );
+    float radius = 0.3f * grid.h * MIN( grid.dim.x, MIN(grid.dim.y, grid.dim.z) );
+    float mass = SCENE_DENSITY * (4.f/3.f)*M_PI*radius*radius*radius / count;
+
+    QVector<Particle> particles( count );
+    for ( int i = 0; i < count; ++i ) {
+        vec3 offset;
+        do {
+            offset = vec3( 2.f*random01()-1.f, 2.f*random01()-1.f, 2.f*random01()-1.f );
+        } while ( vec3::dot(offset, offset) > 1.f );
+        particles[i].position = center + radius*offset;
+        particles[i].velocity = velocity;
+        particles[i].mass = mass;
+    }
+    return particles;
+}
+
+QVector<Particle>
+createRestingSnow( int count, const Grid &grid )
+{
+    vec3 size = 0.8f*grid.h*vec3( grid.dim.x, 0.25f*grid.dim.y, grid.dim.z );
+    vec3 corner = grid.pos + 0.1f*grid.h*vec3( grid.dim.x, 0.f, grid.dim.z );
+    vec3 center = grid.pos + 0.5f*grid.h*vec3( grid.dim.x, grid.dim.y, grid.dim.z );
+    int falling = count / 10;
+    QVector<Particle> particles = createParticleCloud( falling, grid );
+    float mass = SCENE_DENSITY * size.x*size.y*size.z / ( count-falling );
+    for ( int i = 0; i < falling; ++i ) {
+        particles[i].position = center + 0.5f*( particles[i].position-center );
+        particles[i].position.y += 0.25f*grid.h*grid.dim.y;
+        particles[i].mass = mass;
+    }
+
+    particles.resize( count );
+    for ( int i = falling; i < count; ++i ) {
+        particles[i].position = corner + vec3( random01()*size.x, random01()*size.y, random01()*size.z );
+        particles[i].velocity = vec3( 0.f, 0.f, 0.f );
+        particles[i].mass = mass;
+    }
+    return particles;
+}
+
+SceneOptions::SceneOptions()
+    : tolerance(1e-3f),
+      preconditioner(JACOBI_PRECONDITIONER),
+      implicitOperator(MATRIX_FREE_OPERATOR),
+      deterministic(false),
+      tiledG2P(false),
+      sleepSteps(0)
+{
+}
+
+void
+createScene( Scene *scene, const QVector<Particle> &particles, const Grid &grid, const SceneOptions &options )
+{
+    scene->grid = grid;
+    scene->numParticles = particles.size();
+    scene->numNodes = grid.nodeCount();
+    scene->options = options;
+    index_t numParticles = scene->numParticles, numNodes = scene->numNodes;
+
+    // Sized like the engine sizes them for this mode
+    const bool buildMultigrid = ( options.preconditioner == MULTIGRID_PRECONDITIONER && !options.deterministic );
+    MemoryPlan plan;
+    planMemory( &plan, numNodes, true, options.preconditioner, buildMultigrid, options.deterministic );
+
+    checkCudaErrors( cudaMalloc((void**)&scene->devParticles, numParticles*sizeof(Particle)) );
+    checkCudaErrors( cudaMemcpy(scene->devParticles, particles.data(), numParticles*sizeof(Particle), cudaMemcpyHostToDevice) );
+    checkCudaErrors( cudaMalloc((void**)&scene->devNodes, numNodes*sizeof(Node)) );
+    createNodeCaches( &scene->nodeCaches, numNodes, plan.nodeChannels );
+
+    checkCudaErrors( cudaMalloc((void**)&scene->devGrid, sizeof(Grid)) );
+    checkCudaErrors( cudaMemcpy(scene->devGrid, &grid, sizeof(Grid), cudaMemcpyHostToDevice) );
+
+    ImplicitCollider ground( HALF_PLANE, grid.pos, vec3(0.f, 1.f, 0.f) );
+    checkCudaErrors( cudaMalloc((void**)&scene->devColliders, sizeof(ImplicitCollider)) );
+    checkCudaErrors( cudaMemcpy(scene->devColliders, &ground, sizeof(ImplicitCollider), cudaMemcpyHostToDevice) );
+
+    createParticleCache( &scene->hostParticleCache, numParticles, plan );
+    checkCudaErrors( cudaMalloc((void**)&scene->devParticleCache, sizeof(ParticleCache)) );
+    checkCudaErrors( cudaMemcpy(scene->devParticleCache, &scene->hostParticleCache, sizeof(ParticleCache), cudaMemcpyHostToDevice) );
+
+    scene->devBins = NULL;
+    if ( options.deterministic || options.tiledG2P ) {
+        createParticleBins( &scene->bins, numParticles, grid );
+        scene->devBins = &scene->bins;
+    }
+
+    scene->devMultigrid = NULL;
+    if ( buildMultigrid ) {
+        createMultigrid( &scene->multigrid, grid );
+        scene->devMultigrid = &scene->multigrid;
+    }
+
+    scene->devStiffness = NULL;
+    if ( options.implicitOperator != MATRIX_FREE_OPERATOR && !options.deterministic ) {
+        createStiffnessMatrix( &scene->stiffness, numNodes, options.implicitOperator );
+        scene->devStiffness = &scene->stiffness;
+    }
+
+    scene->devSleep = NULL;
+    if ( options.sleepSteps > 0 ) {
+        createSleepState( &scene->sleep, grid, options.sleepSteps, SCENE_SLEEP_SPEED, SCENE_SLEEP_STRAIN_RATE );
+        scene->devSleep = &scene->sleep;
+    }
+
+    scene->graph = createStepGraph();
+
+    DeviceArena arena = { NULL, 0, 0 };
+    reserveDeviceArena( &arena, plan.arenaBytes );
+    initializeParticleVolumes( scene->devParticles, numParticles, scene->devGrid, numNodes,
+                               options.deterministic ? scene->devBins : NULL, NULL, &arena );
+    destroyDeviceArena( &arena );
+}
+
+void
+destroyScene( Scene *scene )
+{
+    destroyStepGraph( scene->graph );
+    if ( scene->devSleep ) destroySleepState( scene->devSleep );
+    if ( scene->devStiffness ) destroyStiffnessMatrix( scene->devStiffness );
+    if ( scene->devMultigrid ) destroyMultigrid( scene->devMultigrid );
+    if ( scene->devBins ) destroyParticleBins( scene->devBins );
+    destroyParticleCache( &scene->hostParticleCache );
+    checkCudaErrors( cudaFree(scene->devParticleCache) );
+    checkCudaErrors( cudaFree(scene->devColliders) );
+    checkCudaErrors( cudaFree(scene->devGrid) );
+    destroyNodeCaches( &scene->nodeCaches );
+    checkCudaErrors( cudaFree(scene->devNodes) );
+    checkCudaErrors( cudaFree(scene->devParticles) );
+}
+
+int
+stepScene( Scene *scene )
+{
+    const SceneOptions &options = scene->options;
+    return updateParticles( scene->devParticles, scene->devParticleCache, &scene->hostParticleCache, scene->numParticles, scene->devGrid,
+                            scene->devNodes, scene->nodeCaches, scene->numNodes, scene->devColliders, 1, true, SCENE_TIME_STEP, true,
+                            options.tolerance, options.preconditioner, scene->devMultigrid, scene->devStiffness, scene->devBins,
+                            options.deterministic, NULL, scene->devSleep, scene->graph );
+}
+
+QByteArray
+sceneState( const Scene &scene )
+{
+    QByteArray state( scene.numParticles*sizeof(Particle) + scene.numNodes*sizeof(Node), 0 );
+    checkCudaErrors( cudaMemcpy(state.data(), scene.devParticles, scene.numParticles*sizeof(Particle), cudaMemcpyDeviceToHost) );
+    checkCudaErrors( cudaMemcpy(state.data()+scene.numParticles*sizeof(Particle), scene.devNodes, scene.numNodes*sizeof(Node),
+                                cudaMemcpyDeviceToHost) );
+    return state;
+}
+
+// Particle count, particle mass and the mass of the nodes this rank owns
+static void
+sumMasses( const Particle *devParticles, index_t numParticles, const Node *devNodes, const Grid &localGrid, const Halo &halo,
+           double totals[3] )
+{
+    QVector<Particle> particles( numParticles );
+    checkCudaErrors( cudaMemcpy(particles.data(), devParticles, numParticles*sizeof(Particle), cudaMemcpyDeviceToHost) );
+    QVector<Node> nodes( localGrid.nodeCount() );
+    checkCudaErrors( cudaMemcpy(nodes.data(), devNodes, nodes.size()*sizeof(Node), cudaMemcpyDeviceToHost) );
+
+    totals[0] = numParticles;
+    totals[1] = 0.0;
+    for ( int i = 0; i < particles.size(); ++i ) totals[1] += particles[i].mass;
+
+    // Ghost node planes are owned by the neighbors
+    index_t planeNodes = (index_t)( localGrid.dim.y+1 ) * ( localGrid.dim.z+1 );
+    int lowest = halo.lowerGhosts / planeNodes, highest = localGrid.dim.x - halo.upperGhosts / planeNodes;
+    totals[2] = 0.0;
+    for ( int i = 0; i < nodes.size(); ++i ) {
+        int x = localGrid.nodeIJK( i ).x;
+        if ( x >= lowest && x <= highest ) totals[2] += nodes[i].mass;
+    }
+}
+
+bool
+runDistributedScene( Communicator *communicator, int count, int resolution, const vec3 &velocity, int steps,
+                     float tolerance, DistributedRun *run )
+{
+    Grid grid = createGrid( resolution );
+    ImplicitCollider ground( HALF_PLANE, grid.pos, vec3(0.f, 1.f, 0.f) );
+
+    Halo halo;
+    Grid localGrid;
+    if ( !createHalo(&halo, communicator, grid, &localGrid) ) return false;
+
+    // Every rank builds the same cloud, then keeps its slab of it, with room
+    // for a quarter more, as the engine does
+    srand( 1 );
+    QVector<Particle> particles = createParticleCloud( count, grid, velocity );
+    Particle *devCloud, *devParticles;
+    checkCudaErrors( cudaMalloc((void**)&devCloud, particles.size()*sizeof(Particle)) );
+    checkCudaErrors( cudaMemcpy(devCloud, particles.data(), particles.size()*sizeof(Particle), cudaMemcpyHostToDevice) );
+    index_t numParticles = copySlabParticles( devCloud, particles.size(), grid, halo, NULL );
+    index_t capacity = MAX( numParticles + numParticles/4, (index_t)1 );
+    checkCudaErrors( cudaMalloc((void**)&devParticles, capacity*sizeof(Particle)) );
+    copySlabParticles( devCloud, particles.size(), grid, halo, devParticles );
+    checkCudaErrors( cudaFree(devCloud) );
+    index_t numNodes = localGrid.nodeCount();
+
+    MemoryPlan plan;
+    planMemory( &plan, numNodes, true, JACOBI_PRECONDITIONER, false, false );
+    DeviceArena arena = { NULL, 0, 0 };
+    reserveDeviceArena( &arena, plan.arenaBytes );
+    Node *devNodes;
+    checkCudaErrors( cudaMalloc((void**)&devNodes, numNodes*sizeof(Node)) );
+    checkCudaErrors( cudaMemset(devNodes, 0, numNodes*sizeof(Node)) );
+    NodeCache nodeCaches;
+    createNodeCaches( &nodeCaches, numNodes, plan.nodeChannels );
+
+    Grid *devGrid;
+    checkCudaErrors( cudaMalloc((void**)&devGrid, sizeof(Grid)) );
+    checkCudaErrors( cudaMemcpy(devGrid, &localGrid, sizeof(Grid), cudaMemcpyHostToDevice) );
+
+    ImplicitCollider *devColliders;
+    checkCudaErrors( cudaMalloc((void**)&devColliders, sizeof(ImplicitCollider)) );
+    checkCudaErrors( cudaMemcpy(devColliders, &ground, sizeof(ImplicitCollider), cudaMemcpyHostToDevice) );
+
+    // The node masses are summed across the slab boundaries
+    initializeParticleVolumes( devParticles, numParticles, devGrid, numNodes, NULL, &halo, &arena );
+
+    // Regrown along with the particles
+    ParticleCache hostParticleCache, *devParticleCache;
+    createParticleCache( &hostParticleCache, capacity, plan );
+    checkCudaErrors( cudaMalloc((void**)&devParticleCache, sizeof(ParticleCache)) );
+    checkCudaErrors( cudaMemcpy(devParticleCache, &hostParticleCache, sizeof(ParticleCache), cudaMemcpyHostToDevice) );
+
+    StepGraph *graph = createStepGraph();
+
+    double before[3], totals[3];
+    sumMasses( devParticles, numParticles, devNodes, localGrid, halo, before );
+    communicator->allReduceSum( before, 3 );
+
+    run->nodeMassError = 0.0;
+    for ( int i = 0; i < steps; ++i ) {
+        Profiler::beginFrame( i*SCENE_TIME_STEP );
+        updateParticles( devParticles, devParticleCache, &hostParticleCache, numParticles, devGrid,
+                         devNodes, nodeCaches, numNodes, devColliders, 1, true, SCENE_TIME_STEP, true, tolerance,
+                         JACOBI_PRECONDITIONER, NULL, NULL, NULL, false, &halo, NULL, graph );
+        const index_t oldCapacity = capacity;
+        numParticles = migrateParticles( &devParticles, numParticles, &capacity, grid, &halo, &arena );
+        if ( capacity != oldCapacity ) {
+            destroyParticleCache( &hostParticleCache );
+            createParticleCache( &hostParticleCache, capacity, plan );
+            checkCudaErrors( cudaMemcpy(devParticleCache, &hostParticleCache, sizeof(ParticleCache), cudaMemcpyHostToDevice) );
+        }
+        Profiler::endFrame();
+
+        // The nodes still hold the masses of this step's particles, and
+        // migration keeps the total over all ranks
+        sumMasses( devParticles, numParticles, devNodes, localGrid, halo, totals );
+        communicator->allReduceSum( totals, 3 );
+        run->nodeMassError = MAX( run->nodeMassError, fabs(totals[2]-totals[1]) / totals[1] );
+    }
+
+    sumMasses( devParticles, numParticles, devNodes, localGrid, halo, totals );
+    communicator->allReduceSum( totals, 3 );
+    run->particles = numParticles;
+    run->bandNodes = halo.bandNodes;
+    run->count = totals[0];
+    run->mass = totals[1];
+    run->conserved = ( totals[0] == before[0] ) && fabs( totals[1]-before[1] ) <= 1e-6*before[1] && run->nodeMassError <= 1e-4;
+
+    destroyStepGraph( graph );
+    destroyParticleCache( &hostParticleCache );
+    checkCudaErrors( cudaFree(devParticleCache) );
+    checkCudaErrors( cudaFree(devColliders) );
+    checkCudaErrors( cudaFree(devGrid) );
+    destroyNodeCaches( &nodeCaches );
+    checkCudaErrors( cudaFree(devNodes) );
+    destroyDeviceArena( &arena );
+    destroyHalo( &halo );
+    checkCudaErrors( cudaFree(devParticles) );
+    return true;
+}
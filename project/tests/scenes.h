@@ -0,0 +1,118 @@
+/**************************************************************************
+**
+**   SNOW - CS224 BROWN UNIVERSITY
+**
+**   scenes.h
+**   Created: 19 Oct 2026
+**
+**************************************************************************/
+
+#ifndef SCENES_H
+#define SCENES_H
+
+/*
+ * Synthetic scenes shared by the tests (tests/tests.h) and the benchmarks
+ * (tests/benchmarks.h), and the device setup to step them the way the engine
+ * steps a single domain. The constants are fixed so that results stay
+ * comparable across commits and settings.
+ */
+
+#include <QByteArray>
+#include <QVector>
+
+#include "common/common.h"
+#include "geometry/grid.h"
+#include "sim/caches.h"
+#include "sim/particle.h"
+
+class Communicator;
+class StepGraph;
+struct ImplicitCollider;
+struct Node;
+
+#define SCENE_TIME_STEP 1e-4f
+#define SCENE_DENSITY 200.f
+#define SCENE_SLEEP_SPEED 0.05f
+#define SCENE_SLEEP_STRAIN_RATE 1.f
+
+// Cube of resolution^3 cells of size 1/resolution at the origin
+Grid createGrid( int resolution );
+
+float random01();
+
+// Uniformly filled ball in the middle of the grid, moving at velocity towards
+// a ground plane
+QVector<Particle> createParticleCloud( int count, const Grid &grid, const vec3 &velocity = vec3(0.f, -1.f, 0.f) );
+
+// Layer of snow at rest on the ground plane, with a tenth of the particles in
+// a small ball falling onto its middle
+QVector<Particle> createRestingSnow( int count, const Grid &grid );
+
+struct SceneOptions
+{
+    float tolerance;
+    Preconditioner preconditioner;
+    ImplicitOperator implicitOperator;
+    bool deterministic;
+    bool tiledG2P;
+    int sleepSteps; // 0 to keep every particle awake
+
+    SceneOptions();
+};
+
+/*
+ * A grid, its particles and a ground plane on the device, with the caches,
+ * bins, multigrid levels, stiffness matrix and sleep state the options call
+ * for, sized like the engine sizes them.
+ */
+struct Scene
+{
+    Grid grid;
+    index_t numParticles, numNodes;
+    SceneOptions options;
+
+    Particle *devParticles;
+    Node *devNodes;
+    NodeCache nodeCaches;
+    Grid *devGrid;
+    ImplicitCollider *devColliders;
+    ParticleCache hostParticleCache, *devParticleCache;
+    ParticleBins bins, *devBins;
+    Multigrid multigrid, *devMultigrid;
+    StiffnessMatrix stiffness, *devStiffness;
+    SleepState sleep, *devSleep;
+    StepGraph *graph;
+};
+
+// Sets the scene up and computes the particle volumes
+void createScene( Scene *scene, const QVector<Particle> &particles, const Grid &grid, const SceneOptions &options );
+void destroyScene( Scene *scene );
+
+// One implicit step. Returns the number of solver iterations.
+int stepScene( Scene *scene );
+
+// The particles and nodes, byte for byte
+QByteArray sceneState( const Scene &scene );
+
+struct DistributedRun
+{
+    index_t particles; // on this rank at the end
+    index_t bandNodes;
+    double count, mass; // over all ranks at the end
+    double nodeMassError; // largest relative difference between node and particle mass
+    bool conserved;
+};
+
+/*
+ * Splits the grid of a particle cloud moving at velocity into slabs across
+ * the ranks of communicator, and runs implicit steps with particle migration
+ * after each, one profiler frame per step. After every step, checks the mass
+ * on the nodes each rank owns against the mass of the particles. Returns
+ * false if the grid can't be split; otherwise run->conserved says whether
+ * particle count and mass over all ranks were conserved, and the node mass
+ * stayed within 1e-4 of the particle mass.
+ */
+bool runDistributedScene( Communicator *communicator, int count, int resolution, const vec3 &velocity, int steps,
+                          float tolerance, DistributedRun *run );
+
+#endif // SCENES_H
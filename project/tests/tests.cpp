@@ -9,90 +9,298 @@
 **************************************************************************/
 
 #include "tests.h"
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <iostream>
 
-//#include "cuda/testFunctions.h"
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QProcess>
+#include <QStringList>
+#include <QVector>
+
+#include "common/communicator.h"
+#include "sim/particlegridnode.h"
+
+#include "tests/scenes.h"
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <helper_functions.h>
+#include <helper_cuda.h>
+
 extern "C"
 {
-    void cumulativeSumTests();
-    void groupParticlesTests();
-    void weightingTestsHost();
-    void svdTestsHost();
-    void testColliding();
-    void testColliderNormal();
-    void grid2ParticlesTests();
-    void testGridMath();
-    void timingTests();
-    void testFillParticleVolume();
-    void testcomputeCellMasses();
-    void implicitTests();
-    void testcompute_dJF_invTrans();
-    void testConjugateResidual();
-    void testMemoryStuff();
+    bool testConjugateResidual();
+    bool testMemoryStuff();
 }
 
-void Tests::runTests(char *argv[])  {
-    if (!strcmp(argv[2],"tim"))
-    {
-       runTimTests();
-    }
-    else if (!strcmp(argv[2],"eric"))
-    {
-        runEricTests();
-    }
-    else if (!strcmp(argv[2],"wil"))
-    {
-        runWilTests();
+/*
+ * Two deterministic runs from the same particles have to end in byte-identical
+ * particles and nodes.
+ */
+static bool testDeterministic()
+{
+    Grid grid = createGrid( 32 );
+    srand( 1 );
+    QVector<Particle> particles = createParticleCloud( 20000, grid );
+    SceneOptions options;
+    options.deterministic = true;
+
+    QByteArray states[2];
+    for ( int run = 0; run < 2; ++run ) {
+        Scene scene;
+        createScene( &scene, particles, grid, options );
+        for ( int i = 0; i < 10; ++i ) stepScene( &scene );
+        states[run] = sceneState( scene );
+        destroyScene( &scene );
     }
-    else if (!strcmp(argv[2], "max"))
-    {
-        runMaxTests();
+
+    int differing = 0;
+    for ( int i = 0; i < states[0].size(); ++i ) differing += ( states[0].at(i) != states[1].at(i) );
+    bool passed = ( differing == 0 );
+    printf( "DETERMINISTIC: %s (%d of %d bytes differ between two runs)\n", passed ? "PASSED" : "FAILED", differing, states[0].size() );
+    return passed;
+}
+
+/*
+ * Every preconditioner has to bring the solve to the tolerance before
+ * MAX_ITERATIONS, on every step.
+ */
+static bool testPreconditioners()
+{
+    Grid grid = createGrid( 32 );
+    srand( 1 );
+    QVector<Particle> particles = createParticleCloud( 20000, grid );
+    const char *names[] = { "none", "jacobi", "multigrid" };
+
+    bool passed = true;
+    for ( int p = NO_PRECONDITIONER; p <= MULTIGRID_PRECONDITIONER; ++p ) {
+        SceneOptions options;
+        options.tolerance = 1e-2f;
+        options.preconditioner = (Preconditioner)p;
+        Scene scene;
+        createScene( &scene, particles, grid, options );
+        int slowest = 0;
+        for ( int i = 0; i < 10; ++i ) slowest = MAX( slowest, stepScene(&scene) );
+        destroyScene( &scene );
+        printf( "    %s: at most %d of %d iterations per step\n", names[p], slowest, MAX_ITERATIONS );
+        passed = passed && ( slowest < MAX_ITERATIONS );
     }
-    else if (!strcmp(argv[2], "all")){
-//        runTimTests();
-//        runEricTests();
-        //runWilTests();
-        runMaxTests();
+    printf( "PRECONDITIONERS: %s\n", passed ? "PASSED" : "FAILED" );
+    return passed;
+}
+
+/*
+ * Solves warm started from the last step's correction must not take more
+ * iterations than solves started from the explicit velocities, with WARM
+ * cleared before every step.
+ */
+static bool testWarmStart()
+{
+    Grid grid = createGrid( 32 );
+    srand( 1 );
+    QVector<Particle> particles = createParticleCloud( 20000, grid );
+    SceneOptions options;
+    options.tolerance = 1e-2f;
+
+    int iterations[2] = { 0, 0 };
+    for ( int warm = 0; warm < 2; ++warm ) {
+        Scene scene;
+        createScene( &scene, particles, grid, options );
+        vec3 *devWarm = scene.nodeCaches.get<NodeCache::WARM>();
+        for ( int i = 0; i < 10; ++i ) {
+            if ( !warm ) checkCudaErrors( cudaMemset(devWarm, 0, scene.numNodes*sizeof(vec3)) );
+            iterations[warm] += stepScene( &scene );
+        }
+        destroyScene( &scene );
     }
-    else
-    {
-        printf("Error: test name not found ...\n");
+
+    bool passed = ( iterations[1] <= iterations[0] );
+    printf( "WARM START: %s (%d iterations cold, %d warm started)\n", passed ? "PASSED" : "FAILED", iterations[0], iterations[1] );
+    return passed;
+}
+
+/*
+ * A layer of snow at rest, with a small ball falling towards it. The resting
+ * particles have to fall asleep, while the ball stays awake.
+ */
+static bool testSleep()
+{
+    Grid grid = createGrid( 32 );
+    const int count = 20000, falling = count / 10;
+    srand( 1 );
+    QVector<Particle> particles = createRestingSnow( count, grid );
+    SceneOptions options;
+    options.sleepSteps = 4;
+
+    Scene scene;
+    createScene( &scene, particles, grid, options );
+    index_t first = -1, awake = -1;
+    for ( int i = 0; i < 20; ++i ) {
+        stepScene( &scene );
+        awake = ( scene.sleep.awakeParticles < 0 ) ? count : scene.sleep.awakeParticles;
+        if ( first < 0 ) first = awake;
     }
+    destroyScene( &scene );
+
+    bool passed = ( awake < first ) && ( awake >= falling );
+    printf( "SLEEP: %s (%lld of %d particles awake after the first step, %lld after the last, %d falling)\n",
+            passed ? "PASSED" : "FAILED", (long long)first, count, (long long)awake, falling );
+    return passed;
 }
 
-void Tests::runTimTests()  {
-    printf("running Tim Tests...\n");
-//    cumulativeSumTests();
-//    groupParticlesTests();
-    printf("done running Tim Tests\n");
+/*
+ * nodeIndex has to map the nodes of a grid one to one into its nodeCount()
+ * slots, and nodeIJK has to invert it, in whichever layout this build stores
+ * nodes (see BLOCKED_NODES).
+ */
+static bool testNodeLayout()
+{
+    const glm::ivec3 dims[] = { glm::ivec3(1,1,1), glm::ivec3(4,4,4), glm::ivec3(5,7,9), glm::ivec3(16,3,11) };
+    bool passed = true;
+    for ( int d = 0; d < (int)(sizeof(dims)/sizeof(dims[0])); ++d ) {
+        Grid grid;
+        grid.dim = dims[d];
+        QVector<bool> used( (int)grid.nodeCount(), false );
+        const glm::ivec3 nodeDim = grid.nodeDim();
+        for ( int i = 0; i < nodeDim.x; ++i ) {
+            for ( int j = 0; j < nodeDim.y; ++j ) {
+                for ( int k = 0; k < nodeDim.z; ++k ) {
+                    index_t index = grid.nodeIndex( i, j, k );
+                    bool valid = ( index >= 0 && index < grid.nodeCount() && !used[index] && grid.nodeIJK(index) == glm::ivec3(i, j, k) );
+                    if ( valid ) used[index] = true;
+                    passed = passed && valid;
+                }
+            }
+        }
+    }
+    printf( "NODE LAYOUT: %s (%s nodes)\n", passed ? "PASSED" : "FAILED", Grid::blockedNodes() ? "blocked" : "row-major" );
+    return passed;
 }
 
-void Tests::runEricTests() {
-    printf("running Eric Tests...\n");
-//    svdTestsHost();
-//    weightingTestsHost();
-    printf("done running Eric Tests\n");
+/*
+ * With HALF_NODE_STORAGE, the node velocities pass through half precision on
+ * their way into velocityChange. Rounds the node velocities of a stepped
+ * scene through it, and checks the error stays within 2^-11 of the speed (or
+ * half the smallest subnormal step). Reports the largest error, which is
+ * what the FLIP update can be off by per step in such builds.
+ */
+static bool testHalfNodes()
+{
+    Grid grid = createGrid( 32 );
+    srand( 1 );
+    QVector<Particle> particles = createParticleCloud( 20000, grid, vec3(0.f, -5.f, 0.f) );
+    SceneOptions options;
+    Scene scene;
+    createScene( &scene, particles, grid, options );
+    for ( int i = 0; i < 10; ++i ) stepScene( &scene );
+    QVector<Node> nodes( (int)scene.numNodes );
+    checkCudaErrors( cudaMemcpy(nodes.data(), scene.devNodes, scene.numNodes*sizeof(Node), cudaMemcpyDeviceToHost) );
+    destroyScene( &scene );
+
+    bool passed = true;
+    float largest = 0.f, fastest = 0.f;
+    for ( int i = 0; i < nodes.size(); ++i ) {
+        const vec3 &velocity = nodes[i].velocity;
+        const vec3 rounded = hvec3( velocity );
+        for ( int c = 0; c < 3; ++c ) {
+            float error = fabsf( rounded[c] - velocity[c] );
+            passed = passed && ( error <= fabsf(velocity[c])/2048.f + 3e-8f );
+            largest = MAX( largest, error );
+            fastest = MAX( fastest, fabsf(velocity[c]) );
+        }
+    }
+    printf( "HALF NODES: %s (velocity error up to %g at speeds up to %g, velocityChange is %s in this build)\n",
+            passed ? "PASSED" : "FAILED", largest, fastest, sizeof(nodevec3) == sizeof(hvec3) ? "half" : "float" );
+    return passed;
 }
 
-void Tests::runWilTests() {
-    printf("running Wil Tests...\n");
-//    testColliderNormal();
-//    testColliding();
-//    testGridMath();
-//    timingTests();
-//    testFillParticleVolume();
-//    testcomputeCellMasses();
-//    testComputedF();
-//    testcompute_dJF_invTrans();
-    printf("done running Wil Tests\n");
+static struct {
+    int rank;
+    QString address;
+} OPTIONS = { 0, QString() };
+
+/*
+ * Two ranks over shared memory, rank 0 starting rank 1 as a second process,
+ * step a cloud moving across the slab boundary. Particle count and mass have
+ * to be conserved over both ranks, and the mass on the nodes each rank owns
+ * has to match the mass of the particles after every halo exchange.
+ */
+static bool testHalo()
+{
+    bool root = ( OPTIONS.rank == 0 );
+    QString address = root ? QString( "snow_test_%1" ).arg( QCoreApplication::applicationPid() ) : OPTIONS.address;
+    QProcess *process = NULL;
+    if ( root ) {
+        process = new QProcess;
+        process->setProcessChannelMode( QProcess::ForwardedChannels );
+        process->start( QCoreApplication::applicationFilePath(),
+                        QStringList() << "-test" << "halo" << "-rank" << "1" << "-address" << address );
+    }
+
+    bool passed = false;
+    DistributedRun run;
+    Communicator *communicator = Communicator::create( Communicator::SHARED_MEMORY, OPTIONS.rank, 2, address.toStdString() );
+    if ( communicator ) {
+        passed = runDistributedScene( communicator, 20000, 32, vec3(2.f, -1.f, 0.f), 20, 1e-2f, &run ) && run.conserved;
+        communicator->barrier();
+        delete communicator;
+    }
+
+    if ( process ) {
+        process->waitForFinished( -1 );
+        passed = passed && process->exitCode() == 0;
+        delete process;
+    }
+    if ( root ) {
+        printf( "HALO: %s (%.0f particles and %g mass over both ranks, node mass within %g of it)\n",
+                passed ? "PASSED" : "FAILED", run.count, run.mass, run.nodeMassError );
+    }
+    return passed;
 }
 
-void Tests::runMaxTests() {
-    printf("\nRunning Max Tests...\n");
-//    implicitTests();
-//    testConjugateResidual();
-    testMemoryStuff();
-    printf("Done running Max Tests.\n");
+static const struct {
+    const char *name;
+    bool (*run)();
+} TESTS[] = {
+    { "cr", testConjugateResidual },
+    { "memory", testMemoryStuff },
+    { "nodeLayout", testNodeLayout },
+    { "halfNodes", testHalfNodes },
+    { "deterministic", testDeterministic },
+    { "preconditioners", testPreconditioners },
+    { "warmStart", testWarmStart },
+    { "sleep", testSleep },
+    { "halo", testHalo }
+};
+
+#define TEST_COUNT (int)(sizeof(TESTS)/sizeof(TESTS[0]))
+
+int Tests::runTests(int argc, char *argv[])  {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-rank")) OPTIONS.rank = atoi(argv[i+1]);
+        else if (!strcmp(argv[i], "-address")) OPTIONS.address = argv[i+1];
+    }
+    bool all = !strcmp(argv[0], "all");
+    bool found = false;
+    int failures = 0;
+    for (int i = 0; i < TEST_COUNT; ++i) {
+        if (all || !strcmp(argv[0], TESTS[i].name)) {
+            printf("\nRunning %s tests...\n", TESTS[i].name);
+            failures += !TESTS[i].run();
+            printf("Done running %s tests.\n", TESTS[i].name);
+            found = true;
+        }
+    }
+    if (!found) {
+        printf("Error: test name not found, expected one of:");
+        for (int i = 0; i < TEST_COUNT; ++i) printf(" %s", TESTS[i].name);
+        printf(" all\n");
+        return 2;
+    }
+    if (failures > 0) printf("%d test(s) failed.\n", failures);
+    return failures > 0 ? 1 : 0;
 }
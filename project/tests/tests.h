@@ -13,14 +13,16 @@
 
 
 
+/*
+ * Correctness tests, run by name with 'snow -test <name>' (or 'all'). Returns
+ * nonzero if any of them failed. The halo test starts its second rank as
+ * 'snow -test halo -rank 1 -address <name>'. The scenes they run are shared with the
+ * benchmarks (see tests/scenes.h); for timing, see Benchmarks in
+ * tests/benchmarks.h.
+ */
 class Tests  {
 public:
-    static void runTests(char *argv[]);
-private:
-    static void runTimTests();
-    static void runEricTests();
-    static void runWilTests();
-    static void runMaxTests();
+    static int runTests(int argc, char *argv[]);
 };
 
 #endif // TESTS_H
@@ -46,6 +46,11 @@ MainWindow::~MainWindow()
     UiSettings::saveSettings();
 }
 
+bool MainWindow::openScene( const QString &filename )
+{
+    return ui->viewPanel->loadFromFile( filename );
+}
+
 void MainWindow::importMesh()
 {
     ui->viewPanel->pauseSimulation();
@@ -49,6 +49,9 @@ public:
     explicit MainWindow( QWidget *parent = 0 );
     ~MainWindow();
 
+    // Returns whether or not it loaded
+    bool openScene( const QString &filename );
+
 private:
 
     Ui::MainWindow *ui;
@@ -7,7 +7,9 @@
 #include <QSettings>
 
 #include "common/common.h"
+#include "common/communicator.h"
 #include "geometry/grid.h"
+#include "sim/caches.h"
 #include "ui/uisettings.h"
 
 UiSettings* UiSettings::INSTANCE = NULL;
@@ -73,6 +75,26 @@ UiSettings::loadSettings()
     timeStep() = s.value( "timeStep", 1e-5 ).toFloat();
     implicit() = s.value( "implicit", true ).toBool();
     materialPreset() = s.value( "materialPreset", MAT_DEFAULT).toInt();
+    profileSimulation() = s.value( "profileSimulation", false ).toBool();
+    deterministic() = s.value( "deterministic", false ).toBool();
+    seed() = s.value( "seed", 0 ).toInt();
+    preconditioner() = s.value( "preconditioner", JACOBI_PRECONDITIONER ).toInt();
+    solverTolerance() = s.value( "solverTolerance", 1e-3 ).toFloat();
+    implicitOperator() = s.value( "implicitOperator", AUTO_OPERATOR ).toInt();
+    tiledG2P() = s.value( "tiledG2P", false ).toBool();
+    numaAware() = s.value( "numaAware", false ).toBool();
+    hugePages() = s.value( "hugePages", 0 ).toInt();
+    autoDomain() = s.value( "autoDomain", false ).toBool();
+    multiDomain() = s.value( "multiDomain", false ).toBool();
+    sleepSteps() = s.value( "sleepSteps", 0 ).toInt();
+    sleepSpeed() = s.value( "sleepSpeed", 0.01f ).toFloat();
+    sleepStrainRate() = s.value( "sleepStrainRate", 0.1f ).toFloat();
+    outOfCore() = s.value( "outOfCore", 0 ).toInt();
+
+    rank() = 0;
+    ranks() = 1;
+    transport() = Communicator::SHARED_MEMORY;
+    address() = QString();
 
     showContainers() = s.value( "showContainers", true ).toBool();
     showContainersMode() = s.value( "showContainersMode", WIREFRAME ).toInt();
@@ -118,6 +140,21 @@ UiSettings::saveSettings()
     s.setValue( "timeStep", timeStep() );
     s.setValue( "implicit", implicit() );
     s.setValue("materialPreset", materialPreset());
+    s.setValue( "profileSimulation", profileSimulation() );
+    s.setValue( "deterministic", deterministic() );
+    s.setValue( "seed", seed() );
+    s.setValue( "preconditioner", preconditioner() );
+    s.setValue( "solverTolerance", solverTolerance() );
+    s.setValue( "implicitOperator", implicitOperator() );
+    s.setValue( "tiledG2P", tiledG2P() );
+    s.setValue( "numaAware", numaAware() );
+    s.setValue( "hugePages", hugePages() );
+    s.setValue( "autoDomain", autoDomain() );
+    s.setValue( "multiDomain", multiDomain() );
+    s.setValue( "sleepSteps", sleepSteps() );
+    s.setValue( "sleepSpeed", sleepSpeed() );
+    s.setValue( "sleepStrainRate", sleepStrainRate() );
+    s.setValue( "outOfCore", outOfCore() );
 
     s.setValue( "showContainers", showContainers() );
     s.setValue( "showContainersMode", showContainersMode() );
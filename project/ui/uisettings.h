@@ -117,6 +117,29 @@ private:
     DEFINE_SETTING( float, timeStep )
     DEFINE_SETTING( bool, implicit )
     DEFINE_SETTING( int, materialPreset )
+    DEFINE_SETTING( bool, profileSimulation )
+    DEFINE_SETTING( bool, deterministic )
+    DEFINE_SETTING( int, seed )
+    DEFINE_SETTING( int, preconditioner )
+    DEFINE_SETTING( float, solverTolerance )
+    DEFINE_SETTING( int, implicitOperator )
+    DEFINE_SETTING( bool, tiledG2P )
+    DEFINE_SETTING( bool, numaAware )
+    DEFINE_SETTING( int, hugePages )
+    DEFINE_SETTING( bool, autoDomain )
+    DEFINE_SETTING( bool, multiDomain )
+    DEFINE_SETTING( int, sleepSteps )
+    DEFINE_SETTING( float, sleepSpeed )
+    DEFINE_SETTING( float, sleepStrainRate )
+    DEFINE_SETTING( int, outOfCore )
+
+    // Distributed runs, set from the command line only (see main.cpp) and
+    // never saved. transport is a Communicator::Transport, and an empty
+    // address picks a default for it.
+    DEFINE_SETTING( int, rank )
+    DEFINE_SETTING( int, ranks )
+    DEFINE_SETTING( int, transport )
+    DEFINE_SETTING( QString, address )
 
     DEFINE_SETTING( bool, showContainers )
     DEFINE_SETTING( int, showContainersMode )
@@ -640,12 +640,19 @@ ViewPanel::saveSelectedMesh()
 void
 ViewPanel::openScene()
 {
-    pauseDrawing();
     // call file dialog
     QString filename = QFileDialog::getOpenFileName( this, "Choose Scene File Path", PROJECT_PATH "/data/scenes/" );
-    if ( !filename.isNull() ) m_sceneIO->read(filename, m_scene, m_engine);
+    if ( !filename.isNull() ) loadFromFile( filename );
     else LOG("could not open file \n");
+}
+
+bool
+ViewPanel::loadFromFile( QString fname )
+{
+    pauseDrawing();
+    bool loaded = m_sceneIO->read( fname, m_scene, m_engine );
     resumeDrawing();
+    return loaded;
 }
 
 void
@@ -38,7 +38,9 @@ public:
 
     // not implemented
     void saveToFile(QString fname);
-    void loadFromFile(QString fname);
+
+    // Returns whether or not it loaded
+    bool loadFromFile(QString fname);
 
     // Returns whether or not it started
     bool startSimulation();